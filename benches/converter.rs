@@ -0,0 +1,215 @@
+//! Converter benchmarks over synthetic maps. Map sizes and tileset color counts come from
+//! `TILED2SATURN_BENCH_SIZES` and `TILED2SATURN_BENCH_COLORS`, and each group prints its peak RSS.
+
+mod support;
+
+use std::fs::{self, File};
+use std::io::Seek;
+use std::path::Path;
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkGroup, BenchmarkId, Criterion, Throughput};
+use criterion::measurement::WallTime;
+use embedded_graphics::pixelcolor::Bgr888;
+use tiled::{Loader, Map};
+use tinybmp::Bmp;
+
+use support::{rss, synthetic::{self, SyntheticMap}};
+use tiled2saturn::saturn_bitmap_layer::SaturnBitmapLayer;
+use tiled2saturn::saturn_budget::BudgetLimits;
+use tiled2saturn::saturn_character_allocation::SaturnCharacterAllocation;
+use tiled2saturn::saturn_collision_masks::SaturnCollisionMasks;
+use tiled2saturn::saturn_collision_rects::SaturnCollisionRects;
+use tiled2saturn::saturn_collisions::SaturnCollisions;
+use tiled2saturn::saturn_color_convert;
+use tiled2saturn::saturn_layer::{SaturnLayer, TileBounds};
+use tiled2saturn::saturn_map::SaturnMap;
+use tiled2saturn::saturn_object_layer::SaturnObjectLayer;
+use tiled2saturn::saturn_sprite_atlas::SaturnSpriteAtlas;
+use tiled2saturn::saturn_tileset::SaturnTileset;
+use tiled2saturn::saturn_writer::SaturnWrite;
+
+const LAYER_COLORS: u32 = 256;
+
+fn load(synthetic: SyntheticMap) -> Map {
+    let tmx = synthetic.write(&synthetic::output_dir()).expect("Unable to write synthetic map");
+    return Loader::new().load_tmx_map(Path::new(&tmx)).expect("Unable to load synthetic map");
+}
+
+fn build_tilesets(map: &Map) -> Vec<SaturnTileset> {
+    return map.tilesets().iter().map(|t| SaturnTileset::build_one(t).unwrap()).collect();
+}
+
+/// Large maps take seconds per iteration, criterion's default of 100 samples would take minutes.
+fn sample_size_for(group: &mut BenchmarkGroup<WallTime>, size: u32) {
+    group.sample_size(if size >= 512 { 10 } else { 50 });
+}
+
+/// Tileset packing, for each tile size, as 8x8 cells and as 16x16 tiles packed cell by cell.
+fn tileset_build(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("tileset_build");
+    for tile_size in synthetic::TILE_SIZES {
+        for colors in synthetic::colors() {
+            let map = load(SyntheticMap { size: 16, tile_size, colors, bitmap_layers: false });
+            let tileset = &map.tilesets()[0];
+            group.throughput(Throughput::Elements(tileset.tilecount as u64));
+            group.bench_with_input(BenchmarkId::new(format!("{0}x{0}", tile_size), colors), tileset, |b, tileset| {
+                b.iter(|| SaturnTileset::build_one(black_box(tileset)).unwrap())
+            });
+        }
+    }
+    group.finish();
+    rss::report("tileset_build");
+}
+
+fn layer_build(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("layer_build");
+    for size in synthetic::sizes() {
+        let map = load(SyntheticMap { size, tile_size: synthetic::TILE_SIZE, colors: LAYER_COLORS, bitmap_layers: false });
+        let (_, infos) = SaturnCharacterAllocation::place(&mut build_tilesets(&map)).unwrap();
+        let bounds = TileBounds::for_map(&map);
+        sample_size_for(&mut group, size);
+        group.throughput(Throughput::Elements(size as u64 * size as u64 * map.layers().len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(format!("{0}x{0}", size)), &map, |b, map| {
+            b.iter(|| SaturnLayer::build(map.layers(), &infos, &bounds).unwrap())
+        });
+    }
+    group.finish();
+    rss::report("layer_build");
+}
+
+fn bitmap_layer_build(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("bitmap_layer_build");
+    let map = load(SyntheticMap { size: 64, tile_size: synthetic::TILE_SIZE, colors: LAYER_COLORS, bitmap_layers: true });
+    group.sample_size(10);
+    group.throughput(Throughput::Bytes(synthetic::BITMAP_WIDTH as u64 * synthetic::BITMAP_HEIGHT as u64 * 3));
+    for layer in map.layers() {
+        if let tiled::LayerType::Image(image_layer) = layer.layer_type() {
+            group.bench_function(layer.name.as_str(), |b| {
+                b.iter(|| SaturnBitmapLayer::build_one(&layer, &image_layer).unwrap())
+            });
+        }
+    }
+    group.finish();
+    rss::report("bitmap_layer_build");
+}
+
+/// The pixels of the castle from the 32768 color bitmap example as packed b, g, r triplets, top row first.
+fn castle_bgr() -> Vec<u8> {
+    let path = Path::new(env!("CARGO_MANIFEST_DIR")).join("examples/32768-color-bitmap-background-layer/resources/castle.bmp");
+    let image_file = fs::read(&path).expect("Unable to read castle.bmp");
+    let bmp = Bmp::<Bgr888>::from_slice(&image_file).expect("Unable to parse castle.bmp");
+    let mut out = Vec::default();
+    saturn_color_convert::for_each_bgr_row(&bmp, |_, row| {
+        out.extend_from_slice(row);
+        Ok(())
+    }).expect("Unable to decode castle.bmp");
+    return out;
+}
+
+/// The direct color conversion kernels over a maximum size bitmap and the castle example, the scalar ones against
+/// AVX2 where the CPU has it.
+fn color_convert(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("color_convert");
+
+    for (name, src) in [("synthetic", synthetic::bitmap_bgr()), ("castle", castle_bgr())] {
+        let mut dst = vec![0u8; src.len() / 3 * 4];
+        group.throughput(Throughput::Bytes(src.len() as u64));
+
+        group.bench_function(format!("rgb555/scalar/{}", name), |b| b.iter(|| saturn_color_convert::bgr888_to_rgb555_be_scalar(black_box(&src), &mut dst)));
+        group.bench_function(format!("rgb888/scalar/{}", name), |b| b.iter(|| saturn_color_convert::bgr888_to_rgb888_be_scalar(black_box(&src), &mut dst)));
+        #[cfg(target_arch = "x86_64")]
+        if is_x86_feature_detected!("avx2") {
+            group.bench_function(format!("rgb555/avx2/{}", name), |b| b.iter(|| unsafe { saturn_color_convert::bgr888_to_rgb555_be_avx2(black_box(&src), &mut dst) }));
+            group.bench_function(format!("rgb888/avx2/{}", name), |b| b.iter(|| unsafe { saturn_color_convert::bgr888_to_rgb888_be_avx2(black_box(&src), &mut dst) }));
+        }
+    }
+    group.finish();
+    rss::report("color_convert");
+}
+
+fn collision_build(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("collision_build");
+    for size in synthetic::sizes() {
+        let map = load(SyntheticMap { size, tile_size: synthetic::TILE_SIZE, colors: LAYER_COLORS, bitmap_layers: false });
+        let bounds = TileBounds::for_map(&map);
+        sample_size_for(&mut group, size);
+        group.throughput(Throughput::Elements(size as u64 * size as u64 * map.layers().len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(format!("{0}x{0}", size)), &map, |b, map| {
+            b.iter(|| SaturnCollisions::build(map, &bounds).unwrap())
+        });
+    }
+    group.finish();
+    rss::report("collision_build");
+}
+
+/// Builds every section the way `export` does, without the budget check, which the largest synthetic maps are
+/// meant to exceed.
+fn build_map(map: &Map) -> SaturnMap {
+    let mut tilesets = build_tilesets(map);
+    let bounds = TileBounds::for_map(map);
+    let (_, infos) = SaturnCharacterAllocation::place(&mut tilesets).unwrap();
+    let layers = SaturnLayer::build(map.layers(), &infos, &bounds).unwrap();
+
+    let mut bitmap_layers = Vec::default();
+    SaturnBitmapLayer::build_each(map.layers(), |layer| { bitmap_layers.push(layer); Ok(()) }).unwrap();
+
+    let sprite_atlas = SaturnSpriteAtlas::from_tilesets(tilesets.iter().map(|t| t.sprite_sheet.as_ref())).unwrap();
+    let object_layers = SaturnObjectLayer::build(map.layers(), bounds.pixel_origin(map), map.tilesets(), &sprite_atlas).unwrap();
+    let collision_rects = SaturnCollisionRects::build(map, &bounds).unwrap();
+    let collision_masks = SaturnCollisionMasks::build(map, &bounds).unwrap();
+    let collisions = SaturnCollisions::build(map, &bounds).unwrap();
+
+    return SaturnMap::from_sections(bounds.width, bounds.height, tilesets, layers, bitmap_layers, object_layers, sprite_atlas,
+                                    collision_rects, collision_masks, collisions).unwrap();
+}
+
+fn serialize(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("serialize");
+    for size in synthetic::sizes() {
+        let map = load(SyntheticMap { size, tile_size: synthetic::TILE_SIZE, colors: LAYER_COLORS, bitmap_layers: true });
+        let saturn_map = build_map(&map);
+        let size_in_bytes = saturn_map.encoded_size();
+        sample_size_for(&mut group, size);
+        group.throughput(Throughput::Bytes(size_in_bytes as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(format!("{0}x{0}", size)), &saturn_map, |b, saturn_map| {
+            b.iter(|| {
+                let mut out = Vec::with_capacity(size_in_bytes as usize);
+                saturn_map.write_to(&mut out).unwrap();
+                out
+            })
+        });
+    }
+    group.finish();
+    rss::report("serialize");
+}
+
+/// A whole export from the loaded map, streamed section by section to a file as the command line does. Its peak
+/// RSS, against `serialize` which holds every section at once, is what streaming saves. Maps over the Saturn's
+/// budgets still stream every section, the export only fails before writing the header.
+fn export(c: &mut Criterion) {
+    rss::reset();
+    let mut group = c.benchmark_group("export");
+    let mut out = File::create(synthetic::output_dir().join("export.bin")).expect("Unable to create export output");
+    for size in synthetic::sizes() {
+        let map = load(SyntheticMap { size, tile_size: synthetic::TILE_SIZE, colors: LAYER_COLORS, bitmap_layers: false });
+        sample_size_for(&mut group, size);
+        group.throughput(Throughput::Elements(size as u64 * size as u64 * map.layers().len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(format!("{0}x{0}", size)), &map, |b, map| {
+            b.iter(|| {
+                out.rewind().unwrap();
+                SaturnMap::export(map, &mut out, &BudgetLimits::default())
+            })
+        });
+    }
+    group.finish();
+    rss::report("export");
+}
+
+criterion_group!(benches, tileset_build, layer_build, bitmap_layer_build, color_convert, collision_build, serialize, export);
+criterion_main!(benches);
@@ -0,0 +1,2 @@
+pub mod rss;
+pub mod synthetic;
@@ -0,0 +1,22 @@
+use std::fs;
+
+/// Resets the peak resident set size, so the next `peak_kb` only covers what runs after this call. Only Linux
+/// supports resetting it, elsewhere the peak covers the whole process.
+pub fn reset() {
+    let _ = fs::write("/proc/self/clear_refs", "5");
+}
+
+/// Peak resident set size of the process in kilobytes, where the platform reports it.
+pub fn peak_kb() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|l| l.starts_with("VmHWM:"))?;
+    return line.split_whitespace().nth(1)?.parse().ok();
+}
+
+/// Prints the peak resident set size reached by a benchmark group, next to criterion's timings.
+pub fn report(group: &str) {
+    match peak_kb() {
+        Some(kb) => eprintln!("{}: peak RSS {:.1} MiB", group, kb as f64 / 1024.0),
+        None => eprintln!("{}: peak RSS not available on this platform", group)
+    }
+}
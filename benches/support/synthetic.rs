@@ -0,0 +1,211 @@
+use std::env;
+use std::fmt::Write as _;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+
+/// Tile sizes a tileset can have, 8x8 cells or 16x16 tiles of 2x2 cells.
+pub const TILE_SIZES: [u32; 2] = [8, 16];
+/// Tile size of the maps of every benchmark but tileset packing.
+pub const TILE_SIZE: u32 = 16;
+pub const TILESET_COLUMNS: u32 = 16;
+pub const TILE_COUNT: u32 = 256;
+
+/// Largest bitmap a VDP2 bitmap layer can hold.
+pub const BITMAP_WIDTH: u32 = 1024;
+pub const BITMAP_HEIGHT: u32 = 512;
+
+const FLIPPED_HORIZONTALLY: u32 = 0x80000000;
+const FLIPPED_VERTICALLY: u32 = 0x40000000;
+
+/// A generated map: one tileset of `tile_size` tiles with exactly `colors` colors, a full background layer, a
+/// sparse foreground layer with flipped tiles, per tile collisions and, optionally, RGB888 and RGB555 direct color
+/// and 256 color bitmap layers.
+pub struct SyntheticMap {
+    pub size: u32,
+    pub tile_size: u32,
+    pub colors: u32,
+    pub bitmap_layers: bool
+}
+
+impl SyntheticMap {
+    /// Writes the TMX and the BMPs it references into `dir` and returns the TMX path. Files that already exist
+    /// from an earlier run with the same parameters are reused.
+    pub fn write(&self, dir: &Path) -> io::Result<PathBuf> {
+        fs::create_dir_all(dir)?;
+
+        let tileset_image = format!("tileset_{}_{}.bmp", self.tile_size, self.colors);
+        if !dir.join(&tileset_image).exists() {
+            fs::write(dir.join(&tileset_image), tileset_bmp(self.tile_size, self.colors))?;
+        }
+
+        if self.bitmap_layers && !dir.join("bitmap.bmp").exists() {
+            fs::write(dir.join("bitmap.bmp"), bitmap_bmp())?;
+        }
+
+        let tmx = dir.join(format!("map_{}x{}_{}_{}{}.tmx", self.size, self.size, self.tile_size, self.colors, if self.bitmap_layers { "_bitmap" } else { "" }));
+        if !tmx.exists() {
+            fs::write(&tmx, self.tmx(&tileset_image))?;
+        }
+
+        return Ok(tmx);
+    }
+
+    fn tmx(&self, tileset_image: &str) -> String {
+        let pnd_size = if self.colors > 1024 { 2 } else { 1 };
+        let mut out = String::new();
+
+        let _ = writeln!(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
+        let _ = writeln!(out, "<map version=\"1.8\" tiledversion=\"1.8.6\" orientation=\"orthogonal\" renderorder=\"right-down\" width=\"{0}\" height=\"{0}\" tilewidth=\"{1}\" tileheight=\"{1}\" infinite=\"0\" nextlayerid=\"6\" nextobjectid=\"1\">",
+                         self.size, self.tile_size);
+        let _ = writeln!(out, " <tileset firstgid=\"1\" name=\"synthetic\" tilewidth=\"{0}\" tileheight=\"{0}\" tilecount=\"{1}\" columns=\"{2}\">",
+                         self.tile_size, TILE_COUNT, TILESET_COLUMNS);
+        let _ = writeln!(out, "  <properties>");
+        let _ = writeln!(out, "   <property name=\"palette_bank\" type=\"int\" value=\"0\"/>");
+        let _ = writeln!(out, "   <property name=\"pnd_size\" type=\"int\" value=\"{}\"/>", pnd_size);
+        let _ = writeln!(out, "  </properties>");
+        let _ = writeln!(out, "  <image source=\"{}\" width=\"{}\" height=\"{}\"/>", tileset_image,
+                         TILESET_COLUMNS * self.tile_size, TILE_COUNT / TILESET_COLUMNS * self.tile_size);
+        for id in (0..TILE_COUNT).step_by(4) {
+            let _ = writeln!(out, "  <tile id=\"{}\">", id);
+            let _ = writeln!(out, "   <objectgroup draworder=\"index\" id=\"2\">");
+            let _ = writeln!(out, "    <object id=\"1\" x=\"0\" y=\"{}\" width=\"{}\" height=\"{}\"/>", id % 8, self.tile_size, self.tile_size - id % 8);
+            let _ = writeln!(out, "   </objectgroup>");
+            let _ = writeln!(out, "  </tile>");
+        }
+        let _ = writeln!(out, " </tileset>");
+
+        self.tile_layer(&mut out, 1, "Background", |x, y| 1 + (x * 7 + y * 13) % TILE_COUNT);
+        self.tile_layer(&mut out, 2, "Foreground", |x, y| {
+            if (x + y) % 5 == 0 {
+                return 0;
+            }
+            let gid = 1 + (x * 3 + y * 5) % TILE_COUNT;
+            let flip_h = if (x * y) % 11 == 0 { FLIPPED_HORIZONTALLY } else { 0 };
+            let flip_v = if (x + 2 * y) % 13 == 0 { FLIPPED_VERTICALLY } else { 0 };
+            return gid | flip_h | flip_v;
+        });
+
+        if self.bitmap_layers {
+            bitmap_layer(&mut out, 3, "Direct", "<property name=\"pnd_size\" type=\"int\" value=\"2\"/>");
+            bitmap_layer(&mut out, 4, "Direct555", "<property name=\"pnd_size\" type=\"int\" value=\"1\"/>");
+            bitmap_layer(&mut out, 5, "Paletted", "<property name=\"pnd_size\" type=\"int\" value=\"1\"/>\n   <property name=\"palette_colors\" type=\"int\" value=\"256\"/>");
+        }
+
+        let _ = writeln!(out, "</map>");
+        return out;
+    }
+
+    fn tile_layer(&self, out: &mut String, id: u32, name: &str, gid: impl Fn(u32, u32) -> u32) {
+        let _ = writeln!(out, " <layer id=\"{}\" name=\"{}\" width=\"{2}\" height=\"{2}\">", id, name, self.size);
+        let _ = writeln!(out, "  <data encoding=\"csv\">");
+        for y in 0..self.size {
+            for x in 0..self.size {
+                let last = x == self.size - 1 && y == self.size - 1;
+                let _ = write!(out, "{}{}", gid(x, y), if last { "" } else { "," });
+            }
+            out.push('\n');
+        }
+        let _ = writeln!(out, "</data>");
+        let _ = writeln!(out, " </layer>");
+    }
+}
+
+fn bitmap_layer(out: &mut String, id: u32, name: &str, properties: &str) {
+    let _ = writeln!(out, " <imagelayer id=\"{}\" name=\"{}\">", id, name);
+    let _ = writeln!(out, "  <image source=\"bitmap.bmp\" width=\"{}\" height=\"{}\"/>", BITMAP_WIDTH, BITMAP_HEIGHT);
+    let _ = writeln!(out, "  <properties>");
+    let _ = writeln!(out, "   {}", properties);
+    let _ = writeln!(out, "  </properties>");
+    let _ = writeln!(out, " </imagelayer>");
+}
+
+/// An uncompressed 24 bit bottom up BMP, with `pixel` giving the RGB color at each position.
+fn bmp(width: u32, height: u32, pixel: impl Fn(u32, u32) -> [u8; 3]) -> Vec<u8> {
+    let stride = (width * 3 + 3) & !3;
+    let image_size = stride * height;
+    let mut out = Vec::with_capacity(54 + image_size as usize);
+
+    out.extend_from_slice(b"BM");
+    out.extend_from_slice(&(54 + image_size).to_le_bytes());
+    out.extend_from_slice(&0u32.to_le_bytes());
+    out.extend_from_slice(&54u32.to_le_bytes());
+
+    out.extend_from_slice(&40u32.to_le_bytes());
+    out.extend_from_slice(&(width as i32).to_le_bytes());
+    out.extend_from_slice(&(height as i32).to_le_bytes());
+    out.extend_from_slice(&1u16.to_le_bytes());
+    out.extend_from_slice(&24u16.to_le_bytes());
+    out.extend_from_slice(&0u32.to_le_bytes());
+    out.extend_from_slice(&image_size.to_le_bytes());
+    out.extend_from_slice(&2835u32.to_le_bytes());
+    out.extend_from_slice(&2835u32.to_le_bytes());
+    out.extend_from_slice(&0u32.to_le_bytes());
+    out.extend_from_slice(&0u32.to_le_bytes());
+
+    for y in (0..height).rev() {
+        for x in 0..width {
+            let [r, g, b] = pixel(x, y);
+            out.extend_from_slice(&[b, g, r]);
+        }
+        out.resize(out.len() + (stride - width * 3) as usize, 0);
+    }
+
+    return out;
+}
+
+/// A tileset image of `tile_size` tiles using exactly `colors` colors. Every run of `colors` pixels holds each
+/// color once, rotated from run to run so neighbouring tiles differ and tile deduplication cannot collapse the
+/// tileset.
+fn tileset_bmp(tile_size: u32, colors: u32) -> Vec<u8> {
+    let width = TILESET_COLUMNS * tile_size;
+    let height = TILE_COUNT / TILESET_COLUMNS * tile_size;
+    return bmp(width, height, |x, y| {
+        let p = x + y * width;
+        let k = (p + (p / colors) * 7) % colors;
+        [((k & 0x1F) << 3) as u8, (((k >> 5) & 0x1F) << 3) as u8, (((k >> 10) & 0x1F) << 3) as u8]
+    });
+}
+
+fn bitmap_pixel(x: u32, y: u32) -> [u8; 3] {
+    [(x & 0xFF) as u8, (y & 0xFF) as u8, ((x ^ y) >> 2) as u8]
+}
+
+/// A maximum size bitmap with far more colors than a palette holds, so paletted layers have to quantize.
+fn bitmap_bmp() -> Vec<u8> {
+    return bmp(BITMAP_WIDTH, BITMAP_HEIGHT, bitmap_pixel);
+}
+
+/// The pixels of the bitmap as packed b, g, r triplets, top row first, the rows the color conversion kernels take.
+pub fn bitmap_bgr() -> Vec<u8> {
+    let mut out = Vec::with_capacity((BITMAP_WIDTH * BITMAP_HEIGHT * 3) as usize);
+    for y in 0..BITMAP_HEIGHT {
+        for x in 0..BITMAP_WIDTH {
+            let [r, g, b] = bitmap_pixel(x, y);
+            out.extend_from_slice(&[b, g, r]);
+        }
+    }
+    return out;
+}
+
+/// Directory the generated inputs are written to, kept between runs so they are only generated once.
+pub fn output_dir() -> PathBuf {
+    return env::temp_dir().join("tiled2saturn-bench");
+}
+
+fn env_list(name: &str, default: &[u32], max: u32) -> Vec<u32> {
+    let values: Vec<u32> = env::var(name).ok()
+        .map(|v| v.split(',').filter_map(|s| s.trim().parse().ok()).filter(|v| *v > 0 && *v <= max).collect())
+        .unwrap_or_default();
+    return if values.is_empty() { default.to_vec() } else { values };
+}
+
+/// Map sizes in tiles, from `TILED2SATURN_BENCH_SIZES`, up to 1024x1024.
+pub fn sizes() -> Vec<u32> {
+    return env_list("TILED2SATURN_BENCH_SIZES", &[64, 256, 1024], 1024);
+}
+
+/// Tileset color counts, from `TILED2SATURN_BENCH_COLORS`, up to 2048.
+pub fn colors() -> Vec<u32> {
+    return env_list("TILED2SATURN_BENCH_COLORS", &[16, 256, 2048], 2048);
+}
@@ -15,8 +15,7 @@
 #define NBGX_CPD         VDP2_VRAM_ADDR(0, 0x000000)
 #define NBGX_PAL         VDP2_CRAM_MODE_0_OFFSET(0, 0, 0)
 
-#define NBG0_MAP         VDP2_VRAM_ADDR(1, 0x000000)
-#define NBGX_MAP_EMPTY   VDP2_VRAM_ADDR(1, 0x002000) 
+#define NBGX_PAGES       VDP2_VRAM_ADDR(1, 0x000000)
 
 #define BACK_SCREEN      VDP2_VRAM_ADDR(3, 0x01FFFE)
 
@@ -40,13 +39,6 @@ int main(void)
                 .palette_base  = NBGX_PAL
         };
 
-        const vdp2_scrn_normal_map_t nbg0_normal_map = {
-                .plane_a = NBG0_MAP,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
          const vdp2_vram_cycp_t vram_cycp = {
                 .pt[0].t0 = VDP2_VRAM_CYCP_CHPNDR_NBG0,
                 .pt[0].t1 = VDP2_VRAM_CYCP_CHPNDR_NBG0,
@@ -90,11 +82,13 @@ int main(void)
         tiled2saturn_t* t2s = tiled2saturn_parse(layer1);
 
         scu_dma_transfer(0, (void *)NBGX_PAL, t2s->tilesets[0]->palette, t2s->tilesets[0]->palette_size);
-        scu_dma_transfer(0, (void *)NBG0_MAP, t2s->layers[0]->pattern_name_data, t2s->layers[0]->pattern_name_data_size);
+        for(uint16_t i = 0; i < t2s->page_count; i++){
+                scu_dma_transfer(0, (void *)(NBGX_PAGES + t2s->pages[i].vram_offset), t2s->pages[i].data, t2s->pages[i].size);
+        }
         scu_dma_transfer(0, (void *)NBGX_CPD, t2s->tilesets[0]->character_pattern, t2s->tilesets[0]->character_pattern_size);
         
-        (void)memset((void *)(NBGX_MAP_EMPTY), 0x101 << 2, 0x800);
-
+        vdp2_scrn_normal_map_t nbg0_normal_map;
+        tiled2saturn_layer_normal_map(t2s->layers[0], NBGX_PAGES, 0, 0, &nbg0_normal_map);
         vdp2_scrn_cell_format_set(&nbg0_format, &nbg0_normal_map);
 
         vdp2_scrn_priority_set(VDP2_SCRN_NBG0, 7);
@@ -13,19 +13,15 @@
 
 #include <tiled2saturn/tiled2saturn.h>
 
-#define NBG0_CPD         VDP2_VRAM_ADDR(0, 0x000000)
+#define NBGX_CPD         VDP2_VRAM_ADDR(0, 0x000000)
+
 #define NBG0_PAL         VDP2_CRAM_MODE_1_OFFSET(0, 0, 0)
 
-#define NBG1_CPD         VDP2_VRAM_ADDR(1, 0x000000)
 #define NBG1_PAL         VDP2_CRAM_MODE_1_OFFSET(0, 1, 0)
 
-#define NBG2_CPD         VDP2_VRAM_ADDR(1, 0x001200)
 #define NBG2_PAL         VDP2_CRAM_MODE_1_OFFSET(0, 2, 0)
 
-#define NBG0_MAP         VDP2_VRAM_ADDR(2, 0x000000)
-#define NBG1_MAP         VDP2_VRAM_ADDR(2, 0x000800)
-#define NBG2_MAP         VDP2_VRAM_ADDR(2, 0x001000)
-#define NBGX_MAP_EMPTY   VDP2_VRAM_ADDR(2, 0x001800)
+#define NBGX_PAGES       VDP2_VRAM_ADDR(2, 0x000000)
 
 #define BACK_SCREEN      VDP2_VRAM_ADDR(3, 0x01FFFE)
 
@@ -45,17 +41,9 @@ int main(void)
                 .pnd_size      = 1,
                 .aux_mode      = VDP2_SCRN_AUX_MODE_1,
                 .plane_size    = VDP2_SCRN_PLANE_SIZE_1X1,
-                .cpd_base      = NBG0_CPD,
                 .palette_base  = NBG0_PAL
         };
 
-        const vdp2_scrn_normal_map_t nbg0_normal_map = {
-                .plane_a = NBG0_MAP,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
         vdp2_scrn_cell_format_t nbg1_format = {
                 .scroll_screen = VDP2_SCRN_NBG1,
                 .ccc           = VDP2_SCRN_CCC_PALETTE_16,
@@ -63,17 +51,9 @@ int main(void)
                 .pnd_size      = 1,
                 .aux_mode      = VDP2_SCRN_AUX_MODE_1,
                 .plane_size    = VDP2_SCRN_PLANE_SIZE_1X1,
-                .cpd_base      = NBG1_CPD,
                 .palette_base  = NBG1_PAL
         };
 
-        const vdp2_scrn_normal_map_t nbg1_normal_map = {
-                .plane_a = NBG1_MAP,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
         vdp2_scrn_cell_format_t nbg2_format = {
                 .scroll_screen = VDP2_SCRN_NBG2,
                 .ccc           = VDP2_SCRN_CCC_PALETTE_16,
@@ -81,17 +61,9 @@ int main(void)
                 .pnd_size      = 1,
                 .aux_mode      = VDP2_SCRN_AUX_MODE_1,
                 .plane_size    = VDP2_SCRN_PLANE_SIZE_1X1,
-                .cpd_base      = NBG2_CPD,
                 .palette_base  = NBG2_PAL
         };
 
-        const vdp2_scrn_normal_map_t nbg2_normal_map = {
-                .plane_a = NBG2_MAP,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
          const vdp2_vram_cycp_t vram_cycp = {
                 .pt[0].t0 = VDP2_VRAM_CYCP_CHPNDR_NBG0,
                 .pt[0].t1 = VDP2_VRAM_CYCP_NO_ACCESS,
@@ -141,38 +113,43 @@ int main(void)
         tiled2saturn_layer_t* t2s_layer_3 =  get_layer_by_id(t2s,3);
         
         scu_dma_transfer(0, (void *)NBG0_PAL, t2s_layer_1->tileset->palette, t2s_layer_1->tileset->palette_size);
-        scu_dma_transfer(0, (void *)NBG0_MAP, t2s_layer_1->pattern_name_data, t2s_layer_1->pattern_name_data_size);
-        scu_dma_transfer(0, (void *)NBG0_CPD, t2s_layer_1->tileset->character_pattern, t2s_layer_1->tileset->character_pattern_size);
+        for(uint16_t i = 0; i < t2s->page_count; i++){
+                scu_dma_transfer(0, (void *)(NBGX_PAGES + t2s->pages[i].vram_offset), t2s->pages[i].data, t2s->pages[i].size);
+        }
+        scu_dma_transfer(0, (void *)(NBGX_CPD + t2s_layer_1->tileset->character_offset), t2s_layer_1->tileset->character_pattern, t2s_layer_1->tileset->character_pattern_size);
         
+        vdp2_scrn_normal_map_t nbg0_normal_map;
+        tiled2saturn_layer_normal_map(t2s_layer_1, NBGX_PAGES, 0, 0, &nbg0_normal_map);
+        nbg0_format.cpd_base = NBGX_CPD + tiled2saturn_tileset_character_window(t2s_layer_1->tileset);
         vdp2_scrn_cell_format_set(&nbg0_format, &nbg0_normal_map);
 
         vdp2_scrn_priority_set(VDP2_SCRN_NBG0, 5);
 
         scu_dma_transfer(0, (void *)NBG1_PAL, t2s_layer_2->tileset->palette, t2s_layer_2->tileset->palette_size);
-        scu_dma_transfer(0, (void *)NBG1_MAP, t2s_layer_2->pattern_name_data, t2s_layer_2->pattern_name_data_size);
-        scu_dma_transfer(0, (void *)NBG1_CPD, t2s_layer_2->tileset->character_pattern, t2s_layer_2->tileset->character_pattern_size);
+        scu_dma_transfer(0, (void *)(NBGX_CPD + t2s_layer_2->tileset->character_offset), t2s_layer_2->tileset->character_pattern, t2s_layer_2->tileset->character_pattern_size);
 
+        vdp2_scrn_normal_map_t nbg1_normal_map;
+        tiled2saturn_layer_normal_map(t2s_layer_2, NBGX_PAGES, 0, 0, &nbg1_normal_map);
+        nbg1_format.cpd_base = NBGX_CPD + tiled2saturn_tileset_character_window(t2s_layer_2->tileset);
         vdp2_scrn_cell_format_set(&nbg1_format, &nbg1_normal_map);
 
         vdp2_scrn_priority_set(VDP2_SCRN_NBG1, 6);
 
         scu_dma_transfer(0, (void *)NBG2_PAL, t2s_layer_3->tileset->palette, t2s_layer_3->tileset->palette_size);
-        scu_dma_transfer(0, (void *)NBG2_MAP, t2s_layer_3->pattern_name_data, t2s_layer_3->pattern_name_data_size);
-        scu_dma_transfer(0, (void *)NBG2_CPD, t2s_layer_3->tileset->character_pattern, t2s_layer_3->tileset->character_pattern_size);
+        scu_dma_transfer(0, (void *)(NBGX_CPD + t2s_layer_3->tileset->character_offset), t2s_layer_3->tileset->character_pattern, t2s_layer_3->tileset->character_pattern_size);
 
+        vdp2_scrn_normal_map_t nbg2_normal_map;
+        tiled2saturn_layer_normal_map(t2s_layer_3, NBGX_PAGES, 0, 0, &nbg2_normal_map);
+        nbg2_format.cpd_base = NBGX_CPD + tiled2saturn_tileset_character_window(t2s_layer_3->tileset);
         vdp2_scrn_cell_format_set(&nbg2_format, &nbg2_normal_map);
 
         vdp2_scrn_priority_set(VDP2_SCRN_NBG2, 7);
 
-        vdp2_scrn_scroll_x_set(VDP2_SCRN_NBG0, FIX16(320.0f/2));
-        vdp2_scrn_scroll_y_set(VDP2_SCRN_NBG0, FIX16(224.0f/2));
-
-        vdp2_scrn_scroll_x_set(VDP2_SCRN_NBG1, FIX16(320.0f/2));
-        vdp2_scrn_scroll_y_set(VDP2_SCRN_NBG1, FIX16(224.0f/2));
+        fix16_vec2_t camera = FIX16_VEC2_INITIALIZER(320.0f/2, 224.0f/2);
 
-
-        vdp2_scrn_scroll_x_set(VDP2_SCRN_NBG2, FIX16(320.0f/2));
-        vdp2_scrn_scroll_y_set(VDP2_SCRN_NBG2, FIX16(224.0f/2));
+        tiled2saturn_layer_scroll_apply(t2s_layer_1, VDP2_SCRN_NBG0, camera.x, camera.y, NULL);
+        tiled2saturn_layer_scroll_apply(t2s_layer_2, VDP2_SCRN_NBG1, camera.x, camera.y, NULL);
+        tiled2saturn_layer_scroll_apply(t2s_layer_3, VDP2_SCRN_NBG2, camera.x, camera.y, NULL);
 
         vdp2_scrn_disp_t disp_mask;
         disp_mask = VDP2_SCRN_DISP_NBG0 | VDP2_SCRN_DISPTP_NBG1 | VDP2_SCRN_DISPTP_NBG2;
@@ -215,15 +192,13 @@ int main(void)
                         .y = pos.y & 0xFFFF0000
                 };
 
-                vdp2_scrn_scroll_x_update(VDP2_SCRN_NBG0, clamped_pos.x);
-                vdp2_scrn_scroll_y_update(VDP2_SCRN_NBG0, clamped_pos.y);
-
-                vdp2_scrn_scroll_x_update(VDP2_SCRN_NBG1, clamped_pos.x);
-                vdp2_scrn_scroll_y_update(VDP2_SCRN_NBG1, clamped_pos.y);
-
+                camera.x += clamped_pos.x;
+                camera.y += clamped_pos.y;
 
-                vdp2_scrn_scroll_x_update(VDP2_SCRN_NBG2, clamped_pos.x);
-                vdp2_scrn_scroll_y_update(VDP2_SCRN_NBG2, clamped_pos.y);
+                // Each layer scrolls by its parallax factor from landscape.tmx
+                tiled2saturn_layer_scroll_apply(t2s_layer_1, VDP2_SCRN_NBG0, camera.x, camera.y, NULL);
+                tiled2saturn_layer_scroll_apply(t2s_layer_2, VDP2_SCRN_NBG1, camera.x, camera.y, NULL);
+                tiled2saturn_layer_scroll_apply(t2s_layer_3, VDP2_SCRN_NBG2, camera.x, camera.y, NULL);
 
                 vdp2_sync();
                 vdp2_sync_wait();
@@ -10,11 +10,7 @@
 #define NBGX_CPD         VDP2_VRAM_ADDR(0, 0x00000)
 #define NBGX_PAL         VDP2_CRAM_MODE_1_OFFSET(0, 0, 0)
 
-#define NBG0_MAP         VDP2_VRAM_ADDR(1, 0x00000)
-#define NBG1_MAP         VDP2_VRAM_ADDR(1, 0x00800)
-#define NBG2_MAP         VDP2_VRAM_ADDR(1, 0x01000)
-#define NBG3_MAP         VDP2_VRAM_ADDR(1, 0x01800)
-#define NBGX_MAP_EMPTY   VDP2_VRAM_ADDR(1, 0x02000) 
+#define NBGX_PAGES       VDP2_VRAM_ADDR(1, 0x00000)
 
 #define BACK_SCREEN      VDP2_VRAM_ADDR(3, 0x01FFFE)
 
@@ -37,34 +33,6 @@ int main(void)
                 .palette_base  = NBGX_PAL
         };
 
-        const vdp2_scrn_normal_map_t nbg0_normal_map = {
-                .plane_a = NBG0_MAP,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
-        const vdp2_scrn_normal_map_t nbg1_normal_map = {
-                .plane_a = NBGX_MAP_EMPTY,
-                .plane_b = NBG1_MAP,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
-        const vdp2_scrn_normal_map_t nbg2_normal_map = {
-                .plane_a = NBGX_MAP_EMPTY,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBG2_MAP,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
-        const vdp2_scrn_normal_map_t nbg3_normal_map = {
-                .plane_a = NBGX_MAP_EMPTY,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBG3_MAP
-         };
-
          const vdp2_vram_cycp_t vram_cycp = {
                 .pt[0].t0 = VDP2_VRAM_CYCP_CHPNDR_NBG2,
                 .pt[0].t1 = VDP2_VRAM_CYCP_CHPNDR_NBG2,
@@ -108,24 +76,29 @@ int main(void)
         tiled2saturn_t* t2s = tiled2saturn_parse(layer1);
         
         scu_dma_transfer(0, (void *)NBGX_PAL, t2s->tilesets[0]->palette, t2s->tilesets[0]->palette_size);
-        scu_dma_transfer(0, (void *)NBG0_MAP, t2s->layers[0]->pattern_name_data, t2s->layers[0]->pattern_name_data_size);
-        scu_dma_transfer(0, (void *)NBG1_MAP, t2s->layers[1]->pattern_name_data, t2s->layers[1]->pattern_name_data_size);
-        scu_dma_transfer(0, (void *)NBG2_MAP, t2s->layers[2]->pattern_name_data, t2s->layers[2]->pattern_name_data_size);
-        scu_dma_transfer(0, (void *)NBG3_MAP, t2s->layers[3]->pattern_name_data, t2s->layers[3]->pattern_name_data_size);
+        for(uint16_t i = 0; i < t2s->page_count; i++){
+                scu_dma_transfer(0, (void *)(NBGX_PAGES + t2s->pages[i].vram_offset), t2s->pages[i].data, t2s->pages[i].size);
+        }
         scu_dma_transfer(0, (void *)NBGX_CPD, t2s->tilesets[0]->character_pattern, t2s->tilesets[0]->character_pattern_size);
 
-        (void)memset((void *)(NBGX_MAP_EMPTY), 0x101 << 1, 0x800);
-        
         nbgx_format.scroll_screen = VDP2_SCRN_NBG0;
+        vdp2_scrn_normal_map_t nbg0_normal_map;
+        tiled2saturn_layer_normal_map(t2s->layers[0], NBGX_PAGES, 0, 0, &nbg0_normal_map);
         vdp2_scrn_cell_format_set(&nbgx_format, &nbg0_normal_map);
 
         nbgx_format.scroll_screen = VDP2_SCRN_NBG1;
+        vdp2_scrn_normal_map_t nbg1_normal_map;
+        tiled2saturn_layer_normal_map(t2s->layers[1], NBGX_PAGES, -1, 0, &nbg1_normal_map);
         vdp2_scrn_cell_format_set(&nbgx_format, &nbg1_normal_map);
 
         nbgx_format.scroll_screen = VDP2_SCRN_NBG2;
+        vdp2_scrn_normal_map_t nbg2_normal_map;
+        tiled2saturn_layer_normal_map(t2s->layers[2], NBGX_PAGES, 0, -1, &nbg2_normal_map);
         vdp2_scrn_cell_format_set(&nbgx_format, &nbg2_normal_map);
 
         nbgx_format.scroll_screen = VDP2_SCRN_NBG3;
+        vdp2_scrn_normal_map_t nbg3_normal_map;
+        tiled2saturn_layer_normal_map(t2s->layers[3], NBGX_PAGES, -1, -1, &nbg3_normal_map);
         vdp2_scrn_cell_format_set(&nbgx_format, &nbg3_normal_map);
 
         vdp2_scrn_priority_set(VDP2_SCRN_NBG0, 7);
@@ -15,8 +15,7 @@
 
 #define NBG0_BMP         VDP2_VRAM_ADDR(1, 0x000000)
 #define NBG1_CPD         VDP2_VRAM_ADDR(0, 0x000000)
-#define NBG1_MAP         VDP2_VRAM_ADDR(0, 0x008000)
-#define NBGX_MAP_EMPTY   VDP2_VRAM_ADDR(0, 0x008800)
+#define NBGX_PAGES       VDP2_VRAM_ADDR(0, 0x008000)
 #define NBG1_PAL         VDP2_CRAM_MODE_1_OFFSET(0, 0, 0)
 #define BACK_SCREEN      VDP2_VRAM_ADDR(3, 0x01FFFE)
 
@@ -80,16 +79,18 @@ typedef struct collision {
   bool right;
 } collision_t;
 
-collision_t** tiled2saturn_collisions_convertor(tiled2saturn_collision_t** tiled2saturn_collisions, uint32_t number_of_collisions){
+collision_t** tiled2saturn_collisions_convertor(const tiled2saturn_collision_masks_t* collision_masks){
+        uint32_t number_of_collisions = collision_masks->width * collision_masks->height;
         collision_t** collisions = (collision_t**)malloc(number_of_collisions * sizeof(collision_t*));
-        const uint8_t tile_row_size = 32;
         for(uint32_t i = 0; i<number_of_collisions; i++){
+                int32_t x = (int32_t)(i % collision_masks->width);
+                int32_t y = (int32_t)(i / collision_masks->width);
                 collision_t* collision = (collision_t*)malloc(sizeof(collision_t));
-                collision->collides = tiled2saturn_collisions[i]->collision_type != (tiled2saturn_collision_type_t)EMPTY;
-                collision->top = (i >= tile_row_size ? tiled2saturn_collisions[i-tile_row_size]->collision_type == (tiled2saturn_collision_type_t)EMPTY : false);
-                collision->bottom = (i < (number_of_collisions - tile_row_size) ? tiled2saturn_collisions[i+tile_row_size]->collision_type == (tiled2saturn_collision_type_t)EMPTY : false);
-                collision->left = (i > 0 ? tiled2saturn_collisions[i-1]->collision_type == (tiled2saturn_collision_type_t)EMPTY : false);
-                collision->right = (i < number_of_collisions ? tiled2saturn_collisions[i+1]->collision_type == (tiled2saturn_collision_type_t)EMPTY : false);
+                collision->collides = tiled2saturn_collision_mask_get(collision_masks, x, y) != 0;
+                collision->top = (y > 0 ? tiled2saturn_collision_mask_get(collision_masks, x, y - 1) == 0 : false);
+                collision->bottom = ((uint32_t)y + 1 < collision_masks->height ? tiled2saturn_collision_mask_get(collision_masks, x, y + 1) == 0 : false);
+                collision->left = (x > 0 ? tiled2saturn_collision_mask_get(collision_masks, x - 1, y) == 0 : false);
+                collision->right = ((uint32_t)x + 1 < collision_masks->width ? tiled2saturn_collision_mask_get(collision_masks, x + 1, y) == 0 : false);
                 collisions[i] = collision;
         }
         return collisions;
@@ -111,21 +112,21 @@ void balls_assets_load()
         scu_dma_transfer(0, (void *)_sprite_pal_base, asset_ball_pal, asset_ball_pal_end - asset_ball_pal);
 }
 
-void balls_cmdts_put(uint16_t index)
+void balls_cmdts_put(tiled2saturn_t* t2s, uint16_t index)
 {
-        const vdp1_cmdt_draw_mode_t draw_mode = {
-                .color_mode           = 0,
-                .trans_pixel_disable  = false,
-                .pre_clipping_disable = true,
-                .end_code_disable     = false
-        };
+        /* The ball sprite is the first object of the Sprites layer, its
+         * command is prebuilt from the object properties in collisions.tmx */
+        tiled2saturn_object_layer_t* sprites = get_object_layer_by_id(t2s, 4);
+        assert(sprites != NULL && sprites->object_count > 0);
 
         vdp1_cmdt_t *cmdt;
         cmdt = (vdp1_cmdt_t *)VDP1_CMD_TABLE(index, 0);
 
-        vdp1_cmdt_normal_sprite_set(cmdt);
+        tiled2saturn_object_layer_cmdts_copy(sprites, cmdt);
 
-        vdp1_cmdt_draw_mode_set(cmdt, draw_mode);
+        /* The texture is loaded wherever the VDP1 VRAM partitions put it,
+         * and each run picks the ball a random palette */
+        vdp1_cmdt_char_base_set(cmdt, _sprite_tex_base);
 
         const uint32_t rand_index = rand() & 15;
         const uint16_t palette_offset =
@@ -137,13 +138,8 @@ void balls_cmdts_put(uint16_t index)
         };
 
         vdp1_cmdt_color_mode0_set(cmdt, color_bank);
-        vdp1_cmdt_char_size_set(cmdt, ball_size, ball_size);
-        vdp1_cmdt_char_base_set(cmdt, _sprite_tex_base);
-
-        cmdt->cmd_xa = 0;
-        cmdt->cmd_ya = 0;
 
-        vdp1_cmdt_end_set(cmdt);
+        vdp1_cmdt_end_set(&cmdt[sprites->object_count - 1]);
 }
 
 static inline fix16_t _ball_position_update(fix16_t pos, fix16_t speed)
@@ -274,13 +270,6 @@ int main(void)
                 .palette_base  = NBG1_PAL
         };
 
-        const vdp2_scrn_normal_map_t nbg1_normal_map = {
-                .plane_a = NBG1_MAP,
-                .plane_b = NBGX_MAP_EMPTY,
-                .plane_c = NBGX_MAP_EMPTY,
-                .plane_d = NBGX_MAP_EMPTY
-        };
-
         const vdp2_vram_cycp_t vram_cycp = {
                 .pt[0].t0 = VDP2_VRAM_CYCP_CHPNDR_NBG1,
                 .pt[0].t1 = VDP2_VRAM_CYCP_PNDR_NBG1,
@@ -347,9 +336,13 @@ int main(void)
         tiled2saturn_layer_t* tileset_layer = get_layer_by_id(t2s, 2);
 
         scu_dma_transfer(0, (void *)NBG1_PAL, tileset_layer->tileset->palette, tileset_layer->tileset->palette_size);
-        scu_dma_transfer(0, (void *)NBG1_MAP, tileset_layer->pattern_name_data, tileset_layer->pattern_name_data_size);
+        for(uint16_t i = 0; i < t2s->page_count; i++){
+                scu_dma_transfer(0, (void *)(NBGX_PAGES + t2s->pages[i].vram_offset), t2s->pages[i].data, t2s->pages[i].size);
+        }
         scu_dma_transfer(0, (void *)NBG1_CPD, tileset_layer->tileset->character_pattern, tileset_layer->tileset->character_pattern_size);
         
+        vdp2_scrn_normal_map_t nbg1_normal_map;
+        tiled2saturn_layer_normal_map(tileset_layer, NBGX_PAGES, 0, 0, &nbg1_normal_map);
         vdp2_scrn_cell_format_set(&format_nbg1, &nbg1_normal_map);
         vdp2_scrn_priority_set(VDP2_SCRN_NBG1, 6);
         
@@ -358,7 +351,7 @@ int main(void)
         vdp2_scrn_scroll_x_set(VDP2_SCRN_NBG0, FIX16(0));
         vdp2_scrn_scroll_y_set(VDP2_SCRN_NBG0, FIX16(0));
 
-        collision_t** collisions = tiled2saturn_collisions_convertor(t2s->collisions, (t2s->header->width * t2s->header->height));
+        collision_t** collisions = tiled2saturn_collisions_convertor(t2s->collision_masks);
 
         vdp2_sync();
         vdp2_sync_wait();
@@ -367,7 +360,7 @@ int main(void)
 
         balls_assets_init();
         balls_assets_load();
-        balls_cmdts_put(VDP1_CMDT_ORDER_BALL_START_INDEX);
+        balls_cmdts_put(t2s, VDP1_CMDT_ORDER_BALL_START_INDEX);
 
          while (true) {
                 smpc_peripheral_process();
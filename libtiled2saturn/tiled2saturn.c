@@ -6,8 +6,12 @@
 
 #include "tiled2saturn.h"
 
+#ifdef TILED2SATURN_PTHREAD
+#include <pthread.h>
+#endif
+
 #define LONG(raw_bytes, position)  (uint32_t)(((BYTE(raw_bytes, position)) << 24) | ((BYTE(raw_bytes, position+1)) << 16) | ((BYTE(raw_bytes, position+2)) << 8) | (BYTE(raw_bytes, position+3)))
-#define SHORT(raw_bytes, position) (uint16_t)((BYTE(raw_bytes, position)) << 8) | (BYTE(raw_bytes, position+1))
+#define SHORT(raw_bytes, position) (uint16_t)(((BYTE(raw_bytes, position)) << 8) | (BYTE(raw_bytes, position+1)))
 #define BYTE(raw_bytes, position)  (uint8_t)*(raw_bytes+(position))
 
 /**
@@ -36,7 +40,7 @@ static tiled2saturn_header_t* parse_header(uint8_t* bytes){
     uint32_t magic = LONG(bytes, 0);  //4 0-3
     assert(magic == 0x894D4150);
     header->version = LONG(bytes, 4); //4 4-7 
-    assert(header->version == 4);
+    assert(header->version == 17);
     header->width = LONG(bytes, 8);   //4 8-11
     assert((header->width % 8) == 0);
     header->height = LONG(bytes, 12); //4 12-15
@@ -63,7 +67,24 @@ static tiled2saturn_header_t* parse_header(uint8_t* bytes){
         assert(header->bitmap_layer_offset > 0);
     }
     
-    header->collision_offset = LONG(bytes, 31); // 4 31 - 34
+    header->object_layer_count = BYTE(bytes, 31); //1 31
+
+    if(header->object_layer_count > 0){
+        header->object_layer_offset = LONG(bytes, 32); //4 32-35
+        assert(header->object_layer_offset > 0);
+    }
+
+    header->sprite_atlas_offset = LONG(bytes, 36); //4 36-39
+    assert(header->sprite_atlas_offset > 0);
+
+    header->collision_rects_offset = LONG(bytes, 40); //4 40-43
+    assert(header->collision_rects_offset > 0);
+    header->collision_rect_layer_count = BYTE(bytes, header->collision_rects_offset);
+
+    header->collision_masks_offset = LONG(bytes, 44); //4 44-47
+    assert(header->collision_masks_offset > 0);
+
+    header->collision_offset = LONG(bytes, 48); // 4 48 - 51
     assert(header->collision_offset > 0);
     return header; 
 }
@@ -93,7 +114,6 @@ static tiled2saturn_tileset_t* parse_tileset(uint8_t* bytes, uint32_t offset){
     tileset->tileset_size = LONG(bytes, offset); //4 25-28
     assert(tileset->tileset_size > 0);
     tileset->tile_width = LONG(bytes, offset + 4); //4 29-32
-    assert(tileset->tile_width == 16);
     tileset->tile_height = LONG(bytes, offset + 8); //4 33-36
     assert(tileset->tile_height > 0);
     tileset->tile_count = LONG(bytes, offset + 12); //4 37-40
@@ -105,14 +125,19 @@ static tiled2saturn_tileset_t* parse_tileset(uint8_t* bytes, uint32_t offset){
     tileset->number_of_colors = SHORT(bytes, offset + 19); //2 44-45
     assert(tileset->number_of_colors == 16 || tileset->number_of_colors == 256 || tileset->number_of_colors == 1024 || tileset->number_of_colors == 2048);
     tileset->palette_bank = BYTE(bytes, offset + 21); //2 44-45
+    // Bytes from the character pattern base, every tileset of the map is placed together by the converter
+    tileset->character_offset = LONG(bytes, offset + 22); //4 46-49
+    assert(tileset->character_offset % 32 == 0);
     
-    tileset->palette_size = LONG(bytes, offset + 22); //4 44-47
+    tileset->palette_size = LONG(bytes, offset + 26); //4 50-53
     assert(tileset->palette_size > 0);
-    tileset->palette = (uint8_t*)bytes+offset+26;
+    tileset->palette = (uint8_t*)bytes+offset+30;
 
-    tileset->character_pattern_size = LONG(bytes, tileset->palette_size+offset+26); //4 48-51
-    assert(tileset->character_pattern_size > 0);
-    tileset->character_pattern = (uint8_t *)bytes+tileset->palette_size+offset+30;
+    // Sprite sheets have no character pattern, their frames are packed into the sprite atlas
+    tileset->character_pattern_size = LONG(bytes, tileset->palette_size+offset+30); //4 54-57
+    tileset->character_pattern = (uint8_t *)bytes+tileset->palette_size+offset+34;
+    // Sprite sheet frames can be any width, VDP2 characters are 8x8 or 16x16
+    assert(tileset->character_pattern_size == 0 || tileset->tile_width == 8 || tileset->tile_width == 16);
     return tileset;
 }
 
@@ -120,7 +145,10 @@ static tiled2saturn_tileset_t* parse_tileset(uint8_t* bytes, uint32_t offset){
  * @brief Parse a layer from a byte stream.
  *
  * This function parses a layer from a byte stream, extracting various properties of the layer,
- * including its ID, size, dimensions, and pattern name data. It performs validation checks on
+ * including its ID, size, dimensions, page table and pattern name data. Pattern name data is stored one
+ * VDP2 page at a time and identical pages are stored once per map, so a layer only holds the `page_count`
+ * pages numbered from `first_page` that no earlier layer stored. Page table entries index the map's pages,
+ * pages without tiles have `TILED2SATURN_EMPTY_PAGE_FLAG` set and point at the blank page. It performs validation checks on
  * some fields and returns a dynamically allocated `tiled2saturn_layer_t` structure containing the
  * parsed layer data.
  *
@@ -152,24 +180,94 @@ static tiled2saturn_layer_t* parse_layer(uint8_t* bytes, uint32_t offset, tiled2
 
     layer->tile_flip_enabled = BYTE(bytes, offset+18); //1 70
     assert(layer->tile_flip_enabled < 2);
-    layer->tile_transparency_enabled = BYTE(bytes, offset+19); //4 71-74
+    layer->tile_transparency_enabled = BYTE(bytes, offset+19); //1 71
     assert(layer->tile_transparency_enabled < 2);
+
+    layer->origin_x = (int32_t)LONG(bytes, offset+20); //4 72-75
+    layer->origin_y = (int32_t)LONG(bytes, offset+24); //4 76-79
+    layer->page_columns = SHORT(bytes, offset+28); //2 80-81
+    layer->page_rows = SHORT(bytes, offset+30); //2 82-83
+    layer->blank_page = SHORT(bytes, offset+32); //2 84-85
+    assert(layer->blank_page < TILED2SATURN_EMPTY_PAGE_FLAG);
+    layer->first_page = SHORT(bytes, offset+34); //2 86-87
+    layer->page_count = SHORT(bytes, offset+36); //2 88-89
     
-    layer->pattern_name_data_size = LONG(bytes, offset+20); //4 75-78
-    assert(layer->pattern_name_data_size > 0);
+    layer->pattern_name_data_size = LONG(bytes, offset+38); //4 90-93
 
-    layer->pattern_name_data = (uint8_t*)bytes+offset+24;
+    layer->scroll_ratio_x = (int32_t)LONG(bytes, offset+42); //4 94-97
+    layer->scroll_ratio_y = (int32_t)LONG(bytes, offset+46); //4 98-101
+    layer->scroll_offset_x = (int32_t)LONG(bytes, offset+50); //4 102-105
+    layer->scroll_offset_y = (int32_t)LONG(bytes, offset+54); //4 106-109
+    layer->line_scroll_band_count = SHORT(bytes, offset+58); //2 110-111
+    layer->line_scroll_bands = (uint8_t*)bytes+offset+60;
+
+    uint32_t page_table_offset = offset + 60 + (uint32_t)layer->line_scroll_band_count * 8;
+    layer->page_table = (uint8_t*)bytes+page_table_offset;
+
+    uint32_t page_table_size = (uint32_t)layer->page_columns * layer->page_rows * 2;
+    layer->pattern_name_data = (uint8_t*)bytes+page_table_offset+page_table_size;
 
     layer->tileset = tilesets[tileset_index];
 
+    // A page is 512x512 pixels, 32x32 cells of 16x16 tiles or 64x64 cells of 8x8 tiles
+    uint32_t page_cells = 512 / layer->tileset->tile_width;
+    layer->page_size = page_cells * page_cells * layer->tileset->words_per_palette * 2;
+    assert(layer->pattern_name_data_size == (uint32_t)layer->page_count * layer->page_size);
+
+    // Filled in once every layer is parsed, see parse_pages
+    layer->pages = NULL;
+
+    // Only allocated while the layer is being edited, see tiled2saturn_layer_edit_begin
+    layer->edit_pages = NULL;
+    layer->dirty_cells = NULL;
+
     return layer;
 }
 
+/**
+ * @brief Gather the pages of pattern name data stored across every layer.
+ *
+ * Each layer stores the pages it introduced, in page number order. This collects them into one array for the
+ * map and gives each page a VRAM offset, laying the pages out back to back with every page aligned to its own
+ * size, as VDP2 plane addresses require. Every layer is pointed at the array.
+ *
+ * @param saturn_map The map whose layers have been parsed.
+ *
+ * @warning The caller must free the allocated page array, `tiled2saturn_free()` does this for parsed maps.
+ */
+static void parse_pages(tiled2saturn_t* saturn_map){
+    saturn_map->page_count = 0;
+    for(uint8_t i = 0; i<saturn_map->header->layer_count; i++){
+        assert(saturn_map->layers[i]->first_page == saturn_map->page_count);
+        saturn_map->page_count += saturn_map->layers[i]->page_count;
+    }
+
+    saturn_map->pages = (tiled2saturn_page_t*)malloc(sizeof(tiled2saturn_page_t) * saturn_map->page_count);
+
+    uint32_t vram_offset = 0;
+    for(uint8_t i = 0; i<saturn_map->header->layer_count; i++){
+        tiled2saturn_layer_t* layer = saturn_map->layers[i];
+        for(uint16_t j = 0; j<layer->page_count; j++){
+            tiled2saturn_page_t* page = &saturn_map->pages[layer->first_page + j];
+            vram_offset = (vram_offset + layer->page_size - 1) & ~(layer->page_size - 1);
+            page->data = layer->pattern_name_data + (uint32_t)j * layer->page_size;
+            page->size = layer->page_size;
+            page->vram_offset = vram_offset;
+            vram_offset += layer->page_size;
+        }
+        layer->pages = saturn_map->pages;
+    }
+
+    saturn_map->pages_vram_size = vram_offset;
+}
+
 /**
  * @brief Parse a bitmap layer from a byte stream.
  *
  * This function parses a butmap layer from a byte stream, extracting various properties of the layer,
- * including its ID, size, dimensions, and bitmap data. It performs validation checks on
+ * including its ID, size, dimensions, color mode, band size, palette and bitmap data. Direct color (RGB) bitmaps have
+ * no palette and `palette` is left NULL. The bitmap is padded by the converter to start on a 4 byte boundary
+ * relative to the start of the byte stream. It performs validation checks on
  * some fields and returns a dynamically allocated `tiled2saturn_bitmap_layer_t` structure containing the
  * parsed layer data.
  *
@@ -196,66 +294,392 @@ static tiled2saturn_bitmap_layer_t* parse_bitmap_layer(uint8_t* bytes, uint32_t
     assert(bitmap_layer->layer_width > 0);
     bitmap_layer->layer_height = LONG(bytes, offset+12); // 47 - 50  
     assert(bitmap_layer->layer_height > 0);
+
+    bitmap_layer->bitmap_color_mode = (tiled2saturn_bitmap_color_mode_t)BYTE(bytes, offset+16); // 51
+    assert(bitmap_layer->bitmap_color_mode <= BITMAP_RGB_16M && bitmap_layer->bitmap_color_mode != 2);
+
+    bitmap_layer->band_lines = SHORT(bytes, offset+17); // 52 - 53
+    assert(bitmap_layer->band_lines <= bitmap_layer->layer_height);
+
+    bitmap_layer->palette_size = LONG(bytes, offset+19); // 54 - 57
+    bitmap_layer->palette = bitmap_layer->palette_size > 0 ? (uint8_t*)bytes+offset+23 : NULL;
   
-    bitmap_layer->bitmap_size = LONG(bytes, offset+16); // 51 - 54
+    bitmap_layer->bitmap_size = LONG(bytes, bitmap_layer->palette_size+offset+23); // 58 - 61
     assert(bitmap_layer->bitmap_size > 0);
+    assert((bitmap_layer->bitmap_size % bitmap_layer->layer_height) == 0);
+
+    uint8_t bitmap_padding = BYTE(bytes, bitmap_layer->palette_size+offset+27); // 62
+    assert(bitmap_padding < 4);
 
-    bitmap_layer->bitmap = (uint8_t*)bytes+offset+20;
+    bitmap_layer->bitmap = (uint8_t*)bytes+bitmap_layer->palette_size+offset+28+bitmap_padding;
 
     return bitmap_layer;
 }
 
 /**
- * @brief Parse a collision set from a byte stream.
+ * @brief Parse an object layer from a byte stream.
+ *
+ * The layer holds one VDP1 normal sprite command per exported object, laid out as `vdp1_cmdt_t` and starting on a
+ * 4 byte boundary, followed by the Tiled id of each object in the same order.
+ *
+ * @param bytes Pointer to the byte stream containing the object layer data.
+ * @param offset The offset in the byte stream where the object layer data begins.
+ *
+ * @return A dynamically allocated `tiled2saturn_object_layer_t` structure containing the parsed object layer.
+ *         The caller is responsible for freeing this memory when it is no longer needed using `free()`.
+ *
+ * @warning The caller must free the memory allocated for the parsed object layer structure to prevent memory leaks.
+ */
+static tiled2saturn_object_layer_t* parse_object_layer(uint8_t* bytes, uint32_t offset){
+    tiled2saturn_object_layer_t* object_layer = (tiled2saturn_object_layer_t*)malloc(sizeof(tiled2saturn_object_layer_t));
+    object_layer->id = LONG(bytes, offset); //4 0-3
+    assert(object_layer->id != 0);
+    object_layer->layer_size = LONG(bytes, offset+4); //4 4-7
+    assert(object_layer->layer_size > 0);
+    object_layer->object_count = SHORT(bytes, offset+8); //2 8-9
+
+    uint8_t record_padding = BYTE(bytes, offset+10); //1 10
+    assert(record_padding < 4);
+
+    object_layer->cmdts = (uint8_t*)bytes+offset+11+record_padding;
+    object_layer->cmdts_size = (uint32_t)object_layer->object_count * TILED2SATURN_CMDT_SIZE;
+    object_layer->object_ids = object_layer->cmdts + object_layer->cmdts_size;
+    assert(object_layer->layer_size == 11 + record_padding + object_layer->cmdts_size + (uint32_t)object_layer->object_count * 4);
+
+    return object_layer;
+}
+
+/**
+ * @brief Parse the sprite atlas from a byte stream.
+ *
+ * The atlas holds the frames of every sprite sheet tileset packed into one VDP1 texture. A table of sheets maps
+ * each sprite sheet's tileset index to its first frame, followed by one 8 byte frame per tile and the texture,
+ * which starts on a 4 byte boundary.
+ *
+ * @param bytes Pointer to the byte stream containing the sprite atlas data.
+ * @param offset The offset in the byte stream where the sprite atlas data begins.
+ *
+ * @return A dynamically allocated `tiled2saturn_sprite_atlas_t` structure containing the parsed sprite atlas.
+ *         The caller is responsible for freeing this memory when it is no longer needed using `free()`.
+ *
+ * @warning The caller must free the memory allocated for the parsed sprite atlas structure to prevent memory leaks.
+ */
+static tiled2saturn_sprite_atlas_t* parse_sprite_atlas(uint8_t* bytes, uint32_t offset){
+    tiled2saturn_sprite_atlas_t* sprite_atlas = (tiled2saturn_sprite_atlas_t*)malloc(sizeof(tiled2saturn_sprite_atlas_t));
+    sprite_atlas->atlas_size = LONG(bytes, offset); //4 0-3
+    assert(sprite_atlas->atlas_size >= 13);
+    sprite_atlas->sheet_count = SHORT(bytes, offset+4); //2 4-5
+    sprite_atlas->frame_count = SHORT(bytes, offset+6); //2 6-7
+    sprite_atlas->texture_size = LONG(bytes, offset+8); //4 8-11
+
+    uint8_t texture_padding = BYTE(bytes, offset+12); //1 12
+    assert(texture_padding < 4);
+
+    sprite_atlas->sheets = (uint8_t*)bytes+offset+13;
+    sprite_atlas->frames = sprite_atlas->sheets + (uint32_t)sprite_atlas->sheet_count * 6;
+    sprite_atlas->texture = sprite_atlas->frames + (uint32_t)sprite_atlas->frame_count * 8 + texture_padding;
+    assert(sprite_atlas->texture + sprite_atlas->texture_size == (uint8_t*)bytes + offset + sprite_atlas->atlas_size);
+
+    return sprite_atlas;
+}
+
+/**
+ * @brief Parse the merged collision rects of a tile layer from a byte stream.
+ *
+ * The solid cells of the layer are merged by the converter into axis aligned rects, 16 bytes each of 32 bit x, y, width and
+ * height in pixels from the top left of the map. A coarse grid of `region_columns` by `region_rows` regions follows,
+ * as a 32 bit start per region into a list of 16 bit rect indices, with one more start for the end of the last
+ * region. A rect is listed in every region it overlaps.
+ *
+ * @param bytes Pointer to the byte stream containing the collision rect layer data.
+ * @param offset The offset in the byte stream where the collision rect layer data begins.
+ *
+ * @return A dynamically allocated `tiled2saturn_collision_rect_layer_t` structure containing the parsed layer.
+ *         The caller is responsible for freeing this memory when it is no longer needed using `free()`.
+ *
+ * @warning The caller must free the memory allocated for the parsed collision rect layer structure to prevent memory leaks.
+ */
+static tiled2saturn_collision_rect_layer_t* parse_collision_rect_layer(uint8_t* bytes, uint32_t offset){
+    tiled2saturn_collision_rect_layer_t* layer = (tiled2saturn_collision_rect_layer_t*)malloc(sizeof(tiled2saturn_collision_rect_layer_t));
+    layer->id = LONG(bytes, offset); //4 0-3
+    assert(layer->id != 0);
+    layer->layer_size = LONG(bytes, offset+4); //4 4-7
+    layer->region_width = SHORT(bytes, offset+8); //2 8-9
+    assert(layer->region_width > 0);
+    layer->region_height = SHORT(bytes, offset+10); //2 10-11
+    assert(layer->region_height > 0);
+    layer->region_columns = SHORT(bytes, offset+12); //2 12-13
+    layer->region_rows = SHORT(bytes, offset+14); //2 14-15
+    layer->rect_count = SHORT(bytes, offset+16); //2 16-17
+    layer->index_count = LONG(bytes, offset+18); //4 18-21
+
+    uint32_t region_count = (uint32_t)layer->region_columns * layer->region_rows;
+    layer->rects = (uint8_t*)bytes+offset+22;
+    layer->region_starts = layer->rects + (uint32_t)layer->rect_count * 16;
+    layer->region_rects = layer->region_starts + (region_count + 1) * 4;
+    assert(LONG(layer->region_starts, region_count * 4) == layer->index_count);
+    assert(layer->region_rects + layer->index_count * 2 == (uint8_t*)bytes + offset + layer->layer_size);
+
+    return layer;
+}
+
+/**
+ * @brief Parse the collision class masks from a byte stream.
+ *
+ * Every map cell has a mask with a bit set for each collision class there, `mask_size` bytes of it in row major
+ * order. The name of each class, a length byte then the name without a terminator, comes before the masks in bit
+ * order. A map without collision classes has a `mask_size` of 0 and no masks.
+ *
+ * @param bytes Pointer to the byte stream containing the collision masks data.
+ * @param header The parsed header of the map, giving its size in cells.
+ *
+ * @return A dynamically allocated `tiled2saturn_collision_masks_t` structure containing the parsed masks.
+ *         The caller is responsible for freeing this memory when it is no longer needed using `free()`.
+ *
+ * @warning The caller must free the memory allocated for the parsed collision masks structure to prevent memory leaks.
+ */
+static tiled2saturn_collision_masks_t* parse_collision_masks(uint8_t* bytes, const tiled2saturn_header_t* header){
+    uint32_t offset = header->collision_masks_offset;
+    tiled2saturn_collision_masks_t* collision_masks = (tiled2saturn_collision_masks_t*)malloc(sizeof(tiled2saturn_collision_masks_t));
+    collision_masks->masks_size = LONG(bytes, offset); //4 0-3
+    collision_masks->width = header->width;
+    collision_masks->height = header->height;
+    collision_masks->class_count = BYTE(bytes, offset+4); //1 4
+    assert(collision_masks->class_count <= 32);
+    collision_masks->mask_size = BYTE(bytes, offset+5); //1 5
+    assert(collision_masks->mask_size == 0 || collision_masks->mask_size == 1 || collision_masks->mask_size == 2 || collision_masks->mask_size == 4);
+
+    collision_masks->class_names = (uint8_t*)bytes+offset+6;
+    uint32_t names_size = 0;
+    for(uint8_t i = 0; i<collision_masks->class_count; i++){
+        names_size += 1 + BYTE(collision_masks->class_names, names_size);
+    }
+    collision_masks->masks = collision_masks->class_names + names_size;
+    assert(6 + names_size + header->width * header->height * collision_masks->mask_size == collision_masks->masks_size);
+
+    return collision_masks;
+}
+
+/**
+ * @brief The collisions of a range of chunks, filled in by `parse_collision_range`.
+ *
+ * Every range fills its own part of one allocation made up front, so ranges can be parsed on any CPU at the same
+ * time without touching the heap.
+ */
+typedef struct collision_range {
+    const uint8_t*              bytes;
+    uint32_t                    offset;
+    tiled2saturn_collisions_t*  collisions;
+    uint32_t                    first_chunk;
+    uint32_t                    chunk_count;
+} collision_range_t;
+
+/**
+ * @brief Find the first stored chunk whose collisions start at or after a collision.
+ */
+static uint32_t collision_chunk_from(const tiled2saturn_collisions_t* collisions, uint32_t collision){
+    uint32_t low = 0;
+    uint32_t high = collisions->chunk_count;
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        if(LONG(collisions->chunks, middle * 12) < collision){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Parse the collisions section header, allocate its collisions and split its chunks into ranges to parse.
+ *
+ * The section starts with its size, the tiles along a chunk's side, the map's tile width and height, the chunk
+ * columns and rows, the number of stored chunks and of collisions, followed by a 16 bit entry per chunk indexing the chunk table, or 0xffff for a
+ * chunk without collisions. Each chunk table entry gives the chunk's first collision, its number of collisions
+ * and where its records start from the start of the section, so ranges are split with a binary search of the
+ * table and no record is read here. Ranges hold about the same number of collisions, whole chunks each.
+ *
+ * @param bytes A pointer to an array of bytes representing the map.
+ * @param header The parsed map header, giving the map's size and where the collisions start.
+ * @param ranges The ranges to fill in, `range_count` of them.
+ * @param range_count The number of ranges to split the chunks between.
+ *
+ * @return The collisions, with every record still to parse and without their collision masks, set them once
+ *         parsed. Free them with `free_collisions`.
+ */
+static tiled2saturn_collisions_t* prepare_collisions(uint8_t* bytes, const tiled2saturn_header_t* header, collision_range_t* ranges, uint8_t range_count){
+    uint32_t offset = header->collision_offset;
+    tiled2saturn_collisions_t* collisions = (tiled2saturn_collisions_t*)malloc(sizeof(tiled2saturn_collisions_t));
+    collisions->collisions_size = LONG(bytes, offset); //4 0-3
+    collisions->width = header->width;
+    collisions->height = header->height;
+    collisions->chunk_tiles = BYTE(bytes, offset+4); //1 4
+    assert(collisions->chunk_tiles == 16);
+    collisions->tile_width = BYTE(bytes, offset+5); //1 5
+    collisions->tile_height = BYTE(bytes, offset+6); //1 6
+    collisions->chunk_columns = SHORT(bytes, offset+7); //2 7-8
+    collisions->chunk_rows = SHORT(bytes, offset+9); //2 9-10
+    collisions->chunk_count = LONG(bytes, offset+11); //4 11-14
+    assert(collisions->chunk_count < 0xffff);
+    collisions->collision_count = LONG(bytes, offset+15); //4 15-18
+    collisions->chunk_grid = bytes+offset+19;
+    collisions->chunks = collisions->chunk_grid + (uint32_t)collisions->chunk_columns * collisions->chunk_rows * 2;
+    collisions->records = collisions->collision_count > 0 ?
+        (tiled2saturn_collision_t*)malloc(collisions->collision_count * sizeof(tiled2saturn_collision_t)) : NULL;
+    collisions->collision_masks = NULL;
+
+    // The shape of every cell left out because it fills its tile
+    collisions->full_tile_points[0] = (tiled2saturn_point_t){ 0, 0 };
+    collisions->full_tile_points[1] = (tiled2saturn_point_t){ collisions->tile_width, 0 };
+    collisions->full_tile_points[2] = (tiled2saturn_point_t){ collisions->tile_width, collisions->tile_height };
+    collisions->full_tile_points[3] = (tiled2saturn_point_t){ 0, collisions->tile_height };
+    collisions->full_tile = (tiled2saturn_collision_t){ RECT, 0, 4, collisions->full_tile_points };
+
+    for(uint8_t i = 0; i<range_count; i++){
+        ranges[i].bytes = bytes;
+        ranges[i].offset = offset;
+        ranges[i].collisions = collisions;
+        ranges[i].first_chunk = collision_chunk_from(collisions, (uint32_t)(((uint64_t)collisions->collision_count * i) / range_count));
+    }
+    for(uint8_t i = 0; i<range_count; i++){
+        ranges[i].chunk_count = (i + 1 < range_count ? ranges[i + 1].first_chunk : collisions->chunk_count) - ranges[i].first_chunk;
+    }
+
+    return collisions;
+}
+
+/**
+ * @brief Parse the collisions of a range of chunks.
  *
- * The function begins by dynamically allocating memory for an array of pointers to tiled2saturn_collision_t structures, with the number of elements equal to the size parameter.
- *   It iterates over the byte array size times, parsing each collision and storing it in the allocated array.
- *   Each collision includes:
+ * Each collision record includes:
+ *      cell: A byte value giving the cell within its chunk, row major.
  *      collision_type: A byte value representing the type of collision.
- *      collision_size: A 32-bit integer representing the size of the collision data.
- *      point_count: A 32-bit integer representing the number of points in the collision.
- *      points: An array of pointers to tiled2saturn_point_t structures representing the points of the collision.
- *
- * @param bytes A pointer to an array of bytes representing the collision data.
- * @param offset: The starting position in the byte array from where the parsing should begin.
- * @param size: The number of collisions to parse from the byte array.
- *
- * @return Returns a pointer to an array of pointers to tiled2saturn_collision_t structures, 
- *         each representing a collision parsed from the byte array.
- *
- * @note The function is designed to be used in scenarios where collision data is stored in a compressed byte format and 
- *       needs to be parsed into a structured format for further processing or analysis.
- *
- * @warning It is the caller's responsibility to ensure that the allocated memory is properly freed to avoid memory leaks.
- */
-
-static tiled2saturn_collision_t** parse_collision(uint8_t* bytes, uint32_t offset, uint32_t size){
-    tiled2saturn_collision_t** collisions = (tiled2saturn_collision_t**)malloc(size * sizeof(tiled2saturn_collision_t*));
-    uint32_t collision_position = 0;
-    for(uint32_t i = 0; i<size; i++){
-        tiled2saturn_collision_t* collision = (tiled2saturn_collision_t*)malloc(sizeof(tiled2saturn_collision_t));
-        collision->collision_type = BYTE(bytes, collision_position+ offset); //1 1
-        assert(collision->collision_type >= 0 && collision->collision_type <= 3 );
-        collision->collision_size = LONG(bytes, collision_position + (offset+1)); // 4 2-5
-        assert(collision->collision_size > 0);
-        collision->point_count =  LONG(bytes, collision_position + (offset+5));   // 4 6-9
-        assert(collision->point_count <= 256);
-        collision->points = (tiled2saturn_point_t**)malloc(collision->point_count * sizeof(tiled2saturn_point_t*));
-        uint32_t point_position = 0;
-        for(uint8_t j = 0; j<collision->point_count;j++){
-            tiled2saturn_point_t* point = (tiled2saturn_point_t*)malloc(sizeof(tiled2saturn_point_t));
-            point->x = BYTE(bytes, collision_position + point_position + (offset+10)); // 1 10
-            point->y = BYTE(bytes, collision_position + point_position + (offset+11)); // 1 11
-            collision->points[j] = point;
-            point_position+=2;
-        }
-        collisions[i] = collision;
-        collision_position += collision->collision_size;
+ *      point_count: A byte value giving the number of points in the collision.
+ *      points: The x and y bytes of each point, which the parsed collision points at rather than copying.
+ *
+ * @param work The `collision_range_t` to parse, prepared by `prepare_collisions`.
+ *
+ * @note Never allocates, so this can run as a job on any CPU.
+ */
+static void parse_collision_range(void* work){
+    collision_range_t* range = (collision_range_t*)work;
+    const uint8_t* bytes = range->bytes;
+    const uint8_t* chunks = range->collisions->chunks;
+    for(uint32_t chunk = range->first_chunk; chunk<range->first_chunk + range->chunk_count; chunk++){
+        uint32_t first = LONG(chunks, chunk * 12); //4 0-3
+        uint32_t count = LONG(chunks, chunk * 12 + 4); //4 4-7
+        uint32_t position = range->offset + LONG(chunks, chunk * 12 + 8); //4 8-11
+        for(uint32_t i = first; i<first + count; i++){
+            tiled2saturn_collision_t* collision = &range->collisions->records[i];
+            collision->cell = BYTE(bytes, position); //1 0
+            collision->collision_type = (tiled2saturn_collision_type_t)BYTE(bytes, position + 1); //1 1
+            assert(collision->collision_type <= POLY);
+            collision->point_count = BYTE(bytes, position + 2); //1 2
+            collision->points = (const tiled2saturn_point_t*)(bytes + position + 3);
+            position += 3 + (uint32_t)collision->point_count * 2;
+        }
     }
+}
 
+/**
+ * @brief Parse the collisions section from a byte stream.
+ *
+ * Parses every collision on the calling CPU, see `prepare_collisions` and `parse_collision_range`.
+ *
+ * @param bytes A pointer to an array of bytes representing the map.
+ * @param header The parsed map header.
+ * @param collision_masks The parsed collision masks of the map.
+ *
+ * @return The parsed collisions.
+ *
+ * @warning It is the caller's responsibility to free the collisions with `free_collisions` to avoid memory leaks.
+ */
+static tiled2saturn_collisions_t* parse_collisions(uint8_t* bytes, const tiled2saturn_header_t* header, const tiled2saturn_collision_masks_t* collision_masks){
+    collision_range_t range;
+    tiled2saturn_collisions_t* collisions = prepare_collisions(bytes, header, &range, 1);
+    collisions->collision_masks = collision_masks;
+    parse_collision_range(&range);
     return collisions;
 }
 
+/**
+ * @brief Free the collisions parsed by `parse_collisions`.
+ *
+ * @param tiled2saturn Pointer to the `tiled2saturn_t` structure whose collisions are freed.
+ */
+static void free_collisions(tiled2saturn_t* tiled2saturn){
+    free(tiled2saturn->collisions->records);
+    free(tiled2saturn->collisions);
+}
+
+/**
+ * @brief Parse every section of a map except its collisions.
+ *
+ * @param work The `tiled2saturn_t` being parsed, with its header already parsed.
+ *
+ * @note Allocates each section, so this always runs on the calling CPU.
+ */
+static void parse_sections(void* work){
+    tiled2saturn_t* saturn_map = (tiled2saturn_t*)work;
+    uint8_t* bytes = saturn_map->bytes;
+
+    size_t tileset_offset = saturn_map->header->tileset_offset;
+    saturn_map->tilesets = (tiled2saturn_tileset_t**)malloc(sizeof(tiled2saturn_tileset_t*) * saturn_map->header->tileset_count);
+    for(uint8_t i = 0; i<saturn_map->header->tileset_count; i++){
+        saturn_map->tilesets[i] = parse_tileset(bytes, tileset_offset);
+        tileset_offset += saturn_map->tilesets[i]->tileset_size;
+    }
+
+    size_t layer_offset = saturn_map->header->layer_offset;
+    saturn_map->layers = (tiled2saturn_layer_t**)malloc(sizeof(tiled2saturn_layer_t*) * saturn_map->header->layer_count);
+    for(uint8_t i = 0; i<saturn_map->header->layer_count; i++){
+        saturn_map->layers[i] = parse_layer(bytes, layer_offset, saturn_map->tilesets);
+        layer_offset += saturn_map->layers[i]->layer_size;
+    }
+
+    parse_pages(saturn_map);
+
+    size_t bitmap_layer_offset = saturn_map->header->bitmap_layer_offset;
+    saturn_map->bitmap_layers = (tiled2saturn_bitmap_layer_t**)malloc(sizeof(tiled2saturn_bitmap_layer_t*) * saturn_map->header->bitmap_layer_count);
+    for(uint8_t i = 0; i<saturn_map->header->bitmap_layer_count; i++){
+        saturn_map->bitmap_layers[i] = parse_bitmap_layer(bytes, bitmap_layer_offset);
+        bitmap_layer_offset += saturn_map->bitmap_layers[i]->layer_size;
+    }
+
+    size_t object_layer_offset = saturn_map->header->object_layer_offset;
+    saturn_map->object_layers = (tiled2saturn_object_layer_t**)malloc(sizeof(tiled2saturn_object_layer_t*) * saturn_map->header->object_layer_count);
+    for(uint8_t i = 0; i<saturn_map->header->object_layer_count; i++){
+        saturn_map->object_layers[i] = parse_object_layer(bytes, object_layer_offset);
+        object_layer_offset += saturn_map->object_layers[i]->layer_size;
+    }
+
+    saturn_map->sprite_atlas = parse_sprite_atlas(bytes, saturn_map->header->sprite_atlas_offset);
+
+    size_t collision_rect_layer_offset = saturn_map->header->collision_rects_offset + 1;
+    saturn_map->collision_rect_layers = (tiled2saturn_collision_rect_layer_t**)malloc(sizeof(tiled2saturn_collision_rect_layer_t*) * saturn_map->header->collision_rect_layer_count);
+    for(uint8_t i = 0; i<saturn_map->header->collision_rect_layer_count; i++){
+        saturn_map->collision_rect_layers[i] = parse_collision_rect_layer(bytes, collision_rect_layer_offset);
+        collision_rect_layer_offset += saturn_map->collision_rect_layers[i]->layer_size;
+    }
+
+    saturn_map->collision_masks = parse_collision_masks(bytes, saturn_map->header);
+}
+
+/**
+ * @brief Run jobs on an executor, or one after another on the calling CPU without one.
+ */
+static void run_jobs(const tiled2saturn_executor_t* executor, tiled2saturn_job_t* jobs, uint16_t job_count){
+    if(executor == NULL || executor->workers < 2){
+        for(uint16_t i = 0; i<job_count; i++){
+            jobs[i].run(jobs[i].work);
+        }
+        return;
+    }
+
+    executor->run_jobs(executor, jobs, job_count);
+}
+
 /**
  * @brief Parse a Tiled2Saturn map from a byte stream.
  *
@@ -278,36 +702,174 @@ static tiled2saturn_collision_t** parse_collision(uint8_t* bytes, uint32_t offse
  */
 
 tiled2saturn_t* tiled2saturn_parse(uint8_t* bytes) {
+    return tiled2saturn_parse_with(bytes, NULL);
+}
+
+/**
+ * @brief Parse a Tiled2Saturn map from a byte stream, spreading the work over an executor's CPUs.
+ *
+ * Parsing is split into independent jobs: one parsing every section except the collisions, which allocates and
+ * so runs on the calling CPU, and one per worker parsing an even share of the map's collisions into memory
+ * allocated before any job starts. The shares come from the chunk table the converter writes, so no collision is
+ * read before the jobs start. With the slave CPU as a second worker, the master parses the sections and half of
+ * the collisions while the slave parses the other half.
+ *
+ * @param bytes Pointer to the byte stream containing the Tiled2Saturn map data.
+ * @param executor The executor to run the jobs on, or NULL to run them on the calling CPU like `tiled2saturn_parse`.
+ *
+ * @return The parsed map, exactly as `tiled2saturn_parse` would return it. Free it with `tiled2saturn_free()`.
+ */
+tiled2saturn_t* tiled2saturn_parse_with(uint8_t* bytes, const tiled2saturn_executor_t* executor) {
     tiled2saturn_t* saturn_map = (tiled2saturn_t*)malloc(sizeof(tiled2saturn_t));
+    saturn_map->bytes = bytes;
     saturn_map->header = parse_header(bytes);
-    
-    size_t tileset_offset = saturn_map->header->tileset_offset;
-    saturn_map->tilesets = (tiled2saturn_tileset_t**)malloc(sizeof(tiled2saturn_tileset_t*) * saturn_map->header->tileset_count);
-    for(uint8_t i = 0; i<saturn_map->header->tileset_count; i++){
-        saturn_map->tilesets[i] = parse_tileset(bytes, tileset_offset);
-        tileset_offset += saturn_map->tilesets[i]->tileset_size;
+
+    uint8_t workers = executor == NULL || executor->workers == 0 ? 1 : executor->workers;
+    workers = workers > TILED2SATURN_MAX_WORKERS ? TILED2SATURN_MAX_WORKERS : workers;
+
+    collision_range_t ranges[TILED2SATURN_MAX_WORKERS];
+    saturn_map->collisions = prepare_collisions(bytes, saturn_map->header, ranges, workers);
+
+    // Job i runs on worker i % workers, so with two workers the master parses the sections and the last range
+    tiled2saturn_job_t jobs[TILED2SATURN_MAX_WORKERS + 1];
+    jobs[0].run = parse_sections;
+    jobs[0].work = saturn_map;
+    for(uint8_t i = 0; i<workers; i++){
+        jobs[i + 1].run = parse_collision_range;
+        jobs[i + 1].work = &ranges[i];
     }
 
-    size_t layer_offset = saturn_map->header->layer_offset;
-    saturn_map->layers = (tiled2saturn_layer_t**)malloc(sizeof(tiled2saturn_layer_t*) * saturn_map->header->layer_count);
-    for(uint8_t i = 0; i<saturn_map->header->layer_count; i++){
-        saturn_map->layers[i] = parse_layer(bytes, layer_offset, saturn_map->tilesets);
-        layer_offset += saturn_map->layers[i]->layer_size;
+    run_jobs(executor, jobs, (uint16_t)(workers + 1));
+    saturn_map->collisions->collision_masks = saturn_map->collision_masks;
+
+    return saturn_map;
+}
+
+#ifdef TILED2SATURN_YAUL
+
+// SH-2 caches are not kept coherent between the CPUs, reads through this region bypass the cache
+#define CACHE_THROUGH 0x20000000UL
+
+static struct {
+    tiled2saturn_job_t* jobs;
+    uint16_t            job_count;
+    volatile uint32_t   done;
+} slave_batch;
+
+/**
+ * @brief Run the odd numbered jobs of the batch on the slave CPU, then flag the batch as done.
+ */
+static void slave_entry(void){
+    // Drop any stale lines of the batch, the jobs and the data they read
+    cpu_cache_purge();
+
+    for(uint16_t i = 1; i<slave_batch.job_count; i += 2){
+        slave_batch.jobs[i].run(slave_batch.jobs[i].work);
     }
 
-    size_t bitmap_layer_offset = saturn_map->header->bitmap_layer_offset;
-    saturn_map->bitmap_layers = (tiled2saturn_bitmap_layer_t**)malloc(sizeof(tiled2saturn_bitmap_layer_t*) * saturn_map->header->bitmap_layer_count);
-    for(uint8_t i = 0; i<saturn_map->header->bitmap_layer_count; i++){
-        saturn_map->bitmap_layers[i] = parse_bitmap_layer(bytes, bitmap_layer_offset);
-        bitmap_layer_offset += saturn_map->bitmap_layers[i]->layer_size;
+    *(volatile uint32_t*)((uintptr_t)&slave_batch.done | CACHE_THROUGH) = 1;
+}
+
+/**
+ * @brief Run a batch of jobs, the even numbered ones on the master CPU and the odd numbered ones on the slave.
+ */
+static void run_jobs_slave(const tiled2saturn_executor_t* executor, tiled2saturn_job_t* jobs, uint16_t job_count){
+    (void)executor;
+
+    slave_batch.jobs = jobs;
+    slave_batch.job_count = job_count;
+    slave_batch.done = 0;
+    cpu_dual_slave_notify();
+
+    for(uint16_t i = 0; i<job_count; i += 2){
+        jobs[i].run(jobs[i].work);
     }
 
-    size_t collision_offset = saturn_map->header->collision_offset;
-    uint32_t count = saturn_map->header->width * saturn_map->header->height;
-    saturn_map->collisions =  parse_collision(bytes, collision_offset, count);
+    while(*(volatile uint32_t*)((uintptr_t)&slave_batch.done | CACHE_THROUGH) == 0){
+    }
 
-    return saturn_map;
+    // Drop the master's stale lines of whatever the slave wrote
+    cpu_cache_purge();
+}
+
+/**
+ * @brief Set up an executor running jobs on both SH-2 CPUs.
+ *
+ * Takes over the slave CPU's entry point, set it back with `cpu_dual_slave_set` after parsing if the slave does
+ * other work. The slave only runs jobs that never allocate, the master runs every job that does.
+ *
+ * @param executor The executor to set up, for `tiled2saturn_parse_with`.
+ */
+void tiled2saturn_executor_slave_init(tiled2saturn_executor_t* executor){
+    cpu_dual_comm_mode_set(CPU_DUAL_ENTRY_ICI);
+    cpu_dual_slave_set(slave_entry);
+
+    executor->workers = 2;
+    executor->run_jobs = run_jobs_slave;
+    executor->context = NULL;
+}
+#endif
+
+#ifdef TILED2SATURN_PTHREAD
+
+typedef struct pthread_worker {
+    tiled2saturn_job_t* jobs;
+    uint16_t            job_count;
+    uint8_t             worker;
+    uint8_t             workers;
+} pthread_worker_t;
+
+static void* run_worker(void* work){
+    pthread_worker_t* worker = (pthread_worker_t*)work;
+    for(uint16_t i = worker->worker; i<worker->job_count; i += worker->workers){
+        worker->jobs[i].run(worker->jobs[i].work);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run a batch of jobs on threads, job i on worker i % workers with worker 0 being the calling thread.
+ */
+static void run_jobs_pthread(const tiled2saturn_executor_t* executor, tiled2saturn_job_t* jobs, uint16_t job_count){
+    pthread_t threads[TILED2SATURN_MAX_WORKERS];
+    bool started[TILED2SATURN_MAX_WORKERS];
+    pthread_worker_t workers[TILED2SATURN_MAX_WORKERS];
+
+    for(uint8_t i = 0; i<executor->workers; i++){
+        workers[i].jobs = jobs;
+        workers[i].job_count = job_count;
+        workers[i].worker = i;
+        workers[i].workers = executor->workers;
+    }
+
+    // A worker whose thread could not be started runs on the calling thread instead
+    for(uint8_t i = 1; i<executor->workers; i++){
+        started[i] = pthread_create(&threads[i], NULL, run_worker, &workers[i]) == 0;
+    }
+
+    run_worker(&workers[0]);
+
+    for(uint8_t i = 1; i<executor->workers; i++){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
+        } else {
+            run_worker(&workers[i]);
+        }
+    }
+}
+
+/**
+ * @brief Set up an executor running jobs on POSIX threads, to test and benchmark parsing on a host.
+ *
+ * @param executor The executor to set up, for `tiled2saturn_parse_with`.
+ * @param workers The number of threads to run jobs on, including the calling thread, up to `TILED2SATURN_MAX_WORKERS`.
+ */
+void tiled2saturn_executor_pthread_init(tiled2saturn_executor_t* executor, uint8_t workers){
+    executor->workers = workers == 0 ? 1 : (workers > TILED2SATURN_MAX_WORKERS ? TILED2SATURN_MAX_WORKERS : workers);
+    executor->run_jobs = run_jobs_pthread;
+    executor->context = NULL;
 }
+#endif
 
 /**
  * @brief Free the memory allocated for a Tiled2Saturn map and its components.
@@ -324,12 +886,18 @@ tiled2saturn_t* tiled2saturn_parse(uint8_t* bytes) {
  *
  */
 void tiled2saturn_free(tiled2saturn_t* tiled2saturn){
-    for (uint32_t i = 0; i < (tiled2saturn->header->width*tiled2saturn->header->height); i++) {
-        for(uint8_t j = 0; j<tiled2saturn->collisions[i]->point_count; j++){
-            free(tiled2saturn->collisions[i]->points[j]);
-        }
-        
-        free(tiled2saturn->collisions[i]);
+    free_collisions(tiled2saturn);
+
+    free(tiled2saturn->collision_masks);
+
+    for (uint8_t i = 0; i < tiled2saturn->header->collision_rect_layer_count; i++) {
+        free(tiled2saturn->collision_rect_layers[i]);
+    }
+
+    free(tiled2saturn->sprite_atlas);
+
+    for (uint8_t i = 0; i < tiled2saturn->header->object_layer_count; i++) {
+        free(tiled2saturn->object_layers[i]);
     }
 
     for (uint8_t i = 0; i < tiled2saturn->header->bitmap_layer_count; i++) {
@@ -337,6 +905,7 @@ void tiled2saturn_free(tiled2saturn_t* tiled2saturn){
     }
 
     for (uint8_t i = 0; i < tiled2saturn->header->layer_count; i++) {
+        tiled2saturn_layer_edit_end(tiled2saturn->layers[i]);
         free(tiled2saturn->layers[i]);
     }
 
@@ -344,12 +913,415 @@ void tiled2saturn_free(tiled2saturn_t* tiled2saturn){
         free(tiled2saturn->tilesets[i]);
     }
 
+    free(tiled2saturn->pages);
     free(tiled2saturn->header);
     free(tiled2saturn);
 }
 
+#define PATCH_MAGIC 0x89504154
+#define PATCH_VERSION 1
+#define PATCH_HEADER_SIZE 24
+#define PATCH_OPERATION_HEADER_SIZE 10
+
+typedef enum {
+    SECTION_TILESET      = 0,
+    SECTION_LAYER        = 1,
+    SECTION_BITMAP_LAYER = 2,
+    SECTION_OBJECT_LAYER = 3,
+    SECTION_SPRITE_ATLAS = 4,
+    SECTION_COLLISIONS   = 5,
+    SECTION_COLLISION_RECTS = 6,
+    SECTION_COLLISION_MASKS = 7
+} section_kind_t;
+
+typedef struct section_upload {
+    tiled2saturn_upload_target_t target;
+    const uint8_t*               data;
+    uint32_t                     size;
+    uint32_t                     offset;
+} section_upload_t;
+
 /**
- * @brief Retrieve a Tiled2Saturn layer by its ID.
+ * @brief Compute the Adler-32 checksum the converter stamps on patches for the map they apply to and produce.
+ */
+static uint32_t adler32(const uint8_t* bytes, uint32_t size){
+    uint32_t a = 1;
+    uint32_t b = 0;
+    while(size > 0){
+        // The most bytes that can be summed before b could overflow
+        uint32_t chunk = size < 5552 ? size : 5552;
+        size -= chunk;
+        while(chunk-- > 0){
+            a += *bytes++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * @brief Size of the whole data.bin a map was parsed from, collisions are the last section.
+ */
+static uint32_t data_size(const tiled2saturn_t* tiled2saturn){
+    return tiled2saturn->header->collision_offset + tiled2saturn->collisions->collisions_size;
+}
+
+/**
+ * @brief Find where a section starts in data.bin and how long it is.
+ *
+ * @return The offset of the section, its size is written to `size`.
+ */
+static uint32_t section_offset(const tiled2saturn_t* tiled2saturn, section_kind_t kind, uint8_t index, uint32_t* size){
+    const tiled2saturn_header_t* header = tiled2saturn->header;
+    uint32_t offset = 0;
+    switch(kind){
+        case SECTION_TILESET:
+            assert(index < header->tileset_count);
+            offset = header->tileset_offset;
+            for(uint8_t i = 0; i < index; i++){
+                offset += tiled2saturn->tilesets[i]->tileset_size;
+            }
+            *size = tiled2saturn->tilesets[index]->tileset_size;
+            break;
+        case SECTION_LAYER:
+            assert(index < header->layer_count);
+            offset = header->layer_offset;
+            for(uint8_t i = 0; i < index; i++){
+                offset += tiled2saturn->layers[i]->layer_size;
+            }
+            *size = tiled2saturn->layers[index]->layer_size;
+            break;
+        case SECTION_BITMAP_LAYER:
+            assert(index < header->bitmap_layer_count);
+            offset = header->bitmap_layer_offset;
+            for(uint8_t i = 0; i < index; i++){
+                offset += tiled2saturn->bitmap_layers[i]->layer_size;
+            }
+            *size = tiled2saturn->bitmap_layers[index]->layer_size;
+            break;
+        case SECTION_OBJECT_LAYER:
+            assert(index < header->object_layer_count);
+            offset = header->object_layer_offset;
+            for(uint8_t i = 0; i < index; i++){
+                offset += tiled2saturn->object_layers[i]->layer_size;
+            }
+            *size = tiled2saturn->object_layers[index]->layer_size;
+            break;
+        case SECTION_SPRITE_ATLAS:
+            offset = header->sprite_atlas_offset;
+            *size = tiled2saturn->sprite_atlas->atlas_size;
+            break;
+        case SECTION_COLLISION_RECTS:
+            assert(index < header->collision_rect_layer_count);
+            offset = header->collision_rects_offset + 1;
+            for(uint8_t i = 0; i < index; i++){
+                offset += tiled2saturn->collision_rect_layers[i]->layer_size;
+            }
+            *size = tiled2saturn->collision_rect_layers[index]->layer_size;
+            break;
+        case SECTION_COLLISION_MASKS:
+            offset = header->collision_masks_offset;
+            *size = tiled2saturn->collision_masks->masks_size;
+            break;
+        case SECTION_COLLISIONS:
+            offset = header->collision_offset;
+            *size = data_size(tiled2saturn) - offset;
+            break;
+        default:
+            assert(false);
+    }
+    return offset;
+}
+
+/**
+ * @brief Check a patch operation names a section of the map and stays within it.
+ */
+static bool valid_operation(const tiled2saturn_t* tiled2saturn, section_kind_t kind, uint8_t index, uint32_t offset, uint32_t size){
+    const tiled2saturn_header_t* header = tiled2saturn->header;
+    uint8_t section_count = 0;
+    switch(kind){
+        case SECTION_TILESET:
+            section_count = header->tileset_count;
+            break;
+        case SECTION_LAYER:
+            section_count = header->layer_count;
+            break;
+        case SECTION_BITMAP_LAYER:
+            section_count = header->bitmap_layer_count;
+            break;
+        case SECTION_OBJECT_LAYER:
+            section_count = header->object_layer_count;
+            break;
+        case SECTION_COLLISION_RECTS:
+            section_count = header->collision_rect_layer_count;
+            break;
+        case SECTION_SPRITE_ATLAS:
+        case SECTION_COLLISIONS:
+        case SECTION_COLLISION_MASKS:
+            section_count = 1;
+            break;
+        default:
+            return false;
+    }
+    if(index >= section_count){
+        return false;
+    }
+
+    uint32_t section_size = 0;
+    uint32_t section_start = section_offset(tiled2saturn, kind, index, &section_size);
+    return offset >= section_start && size <= section_size && offset - section_start <= section_size - size;
+}
+
+/**
+ * @brief List the parts of a section that live in VRAM or CRAM once uploaded.
+ *
+ * @return The number of parts written to `parts`, at most two.
+ */
+static uint8_t section_uploads(const tiled2saturn_t* tiled2saturn, section_kind_t kind, uint8_t index, section_upload_t* parts){
+    switch(kind){
+        case SECTION_TILESET: {
+            const tiled2saturn_tileset_t* tileset = tiled2saturn->tilesets[index];
+            parts[0] = (section_upload_t){ TILED2SATURN_UPLOAD_PALETTE, tileset->palette, tileset->palette_size, 0 };
+            parts[1] = (section_upload_t){ TILED2SATURN_UPLOAD_CHARACTER_PATTERN, tileset->character_pattern, tileset->character_pattern_size, 0 };
+            return 2;
+        }
+        case SECTION_LAYER: {
+            // A layer's pages are consecutive in VRAM, each is aligned to the same page size
+            const tiled2saturn_layer_t* layer = tiled2saturn->layers[index];
+            if(layer->page_count == 0){
+                return 0;
+            }
+            parts[0] = (section_upload_t){ TILED2SATURN_UPLOAD_PAGES, layer->pattern_name_data, layer->pattern_name_data_size,
+                                                     layer->pages[layer->first_page].vram_offset };
+            return 1;
+        }
+        case SECTION_BITMAP_LAYER: {
+            const tiled2saturn_bitmap_layer_t* bitmap_layer = tiled2saturn->bitmap_layers[index];
+            parts[0] = (section_upload_t){ TILED2SATURN_UPLOAD_BITMAP_PALETTE, bitmap_layer->palette, bitmap_layer->palette_size, 0 };
+            parts[1] = (section_upload_t){ TILED2SATURN_UPLOAD_BITMAP, bitmap_layer->bitmap, bitmap_layer->bitmap_size, 0 };
+            return 2;
+        }
+        case SECTION_OBJECT_LAYER: {
+            const tiled2saturn_object_layer_t* object_layer = tiled2saturn->object_layers[index];
+            parts[0] = (section_upload_t){ TILED2SATURN_UPLOAD_COMMANDS, object_layer->cmdts, object_layer->cmdts_size, 0 };
+            return 1;
+        }
+        case SECTION_SPRITE_ATLAS:
+            parts[0] = (section_upload_t){ TILED2SATURN_UPLOAD_SPRITE_TEXTURE, tiled2saturn->sprite_atlas->texture, tiled2saturn->sprite_atlas->texture_size, 0 };
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Re-read the fields of a section after its metadata was patched.
+ *
+ * The section keeps its structure, so pointers held by the application, and by layers to their tileset, stay
+ * valid. Pages and any edit in progress are kept, a patch never moves them.
+ */
+static void reparse_section(tiled2saturn_t* tiled2saturn, section_kind_t kind, uint8_t index, uint32_t offset){
+    switch(kind){
+        case SECTION_TILESET: {
+            tiled2saturn_tileset_t* parsed = parse_tileset(tiled2saturn->bytes, offset);
+            *tiled2saturn->tilesets[index] = *parsed;
+            free(parsed);
+            break;
+        }
+        case SECTION_LAYER: {
+            tiled2saturn_layer_t* layer = tiled2saturn->layers[index];
+            tiled2saturn_layer_t* parsed = parse_layer(tiled2saturn->bytes, offset, tiled2saturn->tilesets);
+            parsed->pages = layer->pages;
+            parsed->edit_pages = layer->edit_pages;
+            parsed->dirty_cells = layer->dirty_cells;
+            *layer = *parsed;
+            free(parsed);
+            break;
+        }
+        case SECTION_BITMAP_LAYER: {
+            tiled2saturn_bitmap_layer_t* parsed = parse_bitmap_layer(tiled2saturn->bytes, offset);
+            *tiled2saturn->bitmap_layers[index] = *parsed;
+            free(parsed);
+            break;
+        }
+        case SECTION_OBJECT_LAYER: {
+            tiled2saturn_object_layer_t* parsed = parse_object_layer(tiled2saturn->bytes, offset);
+            *tiled2saturn->object_layers[index] = *parsed;
+            free(parsed);
+            break;
+        }
+        case SECTION_SPRITE_ATLAS: {
+            tiled2saturn_sprite_atlas_t* parsed = parse_sprite_atlas(tiled2saturn->bytes, offset);
+            *tiled2saturn->sprite_atlas = *parsed;
+            free(parsed);
+            break;
+        }
+        case SECTION_COLLISION_RECTS: {
+            tiled2saturn_collision_rect_layer_t* parsed = parse_collision_rect_layer(tiled2saturn->bytes, offset);
+            *tiled2saturn->collision_rect_layers[index] = *parsed;
+            free(parsed);
+            break;
+        }
+        case SECTION_COLLISION_MASKS: {
+            tiled2saturn_collision_masks_t* parsed = parse_collision_masks(tiled2saturn->bytes, tiled2saturn->header);
+            *tiled2saturn->collision_masks = *parsed;
+            free(parsed);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Add a range to re-upload, extending an earlier range of the same data it touches.
+ *
+ * Once `uploads` is full, ranges are merged into the earlier range of the same data, covering everything between
+ * them.
+ */
+static void add_upload(tiled2saturn_upload_t* uploads, uint16_t* count, uint16_t max_uploads, tiled2saturn_upload_target_t target,
+                       uint8_t index, const uint8_t* data, uint32_t offset, uint32_t size){
+    tiled2saturn_upload_t* merge = NULL;
+    for(uint16_t i = 0; i < *count; i++){
+        tiled2saturn_upload_t* upload = &uploads[i];
+        if(upload->target != target || upload->index != index){
+            continue;
+        }
+        if(offset <= upload->offset + upload->size && upload->offset <= offset + size){
+            merge = upload;
+            break;
+        }
+        if(*count == max_uploads && merge == NULL){
+            merge = upload;
+        }
+    }
+
+    if(merge != NULL){
+        uint32_t start = merge->offset < offset ? merge->offset : offset;
+        uint32_t end = (merge->offset + merge->size) > (offset + size) ? (merge->offset + merge->size) : (offset + size);
+        merge->data = merge->data - (merge->offset - start);
+        merge->offset = start;
+        merge->size = end - start;
+        return;
+    }
+
+    assert(*count < max_uploads);
+    uploads[*count] = (tiled2saturn_upload_t){ target, index, data, offset, size };
+    *count += 1;
+}
+
+/**
+ * @brief Apply a patch written by `tiled2saturn extract --patch` to a parsed map.
+ *
+ * A patch holds only the sections of data.bin that changed between two exports, and within palettes, character
+ * patterns, pages, bitmaps and the sprite texture only the changed byte ranges, so a one tile edit is a few bytes
+ * to transfer instead of the whole map. The patch is written over the bytes the map was parsed from, and the
+ * fields of any section whose metadata changed, and the collisions, are parsed again.
+ *
+ * Every range that must be uploaded again is reported once, overlapping and touching ranges are merged. `offset`
+ * is from the start of the palette, character pattern, bitmap, sprite texture or object layer commands of the
+ * section numbered `index`, or for pages from the start of the map's pages, as `tiled2saturn_page_t.vram_offset`.
+ * Layers being edited keep their own copy of their pages, re-read by the next `tiled2saturn_layer_edit_begin`.
+ *
+ * @param tiled2saturn Pointer to the `tiled2saturn_t` structure to patch.
+ * @param patch Pointer to the patch.
+ * @param uploads The ranges to upload again are written here.
+ * @param max_uploads The number of ranges `uploads` can hold, once full further ranges are merged into the range
+ *        of the same data. Two per tileset and bitmap layer and one per layer, object layer and the sprite atlas
+ *        always suffice.
+ *
+ * @return The number of ranges written to `uploads`, or -1 if the patch was made for a different data.bin or any
+ *         of its operations runs outside the section it names, and nothing was changed.
+ *
+ * @note Patches are only made between exports with the same section sizes, the converter transfers the whole
+ *       data.bin otherwise.
+ */
+int32_t tiled2saturn_apply_patch(tiled2saturn_t* tiled2saturn, const uint8_t* patch, tiled2saturn_upload_t* uploads, uint16_t max_uploads){
+    if(LONG(patch, 0) != PATCH_MAGIC || LONG(patch, 4) != PATCH_VERSION){
+        return -1;
+    }
+
+    uint32_t size = data_size(tiled2saturn);
+    if(LONG(patch, 8) != size || LONG(patch, 12) != adler32(tiled2saturn->bytes, size)){
+        return -1;
+    }
+
+    uint32_t operation_count = LONG(patch, 20);
+    uint32_t position = PATCH_HEADER_SIZE;
+
+    // Every operation is checked before any is applied, so a bad patch leaves the map as it was
+    for(uint32_t i = 0; i < operation_count; i++){
+        uint32_t operation_size = LONG(patch, position+6);
+        if(!valid_operation(tiled2saturn, (section_kind_t)BYTE(patch, position), BYTE(patch, position+1), LONG(patch, position+2), operation_size)){
+            return -1;
+        }
+        position += PATCH_OPERATION_HEADER_SIZE + operation_size;
+    }
+
+    position = PATCH_HEADER_SIZE;
+    uint16_t count = 0;
+    bool collisions_changed = false;
+
+    for(uint32_t i = 0; i < operation_count; i++){
+        section_kind_t kind = (section_kind_t)BYTE(patch, position);
+        uint8_t index = BYTE(patch, position+1);
+        uint32_t offset = LONG(patch, position+2);
+        uint32_t operation_size = LONG(patch, position+6);
+        const uint8_t* data = patch + position + PATCH_OPERATION_HEADER_SIZE;
+        position += PATCH_OPERATION_HEADER_SIZE + operation_size;
+
+        uint32_t section_size = 0;
+        uint32_t section_start = section_offset(tiled2saturn, kind, index, &section_size);
+
+        memcpy(tiled2saturn->bytes + offset, data, operation_size);
+
+        const uint8_t* start = tiled2saturn->bytes + offset;
+        const uint8_t* end = start + operation_size;
+        uint32_t uploaded = 0;
+
+        section_upload_t parts[2];
+        uint8_t part_count = section_uploads(tiled2saturn, kind, index, parts);
+        for(uint8_t j = 0; j < part_count; j++){
+            // Direct color bitmaps have no palette
+            if(parts[j].data == NULL){
+                continue;
+            }
+
+            const uint8_t* part_start = parts[j].data;
+            const uint8_t* part_end = part_start + parts[j].size;
+            const uint8_t* from = start > part_start ? start : part_start;
+            const uint8_t* to = end < part_end ? end : part_end;
+            if(from >= to){
+                continue;
+            }
+
+            add_upload(uploads, &count, max_uploads, parts[j].target, index, from,
+                       parts[j].offset + (uint32_t)(from - part_start), (uint32_t)(to - from));
+            uploaded += (uint32_t)(to - from);
+        }
+
+        if(kind == SECTION_COLLISIONS){
+            collisions_changed = true;
+        } else if(uploaded < operation_size){
+            reparse_section(tiled2saturn, kind, index, section_start);
+        }
+    }
+
+    // Collisions are parsed into one allocation sized by their count, changing any of them means parsing them all again
+    if(collisions_changed){
+        free_collisions(tiled2saturn);
+        tiled2saturn->collisions = parse_collisions(tiled2saturn->bytes, tiled2saturn->header, tiled2saturn->collision_masks);
+    }
+
+    assert(LONG(patch, 16) == adler32(tiled2saturn->bytes, size));
+
+    return count;
+}
+
+/**
+ * @brief Retrieve a Tiled2Saturn layer by its ID.
  *
  * This function searches for a Tiled2Saturn layer with the specified ID within a Tiled2Saturn map and returns
  * a pointer to the layer if found. If no layer with the specified ID is found, it returns NULL.
@@ -364,7 +1336,7 @@ void tiled2saturn_free(tiled2saturn_t* tiled2saturn){
  *       a valid array of layers. If the map is not properly initialized, using this function may result in
  *       undefined behavior.
  */
-tiled2saturn_layer_t* get_layer_by_id(tiled2saturn_t* self, uint32_t id){
+tiled2saturn_layer_t* get_layer_by_id(const tiled2saturn_t* self, uint32_t id){
     for(uint8_t i = 0; i < self->header->layer_count; i++){
         if(self->layers[i]->id == id){
             return self->layers[i];
@@ -390,7 +1362,7 @@ tiled2saturn_layer_t* get_layer_by_id(tiled2saturn_t* self, uint32_t id){
  *       a valid array of layers. If the map is not properly initialized, using this function may result in
  *       undefined behavior.
  */
-tiled2saturn_bitmap_layer_t* get_bitmap_layer_by_id(tiled2saturn_t* self, uint32_t id){
+tiled2saturn_bitmap_layer_t* get_bitmap_layer_by_id(const tiled2saturn_t* self, uint32_t id){
     for(uint8_t i = 0; i < self->header->bitmap_layer_count; i++){
         if(self->bitmap_layers[i]->id == id){
             return self->bitmap_layers[i];
@@ -398,4 +1370,1042 @@ tiled2saturn_bitmap_layer_t* get_bitmap_layer_by_id(tiled2saturn_t* self, uint32
     }
 
     return NULL;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Retrieve a Tiled2Saturn object layer by its ID.
+ *
+ * @param self Pointer to the `tiled2saturn_t` structure representing the Tiled2Saturn map to search within.
+ * @param id The ID of the object layer to retrieve.
+ *
+ * @return A pointer to the `tiled2saturn_object_layer_t` structure representing the found object layer, or NULL if
+ *         the object layer with the specified ID was not found.
+ */
+tiled2saturn_object_layer_t* get_object_layer_by_id(const tiled2saturn_t* self, uint32_t id){
+    for(uint8_t i = 0; i < self->header->object_layer_count; i++){
+        if(self->object_layers[i]->id == id){
+            return self->object_layers[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get the VRAM every tileset's character pattern spans from the character pattern base.
+ *
+ * The converter places every tileset of the map once, so tilesets mixing color counts and pattern name sizes
+ * share VRAM without overlapping. Each tileset is uploaded to the base plus its `character_offset`, e.g.
+ * @code
+ * for(uint8_t i = 0; i < t2s->header->tileset_count; i++){
+ *     const tiled2saturn_tileset_t* tileset = t2s->tilesets[i];
+ *     scu_dma_transfer(0, (void *)(NBGX_CPD + tileset->character_offset), tileset->character_pattern, tileset->character_pattern_size);
+ * }
+ * @endcode
+ * The base has to start a VRAM bank. 2 word pattern names count their character numbers from it, 1 word ones
+ * from the window returned by `tiled2saturn_tileset_character_window()`, where the character pattern base of
+ * the scroll screen drawing the tileset points.
+ *
+ * @param self Pointer to the parsed map.
+ *
+ * @return The number of bytes to reserve from the base, gaps between tilesets included.
+ */
+uint32_t tiled2saturn_character_patterns_size(const tiled2saturn_t* self){
+    uint32_t size = 0;
+    for(uint8_t i = 0; i < self->header->tileset_count; i++){
+        const tiled2saturn_tileset_t* tileset = self->tilesets[i];
+        // Sprite sheets take no VDP2 VRAM
+        if(tileset->character_pattern_size > 0 && tileset->character_offset + tileset->character_pattern_size > size){
+            size = tileset->character_offset + tileset->character_pattern_size;
+        }
+    }
+
+    return size;
+}
+
+/**
+ * @brief Get the character number a layer's pattern name data uses for a tile of a tileset.
+ *
+ * This is the `character` of `tiled2saturn_tile_t`, so tiles can be changed with
+ * `tiled2saturn_layer_set_tile()` by their Tiled tile ID. 1 word pattern names of 16x16 tiles count in
+ * whole tiles of 4 cells, and only hold the number within the tileset's window.
+ *
+ * @param tileset Pointer to the tileset the tile belongs to.
+ * @param tile_id The tile's ID within the tileset, as in Tiled.
+ *
+ * @return The character number.
+ */
+uint16_t tiled2saturn_tileset_character(const tiled2saturn_tileset_t* tileset, uint32_t tile_id){
+    assert(tile_id < tileset->tile_count);
+    uint32_t cell_units = tileset->bpp == 4 ? 1 : tileset->bpp == 8 ? 2 : 4;
+    uint32_t tile_units = (tileset->tile_width / 8) * (tileset->tile_height / 8) * cell_units;
+    uint32_t number = tileset->character_offset / 32 + tile_id * tile_units;
+
+    if(tileset->words_per_palette == 1){
+        if(tileset->tile_width == 16){
+            number >>= 2;
+        }
+        return (uint16_t)(number & 0x3FF);
+    }
+    assert(number <= 0x7FFFu);
+    return (uint16_t)number;
+}
+
+/**
+ * @brief Get the window of VRAM the 1 word pattern names of a tileset reach.
+ *
+ * A 1 word pattern name only holds 10 bits of character number, the supplementary character bits of the scroll
+ * screen select which 32KB, or 128KB for 16x16 tiles, it points into. The converter keeps every 1 word tileset
+ * within one window, so the scroll screen drawing it sets its character pattern base to the window, e.g.
+ * @code
+ * format.cpd_base = NBGX_CPD + tiled2saturn_tileset_character_window(layer->tileset);
+ * @endcode
+ *
+ * @param tileset Pointer to the tileset a layer draws from.
+ *
+ * @return The window's offset in bytes from the character pattern base, 0 for 2 word pattern names.
+ */
+uint32_t tiled2saturn_tileset_character_window(const tiled2saturn_tileset_t* tileset){
+    if(tileset->words_per_palette != 1){
+        return 0;
+    }
+
+    uint32_t window = 0x400 * 32 * (tileset->tile_width / 8) * (tileset->tile_height / 8);
+    return tileset->character_offset / window * window;
+}
+
+/**
+ * @brief Find the command of an object by its Tiled object ID.
+ *
+ * Only tile and rectangle objects are exported, so the index of a command can differ from the object's position in
+ * Tiled.
+ *
+ * @param object_layer Pointer to the `tiled2saturn_object_layer_t` structure to search within.
+ * @param object_id The Tiled ID of the object.
+ *
+ * @return The index of the object's command in `cmdts`, or -1 if the object was not exported.
+ */
+int32_t tiled2saturn_object_layer_find(const tiled2saturn_object_layer_t* object_layer, uint32_t object_id){
+    for(uint16_t i = 0; i < object_layer->object_count; i++){
+        if(LONG(object_layer->object_ids, (uint32_t)i * 4) == object_id){
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Copy the VDP1 commands of an object layer into a command table.
+ *
+ * Every command is a complete normal sprite, position, size, character address, color mode and draw mode are set
+ * from Tiled, so populating the command list for a room is this one block copy. Commands jump to the next one, the
+ * caller sets the end command after the last.
+ *
+ * @param object_layer Pointer to the `tiled2saturn_object_layer_t` structure to copy from.
+ * @param cmdts The first `vdp1_cmdt_t` to fill, `object_count` commands are written.
+ */
+void tiled2saturn_object_layer_cmdts_copy(const tiled2saturn_object_layer_t* object_layer, void* cmdts){
+    memcpy(cmdts, object_layer->cmdts, object_layer->cmdts_size);
+}
+
+/**
+ * @brief Retrieve the merged collision rects of a tile layer by the layer's ID.
+ *
+ * @param self Pointer to the `tiled2saturn_t` structure representing the Tiled2Saturn map to search within.
+ * @param id The ID of the tile layer.
+ *
+ * @return A pointer to the `tiled2saturn_collision_rect_layer_t` structure of the layer, or NULL if the layer has no
+ *         solid cells or no tile layer with the specified ID was exported.
+ */
+tiled2saturn_collision_rect_layer_t* get_collision_rect_layer_by_id(const tiled2saturn_t* self, uint32_t id){
+    for(uint8_t i = 0; i < self->header->collision_rect_layer_count; i++){
+        if(self->collision_rect_layers[i]->id == id){
+            return self->collision_rect_layers[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Read a merged collision rect.
+ *
+ * @param layer Pointer to the `tiled2saturn_collision_rect_layer_t` structure holding the rect.
+ * @param index The index of the rect, less than `rect_count`.
+ * @param rect The rect, in pixels from the top left of the map, is written here.
+ */
+void tiled2saturn_collision_rect_get(const tiled2saturn_collision_rect_layer_t* layer, uint16_t index, tiled2saturn_rect_t* rect){
+    assert(index < layer->rect_count);
+    uint32_t position = (uint32_t)index * 16;
+    rect->x = LONG(layer->rects, position);
+    rect->y = LONG(layer->rects, position+4);
+    rect->width = LONG(layer->rects, position+8);
+    rect->height = LONG(layer->rects, position+12);
+}
+
+/**
+ * @brief Find the merged collision rects overlapping a box, the broad phase of a collision test.
+ *
+ * Only the grid regions the box overlaps are visited. A rect spanning several of them is reported once, from the
+ * first region it shares with the box, so every index is unique without a list of those already seen.
+ *
+ * @param layer Pointer to the `tiled2saturn_collision_rect_layer_t` structure to search.
+ * @param x The left of the box in pixels from the left of the map, it may be off the map.
+ * @param y The top of the box in pixels from the top of the map, it may be off the map.
+ * @param width The width of the box in pixels.
+ * @param height The height of the box in pixels.
+ * @param indices The index of each overlapping rect is written here, read them with `tiled2saturn_collision_rect_get`.
+ * @param max_indices The number of indices `indices` can hold, the search stops once it is full.
+ *
+ * @return The number of indices written to `indices`.
+ */
+uint16_t tiled2saturn_collision_rects_query(const tiled2saturn_collision_rect_layer_t* layer, int32_t x, int32_t y, uint32_t width, uint32_t height,
+                                            uint16_t* indices, uint16_t max_indices){
+    int32_t right = x + (int32_t)width;
+    int32_t bottom = y + (int32_t)height;
+    if(layer->rect_count == 0 || max_indices == 0 || width == 0 || height == 0 || right <= 0 || bottom <= 0){
+        return 0;
+    }
+
+    // Rects reaching past the edge of the map are kept in its last regions, so the box is clamped rather than skipped
+    int32_t last_column = layer->region_columns - 1;
+    int32_t last_row = layer->region_rows - 1;
+    int32_t first_column = x < 0 ? 0 : x / layer->region_width;
+    int32_t first_row = y < 0 ? 0 : y / layer->region_height;
+    first_column = first_column > last_column ? last_column : first_column;
+    first_row = first_row > last_row ? last_row : first_row;
+    int32_t end_column = (right - 1) / layer->region_width;
+    int32_t end_row = (bottom - 1) / layer->region_height;
+    end_column = end_column > last_column ? last_column : end_column;
+    end_row = end_row > last_row ? last_row : end_row;
+
+    uint16_t count = 0;
+    for(int32_t row = first_row; row <= end_row; row++){
+        for(int32_t column = first_column; column <= end_column; column++){
+            uint32_t region = (uint32_t)(row * layer->region_columns + column) * 4;
+            uint32_t end = LONG(layer->region_starts, region+4);
+            for(uint32_t i = LONG(layer->region_starts, region); i < end; i++){
+                uint16_t index = SHORT(layer->region_rects, i * 2);
+                tiled2saturn_rect_t rect;
+                tiled2saturn_collision_rect_get(layer, index, &rect);
+
+                if((int32_t)rect.x >= right || (int32_t)(rect.x + rect.width) <= x || (int32_t)rect.y >= bottom || (int32_t)(rect.y + rect.height) <= y){
+                    continue;
+                }
+
+                int32_t rect_column = (int32_t)(rect.x / layer->region_width);
+                int32_t rect_row = (int32_t)(rect.y / layer->region_height);
+                rect_column = rect_column > last_column ? last_column : rect_column;
+                rect_row = rect_row > last_row ? last_row : rect_row;
+                if((rect_column > first_column ? rect_column : first_column) != column || (rect_row > first_row ? rect_row : first_row) != row){
+                    continue;
+                }
+
+                indices[count++] = index;
+                if(count == max_indices){
+                    return count;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Find the mask of a collision class by its name.
+ *
+ * @param collision_masks Pointer to the `tiled2saturn_collision_masks_t` structure of the map.
+ * @param name The name of the class, the `collision_class` property or the name of the layer it came from.
+ *
+ * @return The mask with the class's bit set, or 0 if no cell of the map has the class.
+ */
+uint32_t tiled2saturn_collision_class_mask(const tiled2saturn_collision_masks_t* collision_masks, const char* name){
+    size_t length = strlen(name);
+    uint32_t position = 0;
+    for(uint8_t i = 0; i < collision_masks->class_count; i++){
+        uint8_t name_length = BYTE(collision_masks->class_names, position);
+        if(name_length == length && memcmp(collision_masks->class_names + position + 1, name, length) == 0){
+            return (uint32_t)1 << i;
+        }
+        position += 1 + name_length;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read the collision classes of a cell.
+ *
+ * @param collision_masks Pointer to the `tiled2saturn_collision_masks_t` structure of the map.
+ * @param tile_x The column of the cell, in tiles from the left of the map.
+ * @param tile_y The row of the cell, in tiles from the top of the map.
+ *
+ * @return The cell's mask, a bit set for each of its classes, or 0 outside the map.
+ */
+uint32_t tiled2saturn_collision_mask_get(const tiled2saturn_collision_masks_t* collision_masks, int32_t tile_x, int32_t tile_y){
+    if(tile_x < 0 || tile_y < 0 || (uint32_t)tile_x >= collision_masks->width || (uint32_t)tile_y >= collision_masks->height){
+        return 0;
+    }
+
+    uint32_t position = ((uint32_t)tile_y * collision_masks->width + (uint32_t)tile_x) * collision_masks->mask_size;
+    switch(collision_masks->mask_size){
+        case 1:
+            return BYTE(collision_masks->masks, position);
+        case 2:
+            return SHORT(collision_masks->masks, position);
+        case 4:
+            return LONG(collision_masks->masks, position);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Test whether a cell has any of the collision classes in a mask, a single AND.
+ *
+ * @param collision_masks Pointer to the `tiled2saturn_collision_masks_t` structure of the map.
+ * @param tile_x The column of the cell, in tiles from the left of the map.
+ * @param tile_y The row of the cell, in tiles from the top of the map.
+ * @param mask The classes to test for, masks from `tiled2saturn_collision_class_mask` ORed together.
+ *
+ * @return true if the cell has any of the classes, false otherwise or outside the map.
+ */
+bool tiled2saturn_collision_mask_test(const tiled2saturn_collision_masks_t* collision_masks, int32_t tile_x, int32_t tile_y, uint32_t mask){
+    return (tiled2saturn_collision_mask_get(collision_masks, tile_x, tile_y) & mask) != 0;
+}
+
+/**
+ * @brief Test whether any cell of an area has any of the collision classes in a mask.
+ *
+ * Cells are read a row at a time straight from the packed grid, stopping at the first match. The part of the area
+ * outside the map has no classes.
+ *
+ * @param collision_masks Pointer to the `tiled2saturn_collision_masks_t` structure of the map.
+ * @param tile_x The column of the area's left cells, in tiles from the left of the map.
+ * @param tile_y The row of the area's top cells, in tiles from the top of the map.
+ * @param width The width of the area in tiles.
+ * @param height The height of the area in tiles.
+ * @param mask The classes to test for, masks from `tiled2saturn_collision_class_mask` ORed together.
+ *
+ * @return true if any cell of the area has any of the classes.
+ */
+bool tiled2saturn_collision_mask_any(const tiled2saturn_collision_masks_t* collision_masks, int32_t tile_x, int32_t tile_y,
+                                     uint32_t width, uint32_t height, uint32_t mask){
+    int32_t left = tile_x < 0 ? 0 : tile_x;
+    int32_t top = tile_y < 0 ? 0 : tile_y;
+    int64_t right = (int64_t)tile_x + width;
+    int64_t bottom = (int64_t)tile_y + height;
+    right = right > collision_masks->width ? collision_masks->width : right;
+    bottom = bottom > collision_masks->height ? collision_masks->height : bottom;
+    if(mask == 0 || collision_masks->mask_size == 0 || left >= right || top >= bottom){
+        return false;
+    }
+
+    uint8_t mask_size = collision_masks->mask_size;
+    for(int32_t y = top; y < bottom; y++){
+        const uint8_t* cell = collision_masks->masks + ((uint32_t)y * collision_masks->width + (uint32_t)left) * mask_size;
+        const uint8_t* end = cell + (uint32_t)(right - left) * mask_size;
+        for(; cell < end; cell += mask_size){
+            uint32_t cell_mask = mask_size == 1 ? BYTE(cell, 0) : mask_size == 2 ? SHORT(cell, 0) : LONG(cell, 0);
+            if((cell_mask & mask) != 0){
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Find the stored collision of a cell inside the map, or NULL if its chunk or the chunk's collisions lack it.
+ */
+static const tiled2saturn_collision_t* find_collision(const tiled2saturn_collisions_t* collisions, uint32_t tile_x, uint32_t tile_y){
+    if(collisions->chunk_count == 0){
+        return NULL;
+    }
+
+    uint32_t chunk_x = tile_x / collisions->chunk_tiles;
+    uint32_t chunk_y = tile_y / collisions->chunk_tiles;
+    uint16_t chunk = SHORT(collisions->chunk_grid, (chunk_y * collisions->chunk_columns + chunk_x) * 2);
+    if(chunk == 0xffff){
+        return NULL;
+    }
+
+    uint8_t cell = (uint8_t)((tile_y % collisions->chunk_tiles) * collisions->chunk_tiles + tile_x % collisions->chunk_tiles);
+    uint32_t low = LONG(collisions->chunks, (uint32_t)chunk * 12);
+    uint32_t high = low + LONG(collisions->chunks, (uint32_t)chunk * 12 + 4);
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        const tiled2saturn_collision_t* collision = &collisions->records[middle];
+        if(collision->cell == cell){
+            return collision;
+        }
+        if(collision->cell < cell){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Look up the collision shape of a cell.
+ *
+ * The cell's chunk is found in the chunk grid, then the cell in the chunk's collisions with a binary search, so a
+ * lookup reads a few bytes wherever the cell is. Shapes filling their tile are not stored, a cell with a collision
+ * class and no stored collision gets `full_tile`, a rect over the whole tile.
+ *
+ * @param collisions Pointer to the `tiled2saturn_collisions_t` structure of the map.
+ * @param tile_x The column of the cell, in tiles from the left of the map.
+ * @param tile_y The row of the cell, in tiles from the top of the map.
+ *
+ * @return The cell's collision, or NULL if it has no collision shape or is outside the map.
+ */
+const tiled2saturn_collision_t* tiled2saturn_collision_get(const tiled2saturn_collisions_t* collisions, int32_t tile_x, int32_t tile_y){
+    if(tile_x < 0 || tile_y < 0 || (uint32_t)tile_x >= collisions->width || (uint32_t)tile_y >= collisions->height){
+        return NULL;
+    }
+
+    const tiled2saturn_collision_t* collision = find_collision(collisions, (uint32_t)tile_x, (uint32_t)tile_y);
+    if(collision != NULL){
+        return collision->collision_type == EMPTY ? NULL : collision;
+    }
+
+    return tiled2saturn_collision_mask_get(collisions->collision_masks, tile_x, tile_y) != 0 ? &collisions->full_tile : NULL;
+}
+
+/**
+ * @brief Look up the VDP1 frame showing a tile of a sprite sheet tileset.
+ *
+ * Upload `texture` once to VDP1 VRAM, frames give their character address in units of 8 bytes from the start of
+ * the texture. Identical frames share one copy of the texture.
+ *
+ * @param sprite_atlas Pointer to the `tiled2saturn_sprite_atlas_t` structure to search within.
+ * @param tileset_index The index of the sprite sheet tileset in the map.
+ * @param tile_id The tile of the sprite sheet, frames are numbered as the tiles in Tiled.
+ * @param frame Pointer to the `tiled2saturn_sprite_frame_t` structure to fill in.
+ *
+ * @return true if the tile is a frame of a sprite sheet, false otherwise.
+ */
+bool tiled2saturn_sprite_frame_get(const tiled2saturn_sprite_atlas_t* sprite_atlas, uint16_t tileset_index, uint32_t tile_id, tiled2saturn_sprite_frame_t* frame){
+    for(uint16_t i = 0; i < sprite_atlas->sheet_count; i++){
+        uint32_t sheet = (uint32_t)i * 6;
+        if(SHORT(sprite_atlas->sheets, sheet) != tileset_index){
+            continue;
+        }
+
+        uint16_t first_frame = SHORT(sprite_atlas->sheets, sheet+2);
+        uint16_t frame_count = SHORT(sprite_atlas->sheets, sheet+4);
+        if(tile_id >= frame_count){
+            return false;
+        }
+
+        uint32_t position = (first_frame + tile_id) * 8;
+        frame->char_address = SHORT(sprite_atlas->frames, position);
+        frame->size = SHORT(sprite_atlas->frames, position+2);
+        frame->color_bank = SHORT(sprite_atlas->frames, position+4);
+        frame->draw_mode = SHORT(sprite_atlas->frames, position+6);
+        return true;
+    }
+
+    return false;
+}
+
+#ifdef TILED2SATURN_YAUL
+/**
+ * @brief Point a sprite command at a frame of the sprite atlas.
+ *
+ * Sets the character address, size and color bank of the command, and the color mode bits of its draw mode,
+ * leaving every other draw mode bit as it was.
+ *
+ * @param frame Pointer to the `tiled2saturn_sprite_frame_t` structure to draw.
+ * @param texture_base VDP1 VRAM address the atlas texture was uploaded to, 8 byte aligned.
+ * @param cmdt Pointer to the `vdp1_cmdt_t` to update.
+ */
+void tiled2saturn_sprite_frame_cmdt_set(const tiled2saturn_sprite_frame_t* frame, vdp1_vram_t texture_base, vdp1_cmdt_t* cmdt){
+    cmdt->cmd_srca = (uint16_t)(((texture_base & 0x7FFFF) >> 3) + frame->char_address);
+    cmdt->cmd_size = frame->size;
+    cmdt->cmd_colr = frame->color_bank;
+    cmdt->cmd_pmod = (cmdt->cmd_pmod & ~0x0038) | frame->draw_mode;
+}
+#endif
+
+/**
+ * @brief Start a banded, time-sliced upload of a bitmap layer.
+ *
+ * Bitmap layers are stored one scanline after another, top to bottom, so any run of scanlines is a single
+ * contiguous block with the same layout in VRAM. The upload hands the bitmap out in bands of `band_lines`
+ * scanlines, letting a large bitmap be copied over several vblanks instead of stalling a single frame.
+ *
+ * @param upload Pointer to the `tiled2saturn_bitmap_upload_t` structure to initialize.
+ * @param bitmap_layer The bitmap layer to upload.
+ * @param band_lines Scanlines per band, or 0 to use the `band_lines` the converter stored for the layer. When
+ *                   neither is set a band is a single scanline.
+ *
+ * @note The upload only refers to the bitmap layer, it must stay valid until the upload is done.
+ */
+void tiled2saturn_bitmap_upload_init(tiled2saturn_bitmap_upload_t* upload, const tiled2saturn_bitmap_layer_t* bitmap_layer, uint16_t band_lines){
+    upload->bitmap_layer = bitmap_layer;
+    upload->line_size = bitmap_layer->bitmap_size / bitmap_layer->layer_height;
+    upload->band_lines = band_lines > 0 ? band_lines : bitmap_layer->band_lines;
+    if(upload->band_lines == 0){
+        upload->band_lines = 1;
+    }
+    upload->next_line = 0;
+}
+
+/**
+ * @brief Get the next part of a bitmap layer to upload within a byte budget.
+ *
+ * Fills `band` with as many whole bands as fit in `byte_budget`, as one contiguous block. The block source
+ * and its `offset` from the start of the bitmap in VRAM are both 4 byte aligned, so it can be handed straight
+ * to a single SCU or CPU DMA transfer. At least one band is always returned so the upload keeps moving even
+ * when a single band is larger than the budget.
+ *
+ * @param upload Pointer to an upload started with `tiled2saturn_bitmap_upload_init()`.
+ * @param byte_budget Number of bytes that can be transferred this frame.
+ * @param band Pointer to the `tiled2saturn_bitmap_band_t` structure to fill in.
+ *
+ * @return true if `band` was filled in, false once the whole bitmap has been handed out.
+ *
+ * @note Call this once per vblank, e.g.
+ *       @code
+ *       tiled2saturn_bitmap_band_t band;
+ *       if(tiled2saturn_bitmap_upload_next(&upload, 16384, &band)){
+ *           scu_dma_transfer(0, (void *)(VDP2_VRAM_ADDR(0, 0) + band.offset), band.data, band.size);
+ *       }
+ *       @endcode
+ */
+bool tiled2saturn_bitmap_upload_next(tiled2saturn_bitmap_upload_t* upload, uint32_t byte_budget, tiled2saturn_bitmap_band_t* band){
+    const uint32_t height = upload->bitmap_layer->layer_height;
+    if(upload->next_line >= height){
+        return false;
+    }
+
+    uint32_t band_size = upload->line_size * upload->band_lines;
+    uint32_t bands = byte_budget / band_size;
+    if(bands == 0){
+        bands = 1;
+    }
+
+    uint32_t line_count = bands * upload->band_lines;
+    if(line_count > height - upload->next_line){
+        line_count = height - upload->next_line;
+    }
+
+    band->offset = upload->next_line * upload->line_size;
+    band->data = upload->bitmap_layer->bitmap + band->offset;
+    band->size = line_count * upload->line_size;
+    band->first_line = upload->next_line;
+    band->line_count = line_count;
+
+    upload->next_line += line_count;
+    return true;
+}
+
+/**
+ * @brief Check whether every band of a bitmap layer upload has been handed out.
+ *
+ * @param upload Pointer to an upload started with `tiled2saturn_bitmap_upload_init()`.
+ *
+ * @return true once `tiled2saturn_bitmap_upload_next()` has returned the last band.
+ */
+bool tiled2saturn_bitmap_upload_done(const tiled2saturn_bitmap_upload_t* upload){
+    return upload->next_line >= upload->bitmap_layer->layer_height;
+}
+
+/**
+ * @brief Look up the map page shown at a page position of a layer.
+ *
+ * @return The page table entry, or the blank page flagged empty if the position lies outside the layer.
+ */
+static uint16_t page_entry(const tiled2saturn_layer_t* layer, int32_t page_x, int32_t page_y){
+    if(page_x < 0 || page_y < 0 || page_x >= layer->page_columns || page_y >= layer->page_rows){
+        return TILED2SATURN_EMPTY_PAGE_FLAG | layer->blank_page;
+    }
+
+    return SHORT(layer->page_table, ((uint32_t)page_y * layer->page_columns + (uint32_t)page_x) * 2);
+}
+
+/**
+ * @brief Retrieve the pattern name data of one page of a layer.
+ *
+ * Pages are counted from the top left of the layer, `page_columns` across and `page_rows` down, each one
+ * `page_size` bytes ready to be copied to a VDP2 plane. Identical pages, and every page without tiles, share
+ * a single copy.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param page_x The page column.
+ * @param page_y The page row.
+ *
+ * @return A pointer to the page's pattern name data, or NULL if the page lies outside the layer.
+ */
+uint8_t* tiled2saturn_layer_get_page(const tiled2saturn_layer_t* layer, uint16_t page_x, uint16_t page_y){
+    if(page_x >= layer->page_columns || page_y >= layer->page_rows){
+        return NULL;
+    }
+
+    uint16_t page = page_entry(layer, page_x, page_y) & ~TILED2SATURN_EMPTY_PAGE_FLAG;
+    return layer->pages[page].data;
+}
+
+/**
+ * @brief Retrieve the pattern name data of the page holding a tile.
+ *
+ * Tile coordinates are the map coordinates used in Tiled, which can be negative for infinite maps.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param tile_x The tile column in the map.
+ * @param tile_y The tile row in the map.
+ *
+ * @return A pointer to the page's pattern name data, or NULL if the tile lies outside the layer.
+ */
+uint8_t* tiled2saturn_layer_get_page_at(const tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y){
+    int32_t page_cells = 512 / (int32_t)layer->tileset->tile_width;
+    int32_t x = tile_x - layer->origin_x;
+    int32_t y = tile_y - layer->origin_y;
+
+    if(x < 0 || y < 0){
+        return NULL;
+    }
+
+    return tiled2saturn_layer_get_page(layer, (uint16_t)(x / page_cells), (uint16_t)(y / page_cells));
+}
+
+/**
+ * @brief Check whether a page of a layer holds no tiles.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param page_x The page column.
+ * @param page_y The page row.
+ *
+ * @return true if the page shows the blank page, or lies outside the layer.
+ */
+bool tiled2saturn_layer_page_is_empty(const tiled2saturn_layer_t* layer, uint16_t page_x, uint16_t page_y){
+    return (page_entry(layer, page_x, page_y) & TILED2SATURN_EMPTY_PAGE_FLAG) != 0;
+}
+
+/**
+ * @brief Get the VRAM offset of the page shown at a page position of a layer.
+ *
+ * Offsets are relative to where the map's pages are uploaded, copying every entry of `pages` to its
+ * `vram_offset`. Positions outside the layer give the layer's blank page, so planes around a small layer
+ * show nothing.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param page_x The page column, may lie outside the layer.
+ * @param page_y The page row, may lie outside the layer.
+ *
+ * @return The byte offset of the page from the start of the uploaded pages.
+ */
+uint32_t tiled2saturn_layer_page_vram_offset(const tiled2saturn_layer_t* layer, int32_t page_x, int32_t page_y){
+    uint16_t page = page_entry(layer, page_x, page_y) & ~TILED2SATURN_EMPTY_PAGE_FLAG;
+    return layer->pages[page].vram_offset;
+}
+
+// Clean cells between two dirty runs that are cheaper to copy again than to start another transfer for
+#define FLUSH_GAP_CELLS 8
+
+/**
+ * @brief Find the cell of a layer's pattern name data holding a tile.
+ *
+ * @param page_position Set to the index of the page position, `page_y * page_columns + page_x`.
+ * @param cell Set to the index of the cell within the page, counted row by row.
+ *
+ * @return false if the tile lies outside the layer.
+ */
+static bool tile_cell(const tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y, uint32_t* page_position, uint32_t* cell){
+    int32_t page_cells = 512 / (int32_t)layer->tileset->tile_width;
+    int32_t x = tile_x - layer->origin_x;
+    int32_t y = tile_y - layer->origin_y;
+
+    if(x < 0 || y < 0 || x / page_cells >= layer->page_columns || y / page_cells >= layer->page_rows){
+        return false;
+    }
+
+    *page_position = (uint32_t)(y / page_cells) * layer->page_columns + (uint32_t)(x / page_cells);
+    *cell = (uint32_t)(y % page_cells) * (uint32_t)page_cells + (uint32_t)(x % page_cells);
+    return true;
+}
+
+/**
+ * @brief Get the number of cells in the pages of a layer being edited.
+ */
+static uint32_t edit_cell_count(const tiled2saturn_layer_t* layer){
+    uint32_t page_cells = 512 / layer->tileset->tile_width;
+    return (uint32_t)layer->page_columns * layer->page_rows * page_cells * page_cells;
+}
+
+/**
+ * @brief Find the first dirty cell at or after `cell`, skipping 32 clean cells at a time.
+ *
+ * @return The dirty cell, or the cell count if there are none left.
+ */
+static uint32_t next_dirty_cell(const tiled2saturn_layer_t* layer, uint32_t cell){
+    uint32_t cell_count = edit_cell_count(layer);
+    while(cell < cell_count){
+        uint32_t bits = layer->dirty_cells[cell >> 5] >> (cell & 31);
+        if(bits == 0){
+            cell = (cell | 31) + 1;
+            continue;
+        }
+
+        while((bits & 1) == 0){
+            bits >>= 1;
+            cell++;
+        }
+        return cell;
+    }
+
+    return cell_count;
+}
+
+/**
+ * @brief Read a tile of a layer.
+ *
+ * Tile coordinates are the map coordinates used in Tiled, which can be negative for infinite maps. The fields
+ * are those of the pattern name data the converter wrote: with 1 word pattern name data `character` is the
+ * 10 bit character number and `palette` the 4 bit palette number, with 2 words they are 15 and 7 bits wide.
+ * A layer being edited reads back its own copy, including changes not yet flushed.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param tile_x The tile column in the map.
+ * @param tile_y The tile row in the map.
+ * @param tile Pointer to the `tiled2saturn_tile_t` structure to fill in.
+ *
+ * @return false if the tile lies outside the layer.
+ */
+bool tiled2saturn_layer_get_tile(const tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y, tiled2saturn_tile_t* tile){
+    uint32_t page_position, cell;
+    if(!tile_cell(layer, tile_x, tile_y, &page_position, &cell)){
+        return false;
+    }
+
+    const uint8_t* data;
+    if(layer->edit_pages != NULL){
+        data = layer->edit_pages + page_position * layer->page_size;
+    } else {
+        uint16_t page = SHORT(layer->page_table, page_position * 2) & ~TILED2SATURN_EMPTY_PAGE_FLAG;
+        data = layer->pages[page].data;
+    }
+
+    if(layer->tileset->words_per_palette == 1){
+        uint16_t word = SHORT(data, cell * 2);
+        tile->character = word & 0x3FF;
+        tile->palette = (word >> 12) & 0xF;
+        tile->flip_h = (word & 0x400) != 0;
+        tile->flip_v = (word & 0x800) != 0;
+    } else {
+        uint32_t word = LONG(data, cell * 4);
+        tile->character = word & 0x7FFF;
+        tile->palette = (word >> 16) & 0x7F;
+        tile->flip_h = (word & 0x40000000) != 0;
+        tile->flip_v = (word & 0x80000000) != 0;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Give a layer its own pages so its tiles can be changed at runtime.
+ *
+ * Identical pages, and every page without tiles, share a single copy in the parsed map, so they cannot be
+ * written to in place. This copies the page at every page position of the layer into a buffer owned by the
+ * layer, `page_size` bytes per position in page table order, which is what `tiled2saturn_layer_set_tile()`
+ * changes. The buffer is uploaded to VRAM as it is, see `tiled2saturn_layer_edit_page_vram_offset()`, and
+ * every cell starts out dirty so the first `tiled2saturn_layer_flush()` uploads all of it.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to edit.
+ *
+ * @return false if the buffers could not be allocated. Calling this on a layer already being edited does nothing.
+ */
+bool tiled2saturn_layer_edit_begin(tiled2saturn_layer_t* layer){
+    if(layer->edit_pages != NULL){
+        return true;
+    }
+
+    uint32_t page_positions = (uint32_t)layer->page_columns * layer->page_rows;
+    uint32_t dirty_words = (edit_cell_count(layer) + 31) / 32;
+
+    layer->edit_pages = (uint8_t*)malloc(page_positions * layer->page_size);
+    layer->dirty_cells = (uint32_t*)malloc(dirty_words * sizeof(uint32_t));
+    if(layer->edit_pages == NULL || layer->dirty_cells == NULL){
+        tiled2saturn_layer_edit_end(layer);
+        return false;
+    }
+
+    for(uint32_t i = 0; i < page_positions; i++){
+        uint16_t page = SHORT(layer->page_table, i * 2) & ~TILED2SATURN_EMPTY_PAGE_FLAG;
+        memcpy(layer->edit_pages + i * layer->page_size, layer->pages[page].data, layer->page_size);
+    }
+
+    // Page sizes are multiples of 32 cells, so no bit past the last cell is ever set
+    memset(layer->dirty_cells, 0xFF, dirty_words * sizeof(uint32_t));
+
+    return true;
+}
+
+/**
+ * @brief Stop editing a layer and release its own pages.
+ *
+ * Reads go back to the pages of the parsed map, so changes made with `tiled2saturn_layer_set_tile()` are lost.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure being edited.
+ */
+void tiled2saturn_layer_edit_end(tiled2saturn_layer_t* layer){
+    free(layer->edit_pages);
+    free(layer->dirty_cells);
+    layer->edit_pages = NULL;
+    layer->dirty_cells = NULL;
+}
+
+/**
+ * @brief Get the VRAM offset of a page position of a layer being edited.
+ *
+ * Offsets are relative to where the layer's own pages are uploaded. Point the planes of the layer's scroll
+ * screen at these instead of `tiled2saturn_layer_page_vram_offset()` while it is being edited.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure being edited.
+ * @param page_x The page column.
+ * @param page_y The page row.
+ *
+ * @return The byte offset of the page from the start of the layer's uploaded pages.
+ */
+uint32_t tiled2saturn_layer_edit_page_vram_offset(const tiled2saturn_layer_t* layer, uint16_t page_x, uint16_t page_y){
+    assert(page_x < layer->page_columns && page_y < layer->page_rows);
+    return ((uint32_t)page_y * layer->page_columns + page_x) * layer->page_size;
+}
+
+/**
+ * @brief Change a tile of a layer being edited and mark its cell dirty.
+ *
+ * The fields are encoded the same way `tiled2saturn_layer_get_tile()` decodes them, so a tile read from the
+ * layer can be changed and written back. Nothing is copied to VRAM until `tiled2saturn_layer_flush()`.
+ *
+ * @param layer Pointer to a layer started with `tiled2saturn_layer_edit_begin()`.
+ * @param tile_x The tile column in the map.
+ * @param tile_y The tile row in the map.
+ * @param tile Pointer to the tile to write.
+ *
+ * @return false if the tile lies outside the layer.
+ */
+bool tiled2saturn_layer_set_tile(tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y, const tiled2saturn_tile_t* tile){
+    assert(layer->edit_pages != NULL);
+
+    uint32_t page_position, cell;
+    if(!tile_cell(layer, tile_x, tile_y, &page_position, &cell)){
+        return false;
+    }
+
+    uint8_t* data = layer->edit_pages + page_position * layer->page_size;
+    uint32_t page_cells = 512 / layer->tileset->tile_width;
+
+    if(layer->tileset->words_per_palette == 1){
+        assert(tile->character <= 0x3FF && tile->palette <= 0xF);
+        uint16_t word = tile->character | (uint16_t)(tile->palette << 12);
+        word |= tile->flip_h ? 0x400 : 0;
+        word |= tile->flip_v ? 0x800 : 0;
+        data[cell * 2] = (uint8_t)(word >> 8);
+        data[cell * 2 + 1] = (uint8_t)word;
+    } else {
+        assert(tile->character <= 0x7FFF && tile->palette <= 0x7F);
+        uint32_t word = tile->character | ((uint32_t)tile->palette << 16);
+        word |= tile->flip_h ? 0x40000000 : 0;
+        word |= tile->flip_v ? 0x80000000 : 0;
+        data[cell * 4] = (uint8_t)(word >> 24);
+        data[cell * 4 + 1] = (uint8_t)(word >> 16);
+        data[cell * 4 + 2] = (uint8_t)(word >> 8);
+        data[cell * 4 + 3] = (uint8_t)word;
+    }
+
+    uint32_t edit_cell = page_position * page_cells * page_cells + cell;
+    layer->dirty_cells[edit_cell >> 5] |= 1u << (edit_cell & 31);
+    return true;
+}
+
+/**
+ * @brief Get the VRAM writes that bring a layer being edited up to date.
+ *
+ * Dirty cells are handed out as runs in VRAM order, row by row within a page and page after page as they were
+ * uploaded, so a cell changed twice is written once and neighbouring changes share a transfer. Runs a few clean cells apart are merged, and runs of 1 word cells are widened to
+ * whole longs, so every write's source and `offset` are 4 byte aligned for SCU DMA. Cells handed out are marked
+ * clean, anything that does not fit in `max_writes` or `byte_budget` stays dirty for the next call. At least
+ * one cell is always handed out so a small budget still makes progress.
+ *
+ * @param layer Pointer to a layer started with `tiled2saturn_layer_edit_begin()`.
+ * @param byte_budget Number of bytes that can be transferred this frame.
+ * @param writes Array to fill in, offsets are relative to where the layer's own pages were uploaded.
+ * @param max_writes Number of entries in `writes`.
+ *
+ * @return The number of writes filled in, 0 once nothing is dirty.
+ *
+ * @note Call this once per vblank, e.g.
+ *       @code
+ *       tiled2saturn_vram_write_t writes[8];
+ *       uint16_t count = tiled2saturn_layer_flush(layer, 4096, writes, 8);
+ *       for(uint16_t i = 0; i < count; i++){
+ *           scu_dma_transfer(0, (void *)(NBG0_PAGES + writes[i].offset), writes[i].data, writes[i].size);
+ *           scu_dma_transfer_wait(0);
+ *       }
+ *       @endcode
+ */
+uint16_t tiled2saturn_layer_flush(tiled2saturn_layer_t* layer, uint32_t byte_budget, tiled2saturn_vram_write_t* writes, uint16_t max_writes){
+    assert(layer->edit_pages != NULL);
+
+    const uint32_t cell_count = edit_cell_count(layer);
+    const uint32_t cell_size = (uint32_t)layer->tileset->words_per_palette * 2;
+    // 1 word cells are handed out in pairs to keep every write long aligned
+    const uint32_t cell_step = cell_size == 2 ? 2 : 1;
+
+    uint32_t budget_cells = (byte_budget / cell_size) & ~(cell_step - 1);
+    if(budget_cells == 0){
+        budget_cells = cell_step;
+    }
+
+    uint16_t count = 0;
+    uint32_t cell = next_dirty_cell(layer, 0);
+    while(count < max_writes && cell < cell_count && budget_cells > 0){
+        uint32_t start = cell & ~(cell_step - 1);
+        uint32_t end = start + cell_step;
+
+        for(;;){
+            uint32_t next = next_dirty_cell(layer, end);
+            uint32_t next_end = (next & ~(cell_step - 1)) + cell_step;
+            if(next >= cell_count || next - end > FLUSH_GAP_CELLS || next_end - start > budget_cells){
+                break;
+            }
+            end = next_end;
+        }
+
+        if(end - start > budget_cells){
+            end = start + budget_cells;
+        }
+
+        for(uint32_t i = start; i < end; i++){
+            layer->dirty_cells[i >> 5] &= ~(1u << (i & 31));
+        }
+
+        writes[count].offset = start * cell_size;
+        writes[count].data = layer->edit_pages + start * cell_size;
+        writes[count].size = (end - start) * cell_size;
+        count++;
+
+        budget_cells -= end - start;
+        cell = next_dirty_cell(layer, end);
+    }
+
+    return count;
+}
+
+#ifdef TILED2SATURN_YAUL
+/**
+ * @brief Fill the plane addresses of a normal scroll screen from a layer's page table.
+ *
+ * Planes A to D show the 2x2 pages starting at `page_x`, `page_y`, which assumes a 1x1 plane size. Repeated
+ * pages point at the same copy in VRAM and positions outside the layer point at the blank page, so no
+ * plane needs to be reserved and cleared by hand.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param pages_base VRAM address the map's pages were uploaded to.
+ * @param page_x The page column shown in plane A, may lie outside the layer.
+ * @param page_y The page row shown in plane A, may lie outside the layer.
+ * @param normal_map Pointer to the `vdp2_scrn_normal_map_t` structure to fill in.
+ */
+void tiled2saturn_layer_normal_map(const tiled2saturn_layer_t* layer, vdp2_vram_t pages_base, int32_t page_x, int32_t page_y, vdp2_scrn_normal_map_t* normal_map){
+    normal_map->plane_a = pages_base + tiled2saturn_layer_page_vram_offset(layer, page_x, page_y);
+    normal_map->plane_b = pages_base + tiled2saturn_layer_page_vram_offset(layer, page_x + 1, page_y);
+    normal_map->plane_c = pages_base + tiled2saturn_layer_page_vram_offset(layer, page_x, page_y + 1);
+    normal_map->plane_d = pages_base + tiled2saturn_layer_page_vram_offset(layer, page_x + 1, page_y + 1);
+}
+#endif
+
+/**
+ * @brief Multiply two 16.16 fixed point values.
+ */
+static int32_t fixed_mul(int32_t a, int32_t b){
+    return (int32_t)(((int64_t)a * b) >> 16);
+}
+
+/**
+ * @brief Compute the scroll position of a layer for a camera position.
+ *
+ * The layer scrolls by its Tiled parallax factor, `scroll_ratio_x` and `scroll_ratio_y`, and is shifted by
+ * its Tiled offset. Every value is 16.16 fixed point, the same as Yaul's fix16_t.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param camera_x The camera position across the map in 16.16 fixed point pixels.
+ * @param camera_y The camera position down the map in 16.16 fixed point pixels.
+ * @param scroll_x Set to the layer's horizontal scroll value.
+ * @param scroll_y Set to the layer's vertical scroll value.
+ */
+void tiled2saturn_layer_scroll(const tiled2saturn_layer_t* layer, int32_t camera_x, int32_t camera_y, int32_t* scroll_x, int32_t* scroll_y){
+    *scroll_x = fixed_mul(camera_x, layer->scroll_ratio_x) - layer->scroll_offset_x;
+    *scroll_y = fixed_mul(camera_y, layer->scroll_ratio_y) - layer->scroll_offset_y;
+}
+
+/**
+ * @brief Fill a VDP2 horizontal line scroll table from a layer's `line_scroll` bands.
+ *
+ * Each band stores its speed relative to the layer's own scroll ratio, as the VDP2 adds the table to the
+ * screen's scroll value, so the frame costs one multiply per band and a store per line. Values are written
+ * in the line scroll table format, integer bits 26-16 and fraction bits 15-8, for a table holding
+ * horizontal values only at a 1 line interval. Lines past the last band are left untouched.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param camera_x The camera position across the map in 16.16 fixed point pixels.
+ * @param line_scroll_table The table to fill, in VRAM or in work RAM for a later transfer.
+ *
+ * @return The number of lines written, 0 if the layer has no `line_scroll` bands.
+ */
+uint32_t tiled2saturn_layer_line_scroll(const tiled2saturn_layer_t* layer, int32_t camera_x, int32_t* line_scroll_table){
+    uint32_t lines = 0;
+
+    for(uint16_t i = 0; i < layer->line_scroll_band_count; i++){
+        uint32_t band = (uint32_t)i * 8;
+        uint16_t start_line = SHORT(layer->line_scroll_bands, band);
+        uint16_t line_count = SHORT(layer->line_scroll_bands, band+2);
+        int32_t ratio = (int32_t)LONG(layer->line_scroll_bands, band+4);
+
+        int32_t value = fixed_mul(camera_x, ratio) & 0x07FFFF00;
+        int32_t* line = line_scroll_table + start_line;
+        for(uint16_t j = 0; j < line_count; j++){
+            line[j] = value;
+        }
+
+        lines = (uint32_t)start_line + line_count;
+    }
+
+    return lines;
+}
+
+#ifdef TILED2SATURN_YAUL
+/**
+ * @brief Scroll a normal scroll screen showing a layer to a camera position.
+ *
+ * Sets the screen's scroll values from `tiled2saturn_layer_scroll()` and, when the layer has `line_scroll`
+ * bands and a table is given, fills the table with `tiled2saturn_layer_line_scroll()`. Call once per frame
+ * before `vdp2_sync()`.
+ *
+ * @param layer Pointer to the `tiled2saturn_layer_t` structure to read from.
+ * @param scroll_screen The normal scroll screen showing the layer.
+ * @param camera_x The camera position across the map.
+ * @param camera_y The camera position down the map.
+ * @param line_scroll_table The screen's line scroll table, or NULL to skip line scroll.
+ */
+void tiled2saturn_layer_scroll_apply(const tiled2saturn_layer_t* layer, vdp2_scrn_t scroll_screen, fix16_t camera_x, fix16_t camera_y, fix16_t* line_scroll_table){
+    int32_t scroll_x;
+    int32_t scroll_y;
+    tiled2saturn_layer_scroll(layer, camera_x, camera_y, &scroll_x, &scroll_y);
+
+    vdp2_scrn_scroll_x_set(scroll_screen, scroll_x);
+    vdp2_scrn_scroll_y_set(scroll_screen, scroll_y);
+
+    if(line_scroll_table != NULL){
+        tiled2saturn_layer_line_scroll(layer, camera_x, line_scroll_table);
+    }
+}
+#endif
@@ -1,7 +1,22 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(__has_include)
+#  if __has_include(<yaul.h>)
+#    include <yaul.h>
+#    define TILED2SATURN_YAUL 1
+#  endif
+#endif
+
+#if !defined(TILED2SATURN_YAUL) && defined(__has_include)
+#  if __has_include(<pthread.h>)
+#    define TILED2SATURN_PTHREAD 1
+#  endif
+#endif
+
 typedef struct tiled2saturn_header {
     uint32_t version;
     uint32_t width;
@@ -12,6 +27,12 @@ typedef struct tiled2saturn_header {
     size_t   layer_offset;
     uint8_t  bitmap_layer_count;
     size_t   bitmap_layer_offset;
+    uint8_t  object_layer_count;
+    size_t   object_layer_offset;
+    size_t   sprite_atlas_offset;
+    uint8_t  collision_rect_layer_count;
+    size_t   collision_rects_offset;
+    size_t   collision_masks_offset;
     size_t   collision_offset;
 } tiled2saturn_header_t;
 
@@ -24,12 +45,19 @@ typedef struct tiled2saturn_tileset {
     uint8_t  words_per_palette;
     uint16_t number_of_colors;
     uint8_t  palette_bank;
+    uint32_t character_offset;
     uint32_t palette_size;
     uint8_t* palette;
     uint32_t character_pattern_size;
     uint8_t* character_pattern;
 } tiled2saturn_tileset_t;
 
+typedef struct tiled2saturn_page {
+    uint8_t* data;
+    uint32_t size;
+    uint32_t vram_offset;
+} tiled2saturn_page_t;
+
 typedef struct tiled2saturn_layer {
     uint32_t                id;
     uint32_t                layer_size;
@@ -37,19 +65,135 @@ typedef struct tiled2saturn_layer {
     uint32_t                layer_height;
     uint8_t                 tile_flip_enabled;
     uint8_t                 tile_transparency_enabled;
+    int32_t                 origin_x;
+    int32_t                 origin_y;
+    uint16_t                page_columns;
+    uint16_t                page_rows;
+    uint32_t                page_size;
+    uint8_t*                page_table;
+    uint16_t                blank_page;
+    uint16_t                first_page;
+    uint16_t                page_count;
     uint32_t                pattern_name_data_size;
+    int32_t                 scroll_ratio_x;
+    int32_t                 scroll_ratio_y;
+    int32_t                 scroll_offset_x;
+    int32_t                 scroll_offset_y;
+    uint16_t                line_scroll_band_count;
+    uint8_t*                line_scroll_bands;
     uint8_t*                pattern_name_data;
     tiled2saturn_tileset_t* tileset;
+    tiled2saturn_page_t*    pages;
+    uint8_t*                edit_pages;
+    uint32_t*               dirty_cells;
 } tiled2saturn_layer_t;
 
+typedef struct tiled2saturn_tile {
+    uint16_t character;
+    uint8_t  palette;
+    bool     flip_h;
+    bool     flip_v;
+} tiled2saturn_tile_t;
+
+typedef struct tiled2saturn_vram_write {
+    const uint8_t* data;
+    uint32_t       offset;
+    uint32_t       size;
+} tiled2saturn_vram_write_t;
+
+#define TILED2SATURN_EMPTY_PAGE_FLAG 0x8000
+
+typedef enum {
+    BITMAP_PALETTE_16  = 0,
+    BITMAP_PALETTE_256 = 1,
+    BITMAP_RGB_32768   = 3,
+    BITMAP_RGB_16M     = 4
+} tiled2saturn_bitmap_color_mode_t;
+
 typedef struct tiled2saturn_bitmap_layer {
+    uint32_t                         id;
+    uint32_t                         layer_size;
+    uint32_t                         layer_width;
+    uint32_t                         layer_height;
+    tiled2saturn_bitmap_color_mode_t bitmap_color_mode;
+    uint16_t                         band_lines;
+    uint32_t                         palette_size;
+    uint8_t*                         palette;
+    uint32_t                         bitmap_size;
+    uint8_t*                         bitmap;
+} tiled2saturn_bitmap_layer_t;
+
+typedef struct tiled2saturn_bitmap_band {
+    const uint8_t* data;
+    uint32_t       offset;
+    uint32_t       size;
+    uint32_t       first_line;
+    uint32_t       line_count;
+} tiled2saturn_bitmap_band_t;
+
+typedef struct tiled2saturn_bitmap_upload {
+    const tiled2saturn_bitmap_layer_t* bitmap_layer;
+    uint32_t                           line_size;
+    uint32_t                           band_lines;
+    uint32_t                           next_line;
+} tiled2saturn_bitmap_upload_t;
+
+typedef struct tiled2saturn_object_layer {
     uint32_t id;
     uint32_t layer_size;
-    uint32_t layer_width;
-    uint32_t layer_height;
-    uint32_t bitmap_size;
-    uint8_t* bitmap;
-} tiled2saturn_bitmap_layer_t;
+    uint16_t object_count;
+    uint8_t* cmdts;
+    uint32_t cmdts_size;
+    uint8_t* object_ids;
+} tiled2saturn_object_layer_t;
+
+#define TILED2SATURN_CMDT_SIZE 32
+
+typedef struct tiled2saturn_sprite_frame {
+    uint16_t char_address;
+    uint16_t size;
+    uint16_t color_bank;
+    uint16_t draw_mode;
+} tiled2saturn_sprite_frame_t;
+
+typedef struct tiled2saturn_sprite_atlas {
+    uint32_t atlas_size;
+    uint16_t sheet_count;
+    uint16_t frame_count;
+    uint8_t* sheets;
+    uint8_t* frames;
+    uint32_t texture_size;
+    uint8_t* texture;
+} tiled2saturn_sprite_atlas_t;
+
+typedef struct tiled2saturn_rect {
+    uint32_t x, y;
+    uint32_t width, height;
+} tiled2saturn_rect_t;
+
+typedef struct tiled2saturn_collision_rect_layer {
+    uint32_t id;
+    uint32_t layer_size;
+    uint16_t region_width;
+    uint16_t region_height;
+    uint16_t region_columns;
+    uint16_t region_rows;
+    uint16_t rect_count;
+    uint32_t index_count;
+    uint8_t* rects;
+    uint8_t* region_starts;
+    uint8_t* region_rects;
+} tiled2saturn_collision_rect_layer_t;
+
+typedef struct tiled2saturn_collision_masks {
+    uint32_t masks_size;
+    uint32_t width;
+    uint32_t height;
+    uint8_t  class_count;
+    uint8_t  mask_size;
+    uint8_t* class_names;
+    uint8_t* masks;
+} tiled2saturn_collision_masks_t;
 
 typedef struct tiled2saturn_point{
     uint8_t x, y;
@@ -63,20 +207,127 @@ typedef enum {
 
 typedef struct tiled2saturn_collision{
     tiled2saturn_collision_type_t   collision_type;
-    uint32_t                        collision_size;
-    tiled2saturn_point_t**          points;
-    uint32_t                        point_count;
+    uint8_t                         cell;
+    uint8_t                         point_count;
+    const tiled2saturn_point_t*     points;
 } tiled2saturn_collision_t;
 
+typedef struct tiled2saturn_collisions {
+    uint32_t collisions_size;
+    uint32_t width;
+    uint32_t height;
+    uint8_t  chunk_tiles;
+    uint8_t  tile_width;
+    uint8_t  tile_height;
+    uint16_t chunk_columns;
+    uint16_t chunk_rows;
+    uint32_t chunk_count;
+    uint32_t collision_count;
+    uint8_t* chunk_grid;
+    uint8_t* chunks;
+    tiled2saturn_collision_t* records;
+    const tiled2saturn_collision_masks_t* collision_masks;
+    tiled2saturn_collision_t  full_tile;
+    tiled2saturn_point_t      full_tile_points[4];
+} tiled2saturn_collisions_t;
+
 typedef struct tiled2saturn {
     tiled2saturn_header_t*        header;
     tiled2saturn_tileset_t**      tilesets;
     tiled2saturn_layer_t**        layers;
     tiled2saturn_bitmap_layer_t** bitmap_layers; 
-    tiled2saturn_collision_t**    collisions;
+    tiled2saturn_object_layer_t** object_layers;
+    tiled2saturn_sprite_atlas_t*  sprite_atlas;
+    tiled2saturn_collision_rect_layer_t** collision_rect_layers;
+    tiled2saturn_collision_masks_t* collision_masks;
+    tiled2saturn_collisions_t*    collisions;
+    uint16_t                      page_count;
+    tiled2saturn_page_t*          pages;
+    uint32_t                      pages_vram_size;
+    uint8_t*                      bytes;
 } tiled2saturn_t;
 
+typedef enum {
+    TILED2SATURN_UPLOAD_PALETTE           = 0,
+    TILED2SATURN_UPLOAD_CHARACTER_PATTERN = 1,
+    TILED2SATURN_UPLOAD_PAGES             = 2,
+    TILED2SATURN_UPLOAD_BITMAP_PALETTE    = 3,
+    TILED2SATURN_UPLOAD_BITMAP            = 4,
+    TILED2SATURN_UPLOAD_COMMANDS          = 5,
+    TILED2SATURN_UPLOAD_SPRITE_TEXTURE    = 6
+} tiled2saturn_upload_target_t;
+
+typedef struct tiled2saturn_upload {
+    tiled2saturn_upload_target_t target;
+    uint8_t                      index;
+    const uint8_t*               data;
+    uint32_t                     offset;
+    uint32_t                     size;
+} tiled2saturn_upload_t;
+
+#define TILED2SATURN_MAX_WORKERS 8
+
+typedef struct tiled2saturn_job {
+    void  (*run)(void* work);
+    void* work;
+} tiled2saturn_job_t;
+
+typedef struct tiled2saturn_executor {
+    uint8_t workers;
+    void    (*run_jobs)(const struct tiled2saturn_executor* executor, tiled2saturn_job_t* jobs, uint16_t job_count);
+    void*   context;
+} tiled2saturn_executor_t;
+
 tiled2saturn_t* tiled2saturn_parse(uint8_t* raw_bytes);
+tiled2saturn_t* tiled2saturn_parse_with(uint8_t* raw_bytes, const tiled2saturn_executor_t* executor);
+#ifdef TILED2SATURN_YAUL
+void tiled2saturn_executor_slave_init(tiled2saturn_executor_t* executor);
+#endif
+#ifdef TILED2SATURN_PTHREAD
+void tiled2saturn_executor_pthread_init(tiled2saturn_executor_t* executor, uint8_t workers);
+#endif
 void tiled2saturn_free(tiled2saturn_t* tiled2saturn);
-tiled2saturn_layer_t* get_layer_by_id(tiled2saturn_t* self, uint32_t id);
-tiled2saturn_bitmap_layer_t* get_bitmap_layer_by_id(tiled2saturn_t* self, uint32_t id);
\ No newline at end of file
+int32_t tiled2saturn_apply_patch(tiled2saturn_t* tiled2saturn, const uint8_t* patch, tiled2saturn_upload_t* uploads, uint16_t max_uploads);
+tiled2saturn_layer_t* get_layer_by_id(const tiled2saturn_t* self, uint32_t id);
+tiled2saturn_bitmap_layer_t* get_bitmap_layer_by_id(const tiled2saturn_t* self, uint32_t id);
+tiled2saturn_object_layer_t* get_object_layer_by_id(const tiled2saturn_t* self, uint32_t id);
+tiled2saturn_collision_rect_layer_t* get_collision_rect_layer_by_id(const tiled2saturn_t* self, uint32_t id);
+uint32_t tiled2saturn_character_patterns_size(const tiled2saturn_t* self);
+uint16_t tiled2saturn_tileset_character(const tiled2saturn_tileset_t* tileset, uint32_t tile_id);
+uint32_t tiled2saturn_tileset_character_window(const tiled2saturn_tileset_t* tileset);
+int32_t tiled2saturn_object_layer_find(const tiled2saturn_object_layer_t* object_layer, uint32_t object_id);
+void tiled2saturn_object_layer_cmdts_copy(const tiled2saturn_object_layer_t* object_layer, void* cmdts);
+void tiled2saturn_collision_rect_get(const tiled2saturn_collision_rect_layer_t* layer, uint16_t index, tiled2saturn_rect_t* rect);
+uint16_t tiled2saturn_collision_rects_query(const tiled2saturn_collision_rect_layer_t* layer, int32_t x, int32_t y, uint32_t width, uint32_t height,
+                                            uint16_t* indices, uint16_t max_indices);
+uint32_t tiled2saturn_collision_class_mask(const tiled2saturn_collision_masks_t* collision_masks, const char* name);
+uint32_t tiled2saturn_collision_mask_get(const tiled2saturn_collision_masks_t* collision_masks, int32_t tile_x, int32_t tile_y);
+bool tiled2saturn_collision_mask_test(const tiled2saturn_collision_masks_t* collision_masks, int32_t tile_x, int32_t tile_y, uint32_t mask);
+bool tiled2saturn_collision_mask_any(const tiled2saturn_collision_masks_t* collision_masks, int32_t tile_x, int32_t tile_y,
+                                     uint32_t width, uint32_t height, uint32_t mask);
+const tiled2saturn_collision_t* tiled2saturn_collision_get(const tiled2saturn_collisions_t* collisions, int32_t tile_x, int32_t tile_y);
+bool tiled2saturn_sprite_frame_get(const tiled2saturn_sprite_atlas_t* sprite_atlas, uint16_t tileset_index, uint32_t tile_id, tiled2saturn_sprite_frame_t* frame);
+#ifdef TILED2SATURN_YAUL
+void tiled2saturn_sprite_frame_cmdt_set(const tiled2saturn_sprite_frame_t* frame, vdp1_vram_t texture_base, vdp1_cmdt_t* cmdt);
+#endif
+uint8_t* tiled2saturn_layer_get_page(const tiled2saturn_layer_t* layer, uint16_t page_x, uint16_t page_y);
+uint8_t* tiled2saturn_layer_get_page_at(const tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y);
+bool tiled2saturn_layer_page_is_empty(const tiled2saturn_layer_t* layer, uint16_t page_x, uint16_t page_y);
+uint32_t tiled2saturn_layer_page_vram_offset(const tiled2saturn_layer_t* layer, int32_t page_x, int32_t page_y);
+bool tiled2saturn_layer_get_tile(const tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y, tiled2saturn_tile_t* tile);
+bool tiled2saturn_layer_edit_begin(tiled2saturn_layer_t* layer);
+void tiled2saturn_layer_edit_end(tiled2saturn_layer_t* layer);
+uint32_t tiled2saturn_layer_edit_page_vram_offset(const tiled2saturn_layer_t* layer, uint16_t page_x, uint16_t page_y);
+bool tiled2saturn_layer_set_tile(tiled2saturn_layer_t* layer, int32_t tile_x, int32_t tile_y, const tiled2saturn_tile_t* tile);
+uint16_t tiled2saturn_layer_flush(tiled2saturn_layer_t* layer, uint32_t byte_budget, tiled2saturn_vram_write_t* writes, uint16_t max_writes);
+#ifdef TILED2SATURN_YAUL
+void tiled2saturn_layer_normal_map(const tiled2saturn_layer_t* layer, vdp2_vram_t pages_base, int32_t page_x, int32_t page_y, vdp2_scrn_normal_map_t* normal_map);
+#endif
+void tiled2saturn_layer_scroll(const tiled2saturn_layer_t* layer, int32_t camera_x, int32_t camera_y, int32_t* scroll_x, int32_t* scroll_y);
+uint32_t tiled2saturn_layer_line_scroll(const tiled2saturn_layer_t* layer, int32_t camera_x, int32_t* line_scroll_table);
+#ifdef TILED2SATURN_YAUL
+void tiled2saturn_layer_scroll_apply(const tiled2saturn_layer_t* layer, vdp2_scrn_t scroll_screen, fix16_t camera_x, fix16_t camera_y, fix16_t* line_scroll_table);
+#endif
+void tiled2saturn_bitmap_upload_init(tiled2saturn_bitmap_upload_t* upload, const tiled2saturn_bitmap_layer_t* bitmap_layer, uint16_t band_lines);
+bool tiled2saturn_bitmap_upload_next(tiled2saturn_bitmap_upload_t* upload, uint32_t byte_budget, tiled2saturn_bitmap_band_t* band);
+bool tiled2saturn_bitmap_upload_done(const tiled2saturn_bitmap_upload_t* upload);
\ No newline at end of file
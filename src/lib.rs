@@ -0,0 +1,23 @@
+//! Converts Tiled maps into the single binary representation libtiled2saturn parses. The command line tool
+//! and the benchmarks are both built on these modules.
+
+pub mod saturn_map;
+pub mod saturn_tileset;
+pub mod saturn_color_table;
+pub mod saturn_color_convert;
+pub mod saturn_layer;
+pub mod saturn_bitmap_layer;
+pub mod saturn_budget;
+pub mod saturn_character_allocation;
+pub mod saturn_collision_masks;
+pub mod saturn_collision_rects;
+pub mod saturn_collisions;
+pub mod saturn_emit;
+pub mod saturn_object_layer;
+pub mod saturn_patch;
+pub mod saturn_profile;
+pub mod saturn_quantize;
+pub mod saturn_scroll;
+pub mod saturn_sprite_atlas;
+pub mod saturn_writer;
+pub mod watch;
@@ -1,17 +1,17 @@
 use std::fs;
-use std::io::Write; // bring trait into scope
+use std::io::{BufWriter, Write}; // bring trait into scope
+use std::path::Path;
 use tiled::{Loader, Map};
 use clap::{Command, arg};
 
-use crate::saturn_map::SaturnMap;
-mod saturn_map;
-mod saturn_tileset;
-mod saturn_color_table;
-mod saturn_layer;
-mod saturn_bitmap_layer;
-mod saturn_collisions;
+use tiled2saturn::saturn_budget::{self, BudgetLimits};
+use tiled2saturn::saturn_map::SaturnMap;
+use tiled2saturn::{saturn_emit, saturn_patch, saturn_profile, watch};
 
-use deku::prelude::*;
+// Counting every allocation costs an atomic add each, so only profiling builds pay for it
+#[cfg(feature = "profile")]
+#[global_allocator]
+static ALLOCATOR: saturn_profile::CountingAllocator = saturn_profile::CountingAllocator;
 
 fn cli() -> Command {
     Command::new("tiled2saturn")
@@ -22,6 +22,23 @@ fn cli() -> Command {
             Command::new("extract")
                 .about("Extracts all componenets of a tmx map into a single binary representation")
                 .arg(arg!(-w<WORDS>).value_parser(clap::value_parser!(u8).range(1..2)))
+                .arg(arg!(--watch "Keep running and re-export whenever the tmx, tsx or bmp files change"))
+                .arg(arg!(--profile [REPORT] "Write the time and memory taken by each stage as JSON, to profile.json by default. Allocated bytes are only counted when built with --features profile")
+                    .num_args(0..=1).default_missing_value("profile.json").conflicts_with("watch"))
+                .arg(arg!(--trace <TRACE> "Write the stages as Chrome trace events, for chrome://tracing or a flame graph viewer")
+                    .required(false).conflicts_with("watch"))
+                .arg(arg!(--"vram-limit" <BYTES> "Fail the export if it needs more VDP2 VRAM, overrides the map's vram_limit").required(false)
+                    .value_parser(saturn_budget::parse_size))
+                .arg(arg!(--"cram-limit" <BYTES> "Fail the export if its palettes need more CRAM, overrides cram_limit").required(false)
+                    .value_parser(saturn_budget::parse_size))
+                .arg(arg!(--"vdp1-vram-limit" <BYTES> "Fail the export if it needs more VDP1 VRAM, overrides vdp1_vram_limit").required(false)
+                    .value_parser(saturn_budget::parse_size))
+                .arg(arg!(--"wram-limit" <BYTES> "Fail the export if the loaded and parsed map needs more work RAM, overrides wram_limit").required(false)
+                    .value_parser(saturn_budget::parse_size))
+                .arg(arg!(--patch <PATCH> "Also write the changes from the previous data.bin, for tiled2saturn_apply_patch").required(false))
+                .arg(arg!(--"emit-c" [NAME] "Also write the map as NAME.c and NAME.h, already parsed into const structures, data.c by default")
+                    .num_args(0..=1).default_missing_value("data").conflicts_with("watch"))
+                .arg(arg!(--section <SECTION> "Linker section to place the --emit-c map in").required(false).requires("emit-c"))
                 .arg(arg!(<TMX_FILE> "The tmx file to extract from"))
                 .arg_required_else_help(true),
         )
@@ -39,25 +56,85 @@ fn main() {
     match matches.subcommand() {
         Some(("extract", sub_matches)) => {
             let filename = sub_matches.get_one::<String>("TMX_FILE").expect("TMX file to process is required");
+            let limits = BudgetLimits {
+                vram: sub_matches.get_one::<u32>("vram-limit").copied(),
+                cram: sub_matches.get_one::<u32>("cram-limit").copied(),
+                vdp1_vram: sub_matches.get_one::<u32>("vdp1-vram-limit").copied(),
+                wram: sub_matches.get_one::<u32>("wram-limit").copied()
+            };
+
+            let patch_file = sub_matches.get_one::<String>("patch").map(Path::new);
+            let c_file = sub_matches.get_one::<String>("emit-c").map(Path::new);
+            let section = sub_matches.get_one::<String>("section").map(String::as_str);
+
+            if sub_matches.get_flag("watch") {
+                if let Err(err) = watch::watch(Path::new(filename), Path::new("data.bin"), &limits, patch_file) {
+                    println!("{}", err)
+                }
+                return;
+            }
+
+            let report_file = sub_matches.get_one::<String>("profile");
+            let trace_file = sub_matches.get_one::<String>("trace");
+            if report_file.is_some() || trace_file.is_some() {
+                saturn_profile::enable();
+            }
+
+            let load_stage = saturn_profile::stage("load_tmx");
             let tmx_file = load_tmx(filename);
-            let saturn_map = SaturnMap::build(tmx_file);
+            drop(load_stage);
 
-            let map_bytes = match saturn_map {
-                Ok(map) => map.to_bytes().map_err(|err| err.to_string()),
-                Err(msg) => Err(msg)
-            };
+            let previous = patch_file.and_then(|_| fs::read("data.bin").ok());
+
+            // Export beside data.bin and only replace it once the export succeeds, a failed export leaves the previous one in place
+            let file = fs::File::create("data.bin.tmp").expect("Unable to open file data.bin.tmp");
+            let mut writer = BufWriter::new(file);
 
-            match map_bytes {
-                Ok(map) =>  {
-                    let mut file = fs::OpenOptions::new()
-                        .create(true) 
-                        .write(true)
-                        .open("data.bin").expect("Unable to open file data.bin");
-                    file.write_all(&map).expect("Failed to write bytes to output file");
-                    println!("Completed")
+            let export_stage = saturn_profile::stage("export");
+            let result = SaturnMap::export(&tmx_file, &mut writer, &limits).and_then(|reports| writer.flush().map(|_| reports).map_err(|e| e.to_string()));
+            drop(writer);
+            let result = match result {
+                Ok(reports) => fs::rename("data.bin.tmp", "data.bin").map(|_| reports).map_err(|e| e.to_string() + " data.bin"),
+                Err(err) => {
+                    let _ = fs::remove_file("data.bin.tmp");
+                    Err(err)
                 }
+            };
+            drop(export_stage);
+
+            match result {
+                Ok(reports) => {
+                    for report in reports {
+                        println!("{}", report);
+                    }
+                    println!("Completed");
+                    if let Some(patch_file) = patch_file {
+                        match saturn_patch::write_patch(previous.as_deref(), Path::new("data.bin"), patch_file) {
+                            Ok(report) => println!("{}", report),
+                            Err(err) => println!("{}", err)
+                        }
+                    }
+                    if let Some(c_file) = c_file {
+                        match fs::read("data.bin").map_err(|e| e.to_string() + " data.bin").and_then(|bytes| saturn_emit::write_c(&bytes, c_file, section)) {
+                            Ok(report) => println!("{}", report),
+                            Err(err) => println!("{}", err)
+                        }
+                    }
+                },
                 Err(err) => println!("{}", err)
             }
+
+            if let Some(profile) = saturn_profile::finish() {
+                let outputs = [(report_file, profile.report_json()), (trace_file, profile.trace_json())];
+                for (path, json) in outputs {
+                    if let Some(path) = path {
+                        match fs::write(path, json) {
+                            Ok(()) => println!("Profile written to {}", path),
+                            Err(err) => println!("Unable to write {}: {}", path, err)
+                        }
+                    }
+                }
+            }
         }
         _ => unreachable!(), // If all subcommands are defined above, anything else is unreachable!()
     }
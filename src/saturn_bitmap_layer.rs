@@ -1,61 +1,186 @@
 use std::fs;
+use std::io::{self, Write};
 
-use deku::prelude::*;
-use embedded_graphics::pixelcolor::{RgbColor, Bgr888};
+use embedded_graphics::{geometry::OriginDimensions, pixelcolor::Bgr888};
 use tiled::{ImageLayer, Layer,PropertyValue};
-use tinybmp::{Bmp, Pixels};
+use tinybmp::Bmp;
+
+use crate::saturn_color_convert;
+use crate::saturn_profile;
+use crate::saturn_quantize;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
+
+// id .. palette_size, followed by the palette, bitmap_size, bitmap_padding, the padding and the bitmap
+const BITMAP_LAYER_HEADER_SIZE: u32 = 23;
+
+// SCU DMA transfers need a long aligned source, so the bitmap is padded to start on one
+const BITMAP_ALIGNMENT: u32 = 4;
+
+/// Bitmap color modes, numbered as the VDP2 character color count (CHCN) bits.
+#[repr(u8)]
+#[derive(Debug, PartialEq, Clone, Copy)]
+pub enum BitmapColorMode {
+    Palette16 = 0,
+    Palette256 = 1,
+    Rgb32768 = 3,
+    Rgb16M = 4
+}
 
 #[repr(C)]
-#[derive(Debug, PartialEq, DekuWrite)]
-#[deku(endian = "endian", ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+#[derive(Debug, PartialEq)]
 pub struct SaturnBitmapLayer{
     id: u32,
-    #[deku(update = "self.to_bytes().unwrap().len()")]
     pub layer_size: u32,
     width: u32,
     height: u32,
-    #[deku(update = "self.bitmap.len()")]
+    color_mode: BitmapColorMode,
+    band_lines: u16,
+    palette_size: u32,
+    palette: Vec<u8>,
     bitmap_size: u32,
-    #[deku(count = "bitmap_size", endian = "big")]
+    bitmap_padding: u8,
     bitmap:Vec<u8>
 }
 
 impl SaturnBitmapLayer {
-    fn new(id: u32, width: u32, height: u32, bitmap: Vec<u8>) -> Result<Self, String> {
+    fn new(id: u32, width: u32, height: u32, color_mode: BitmapColorMode, band_lines: u16, palette: Vec<u8>, bitmap: Vec<u8>) -> Result<Self, String> {
         Ok(SaturnBitmapLayer {
             id,
             layer_size: Default::default(),
             width,
             height,
+            color_mode,
+            band_lines,
+            palette_size: Default::default(),
+            palette,
             bitmap_size: Default::default(),
+            bitmap_padding: Default::default(),
             bitmap,
         })
     }
 
-    fn get_pallette_data_32(pixels: Pixels<Bgr888>) -> Result<Vec<u32>, String> {
-        let mut results: Vec<u32> = Vec::default();
+    fn update_sizes(&mut self) {
+        self.palette_size = self.palette.len() as u32;
+        self.bitmap_size = self.bitmap.len() as u32;
+        self.layer_size = self.encoded_size();
+    }
+
+    /// Bytes of VDP2 VRAM the bitmap takes, and of CRAM its palette takes.
+    pub fn vram_usage(&self) -> (u32, u32) {
+        (self.bitmap.len() as u32, self.palette.len() as u32)
+    }
+
+    /// Pads the bitmap so it starts on an aligned address once this section is written at `section_offset`
+    /// from the start of the output. Rows are stored top to bottom at a multiple of 4 bytes each, so every
+    /// band of scanlines is then a single aligned transfer.
+    pub fn align_to(&mut self, section_offset: u32) {
+        let bitmap_offset = section_offset + BITMAP_LAYER_HEADER_SIZE + self.palette.len() as u32 + 5;
+        self.bitmap_padding = ((BITMAP_ALIGNMENT - bitmap_offset % BITMAP_ALIGNMENT) % BITMAP_ALIGNMENT) as u8;
+        self.update_sizes();
+    }
+
+    /// Scanlines per upload band from the optional `band_lines` property, 0 leaves the band size to the runtime.
+    fn get_band_lines<'a>(layer:&Layer<'a>, height: u32) -> Result<u16, String> {
+        let band_lines : u16 = match layer.properties.get("band_lines") {
+            None => 0,
+            Some(PropertyValue::IntValue(s)) => u16::try_from(*s).map_err(|e| format!("Invalid band_lines {:?}", e))?,
+            Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid band_lines {:?}", e))?,
+            _ => Err("Invalid band_lines")?
+        };
+
+        if band_lines as u32 > height {
+            return Err(format!("band_lines {} is larger than the layer height {}", band_lines, height));
+        }
+
+        Ok(band_lines)
+    }
 
-        for p in pixels {
-            let color = p.1;
-            results.push(u32::from(color.r()) | (u32::from(color.g()) << 8) | (u32::from(color.b()) << 16));
+    fn check_size(bmp: &Bmp<Bgr888>, width: usize, height: usize) -> Result<(), String> {
+        let size = bmp.size();
+        if size.width as usize != width || size.height as usize != height {
+            return Err(format!("Bitmap size {}x{} does not match layer image size {}x{}", size.width, size.height, width, height));
         }
+        return Ok(());
+    }
+
+    fn get_bitmap_data(bmp: &Bmp<Bgr888>, width: usize, height: usize, words_per_palette: u8) -> Result<Vec<u8>, String> {
+        let bytes_per_pixel = if words_per_palette == 1 { 2 } else { 4 };
+        let row_size = width * bytes_per_pixel;
+        let mut results: Vec<u8> = vec![0; row_size * height];
+
+        saturn_color_convert::for_each_bgr_row(bmp, |y, row| {
+            let out = &mut results[y * row_size..(y + 1) * row_size];
+            if words_per_palette == 1 {
+                saturn_color_convert::bgr888_to_rgb555_be(row, out);
+            } else {
+                saturn_color_convert::bgr888_to_rgb888_be(row, out);
+            }
+            Ok(())
+        })?;
 
         return Ok(results);
     }
 
-    fn get_pallette_data_16(pixels: Pixels<Bgr888>) -> Result<Vec<u16>, String> {
-        let mut results: Vec<u16> = Vec::default();
+    fn get_bgr_image(bmp: &Bmp<Bgr888>, width: usize, height: usize) -> Result<Vec<u8>, String> {
+        let row_size = width * 3;
+        let mut results: Vec<u8> = vec![0; row_size * height];
+
+        saturn_color_convert::for_each_bgr_row(bmp, |y, row| {
+            results[y * row_size..(y + 1) * row_size].copy_from_slice(row);
+            Ok(())
+        })?;
 
-        for p in pixels {
-            let color = p.1;
+        return Ok(results);
+    }
 
-            let r = (color.r() & 0xff).overflowing_shr(3);
-            let g = ((color.g().overflowing_shr(8).0) & 0xff).overflowing_shr(3);
-            let b = ((color.b().overflowing_shr(16).0) & 0xff).overflowing_shr(3);
-            results.push(u16::from(r.0) | (u16::from(g.0) << 5) | (u16::from(b.0) << 10) | 0x8000);
+    /// Indexes the image into a 16 or 256 color palette, quantizing when it holds more colors than that.
+    /// Returns the palette in CRAM format and the 4bpp or 8bpp bitmap.
+    fn get_paletted_data(bgr_image: &[u8], color_mode: BitmapColorMode, words_per_palette: u8) -> Result<(Vec<u8>, Vec<u8>), String> {
+        let max_colors = if color_mode == BitmapColorMode::Palette16 { 16 } else { 256 };
+        let (palette, indices) = saturn_quantize::quantize(bgr_image, max_colors);
+
+        let palette_bgr: Vec<u8> = palette.iter().flatten().copied().collect();
+        let bytes_per_color = if words_per_palette == 1 { 2 } else { 4 };
+        let mut palette_data: Vec<u8> = vec![0; palette.len() * bytes_per_color];
+
+        if words_per_palette == 1 {
+            saturn_color_convert::bgr888_to_rgb555_be(&palette_bgr, &mut palette_data);
+        } else {
+            saturn_color_convert::bgr888_to_rgb888_be(&palette_bgr, &mut palette_data);
         }
 
-        return Ok(results);
+        let bitmap_data: Vec<u8> = if color_mode == BitmapColorMode::Palette16 {
+            indices.chunks_exact(2).map(|pair| (((pair[0] as u8) & 0xF) << 4) | ((pair[1] as u8) & 0xF)).collect()
+        } else {
+            indices.iter().map(|index| *index as u8).collect()
+        };
+
+        return Ok((palette_data, bitmap_data));
+    }
+
+    /// The optional `palette_colors` property selects a paletted bitmap: 16 or 256 to always index (and
+    /// quantize if needed) to that many colors, or "auto" to use the smallest palette the image fits in
+    /// without loss. Without it the bitmap is direct color, RGB555 or RGB888 depending on `pnd_size`.
+    fn get_color_mode<'a>(layer:&Layer<'a>, words_per_palette: u8, bgr_colors: impl FnOnce() -> usize) -> Result<BitmapColorMode, String> {
+        let direct = if words_per_palette == 1 { BitmapColorMode::Rgb32768 } else { BitmapColorMode::Rgb16M };
+
+        let palette_colors = match layer.properties.get("palette_colors") {
+            None => return Ok(direct),
+            Some(PropertyValue::IntValue(s)) => s.to_string(),
+            Some(PropertyValue::StringValue(c)) => c.clone(),
+            _ => Err("Invalid palette_colors")?
+        };
+
+        match palette_colors.as_str() {
+            "16" => Ok(BitmapColorMode::Palette16),
+            "256" => Ok(BitmapColorMode::Palette256),
+            "auto" => Ok(match bgr_colors() {
+                0..=16 => BitmapColorMode::Palette16,
+                17..=256 => BitmapColorMode::Palette256,
+                _ => direct
+            }),
+            e => Err(format!("Invalid palette_colors {}, expected 16, 256 or auto", e))
+        }
     }
 
     fn get_words_per_palette<'a>(layer:&Layer<'a>) -> Result<u8, String> {
@@ -69,40 +194,98 @@ impl SaturnBitmapLayer {
         Ok(words_per_palette)
     }
 
-    pub fn build<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>) -> Result<Vec<Self>, String> {
-        let mut results: Vec<SaturnBitmapLayer> = Vec::default();
-
-        let bitmap_layers: Vec<(Layer<'a>, ImageLayer)> = layers.filter_map(|layer| match layer.layer_type() {
-            tiled::LayerType::Image(image_layer) => Some((layer, image_layer)),
-            _ => None,
-        }).collect();
-
-        for (layer, image_layer) in bitmap_layers.iter() {
-            let id = layer.id();
-            let image = image_layer.image.as_ref();
-            let width = image.map(|i| i.width).filter(|i| *i == 512 || *i == 1024).ok_or(format!("Unable to get valid width for layer {}", id))?;
-            let height = image.map(|i| i.height).filter(|i| *i == 256 || *i == 512).ok_or(format!("Unable to get valid height for layer {}", id))?;
-            let source = image.map(|i| i.source.clone()).ok_or(format!("Unable to get source for layer {}", id))?;
-            let image_file = fs::read(source.as_path()).map_err(|op| op.to_string() + " " + source.as_path().to_str().unwrap())?;
-            let bmp = Bmp::<Bgr888>::from_slice(&image_file).map_err(|op| format!("{:?}", op))?;
-            let words_per_palette = SaturnBitmapLayer::get_words_per_palette(layer)?;
-
-            let iter = bmp.pixels().into_iter();
-            
-            let bitmap_data_bytes: Vec<u8> = if words_per_palette == 1 {
-                let bitmap_data = SaturnBitmapLayer::get_pallette_data_16(iter)?;
-                bitmap_data.iter().flat_map(|val| val.to_be_bytes()).collect()
-            } else {
-                let bitmap_data = SaturnBitmapLayer::get_pallette_data_32(iter)?;
-                bitmap_data.iter().flat_map(|val| val.to_be_bytes()).collect()
-            };
+    /// Builds the bitmap layers one at a time, handing each to `f` as soon as it is encoded.
+    pub fn build_each<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>, mut f: impl FnMut(SaturnBitmapLayer) -> Result<(), String>) -> Result<(), String> {
+        for layer in layers {
+            if let tiled::LayerType::Image(image_layer) = layer.layer_type() {
+                let _stage = saturn_profile::stage_for("bitmap_layer", || layer.id().to_string());
+                f(SaturnBitmapLayer::build_one(&layer, &image_layer)?)?;
+            }
+        }
 
-           let mut saturn_bitmap_layer = SaturnBitmapLayer::new(id, width as u32, height as u32, bitmap_data_bytes)?;
+        return Ok(());
+    }
 
-            saturn_bitmap_layer.update().map_err(|op| op.to_string())?;
-            results.push(saturn_bitmap_layer);
-        }
+    pub fn build_one<'a>(layer: &Layer<'a>, image_layer: &ImageLayer) -> Result<Self, String> {
+        let id = layer.id();
+        let image = image_layer.image.as_ref();
+        let width = image.map(|i| i.width).filter(|i| *i == 512 || *i == 1024).ok_or(format!("Unable to get valid width for layer {}", id))?;
+        let height = image.map(|i| i.height).filter(|i| *i == 256 || *i == 512).ok_or(format!("Unable to get valid height for layer {}", id))?;
+        let source = image.map(|i| i.source.clone()).ok_or(format!("Unable to get source for layer {}", id))?;
+        let image_file = fs::read(source.as_path()).map_err(|op| op.to_string() + " " + source.as_path().to_str().unwrap())?;
+        let bmp = Bmp::<Bgr888>::from_slice(&image_file).map_err(|op| format!("{:?}", op))?;
+        let words_per_palette = SaturnBitmapLayer::get_words_per_palette(layer)?;
 
-        return Ok(results);
+        SaturnBitmapLayer::check_size(&bmp, width as usize, height as usize)?;
+
+        let mut bgr_image: Option<Vec<u8>> = None;
+        let color_mode = SaturnBitmapLayer::get_color_mode(layer, words_per_palette, || {
+            bgr_image = SaturnBitmapLayer::get_bgr_image(&bmp, width as usize, height as usize).ok();
+            bgr_image.as_ref().map_or(usize::MAX, |image| saturn_quantize::histogram(image).len())
+        })?;
+
+        let (palette, bitmap) = match color_mode {
+            BitmapColorMode::Palette16 | BitmapColorMode::Palette256 => {
+                let bgr_image = match bgr_image {
+                    Some(image) => image,
+                    None => SaturnBitmapLayer::get_bgr_image(&bmp, width as usize, height as usize)?
+                };
+                SaturnBitmapLayer::get_paletted_data(&bgr_image, color_mode, words_per_palette)?
+            }
+            _ => (Vec::default(), SaturnBitmapLayer::get_bitmap_data(&bmp, width as usize, height as usize, words_per_palette)?)
+        };
+
+        let band_lines = SaturnBitmapLayer::get_band_lines(layer, height as u32)?;
+
+        let mut saturn_bitmap_layer = SaturnBitmapLayer::new(id, width as u32, height as u32, color_mode, band_lines, palette, bitmap)?;
+
+        saturn_bitmap_layer.update_sizes();
+
+        return Ok(saturn_bitmap_layer);
+    }
+}
+
+impl SaturnWrite for SaturnBitmapLayer {
+    fn encoded_size(&self) -> u32 {
+        BITMAP_LAYER_HEADER_SIZE + self.palette.len() as u32 + 5 + self.bitmap_padding as u32 + self.bitmap.len() as u32
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.id)?;
+        write_u32(out, self.layer_size)?;
+        write_u32(out, self.width)?;
+        write_u32(out, self.height)?;
+        write_u8(out, self.color_mode as u8)?;
+        write_u16(out, self.band_lines)?;
+        write_u32(out, self.palette_size)?;
+        out.write_all(&self.palette)?;
+        write_u32(out, self.bitmap_size)?;
+        write_u8(out, self.bitmap_padding)?;
+        out.write_all(&[0; BITMAP_ALIGNMENT as usize][..self.bitmap_padding as usize])?;
+        out.write_all(&self.bitmap)
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// A 4x2 bitmap of 16 colors with its palette.
+    pub(crate) fn sample_bitmap_layer() -> SaturnBitmapLayer {
+        let mut layer = SaturnBitmapLayer::new(2, 4, 2, BitmapColorMode::Palette16, 0, vec![0x7f; 32], vec![0x12; 8]).unwrap();
+        layer.update_sizes();
+        return layer;
     }
-}
\ No newline at end of file
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let mut layer = sample_bitmap_layer();
+        for section_offset in 52..56 {
+            layer.align_to(section_offset);
+            let bytes = encode(&layer);
+            assert_eq!(read_u32(&bytes, 4), layer.layer_size);
+            assert_eq!((section_offset + bytes.len() as u32 - layer.bitmap.len() as u32) % BITMAP_ALIGNMENT, 0);
+        }
+    }
+}
@@ -0,0 +1,357 @@
+use tiled::{Map, PropertyValue};
+
+use crate::saturn_bitmap_layer::SaturnBitmapLayer;
+use crate::saturn_collision_rects::SaturnCollisionRects;
+use crate::saturn_collisions::SaturnCollisions;
+use crate::saturn_layer::SaturnLayer;
+use crate::saturn_map::SaturnMap;
+use crate::saturn_object_layer::SaturnObjectLayer;
+use crate::saturn_sprite_atlas::SaturnSpriteAtlas;
+use crate::saturn_tileset::SaturnTileset;
+use crate::saturn_writer::SaturnWrite;
+
+// VDP2 VRAM is 4 banks, A0, A1, B0 and B1, and bitmaps start on a bank boundary
+const VDP2_VRAM_SIZE: u32 = 0x80000;
+const VDP2_BANK_SIZE: u32 = 0x20000;
+const VDP2_BANKS: [&str; 4] = ["A0", "A1", "B0", "B1"];
+
+// Color RAM modes 1 and 2, 2048 RGB555 or 1024 RGB888 colors
+const CRAM_SIZE: u32 = 0x1000;
+
+const VDP1_VRAM_SIZE: u32 = 0x80000;
+
+// sizeof the libtiled2saturn structures on SH-2, 4 byte pointers and size_t
+const MAP_STRUCT_SIZE: u32 = 52;
+const HEADER_STRUCT_SIZE: u32 = 64;
+const TILESET_STRUCT_SIZE: u32 = 44;
+const LAYER_STRUCT_SIZE: u32 = 96;
+const PAGE_STRUCT_SIZE: u32 = 12;
+const BITMAP_LAYER_STRUCT_SIZE: u32 = 40;
+const OBJECT_LAYER_STRUCT_SIZE: u32 = 24;
+const SPRITE_ATLAS_STRUCT_SIZE: u32 = 24;
+const COLLISION_RECT_LAYER_STRUCT_SIZE: u32 = 36;
+const COLLISION_MASKS_STRUCT_SIZE: u32 = 24;
+const COLLISIONS_STRUCT_SIZE: u32 = 64;
+const COLLISION_STRUCT_SIZE: u32 = 12;
+const POINTER_SIZE: u32 = 4;
+
+/// Bytes newlib's malloc takes from the heap for a request of `size`, a 4 byte size field rounded up to 8
+/// bytes with a 16 byte minimum.
+fn heap_chunk(size: u32) -> u32 {
+    ((size + 4 + 7) & !7).max(16)
+}
+
+/// Parses a byte count, with an optional `K` or `KB` suffix for kilobytes, or in hex with a `0x` prefix.
+pub fn parse_size(value: &str) -> Result<u32, String> {
+    let value = value.trim();
+    let upper = value.to_ascii_uppercase();
+    let (digits, scale) = match upper.strip_suffix("KB").or(upper.strip_suffix('K')) {
+        Some(digits) => (digits.trim().to_string(), 1024),
+        None => (upper.clone(), 1)
+    };
+    let size = match digits.strip_prefix("0X") {
+        Some(hex) => u32::from_str_radix(hex, 16),
+        None => digits.parse::<u32>()
+    }.map_err(|e| format!("Invalid size {:?} {:?}", value, e))?;
+    return size.checked_mul(scale).ok_or(format!("Invalid size {:?}", value));
+}
+
+/// Upper bounds on the memory an export may use. The hardware sizes always apply, these only lower them.
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct BudgetLimits {
+    pub vram: Option<u32>,
+    pub cram: Option<u32>,
+    pub vdp1_vram: Option<u32>,
+    pub wram: Option<u32>
+}
+
+impl BudgetLimits {
+    fn get_limit(map: &Map, name: &str) -> Result<Option<u32>, String> {
+        let limit: Option<u32> = match map.properties.get(name) {
+            None => None,
+            Some(PropertyValue::IntValue(s)) => Some(u32::try_from(*s).map_err(|e| format!("Invalid {} {:?}", name, e))?),
+            Some(PropertyValue::StringValue(c)) => Some(parse_size(c).map_err(|e| format!("Invalid {} {}", name, e))?),
+            _ => Err(format!("Invalid {}", name))?
+        };
+        Ok(limit)
+    }
+
+    /// Reads the `vram_limit`, `cram_limit`, `vdp1_vram_limit` and `wram_limit` map properties.
+    pub fn from_map(map: &Map) -> Result<Self, String> {
+        Ok(BudgetLimits {
+            vram: BudgetLimits::get_limit(map, "vram_limit")?,
+            cram: BudgetLimits::get_limit(map, "cram_limit")?,
+            vdp1_vram: BudgetLimits::get_limit(map, "vdp1_vram_limit")?,
+            wram: BudgetLimits::get_limit(map, "wram_limit")?
+        })
+    }
+
+    /// These limits, falling back to `defaults` for any that are not set.
+    pub fn or(&self, defaults: &BudgetLimits) -> BudgetLimits {
+        BudgetLimits {
+            vram: self.vram.or(defaults.vram),
+            cram: self.cram.or(defaults.cram),
+            vdp1_vram: self.vdp1_vram.or(defaults.vdp1_vram),
+            wram: self.wram.or(defaults.wram)
+        }
+    }
+}
+
+/// What an export costs on the Saturn: VDP2 VRAM for character patterns, pages and bitmaps laid out in its
+/// banks, CRAM for palettes, VDP1 VRAM for the sprite atlas and sprite commands, and work RAM for the loaded
+/// file plus everything `tiled2saturn_parse` allocates.
+///
+/// VDP2 VRAM is laid out the way the examples load it: bitmaps from the start of VRAM, each on its own bank
+/// boundary, then the character patterns at the offsets `SaturnCharacterAllocation` gave them, then the map's
+/// pages aligned as `tiled2saturn_parse` assigns them. Tileset palettes sit at their `palette_bank`, and bitmap
+/// palettes follow the last of them.
+#[derive(Debug, Default, PartialEq)]
+pub struct SaturnBudget {
+    character_patterns: u32,
+    pages: u32,
+    page_alignment: u32,
+    page_count: u32,
+    bitmaps: Vec<u32>,
+    palettes_end: u32,
+    bitmap_palettes: u32,
+    sprite_texture: u32,
+    sprite_commands: u32,
+    data_size: u32,
+    heap: u32,
+    allocations: u32,
+    counts: [u32; 5]
+}
+
+// Indices into `counts`, the lengths of the pointer arrays `tiled2saturn_parse` allocates
+const TILESETS: usize = 0;
+const LAYERS: usize = 1;
+const BITMAP_LAYERS: usize = 2;
+const OBJECT_LAYERS: usize = 3;
+const COLLISION_RECT_LAYERS: usize = 4;
+
+impl SaturnBudget {
+    fn allocate(&mut self, size: u32) {
+        self.heap += heap_chunk(size);
+        self.allocations += 1;
+    }
+
+    pub fn add_tileset(&mut self, tileset: &SaturnTileset) {
+        if tileset.palette_size > 0 {
+            let color_size: u32 = if tileset.words_per_palette == 1 { 2 } else { 4 };
+            // A 1 word palette number counts in 256 colors for 256 and 2048 color tilesets, otherwise in 16
+            let bank_colors: u32 = if tileset.words_per_palette == 1 && tileset.number_of_colors > 16 { 256 } else { 16 };
+            let offset = tileset.palette_bank as u32 * bank_colors * color_size;
+            self.palettes_end = self.palettes_end.max(offset + tileset.palette_size);
+        }
+
+        self.allocate(TILESET_STRUCT_SIZE);
+        self.counts[TILESETS] += 1;
+    }
+
+    /// Records the VRAM the placed character patterns span, gaps between tilesets included.
+    pub fn set_character_patterns(&mut self, size: u32) {
+        self.character_patterns = size;
+    }
+
+    pub fn add_layer(&mut self, layer: &SaturnLayer) {
+        let (page_count, page_size) = layer.page_usage();
+        for _ in 0..page_count {
+            self.pages = (self.pages + page_size - 1) & !(page_size - 1);
+            self.pages += page_size;
+        }
+        self.page_alignment = self.page_alignment.max(page_size);
+        self.page_count += page_count as u32;
+
+        self.allocate(LAYER_STRUCT_SIZE);
+        self.counts[LAYERS] += 1;
+    }
+
+    pub fn add_bitmap_layer(&mut self, bitmap_layer: &SaturnBitmapLayer) {
+        let (bitmap_size, palette_size) = bitmap_layer.vram_usage();
+        self.bitmaps.push(bitmap_size);
+        self.bitmap_palettes += palette_size;
+
+        self.allocate(BITMAP_LAYER_STRUCT_SIZE);
+        self.counts[BITMAP_LAYERS] += 1;
+    }
+
+    pub fn add_object_layer(&mut self, object_layer: &SaturnObjectLayer) {
+        self.sprite_commands += object_layer.command_table_size();
+
+        self.allocate(OBJECT_LAYER_STRUCT_SIZE);
+        self.counts[OBJECT_LAYERS] += 1;
+    }
+
+    pub fn add_sprite_atlas(&mut self, sprite_atlas: &SaturnSpriteAtlas) {
+        self.sprite_texture = sprite_atlas.texture_size();
+        self.allocate(SPRITE_ATLAS_STRUCT_SIZE);
+    }
+
+    pub fn add_collision_rects(&mut self, collision_rects: &SaturnCollisionRects) {
+        for _ in collision_rects.layers.iter() {
+            self.allocate(COLLISION_RECT_LAYER_STRUCT_SIZE);
+            self.counts[COLLISION_RECT_LAYERS] += 1;
+        }
+    }
+
+    pub fn add_collision_masks(&mut self) {
+        self.allocate(COLLISION_MASKS_STRUCT_SIZE);
+    }
+
+    /// The collisions structure, and one allocation holding a structure per stored collision if there are any.
+    pub fn add_collisions(&mut self, collisions: &SaturnCollisions) {
+        self.allocate(COLLISIONS_STRUCT_SIZE);
+        if collisions.collision_count() > 0 {
+            self.allocate(collisions.collision_count() * COLLISION_STRUCT_SIZE);
+        }
+    }
+
+    /// Records the size of the exported file, loaded whole into work RAM before it is parsed.
+    pub fn set_data_size(&mut self, data_size: u32) {
+        self.data_size = data_size;
+    }
+
+    /// The budget of a map built in memory.
+    pub fn for_map(saturn_map: &SaturnMap) -> Self {
+        let mut budget = SaturnBudget::default();
+        for tileset in saturn_map.tilesets.iter() {
+            budget.add_tileset(tileset);
+        }
+        budget.set_character_patterns(saturn_map.tilesets.iter().filter(|t| t.sprite_sheet.is_none())
+                                      .map(|t| t.character_offset + t.character_pattern_size).max().unwrap_or(0));
+        for layer in saturn_map.layers.iter() {
+            budget.add_layer(layer);
+        }
+        for bitmap_layer in saturn_map.bitmap_layers.iter() {
+            budget.add_bitmap_layer(bitmap_layer);
+        }
+        for object_layer in saturn_map.object_layers.iter() {
+            budget.add_object_layer(object_layer);
+        }
+        budget.add_sprite_atlas(&saturn_map.sprite_atlas);
+        budget.add_collision_rects(&saturn_map.collision_rects);
+        budget.add_collision_masks();
+        budget.add_collisions(&saturn_map.collisions);
+        budget.set_data_size(saturn_map.encoded_size());
+        return budget;
+    }
+
+    /// Heap taken by `tiled2saturn_parse`, and the number of allocations making it up.
+    fn parse_heap(&self) -> (u32, u32) {
+        let mut heap = self.heap + heap_chunk(MAP_STRUCT_SIZE) + heap_chunk(HEADER_STRUCT_SIZE);
+        for count in self.counts.iter() {
+            heap += heap_chunk(count * POINTER_SIZE);
+        }
+        heap += heap_chunk(self.page_count * PAGE_STRUCT_SIZE);
+        return (heap, self.allocations + 3 + self.counts.len() as u32);
+    }
+
+    /// Byte ranges of VDP2 VRAM in use, bitmaps first then character patterns and pages.
+    fn vram_ranges(&self) -> Vec<(&'static str, u32, u32)> {
+        let mut ranges: Vec<(&'static str, u32, u32)> = Vec::default();
+        let mut cursor: u32 = 0;
+
+        for bitmap in self.bitmaps.iter() {
+            cursor = (cursor + VDP2_BANK_SIZE - 1) & !(VDP2_BANK_SIZE - 1);
+            ranges.push(("bitmaps", cursor, *bitmap));
+            cursor += bitmap;
+        }
+
+        ranges.push(("character patterns", cursor, self.character_patterns));
+        cursor += self.character_patterns;
+
+        if self.page_alignment > 0 {
+            cursor = (cursor + self.page_alignment - 1) & !(self.page_alignment - 1);
+        }
+        ranges.push(("pages", cursor, self.pages));
+
+        return ranges;
+    }
+
+    fn vram_end(&self) -> u32 {
+        self.vram_ranges().iter().map(|(_, start, size)| start + size).max().unwrap_or(0)
+    }
+
+    fn cram_used(&self) -> u32 {
+        self.palettes_end + self.bitmap_palettes
+    }
+
+    fn vdp1_vram_used(&self) -> u32 {
+        self.sprite_texture + self.sprite_commands
+    }
+
+    fn wram_used(&self) -> u32 {
+        self.data_size + self.parse_heap().0
+    }
+
+    fn row(out: &mut String, name: &str, used: u32, limit: Option<u32>) {
+        match limit {
+            Some(limit) => out.push_str(&format!("  {:<24} {:>8} / {:>8} bytes ({:>5.1}%)\n", name, used, limit,
+                                                 used as f64 * 100.0 / limit.max(1) as f64)),
+            None => out.push_str(&format!("  {:<24} {:>8} bytes\n", name, used))
+        }
+    }
+
+    /// The budget table, usage against the limits that apply.
+    pub fn table(&self, limits: &BudgetLimits) -> String {
+        let mut out = String::from("Budget:\n");
+        let ranges = self.vram_ranges();
+
+        SaturnBudget::row(&mut out, "VDP2 VRAM", self.vram_end(), Some(limits.vram.unwrap_or(VDP2_VRAM_SIZE).min(VDP2_VRAM_SIZE)));
+        for name in ["bitmaps", "character patterns", "pages"] {
+            let used: u32 = ranges.iter().filter(|(n, _, _)| *n == name).map(|(_, _, size)| size).sum();
+            SaturnBudget::row(&mut out, &format!("  {}", name), used, None);
+        }
+        for (bank, bank_name) in VDP2_BANKS.iter().enumerate() {
+            let bank_start = bank as u32 * VDP2_BANK_SIZE;
+            let used: u32 = ranges.iter().map(|(_, start, size)| {
+                let end = (start + size).min(bank_start + VDP2_BANK_SIZE);
+                end.saturating_sub((*start).max(bank_start))
+            }).sum();
+            SaturnBudget::row(&mut out, &format!("  bank {}", bank_name), used, Some(VDP2_BANK_SIZE));
+        }
+
+        SaturnBudget::row(&mut out, "CRAM", self.cram_used(), Some(limits.cram.unwrap_or(CRAM_SIZE).min(CRAM_SIZE)));
+        SaturnBudget::row(&mut out, "  tileset palettes", self.palettes_end, None);
+        SaturnBudget::row(&mut out, "  bitmap palettes", self.bitmap_palettes, None);
+
+        SaturnBudget::row(&mut out, "VDP1 VRAM", self.vdp1_vram_used(), Some(limits.vdp1_vram.unwrap_or(VDP1_VRAM_SIZE).min(VDP1_VRAM_SIZE)));
+        SaturnBudget::row(&mut out, "  sprite atlas", self.sprite_texture, None);
+        SaturnBudget::row(&mut out, "  sprite commands", self.sprite_commands, None);
+
+        let (heap, allocations) = self.parse_heap();
+        SaturnBudget::row(&mut out, "WRAM", self.wram_used(), limits.wram);
+        SaturnBudget::row(&mut out, "  data.bin", self.data_size, None);
+        SaturnBudget::row(&mut out, &format!("  parse heap, {} allocs", allocations), heap, None);
+
+        return out;
+    }
+
+    /// Fails naming every budget the export goes over.
+    pub fn check(&self, limits: &BudgetLimits) -> Result<(), String> {
+        let budgets = [("VDP2 VRAM", self.vram_end(), limits.vram, Some(VDP2_VRAM_SIZE)),
+                       ("CRAM", self.cram_used(), limits.cram, Some(CRAM_SIZE)),
+                       ("VDP1 VRAM", self.vdp1_vram_used(), limits.vdp1_vram, Some(VDP1_VRAM_SIZE)),
+                       ("WRAM", self.wram_used(), limits.wram, None)];
+
+        let mut errors: Vec<String> = Vec::default();
+        for (name, used, limit, hardware) in budgets {
+            let limit = match (limit, hardware) {
+                (Some(limit), Some(hardware)) => limit.min(hardware),
+                (limit, hardware) => match limit.or(hardware) {
+                    Some(limit) => limit,
+                    None => continue
+                }
+            };
+            if used > limit {
+                errors.push(format!("{} needs {} bytes, over the limit of {} by {}", name, used, limit, used - limit));
+            }
+        }
+
+        if !errors.is_empty() {
+            return Err(format!("Export over budget: {}", errors.join(", ")));
+        }
+
+        return Ok(());
+    }
+}
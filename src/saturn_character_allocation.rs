@@ -0,0 +1,218 @@
+use std::cmp::Reverse;
+
+use crate::saturn_tileset::{SaturnTileset, SaturnTilesetInfo};
+
+// VDP2 character numbers count in 32 bytes, one 8x8 cell of 16 colors
+pub const CHARACTER_UNIT: u32 = 32;
+// Character numbers a 1 word pattern name reaches per cell of its tiles, the supplementary character bits of
+// the scroll screen pick the window, and the highest character number a 2 word one holds
+const ONE_WORD_WINDOW_UNITS: u32 = 0x400;
+const TWO_WORD_CHARACTER_LIMIT: u32 = 0x7fff;
+
+/// Character units taken by one tile of `tileset`, 1, 2 or 4 per 8x8 cell for 16, 256 and 2048 colors.
+pub fn tile_units(tileset: &SaturnTilesetInfo) -> u32 {
+    let cells = (tileset.tile_width / 8) * (tileset.tile_height / 8);
+    let cell_units = match tileset.bpp {
+        4 => 1,
+        8 => 2,
+        _ => 4
+    };
+    cells * cell_units
+}
+
+/// Bytes of VRAM a 1 word pattern name of `tileset` reaches, 32KB for 8x8 tiles and 128KB for 16x16 ones, 0 for
+/// 2 word pattern names which reach all of it.
+pub fn window_size(tileset: &SaturnTilesetInfo) -> u32 {
+    if tileset.words_per_palette != 1 {
+        return 0;
+    }
+    ONE_WORD_WINDOW_UNITS * (tileset.tile_width / 8) * (tileset.tile_height / 8) * CHARACTER_UNIT
+}
+
+/// Offset of the window holding `tileset` from the character pattern base, where the character pattern base of
+/// the scroll screen drawing it has to point so its supplementary character bits select the window.
+pub fn character_window(tileset: &SaturnTilesetInfo) -> u32 {
+    match window_size(tileset) {
+        0 => 0,
+        size => tileset.character_offset / size * size
+    }
+}
+
+/// The character number of `tile_id` as a pattern name stores it, counted from the character pattern base. 1 word pattern names of 16x16
+/// tiles leave out the lowest 2 bits, the VDP2 fills them in for the four cells of the tile, and only keep the
+/// low 10 bits, the number within the tileset's window.
+pub fn pattern_character(tileset: &SaturnTilesetInfo, tile_id: u32) -> u32 {
+    let number = tileset.character_offset / CHARACTER_UNIT + tile_id * tile_units(tileset);
+    if tileset.words_per_palette == 1 {
+        let number = if tileset.tile_width == 16 { number >> 2 } else { number };
+        return number & (ONE_WORD_WINDOW_UNITS - 1);
+    }
+    number
+}
+
+/// Where the character pattern of every tileset goes in VDP2 VRAM, as a byte offset from the character pattern
+/// base the application picks, so tilesets sharing VRAM are placed once for the whole map instead of back to
+/// back in map order.
+///
+/// Each tileset starts on a multiple of its tile size, so 256 and 2048 color characters and 16x16 tiles stay
+/// addressable. Tilesets using 1 word pattern names go first, then the 2 word ones. Within each group the
+/// largest alignment goes first, which leaves no gap between tilesets of the same group. The 10 bit character
+/// numbers of a 1 word tileset only reach a 32 or 128KB window, so a tileset that would cross into the next
+/// window starts at that window instead.
+#[derive(Debug, Default, PartialEq)]
+pub struct SaturnCharacterAllocation {
+    /// Tileset index and byte offset of each placed tileset, in VRAM order
+    placements: Vec<(usize, u32)>,
+    pub size: u32,
+    gaps: u32
+}
+
+impl SaturnCharacterAllocation {
+    /// Places every tileset but sprite sheets, writing its offset to `character_offset`, and checks every
+    /// tile fits the window of a 1 word pattern name or the character number of a 2 word one.
+    pub fn allocate(tilesets: &mut [SaturnTilesetInfo]) -> Result<Self, String> {
+        let mut order: Vec<usize> = (0..tilesets.len()).filter(|i| !tilesets[*i].sprite_sheet).collect();
+        order.sort_by_key(|i| (tilesets[*i].words_per_palette, Reverse(tile_units(&tilesets[*i]))));
+
+        let mut placements: Vec<(usize, u32)> = Vec::with_capacity(order.len());
+        let mut cursor: u32 = 0;
+        let mut gaps: u32 = 0;
+
+        for index in order {
+            let tileset = &mut tilesets[index];
+            let alignment = tile_units(tileset) * CHARACTER_UNIT;
+            let size = tileset.tile_count * alignment;
+            let mut offset = (cursor + alignment - 1) / alignment * alignment;
+
+            let window = window_size(tileset);
+            if window > 0 {
+                if size > window {
+                    return Err(format!("Tileset {} takes {:#x} bytes, past the {:#x} a 1 word pattern name reaches, use pnd_size 2 or fewer tiles",
+                                       index, size, window));
+                }
+                if size > 0 && offset / window != (offset + size - 1) / window {
+                    offset = (offset / window + 1) * window;
+                }
+            }
+
+            gaps += offset - cursor;
+            tileset.character_offset = offset;
+            cursor = offset + size;
+
+            if window == 0 {
+                let last = pattern_character(tileset, tileset.tile_count.saturating_sub(1));
+                if last > TWO_WORD_CHARACTER_LIMIT {
+                    return Err(format!("Tileset {} reaches character number {:#x}, past the {:#x} a 2 word pattern name holds",
+                                       index, last, TWO_WORD_CHARACTER_LIMIT));
+                }
+            }
+
+            placements.push((index, offset));
+        }
+
+        return Ok(SaturnCharacterAllocation { placements, size: cursor, gaps });
+    }
+
+    /// Allocates `tilesets` and sets their `character_offset`, returning the infos their layers are encoded against.
+    pub fn place(tilesets: &mut [SaturnTileset]) -> Result<(Self, Vec<SaturnTilesetInfo>), String> {
+        let mut infos: Vec<SaturnTilesetInfo> = tilesets.iter().map(|t| t.info()).collect();
+        let allocation = SaturnCharacterAllocation::allocate(&mut infos)?;
+        for (tileset, info) in tilesets.iter_mut().zip(infos.iter()) {
+            tileset.character_offset = info.character_offset;
+        }
+        return Ok((allocation, infos));
+    }
+
+    /// The offset of each tileset, only worth printing once tilesets stop following map order.
+    pub fn report(&self) -> Option<String> {
+        if self.gaps == 0 && self.placements.windows(2).all(|p| p[0].0 < p[1].0) {
+            return None;
+        }
+
+        let placements: Vec<String> = self.placements.iter().map(|(index, offset)| format!("tileset {} at {:#07x}", index, offset)).collect();
+        return Some(format!("Character patterns: {}, {} bytes with {} bytes of gaps", placements.join(", "), self.size, self.gaps));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn tileset(tile_size: u32, bpp: u16, words_per_palette: u8, tile_count: u32) -> SaturnTilesetInfo {
+        SaturnTilesetInfo { tile_width: tile_size, tile_height: tile_size, tile_count, bpp, words_per_palette, palette_bank: 0,
+                            character_offset: 0, sprite_sheet: false }
+    }
+
+    #[test]
+    fn window_is_32kb_for_8x8_and_128kb_for_16x16_tiles() {
+        assert_eq!(window_size(&tileset(8, 4, 1, 1)), 0x8000);
+        assert_eq!(window_size(&tileset(8, 8, 1, 1)), 0x8000);
+        assert_eq!(window_size(&tileset(16, 4, 1, 1)), 0x20000);
+        assert_eq!(window_size(&tileset(16, 4, 2, 1)), 0);
+    }
+
+    #[test]
+    fn tileset_of_8x8_tiles_crossing_32kb_moves_to_the_next_window() {
+        // 12800 bytes of 256 color tiles, then 22400 bytes of 16 color tiles that would end past 0x8000
+        let mut tilesets = vec![tileset(8, 4, 1, 700), tileset(8, 8, 1, 200)];
+        let allocation = SaturnCharacterAllocation::allocate(&mut tilesets).unwrap();
+
+        assert_eq!(tilesets[1].character_offset, 0);
+        assert_eq!(tilesets[0].character_offset, 0x8000);
+        assert_eq!(allocation.size, 0x8000 + 22400);
+        assert_eq!(allocation.gaps, 0x8000 - 12800);
+        assert_eq!(character_window(&tilesets[0]), 0x8000);
+        assert_eq!(character_window(&tilesets[1]), 0);
+
+        // Character numbers are 10 bits within the window, 0x400 + 5 is stored as 5
+        assert_eq!(pattern_character(&tilesets[0], 5), 5);
+        assert_eq!(pattern_character(&tilesets[1], 100), 200);
+        assert!(allocation.report().is_some());
+    }
+
+    #[test]
+    fn tileset_of_16x16_tiles_crossing_128kb_moves_to_the_next_window() {
+        // 76800 bytes of 256 color tiles, then 64000 bytes of 16 color tiles that would end past 0x20000
+        let mut tilesets = vec![tileset(16, 8, 1, 300), tileset(16, 4, 1, 500)];
+        let allocation = SaturnCharacterAllocation::allocate(&mut tilesets).unwrap();
+
+        assert_eq!(tilesets[0].character_offset, 0);
+        assert_eq!(tilesets[1].character_offset, 0x20000);
+        assert_eq!(allocation.size, 0x20000 + 64000);
+        assert_eq!(character_window(&tilesets[1]), 0x20000);
+
+        // 16x16 numbers leave out the lowest 2 bits: (0x1000 + 3 * 4) >> 2 & 0x3ff
+        assert_eq!(pattern_character(&tilesets[1], 3), 3);
+        assert_eq!(pattern_character(&tilesets[1], 255), 255);
+        assert_eq!(pattern_character(&tilesets[0], 10), 20);
+    }
+
+    #[test]
+    fn tileset_larger_than_its_window_is_an_error() {
+        assert!(SaturnCharacterAllocation::allocate(&mut [tileset(8, 4, 1, 1024)]).is_ok());
+        assert!(SaturnCharacterAllocation::allocate(&mut [tileset(8, 4, 1, 1025)]).is_err());
+        assert!(SaturnCharacterAllocation::allocate(&mut [tileset(16, 4, 1, 1025)]).is_err());
+    }
+
+    #[test]
+    fn two_word_character_number_overflow_is_an_error() {
+        assert!(SaturnCharacterAllocation::allocate(&mut [tileset(8, 8, 2, 0x4000)]).is_ok());
+        assert!(SaturnCharacterAllocation::allocate(&mut [tileset(8, 8, 2, 0x4001)]).is_err());
+        // A tileset that fits alone overflows once placed after another
+        assert!(SaturnCharacterAllocation::allocate(&mut [tileset(8, 4, 2, 0x7000), tileset(8, 4, 2, 0x1001)]).is_err());
+    }
+
+    #[test]
+    fn two_word_tilesets_follow_one_word_ones_and_keep_full_numbers() {
+        let mut tilesets = vec![tileset(8, 4, 2, 64), tileset(16, 4, 1, 16)];
+        tilesets.push(SaturnTilesetInfo { sprite_sheet: true, ..tileset(8, 4, 1, 4) });
+        let allocation = SaturnCharacterAllocation::allocate(&mut tilesets).unwrap();
+
+        assert_eq!(tilesets[1].character_offset, 0);
+        assert_eq!(tilesets[0].character_offset, 16 * 128);
+        assert_eq!(allocation.size, 16 * 128 + 64 * 32);
+        assert_eq!(allocation.placements, vec![(1, 0), (0, 16 * 128)]);
+        assert_eq!(pattern_character(&tilesets[0], 63), 64 + 63);
+        assert_eq!(character_window(&tilesets[0]), 0);
+    }
+}
@@ -0,0 +1,177 @@
+use std::collections::HashMap;
+use std::io::{self, Write};
+
+use tiled::{Map, PropertyValue, Tile};
+
+use crate::saturn_layer::TileBounds;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
+
+// masks_size, class_count and mask_size, followed by the class names and the masks
+const MASKS_HEADER_SIZE: u32 = 6;
+// Bits in the widest mask
+const MAX_CLASSES: usize = 32;
+
+fn collision_class(value: Option<&PropertyValue>) -> Result<Option<&str>, String> {
+    match value {
+        None => Ok(None),
+        Some(PropertyValue::StringValue(c)) if !c.is_empty() => Ok(Some(c.as_str())),
+        _ => Err(String::from("Invalid collision_class"))
+    }
+}
+
+/// The collision class a tile gives its cell, its own `collision_class` property or, if it has a collision shape,
+/// `layer_class`.
+pub(crate) fn tile_collision_class<'a>(tile: &'a Tile, layer_class: &'a str) -> Result<Option<&'a str>, String> {
+    return match collision_class(tile.properties.get("collision_class"))? {
+        Some(class) => Ok(Some(class)),
+        None if tile.collision.as_ref().map_or(false, |c| !c.object_data().is_empty()) => Ok(Some(layer_class)),
+        None => Ok(None)
+    };
+}
+
+/// A bitmask per map cell with a bit for each collision class present there, so "solid", "water" and "ladder"
+/// layers can overlap without one hiding another.
+///
+/// A tile's `collision_class` property gives its class, otherwise a tile with a collision shape takes the class of
+/// its layer, the layer's own `collision_class` property or its name. Classes are numbered from bit 0 in the order
+/// they are first found, and masks are 1, 2 or 4 bytes, the smallest holding every class.
+#[derive(Debug, Default, PartialEq)]
+pub struct SaturnCollisionMasks {
+    classes: Vec<String>,
+    mask_size: u8,
+    masks: Vec<u32>,
+    pub masks_size: u32
+}
+
+impl SaturnCollisionMasks {
+    pub fn build(map: &Map, bounds: &TileBounds) -> Result<Self, String> {
+        let mut classes: Vec<String> = Vec::default();
+        let mut bits: HashMap<String, u32> = HashMap::default();
+        let mut masks: Vec<u32> = vec![0; (bounds.width * bounds.height) as usize];
+
+        let mut bit_for = |name: &str| -> Result<u32, String> {
+            if let Some(bit) = bits.get(name) {
+                return Ok(*bit);
+            }
+            if classes.len() == MAX_CLASSES {
+                return Err(format!("Collision class {} is over the limit of {} classes", name, MAX_CLASSES));
+            }
+            let bit = 1 << classes.len();
+            classes.push(String::from(name));
+            bits.insert(String::from(name), bit);
+            Ok(bit)
+        };
+
+        for layer in map.layers() {
+            let tile_layer = match layer.layer_type() {
+                tiled::LayerType::Tiles(tile_layer) => tile_layer,
+                _ => continue
+            };
+            let layer_class = collision_class(layer.properties.get("collision_class"))?.unwrap_or(layer.name.as_str());
+
+            for y in 0..bounds.height {
+                for x in 0..bounds.width {
+                    let tile = match tile_layer.get_tile(bounds.origin_x + x as i32, bounds.origin_y + y as i32).and_then(|t| t.get_tile()) {
+                        Some(tile) => tile,
+                        None => continue
+                    };
+
+                    let class = match tile_collision_class(&tile, layer_class)? {
+                        Some(class) => class,
+                        None => continue
+                    };
+
+                    masks[(y * bounds.width + x) as usize] |= bit_for(class)?;
+                }
+            }
+        }
+
+        return SaturnCollisionMasks::from_masks(classes, masks);
+    }
+
+    /// Packs `masks`, a mask per cell with bit n set for `classes[n]`, into the smallest mask size holding them.
+    fn from_masks(classes: Vec<String>, mut masks: Vec<u32>) -> Result<Self, String> {
+        let mask_size: u8 = match classes.len() {
+            0 => 0,
+            1..=8 => 1,
+            9..=16 => 2,
+            _ => 4
+        };
+        if mask_size == 0 {
+            masks.clear();
+        }
+
+        let names_size: u32 = classes.iter().map(|c| 1 + c.len() as u32).sum();
+        let masks_size = MASKS_HEADER_SIZE + names_size + masks.len() as u32 * mask_size as u32;
+
+        for class in classes.iter() {
+            u8::try_from(class.len()).map_err(|_| format!("Collision class {} is longer than 255 bytes", class))?;
+        }
+
+        return Ok(SaturnCollisionMasks { classes, mask_size, masks, masks_size });
+    }
+
+    /// The bit of each class and the size of the packed grid.
+    pub fn report(&self) -> Option<String> {
+        if self.classes.is_empty() {
+            return None;
+        }
+
+        let classes: Vec<String> = self.classes.iter().enumerate().map(|(bit, class)| format!("{} bit {}", class, bit)).collect();
+        return Some(format!("Collision classes: {}, {} bytes per cell, {} byte grid", classes.join(", "), self.mask_size,
+                            self.masks.len() as u32 * self.mask_size as u32));
+    }
+}
+
+impl SaturnWrite for SaturnCollisionMasks {
+    fn encoded_size(&self) -> u32 {
+        self.masks_size
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.masks_size)?;
+        write_u8(out, self.classes.len() as u8)?;
+        write_u8(out, self.mask_size)?;
+        for class in self.classes.iter() {
+            write_u8(out, class.len() as u8)?;
+            out.write_all(class.as_bytes())?;
+        }
+        for mask in self.masks.iter() {
+            match self.mask_size {
+                1 => write_u8(out, *mask as u8)?,
+                2 => write_u16(out, *mask as u16)?,
+                _ => write_u32(out, *mask)?
+            }
+        }
+        return Ok(());
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// Solid and water classes over a 2x2 cell map.
+    pub(crate) fn sample_collision_masks() -> SaturnCollisionMasks {
+        SaturnCollisionMasks::from_masks(vec![String::from("solid"), String::from("water")], vec![1, 0, 2, 3]).unwrap()
+    }
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let collision_masks = sample_collision_masks();
+        let bytes = encode(&collision_masks);
+        assert_eq!(read_u32(&bytes, 0), collision_masks.masks_size);
+        assert_eq!(&bytes[bytes.len() - 4..], [1, 0, 2, 3]);
+    }
+
+    #[test]
+    fn mask_size_holds_every_class() {
+        for (class_count, mask_size) in [(0, 0), (8, 1), (9, 2), (16, 2), (17, 4), (32, 4)] {
+            let classes: Vec<String> = (0..class_count).map(|c| format!("class{}", c)).collect();
+            let collision_masks = SaturnCollisionMasks::from_masks(classes, vec![1; 6]).unwrap();
+            assert_eq!(collision_masks.mask_size, mask_size);
+            encode(&collision_masks);
+        }
+    }
+}
@@ -0,0 +1,281 @@
+use std::collections::HashMap;
+use std::io::{self, Write};
+
+use tiled::{Map, PropertyValue, TileLayer};
+
+use crate::saturn_collisions::SaturnCollision;
+use crate::saturn_layer::TileBounds;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
+
+// id, layer_size, region_width .. region_rows, rect_count and index_count, followed by the rects and the grid
+const RECT_LAYER_HEADER_SIZE: u32 = 22;
+// x, y, width and height
+const RECT_SIZE: u32 = 16;
+// Tiles along each side of a grid region when the map has no collision_region property
+const DEFAULT_REGION_TILES: u32 = 8;
+
+/// An axis aligned box in pixels from the top left of the exported map, 32 bit so maps of any size merge.
+#[derive(Debug, PartialEq, Clone, Copy)]
+pub struct SaturnRect {
+    pub x: u32,
+    pub y: u32,
+    pub width: u32,
+    pub height: u32
+}
+
+/// The solid cells of one tile layer merged into as few rects as the greedy pass finds, with a coarse grid
+/// listing the rects overlapping each region so a broad phase only tests the rects near what it moves.
+///
+/// The grid is stored compressed, `region_starts` holds where each region's list starts in `region_rects`, with
+/// one more entry for the end of the last.
+#[derive(Debug, PartialEq)]
+pub struct SaturnCollisionRectLayer {
+    id: u32,
+    pub layer_size: u32,
+    solid_cells: u32,
+    region_width: u16,
+    region_height: u16,
+    region_columns: u16,
+    region_rows: u16,
+    rects: Vec<SaturnRect>,
+    region_starts: Vec<u32>,
+    region_rects: Vec<u16>
+}
+
+impl SaturnCollisionRectLayer {
+    /// Merges the collision rects of every cell in `bounds`. Cells are first joined along each row into runs
+    /// sharing the same top and height, then runs are joined downwards into the rect ending on the row above
+    /// with the same left and width. A 40 tile floor becomes one rect, as does a solid block of any size.
+    fn merge(tile_layer: &TileLayer, bounds: &TileBounds, tile_width: u32, tile_height: u32) -> Result<(Vec<SaturnRect>, u32), String> {
+        let mut rects: Vec<SaturnRect> = Vec::default();
+        let mut solid_cells: u32 = 0;
+        // The rect each left, width and bottom edge can still be extended downwards from
+        let mut open: HashMap<(u32, u32, u32), usize> = HashMap::default();
+
+        for y in 0..bounds.height {
+            let mut runs: Vec<SaturnRect> = Vec::default();
+            for x in 0..bounds.width {
+                let cell = match SaturnCollision::tile_rect(tile_layer, bounds.origin_x + x as i32, bounds.origin_y + y as i32) {
+                    Some(cell) if cell.2 > 0 && cell.3 > 0 => cell,
+                    _ => continue
+                };
+                solid_cells += 1;
+
+                let rect = SaturnRect { x: x * tile_width + cell.0 as u32, y: y * tile_height + cell.1 as u32, width: cell.2 as u32, height: cell.3 as u32 };
+
+                match runs.last_mut() {
+                    Some(run) if run.y == rect.y && run.height == rect.height && run.x + run.width == rect.x => run.width += rect.width,
+                    _ => runs.push(rect)
+                }
+            }
+
+            for run in runs {
+                match open.remove(&(run.x, run.width, run.y)) {
+                    Some(index) => {
+                        rects[index].height += run.height;
+                        open.insert((run.x, run.width, run.y + run.height), index);
+                    },
+                    None => {
+                        open.insert((run.x, run.width, run.y + run.height), rects.len());
+                        rects.push(run);
+                    }
+                }
+            }
+        }
+
+        if rects.len() > u16::MAX as usize {
+            return Err(format!("{} collision rects, more than the {} a layer can hold", rects.len(), u16::MAX));
+        }
+
+        return Ok((rects, solid_cells));
+    }
+
+    fn build_one(id: u32, tile_layer: &TileLayer, bounds: &TileBounds, tile_width: u32, tile_height: u32, region_tiles: u32) -> Result<Option<Self>, String> {
+        let (rects, solid_cells) = SaturnCollisionRectLayer::merge(tile_layer, bounds, tile_width, tile_height)?;
+        if rects.is_empty() {
+            return Ok(None);
+        }
+
+        return SaturnCollisionRectLayer::from_rects(id, rects, solid_cells, bounds, tile_width, tile_height, region_tiles).map(Some);
+    }
+
+    /// Builds the region grid of `rects`, merged from `solid_cells` cells of `bounds`.
+    fn from_rects(id: u32, rects: Vec<SaturnRect>, solid_cells: u32, bounds: &TileBounds, tile_width: u32, tile_height: u32,
+                  region_tiles: u32) -> Result<Self, String> {
+        let region_width = u16::try_from(region_tiles * tile_width).map_err(|e| format!("Invalid collision_region {:?}", e))?;
+        let region_height = u16::try_from(region_tiles * tile_height).map_err(|e| format!("Invalid collision_region {:?}", e))?;
+        let region_columns = u16::try_from(bounds.width.div_ceil(region_tiles)).map_err(|e| e.to_string())?;
+        let region_rows = u16::try_from(bounds.height.div_ceil(region_tiles)).map_err(|e| e.to_string())?;
+
+        let mut regions: Vec<Vec<u16>> = vec![Vec::default(); region_columns as usize * region_rows as usize];
+        for (index, rect) in rects.iter().enumerate() {
+            // Shapes can reach outside their tile, rects past the edge of the map are kept in its last region
+            let last_column = region_columns - 1;
+            let last_row = region_rows - 1;
+            let columns = (rect.x / region_width as u32).min(last_column as u32)..=((rect.x + rect.width - 1) / region_width as u32).min(last_column as u32);
+            let rows = (rect.y / region_height as u32).min(last_row as u32)..=((rect.y + rect.height - 1) / region_height as u32).min(last_row as u32);
+            for row in rows {
+                for column in columns.clone() {
+                    regions[row as usize * region_columns as usize + column as usize].push(index as u16);
+                }
+            }
+        }
+
+        let mut region_starts: Vec<u32> = Vec::with_capacity(regions.len() + 1);
+        let mut region_rects: Vec<u16> = Vec::default();
+        for region in regions {
+            region_starts.push(region_rects.len() as u32);
+            region_rects.extend(region);
+        }
+        region_starts.push(region_rects.len() as u32);
+
+        let layer_size = RECT_LAYER_HEADER_SIZE + rects.len() as u32 * RECT_SIZE + region_starts.len() as u32 * 4 + region_rects.len() as u32 * 2;
+
+        return Ok(SaturnCollisionRectLayer {
+            id,
+            layer_size,
+            solid_cells,
+            region_width,
+            region_height,
+            region_columns,
+            region_rows,
+            rects,
+            region_starts,
+            region_rects
+        });
+    }
+}
+
+impl SaturnWrite for SaturnCollisionRectLayer {
+    fn encoded_size(&self) -> u32 {
+        self.layer_size
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.id)?;
+        write_u32(out, self.layer_size)?;
+        write_u16(out, self.region_width)?;
+        write_u16(out, self.region_height)?;
+        write_u16(out, self.region_columns)?;
+        write_u16(out, self.region_rows)?;
+        write_u16(out, self.rects.len() as u16)?;
+        write_u32(out, self.region_rects.len() as u32)?;
+        for rect in self.rects.iter() {
+            write_u32(out, rect.x)?;
+            write_u32(out, rect.y)?;
+            write_u32(out, rect.width)?;
+            write_u32(out, rect.height)?;
+        }
+        for start in self.region_starts.iter() {
+            write_u32(out, *start)?;
+        }
+        for index in self.region_rects.iter() {
+            write_u16(out, *index)?;
+        }
+        return Ok(());
+    }
+}
+
+/// The merged collision rects of every tile layer with a solid cell, in map order.
+#[derive(Debug, Default, PartialEq)]
+pub struct SaturnCollisionRects {
+    pub(crate) layers: Vec<SaturnCollisionRectLayer>,
+    pub rects_size: u32
+}
+
+impl SaturnCollisionRects {
+    /// Tiles along each side of a grid region from the optional `collision_region` map property.
+    fn get_region_tiles(map: &Map) -> Result<u32, String> {
+        let region_tiles: u32 = match map.properties.get("collision_region") {
+            None => DEFAULT_REGION_TILES,
+            Some(PropertyValue::IntValue(s)) => u32::try_from(*s).map_err(|e| format!("Invalid collision_region {:?}", e))?,
+            Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid collision_region {:?}", e))?,
+            _ => Err("Invalid collision_region")?
+        };
+
+        if region_tiles == 0 {
+            return Err(String::from("collision_region must be at least 1 tile"));
+        }
+
+        Ok(region_tiles)
+    }
+
+    pub fn build(map: &Map, bounds: &TileBounds) -> Result<Self, String> {
+        let region_tiles = SaturnCollisionRects::get_region_tiles(map)?;
+
+        let mut layers: Vec<SaturnCollisionRectLayer> = Vec::default();
+        for layer in map.layers() {
+            if let tiled::LayerType::Tiles(tile_layer) = layer.layer_type() {
+                if let Some(rect_layer) = SaturnCollisionRectLayer::build_one(layer.id(), &tile_layer, bounds, map.tile_width, map.tile_height, region_tiles)? {
+                    layers.push(rect_layer);
+                }
+            }
+        }
+
+        return SaturnCollisionRects::from_layers(layers);
+    }
+
+    fn from_layers(layers: Vec<SaturnCollisionRectLayer>) -> Result<Self, String> {
+        u8::try_from(layers.len()).map_err(|e| e.to_string())?;
+        let rects_size = 1 + layers.iter().map(|l| l.layer_size).sum::<u32>();
+
+        return Ok(SaturnCollisionRects { layers, rects_size });
+    }
+
+    /// One line per layer comparing the solid cells to the rects they merged into.
+    pub fn report(&self) -> Option<String> {
+        if self.layers.is_empty() {
+            return None;
+        }
+
+        let lines: Vec<String> = self.layers.iter().map(|l| format!("Collision rects: layer {} merged {} solid cells into {} rects, {}x{} regions of {}x{} pixels",
+                                                                      l.id, l.solid_cells, l.rects.len(), l.region_columns, l.region_rows,
+                                                                      l.region_width, l.region_height)).collect();
+        return Some(lines.join("\n"));
+    }
+}
+
+impl SaturnWrite for SaturnCollisionRects {
+    fn encoded_size(&self) -> u32 {
+        self.rects_size
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u8(out, self.layers.len() as u8)?;
+        for layer in self.layers.iter() {
+            layer.write_to(out)?;
+        }
+        return Ok(());
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// A floor and a block on a 16x16 cell map of 8x8 tiles, in 8x8 tile regions.
+    pub(crate) fn sample_collision_rects() -> SaturnCollisionRects {
+        let bounds = TileBounds { origin_x: 0, origin_y: 0, width: 16, height: 16 };
+        let rects = vec![SaturnRect { x: 0, y: 120, width: 128, height: 8 }, SaturnRect { x: 56, y: 56, width: 16, height: 16 }];
+        let layer = SaturnCollisionRectLayer::from_rects(4, rects, 20, &bounds, 8, 8, 8).unwrap();
+        return SaturnCollisionRects::from_layers(vec![layer]).unwrap();
+    }
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let collision_rects = sample_collision_rects();
+        let bytes = encode(&collision_rects);
+        assert_eq!(bytes[0], 1);
+        assert_eq!(read_u32(&bytes, 5), collision_rects.layers[0].layer_size);
+        assert_eq!(encode(&collision_rects.layers[0]).len() as u32, collision_rects.layers[0].layer_size);
+    }
+
+    #[test]
+    fn rects_are_listed_in_every_region_they_overlap() {
+        let collision_rects = sample_collision_rects();
+        let layer = &collision_rects.layers[0];
+        assert_eq!(layer.region_starts, vec![0, 1, 2, 4, 6]);
+        assert_eq!(layer.region_rects, vec![1, 1, 0, 1, 0, 1]);
+    }
+}
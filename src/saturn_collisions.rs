@@ -1,9 +1,25 @@
-use deku::prelude::*;
-use tiled::{Layer, TileLayer};
+use std::io::{self, Write};
+
+use tiled::{Map, TileLayer};
+
+use crate::saturn_collision_masks::tile_collision_class;
+use crate::saturn_layer::TileBounds;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
+
+// collisions_size, chunk_tiles, tile_width, tile_height, chunk_columns, chunk_rows, chunk_count and
+// collision_count, followed by the chunk grid, the chunk table and the collisions
+const COLLISIONS_HEADER_SIZE: u32 = 19;
+// first_collision, collision_count and offset of a chunk
+const CHUNK_ENTRY_SIZE: u32 = 12;
+// cell, collision_type and points_count, followed by the points
+const COLLISION_HEADER_SIZE: u32 = 3;
+// Tiles along each side of a chunk, so a cell's position within its chunk fits a byte
+const CHUNK_TILES: u32 = 16;
+// Chunk grid entry of a chunk without any collision
+const EMPTY_CHUNK: u16 = 0xffff;
 
 #[repr(u8)]
-#[derive(Debug, PartialEq, DekuWrite, Clone)]
-#[deku(type = "u8", endian = "endian", ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+#[derive(Debug, PartialEq, Clone, Copy)]
 enum CollisionType{
     Empty = 0,
     Rect = 1,
@@ -11,85 +27,277 @@ enum CollisionType{
 }
 
 #[repr(C)]
-#[derive(Debug, PartialEq, DekuWrite, Clone)]
-#[deku(endian = "endian", ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+#[derive(Debug, PartialEq, Clone)]
 pub struct SaturnCollision {
+    cell: u8,
     collision_type: CollisionType,
-    #[deku(update = "self.to_bytes().unwrap().len()")]
-    collision_size: u32,
-    points_count:u32,
     points:Vec<(u8, u8)>
 }
 
-impl SaturnCollision { 
+impl SaturnCollision {
 
-    fn new(collision_type: CollisionType, points: Vec<(u8, u8)>) -> Result<Self, String> {
-        let count = points.len() as u32;
+    fn new(cell: u8, collision_type: CollisionType, points: Vec<(u8, u8)>) -> Result<Self, String> {
+        u8::try_from(points.len()).map_err(|_| format!("Collision shape with {} points, more than 255", points.len()))?;
         Ok(SaturnCollision {
+            cell,
             collision_type,
-            collision_size: Default::default(),
-            points_count: count,
             points,
         })
     }
 
-    pub fn build<'a>(map_width:u32, map_height:u32, layers: impl ExactSizeIterator<Item = Layer<'a>>) -> Result<Vec<Self>, String> {
-        let mut empty = SaturnCollision::new( CollisionType::Empty, Vec::default())?;
-        empty.update().map_err(|op| op.to_string())?; 
-        
-        let mut results: Vec<SaturnCollision> = vec![empty; (map_width * map_height) as usize];
+    /// Number of points in the collision's shape.
+    pub fn point_count(&self) -> u32 {
+        self.points.len() as u32
+    }
+
+    /// The last rect shape in the collision of the tile at `x`, `y`, as its left, top, width and height in pixels
+    /// from the tile's top left.
+    pub(crate) fn tile_rect(tile_layer: &TileLayer, x: i32, y: i32) -> Option<(u8, u8, u8, u8)> {
+        let mut result: Option<(u8, u8, u8, u8)> = None;
 
-        let tile_layers: Vec<(u32, TileLayer)> = layers.filter_map(|layer| match layer.layer_type() {
-            tiled::LayerType::Tiles(tile_layer) => Some((layer.id(), tile_layer)),
+        let layer_tile = tile_layer.get_tile(x, y);
+        let tile = layer_tile.map(|f| f.get_tile()).flatten();
+        if tile.is_some() {
+            let object_layer_tile = &tile.unwrap().collision;
+            if object_layer_tile.is_some() {
+                let od = object_layer_tile.clone().unwrap();
+                let obj_d = od.object_data().into_iter();
+
+                for object_data in obj_d {
+                    let rect = match object_data.shape {
+                        tiled::ObjectShape::Rect{ width, height} => Some((width, height)),
+                        _ => None
+                    };
+
+                    if rect.is_some() {
+                        let (width, height) = rect.unwrap();
+                        result = Some((object_data.x.round() as u8, object_data.y.round() as u8, width.round() as u8, height.round() as u8));
+                    }
+                }
+            }
+        }
+
+        return result;
+    }
+
+    fn for_rect(cell: u8, (x_narrow, y_narrow, width_narrow, height_narrow): (u8, u8, u8, u8)) -> Result<Self, String> {
+        let points = vec![(x_narrow, y_narrow),
+                                         (width_narrow, y_narrow),
+                                         (width_narrow, height_narrow),
+                                         (x_narrow, height_narrow)];
+
+        return SaturnCollision::new(cell, CollisionType::Rect, points);
+    }
+}
+
+impl SaturnWrite for SaturnCollision {
+    fn encoded_size(&self) -> u32 {
+        COLLISION_HEADER_SIZE + self.points.len() as u32 * 2
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u8(out, self.cell)?;
+        write_u8(out, self.collision_type as u8)?;
+        write_u8(out, self.points.len() as u8)?;
+        for (x, y) in self.points.iter() {
+            out.write_all(&[*x, *y])?;
+        }
+        return Ok(());
+    }
+}
+
+/// The collisions of one chunk of 16x16 cells, in row major order of their cell within the chunk.
+#[derive(Debug, PartialEq)]
+struct SaturnCollisionChunk {
+    first_collision: u32,
+    offset: u32,
+    collisions: Vec<SaturnCollision>
+}
+
+/// The collision shape of every cell that has one, for narrow phase tests the merged rects and the class masks
+/// can't answer.
+///
+/// Cells are grouped into chunks of 16x16, and only chunks holding a collision are stored, so the section and the
+/// structures `tiled2saturn_parse` builds from it grow with the collisions rather than with the map's bounding
+/// box. A grid with a 16 bit entry per chunk points into a table giving each stored chunk's first collision and
+/// where its records start, which is also what lets the parse split chunks between CPUs without reading the
+/// records first.
+///
+/// Shapes filling their tile, most of them, are left out: a cell with a collision class and no stored collision
+/// is a full tile rect, which `tiled2saturn_collision_get` rebuilds from the masks. A cell with a class but no rect
+/// shape, from a `collision_class` property or a shape other than a rect, stores an empty collision instead.
+#[derive(Debug, PartialEq)]
+pub struct SaturnCollisions {
+    tile_width: u8,
+    tile_height: u8,
+    chunk_columns: u16,
+    chunk_rows: u16,
+    chunk_grid: Vec<u16>,
+    chunks: Vec<SaturnCollisionChunk>,
+    collision_count: u32,
+    point_count: u32,
+    pub collisions_size: u32
+}
+
+impl SaturnCollisions {
+    /// Builds the collisions over `bounds`. A later layer's shape replaces an earlier layer's shape at the same cell.
+    pub fn build(map: &Map, bounds: &TileBounds) -> Result<Self, String> {
+        let tile_layers: Vec<TileLayer> = map.layers().filter_map(|layer| match layer.layer_type() {
+            tiled::LayerType::Tiles(tile_layer) => Some(tile_layer),
             _ => None,
         }).collect();
 
-        for tile_packed in tile_layers.iter() {
-            let layer_id = tile_packed.0;
-            let tile_layer = &tile_packed.1;
-            let width = tile_layer.width().ok_or(format!("Unable to get width for layer {}", layer_id))?;
-            let height = tile_layer.height().ok_or(format!("Unable to get height for layer {}", layer_id))?;
-
-            for y in 0..height {
-                for x in 0..width {
-                    let layer_tile = tile_layer.get_tile(x as i32,y as i32);
-                    let tile = layer_tile.map(|f| f.get_tile()).flatten();
-                    if tile.is_some() {
-                        let object_layer_tile = &tile.unwrap().collision;
-                        if object_layer_tile.is_some() {
-                            let od = object_layer_tile.clone().unwrap();
-                            let obj_d = od.object_data().into_iter();
-                            
-                            for object_data in obj_d {
-                                let rect = match object_data.shape {
-                                    tiled::ObjectShape::Rect{ width, height} => Some((width, height)),
-                                    _ => None
-                                };
-                                
-                                if rect.is_some() {
-                                    let (width, height) = rect.unwrap();
-                                    let width_narrow = width.round() as u8;
-                                    let height_narrow = height.round() as u8;
-                                    let x_narrow = object_data.x.round() as u8;
-                                    let y_narrow = object_data.y.round() as u8;
-                                    let points = vec![(x_narrow, y_narrow),
-                                                                     (width_narrow, y_narrow), 
-                                                                     (width_narrow, height_narrow), 
-                                                                     (x_narrow, height_narrow)];
-                                    
-                                    let mut solid = SaturnCollision::new(CollisionType::Rect, points)?;
-                            
-                                    solid.update().map_err(|op| op.to_string())?;
-                                    results[((map_width*(y))+(x)) as usize] = solid;
-                                }
-                            }
-                        }
+        let chunk_columns = u16::try_from(bounds.width.div_ceil(CHUNK_TILES)).map_err(|e| e.to_string())?;
+        let chunk_rows = u16::try_from(bounds.height.div_ceil(CHUNK_TILES)).map_err(|e| e.to_string())?;
+
+        let mut chunks: Vec<(usize, Vec<SaturnCollision>)> = Vec::default();
+        let full_tile = (0, 0, map.tile_width as u8, map.tile_height as u8);
 
+        for chunk_y in 0..chunk_rows as u32 {
+            for chunk_x in 0..chunk_columns as u32 {
+                let mut collisions: Vec<SaturnCollision> = Vec::default();
+
+                for cell_y in 0..CHUNK_TILES.min(bounds.height - chunk_y * CHUNK_TILES) {
+                    for cell_x in 0..CHUNK_TILES.min(bounds.width - chunk_x * CHUNK_TILES) {
+                        let x = bounds.origin_x + (chunk_x * CHUNK_TILES + cell_x) as i32;
+                        let y = bounds.origin_y + (chunk_y * CHUNK_TILES + cell_y) as i32;
+                        let cell = (cell_y * CHUNK_TILES + cell_x) as u8;
+                        let collision = match tile_layers.iter().filter_map(|tile_layer| SaturnCollision::tile_rect(tile_layer, x, y)).last() {
+                            Some(rect) if rect == full_tile => continue,
+                            Some(rect) => SaturnCollision::for_rect(cell, rect)?,
+                            None if SaturnCollisions::has_class(&tile_layers, x, y)? => SaturnCollision::new(cell, CollisionType::Empty, Vec::default())?,
+                            None => continue
+                        };
+                        collisions.push(collision);
                     }
                 }
+
+                if !collisions.is_empty() {
+                    chunks.push(((chunk_y * chunk_columns as u32 + chunk_x) as usize, collisions));
+                }
+            }
+        }
+
+        return SaturnCollisions::from_chunks(full_tile.2, full_tile.3, chunk_columns, chunk_rows, chunks);
+    }
+
+    /// Lays out `chunks`, the collisions of each chunk holding any with its position in the row major chunk grid,
+    /// in grid order.
+    fn from_chunks(tile_width: u8, tile_height: u8, chunk_columns: u16, chunk_rows: u16, chunks: Vec<(usize, Vec<SaturnCollision>)>) -> Result<Self, String> {
+        if chunks.len() >= EMPTY_CHUNK as usize {
+            return Err(format!("{} chunks of collisions, more than the {} a map can hold", chunks.len(), EMPTY_CHUNK - 1));
+        }
+
+        let mut chunk_grid: Vec<u16> = vec![EMPTY_CHUNK; chunk_columns as usize * chunk_rows as usize];
+        let mut stored: Vec<SaturnCollisionChunk> = Vec::with_capacity(chunks.len());
+        let mut collision_count: u32 = 0;
+        let mut point_count: u32 = 0;
+        let mut offset = COLLISIONS_HEADER_SIZE + chunk_grid.len() as u32 * 2 + chunks.len() as u32 * CHUNK_ENTRY_SIZE;
+        for (index, (position, collisions)) in chunks.into_iter().enumerate() {
+            chunk_grid[position] = index as u16;
+            let chunk = SaturnCollisionChunk { first_collision: collision_count, offset, collisions };
+            collision_count += chunk.collisions.len() as u32;
+            point_count += chunk.collisions.iter().map(|c| c.point_count()).sum::<u32>();
+            offset += chunk.collisions.iter().map(|c| c.encoded_size()).sum::<u32>();
+            stored.push(chunk);
+        }
+
+        return Ok(SaturnCollisions {
+            tile_width,
+            tile_height,
+            chunk_columns,
+            chunk_rows,
+            chunk_grid,
+            chunks: stored,
+            collision_count,
+            point_count,
+            collisions_size: offset
+        });
+    }
+
+    /// Whether any layer's tile at `x`, `y` gives the cell a collision class, as the collision masks see it.
+    fn has_class(tile_layers: &[TileLayer], x: i32, y: i32) -> Result<bool, String> {
+        for tile_layer in tile_layers.iter() {
+            if let Some(tile) = tile_layer.get_tile(x, y).and_then(|t| t.get_tile()) {
+                if tile_collision_class(&tile, "")?.is_some() {
+                    return Ok(true);
+                }
             }
         }
+        return Ok(false);
+    }
+
+    /// Number of cells with a stored collision shape.
+    pub fn collision_count(&self) -> u32 {
+        self.collision_count
+    }
+
+    /// The stored chunks and shapes, only worth printing when the map has any.
+    pub fn report(&self) -> Option<String> {
+        if self.chunks.is_empty() {
+            return None;
+        }
 
-        return Ok(results);
+        return Some(format!("Collisions: {} cells with {} points in {} of {} chunks, {} bytes",
+                            self.collision_count, self.point_count, self.chunks.len(), self.chunk_grid.len(), self.collisions_size));
     }
-}
\ No newline at end of file
+}
+
+impl SaturnWrite for SaturnCollisions {
+    fn encoded_size(&self) -> u32 {
+        self.collisions_size
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.collisions_size)?;
+        write_u8(out, CHUNK_TILES as u8)?;
+        write_u8(out, self.tile_width)?;
+        write_u8(out, self.tile_height)?;
+        write_u16(out, self.chunk_columns)?;
+        write_u16(out, self.chunk_rows)?;
+        write_u32(out, self.chunks.len() as u32)?;
+        write_u32(out, self.collision_count)?;
+        for chunk in self.chunk_grid.iter() {
+            write_u16(out, *chunk)?;
+        }
+        for chunk in self.chunks.iter() {
+            write_u32(out, chunk.first_collision)?;
+            write_u32(out, chunk.collisions.len() as u32)?;
+            write_u32(out, chunk.offset)?;
+        }
+        for chunk in self.chunks.iter() {
+            for collision in chunk.collisions.iter() {
+                collision.write_to(out)?;
+            }
+        }
+        return Ok(());
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// A half tile rect and a cell with only a collision class, in the second chunk of a 32x16 cell map of 16x16 tiles.
+    pub(crate) fn sample_collisions() -> SaturnCollisions {
+        let collisions = vec![SaturnCollision::for_rect(0, (0, 8, 16, 8)).unwrap(), SaturnCollision::new(17, CollisionType::Empty, Vec::default()).unwrap()];
+        return SaturnCollisions::from_chunks(16, 16, 2, 1, vec![(1, collisions)]).unwrap();
+    }
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let collisions = sample_collisions();
+        let bytes = encode(&collisions);
+        assert_eq!(read_u32(&bytes, 0), collisions.collisions_size);
+        assert_eq!(read_u32(&bytes, 11), 1);
+        assert_eq!(read_u32(&bytes, 15), 2);
+        assert_eq!(&bytes[19..23], [0xff, 0xff, 0, 0]);
+
+        // The chunk table points at the records, which run to the end of the section
+        let records = read_u32(&bytes, 23 + 8) as usize;
+        assert_eq!(records, COLLISIONS_HEADER_SIZE as usize + 4 + CHUNK_ENTRY_SIZE as usize);
+        assert_eq!(&bytes[records..records + 3], [0, CollisionType::Rect as u8, 4]);
+        assert_eq!(&bytes[records + 11..], [17, CollisionType::Empty as u8, 0]);
+    }
+}
@@ -0,0 +1,208 @@
+use embedded_graphics::pixelcolor::{Bgr888, RgbColor};
+use embedded_graphics::Pixel;
+use tinybmp::{Bmp, Bpp, RowOrder};
+
+// Conversion kernels work on whole rows of packed b, g, r triplets, the order 24 bit BMPs store pixels in.
+// On x86_64 CPUs with AVX2 they convert 8 pixels per step with byte shuffles, the scalar loops finish the
+// row and run everywhere else.
+
+/// Scalar RGB555 kernel, the reference the AVX2 one must match.
+pub fn bgr888_to_rgb555_be_scalar(src: &[u8], dst: &mut [u8]) {
+    for (pixel, out) in src.chunks_exact(3).zip(dst.chunks_exact_mut(2)) {
+        let value = 0x8000 | ((pixel[0] as u16 >> 3) << 10) | ((pixel[1] as u16 >> 3) << 5) | (pixel[2] as u16 >> 3);
+        out.copy_from_slice(&value.to_be_bytes());
+    }
+}
+
+/// Scalar RGB888 kernel, the reference the AVX2 one must match.
+pub fn bgr888_to_rgb888_be_scalar(src: &[u8], dst: &mut [u8]) {
+    for (pixel, out) in src.chunks_exact(3).zip(dst.chunks_exact_mut(4)) {
+        out[0] = 0;
+        out[1] = pixel[0];
+        out[2] = pixel[1];
+        out[3] = pixel[2];
+    }
+}
+
+// Each step loads 32 bytes but only uses the first 24, the 8 pixels, so the vector loop stops while at least
+// 32 bytes are left and the scalar kernel converts the rest.
+#[cfg(target_arch = "x86_64")]
+const AVX2_PIXELS: usize = 8;
+#[cfg(target_arch = "x86_64")]
+const AVX2_LOAD: usize = 32;
+
+/// Moves pixels 0-3 of a 32 byte load into the low lane and pixels 4-7 into the high lane, as 12 bytes at
+/// the start of each, since byte shuffles can't cross lanes.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+unsafe fn load_8_pixels(src: *const u8) -> std::arch::x86_64::__m256i {
+    use std::arch::x86_64::*;
+
+    let bytes = _mm256_loadu_si256(src as *const __m256i);
+    _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0))
+}
+
+/// AVX2 RGB555 kernel. The caller checks the CPU supports AVX2.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+pub unsafe fn bgr888_to_rgb555_be_avx2(src: &[u8], dst: &mut [u8]) {
+    use std::arch::x86_64::*;
+
+    let pixels = (src.len() / 3).min(dst.len() / 2);
+    let mut done = 0;
+
+    // Spread each component of the 4 pixels in a lane to 16 bit words, the high 8 bytes stay zero
+    let blue = _mm256_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                0, -1, 3, -1, 6, -1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    let green = _mm256_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                 1, -1, 4, -1, 7, -1, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    let red = _mm256_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                               2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    let big_endian = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1,
+                                      1, 0, 3, 2, 5, 4, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1);
+    let top_bits = _mm256_set1_epi16(0xf8);
+    let msb = _mm256_set1_epi16(-0x8000);
+
+    while pixels - done >= AVX2_PIXELS && src.len() - done * 3 >= AVX2_LOAD {
+        let bytes = load_8_pixels(src.as_ptr().add(done * 3));
+
+        let b = _mm256_slli_epi16::<7>(_mm256_and_si256(_mm256_shuffle_epi8(bytes, blue), top_bits));
+        let g = _mm256_slli_epi16::<2>(_mm256_and_si256(_mm256_shuffle_epi8(bytes, green), top_bits));
+        let r = _mm256_srli_epi16::<3>(_mm256_shuffle_epi8(bytes, red));
+        let words = _mm256_or_si256(_mm256_or_si256(msb, b), _mm256_or_si256(g, r));
+
+        // Both lanes hold 4 words in their low 8 bytes, gather them into the low 16 bytes
+        let packed = _mm256_permute4x64_epi64::<0b1000>(_mm256_shuffle_epi8(words, big_endian));
+        _mm_storeu_si128(dst.as_mut_ptr().add(done * 2) as *mut __m128i, _mm256_castsi256_si128(packed));
+
+        done += AVX2_PIXELS;
+    }
+
+    bgr888_to_rgb555_be_scalar(&src[done * 3..], &mut dst[done * 2..]);
+}
+
+/// AVX2 RGB888 kernel. The caller checks the CPU supports AVX2.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+pub unsafe fn bgr888_to_rgb888_be_avx2(src: &[u8], dst: &mut [u8]) {
+    use std::arch::x86_64::*;
+
+    let pixels = (src.len() / 3).min(dst.len() / 4);
+    let mut done = 0;
+
+    // A zero byte then b, g, r for each of the 4 pixels in a lane
+    let longs = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                 -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+
+    while pixels - done >= AVX2_PIXELS && src.len() - done * 3 >= AVX2_LOAD {
+        let bytes = load_8_pixels(src.as_ptr().add(done * 3));
+        _mm256_storeu_si256(dst.as_mut_ptr().add(done * 4) as *mut __m256i, _mm256_shuffle_epi8(bytes, longs));
+
+        done += AVX2_PIXELS;
+    }
+
+    bgr888_to_rgb888_be_scalar(&src[done * 3..], &mut dst[done * 4..]);
+}
+
+/// Converts b, g, r triplets to big endian RGB555 words with the MSB set, 2 bytes per pixel in `dst`.
+pub fn bgr888_to_rgb555_be(src: &[u8], dst: &mut [u8]) {
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("avx2") {
+        return unsafe { bgr888_to_rgb555_be_avx2(src, dst) };
+    }
+
+    bgr888_to_rgb555_be_scalar(src, dst)
+}
+
+/// Converts b, g, r triplets to big endian 0x00BBGGRR longs, 4 bytes per pixel in `dst`.
+pub fn bgr888_to_rgb888_be(src: &[u8], dst: &mut [u8]) {
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("avx2") {
+        return unsafe { bgr888_to_rgb888_be_avx2(src, dst) };
+    }
+
+    bgr888_to_rgb888_be_scalar(src, dst)
+}
+
+/// Hands every row of the image to `f` as packed b, g, r triplets, top row first. 24 bit images are read
+/// straight from the pixel data, any other depth is decoded through tinybmp one row at a time.
+pub fn for_each_bgr_row(bmp: &Bmp<Bgr888>, mut f: impl FnMut(usize, &[u8]) -> Result<(), String>) -> Result<(), String> {
+    let raw = bmp.as_raw();
+    let header = raw.header();
+    let width = header.image_size.width as usize;
+    let height = header.image_size.height as usize;
+
+    if matches!(header.bpp, Bpp::Bits24) {
+        // Rows are padded to a multiple of 4 bytes
+        let stride = (width * 3 + 3) & !3;
+        let data = raw.image_data();
+
+        for y in 0..height {
+            let row = match header.row_order {
+                RowOrder::BottomUp => height - 1 - y,
+                RowOrder::TopDown => y
+            };
+            let start = row * stride;
+            let bytes = data.get(start..start + width * 3).ok_or(format!("Bitmap data too short for row {}", y))?;
+            f(y, bytes)?;
+        }
+    } else {
+        let mut row = vec![0u8; width * 3];
+        let mut pixels = bmp.pixels();
+
+        for y in 0..height {
+            for pixel in row.chunks_exact_mut(3) {
+                let Pixel(_, color) = pixels.next().ok_or(format!("Bitmap data too short for row {}", y))?;
+                pixel.copy_from_slice(&[color.b(), color.g(), color.r()]);
+            }
+            f(y, &row)?;
+        }
+    }
+
+    return Ok(());
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pixels(count: usize) -> Vec<u8> {
+        (0..count * 3).map(|i| (i * 37 + 11) as u8).collect()
+    }
+
+    #[test]
+    fn scalar_kernels_pack_big_endian() {
+        let mut rgb555 = [0u8; 2];
+        bgr888_to_rgb555_be_scalar(&[0xff, 0x80, 0x08], &mut rgb555);
+        assert_eq!(rgb555, [0xfe, 0x01]);
+
+        let mut rgb888 = [0xffu8; 4];
+        bgr888_to_rgb888_be_scalar(&[0x12, 0x34, 0x56], &mut rgb888);
+        assert_eq!(rgb888, [0x00, 0x12, 0x34, 0x56]);
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    #[test]
+    fn avx2_kernels_match_scalar() {
+        if !is_x86_feature_detected!("avx2") {
+            return;
+        }
+
+        // Lengths around and between multiples of the 8 pixel step, where the scalar loop takes over
+        for count in (0..40).chain([63, 64, 65, 127, 513]) {
+            let src = pixels(count);
+
+            let mut scalar = vec![0u8; count * 2];
+            let mut avx2 = vec![0u8; count * 2];
+            bgr888_to_rgb555_be_scalar(&src, &mut scalar);
+            unsafe { bgr888_to_rgb555_be_avx2(&src, &mut avx2) };
+            assert_eq!(avx2, scalar, "rgb555 of {} pixels", count);
+
+            let mut scalar = vec![0u8; count * 4];
+            let mut avx2 = vec![0u8; count * 4];
+            bgr888_to_rgb888_be_scalar(&src, &mut scalar);
+            unsafe { bgr888_to_rgb888_be_avx2(&src, &mut avx2) };
+            assert_eq!(avx2, scalar, "rgb888 of {} pixels", count);
+        }
+    }
+}
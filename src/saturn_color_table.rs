@@ -25,6 +25,14 @@ impl<'a> SaturnColorTable {
         self.data.contains(&value)
     }
 
+    /// Returns every entry as packed b, g, r triplets, ready for the color conversion kernels.
+    pub fn to_bgr888(&self) -> Vec<u8> {
+        self.data.iter().flat_map(|raw| {
+            let [b, g, r, _] = raw.to_le_bytes();
+            [b, g, r]
+        }).collect()
+    }
+
     /// Returns a color table entry.
     ///
     /// `None` is returned if `index` is out of bounds.
@@ -0,0 +1,480 @@
+use std::fmt::Write as _;
+use std::fs;
+use std::path::Path;
+
+use crate::saturn_patch::{read_u8, read_u16, read_u32};
+
+const MAP_MAGIC: u32 = 0x894D4150;
+const MAP_VERSION: u32 = 17;
+
+// A VDP1 normal sprite command, see TILED2SATURN_CMDT_SIZE
+const CMDT_SIZE: u32 = 32;
+
+// Bytes per line of the payload array
+const BYTES_PER_LINE: usize = 16;
+
+/// Writes an exported map as C, with the payload as a `const` array and every structure `tiled2saturn_parse` would
+/// allocate initialized to point into it, so a map linked into the program needs no parsing and no heap.
+struct CEmitter<'a> {
+    bytes: &'a [u8],
+    name: String,
+    attributes: String,
+    out: String
+}
+
+impl<'a> CEmitter<'a> {
+    fn new(bytes: &'a [u8], name: &str, section: Option<&str>) -> Self {
+        CEmitter {
+            bytes,
+            name: String::from(name),
+            attributes: section.map(|s| format!(" __attribute__((section(\"{}\")))", s)).unwrap_or_default(),
+            out: String::new()
+        }
+    }
+
+    /// A pointer into the payload, the structures take non-const pointers as parsed maps point into a loaded buffer.
+    fn pointer(&self, offset: u32) -> String {
+        format!("(uint8_t*)&{}_bytes[{}]", self.name, offset)
+    }
+
+    /// A pointer to the emitted array `array`, or NULL when it is empty and was never emitted.
+    fn array(&self, count: u32, pointer_type: &str, array: &str) -> String {
+        if count == 0 { String::from("NULL") } else { format!("({}){}_{}", pointer_type, self.name, array) }
+    }
+
+    fn begin(&mut self, declaration: &str) {
+        let _ = writeln!(self.out, "\n{}{} = {{", declaration, self.attributes);
+    }
+
+    fn field(&mut self, name: &str, value: impl std::fmt::Display) {
+        let _ = writeln!(self.out, "    .{} = {},", name, value);
+    }
+
+    fn end(&mut self) {
+        self.out.push_str("};\n");
+    }
+
+    fn pointer_array(&mut self, element_type: &str, array: &str, values: &[String]) {
+        if values.is_empty() {
+            return;
+        }
+        self.begin(&format!("static {}* const {}_{}[{}]", element_type, self.name, array, values.len()));
+        for value in values {
+            let _ = writeln!(self.out, "    {},", value);
+        }
+        self.end();
+    }
+
+    fn payload(&mut self) {
+        self.begin(&format!("static const _Alignas(4) uint8_t {}_bytes[{}]", self.name, self.bytes.len()));
+        for line in self.bytes.chunks(BYTES_PER_LINE) {
+            self.out.push_str("   ");
+            for byte in line {
+                let _ = write!(self.out, " 0x{:02X},", byte);
+            }
+            self.out.push('\n');
+        }
+        self.end();
+    }
+
+    fn header(&mut self, counts: &[u32; 5]) -> Result<(), String> {
+        let bytes = self.bytes;
+        self.begin(&format!("static const tiled2saturn_header_t {}_header", self.name));
+        self.field("version", read_u32(bytes, 4)?);
+        self.field("width", read_u32(bytes, 8)?);
+        self.field("height", read_u32(bytes, 12)?);
+        // Offsets of empty sections are left unset by tiled2saturn_parse, they are zero here
+        for (index, section) in ["tileset", "layer", "bitmap_layer", "object_layer"].iter().enumerate() {
+            let position = 16 + index as u32 * 5;
+            self.field(&format!("{}_count", section), counts[index]);
+            self.field(&format!("{}_offset", section), if counts[index] > 0 { read_u32(bytes, position + 1)? } else { 0 });
+        }
+        self.field("sprite_atlas_offset", read_u32(bytes, 36)?);
+        self.field("collision_rect_layer_count", counts[4]);
+        self.field("collision_rects_offset", read_u32(bytes, 40)?);
+        self.field("collision_masks_offset", read_u32(bytes, 44)?);
+        self.field("collision_offset", read_u32(bytes, 48)?);
+        self.end();
+        return Ok(());
+    }
+
+    /// Emits every tileset and returns the tile width and words per palette of each, which size the layer pages.
+    fn tilesets(&mut self, count: u32) -> Result<Vec<(u32, u32)>, String> {
+        let bytes = self.bytes;
+        let mut formats = Vec::default();
+        let mut tilesets = Vec::default();
+        let mut offset = read_u32(bytes, 17)?;
+
+        for index in 0..count {
+            let size = read_u32(bytes, offset)?;
+            let palette_size = read_u32(bytes, offset + 26)?;
+            self.begin(&format!("static const tiled2saturn_tileset_t {}_tileset_{}", self.name, index));
+            self.field("tileset_size", size);
+            self.field("tile_width", read_u32(bytes, offset + 4)?);
+            self.field("tile_height", read_u32(bytes, offset + 8)?);
+            self.field("tile_count", read_u32(bytes, offset + 12)?);
+            self.field("bpp", read_u16(bytes, offset + 16)?);
+            self.field("words_per_palette", read_u8(bytes, offset + 18)?);
+            self.field("number_of_colors", read_u16(bytes, offset + 19)?);
+            self.field("palette_bank", read_u8(bytes, offset + 21)?);
+            self.field("character_offset", read_u32(bytes, offset + 22)?);
+            self.field("palette_size", palette_size);
+            self.field("palette", self.pointer(offset + 30));
+            self.field("character_pattern_size", read_u32(bytes, offset + 30 + palette_size)?);
+            self.field("character_pattern", self.pointer(offset + 34 + palette_size));
+            self.end();
+
+            formats.push((read_u32(bytes, offset + 4)?, read_u8(bytes, offset + 18)?));
+            tilesets.push(format!("(tiled2saturn_tileset_t*)&{}_tileset_{}", self.name, index));
+            offset += size;
+        }
+
+        self.pointer_array("tiled2saturn_tileset_t", "tilesets", &tilesets);
+        return Ok(formats);
+    }
+
+    /// Emits the map's pages, laid out in VRAM the way `parse_pages` does, then every layer pointing at them.
+    /// Returns the page count and the VRAM the pages take.
+    fn layers(&mut self, count: u32, formats: &[(u32, u32)]) -> Result<(u32, u32), String> {
+        let bytes = self.bytes;
+        let mut pages: Vec<(u32, u32, u32)> = Vec::default();
+        let mut vram_offset: u32 = 0;
+        let mut layers = Vec::default();
+        let mut offset = read_u32(bytes, 22)?;
+
+        for _ in 0..count {
+            let (tile_width, words_per_palette) = *formats.get(read_u16(bytes, offset + 16)? as usize).ok_or("Layer references a missing tileset")?;
+            let page_cells = 512 / tile_width;
+            let page_size = page_cells * page_cells * words_per_palette * 2;
+            let line_scroll_band_count = read_u16(bytes, offset + 58)?;
+            let page_table = offset + 60 + line_scroll_band_count * 8;
+            let pattern_name_data = page_table + read_u16(bytes, offset + 28)? * read_u16(bytes, offset + 30)? * 2;
+
+            if read_u16(bytes, offset + 34)? != pages.len() as u32 {
+                return Err(String::from("Layer pages are out of order"));
+            }
+            for page in 0..read_u16(bytes, offset + 36)? {
+                vram_offset = (vram_offset + page_size - 1) & !(page_size - 1);
+                pages.push((pattern_name_data + page * page_size, page_size, vram_offset));
+                vram_offset += page_size;
+            }
+
+            layers.push((offset, page_size, line_scroll_band_count, page_table, pattern_name_data));
+            offset += read_u32(bytes, offset + 4)?;
+        }
+
+        if !pages.is_empty() {
+            self.begin(&format!("static const tiled2saturn_page_t {}_pages[{}]", self.name, pages.len()));
+            for (data, size, vram_offset) in pages.iter() {
+                let _ = writeln!(self.out, "    {{ .data = {}, .size = {}, .vram_offset = {} }},", self.pointer(*data), size, vram_offset);
+            }
+            self.end();
+        }
+
+        let mut pointers = Vec::default();
+        for (index, (offset, page_size, line_scroll_band_count, page_table, pattern_name_data)) in layers.into_iter().enumerate() {
+            self.begin(&format!("static const tiled2saturn_layer_t {}_layer_{}", self.name, index));
+            self.field("id", read_u32(bytes, offset)?);
+            self.field("layer_size", read_u32(bytes, offset + 4)?);
+            self.field("layer_width", read_u32(bytes, offset + 8)?);
+            self.field("layer_height", read_u32(bytes, offset + 12)?);
+            self.field("tile_flip_enabled", read_u8(bytes, offset + 18)?);
+            self.field("tile_transparency_enabled", read_u8(bytes, offset + 19)?);
+            self.field("origin_x", read_u32(bytes, offset + 20)? as i32);
+            self.field("origin_y", read_u32(bytes, offset + 24)? as i32);
+            self.field("page_columns", read_u16(bytes, offset + 28)?);
+            self.field("page_rows", read_u16(bytes, offset + 30)?);
+            self.field("page_size", page_size);
+            self.field("page_table", self.pointer(page_table));
+            self.field("blank_page", read_u16(bytes, offset + 32)?);
+            self.field("first_page", read_u16(bytes, offset + 34)?);
+            self.field("page_count", read_u16(bytes, offset + 36)?);
+            self.field("pattern_name_data_size", read_u32(bytes, offset + 38)?);
+            self.field("scroll_ratio_x", read_u32(bytes, offset + 42)? as i32);
+            self.field("scroll_ratio_y", read_u32(bytes, offset + 46)? as i32);
+            self.field("scroll_offset_x", read_u32(bytes, offset + 50)? as i32);
+            self.field("scroll_offset_y", read_u32(bytes, offset + 54)? as i32);
+            self.field("line_scroll_band_count", line_scroll_band_count);
+            self.field("line_scroll_bands", self.pointer(offset + 60));
+            self.field("pattern_name_data", self.pointer(pattern_name_data));
+            self.field("tileset", format!("(tiled2saturn_tileset_t*)&{}_tileset_{}", self.name, read_u16(bytes, offset + 16)?));
+            self.field("pages", self.array(pages.len() as u32, "tiled2saturn_page_t*", "pages"));
+            self.field("edit_pages", "NULL");
+            self.field("dirty_cells", "NULL");
+            self.end();
+
+            pointers.push(format!("(tiled2saturn_layer_t*)&{}_layer_{}", self.name, index));
+        }
+
+        self.pointer_array("tiled2saturn_layer_t", "layers", &pointers);
+        return Ok((pages.len() as u32, vram_offset));
+    }
+
+    fn bitmap_layers(&mut self, count: u32) -> Result<(), String> {
+        let bytes = self.bytes;
+        let mut pointers = Vec::default();
+        let mut offset = read_u32(bytes, 27)?;
+
+        for index in 0..count {
+            let color_mode = match read_u8(bytes, offset + 16)? {
+                0 => "BITMAP_PALETTE_16",
+                1 => "BITMAP_PALETTE_256",
+                3 => "BITMAP_RGB_32768",
+                4 => "BITMAP_RGB_16M",
+                mode => return Err(format!("Unsupported bitmap color mode {}", mode))
+            };
+            let palette_size = read_u32(bytes, offset + 19)?;
+            let bitmap_padding = read_u8(bytes, offset + 27 + palette_size)?;
+
+            self.begin(&format!("static const tiled2saturn_bitmap_layer_t {}_bitmap_layer_{}", self.name, index));
+            self.field("id", read_u32(bytes, offset)?);
+            self.field("layer_size", read_u32(bytes, offset + 4)?);
+            self.field("layer_width", read_u32(bytes, offset + 8)?);
+            self.field("layer_height", read_u32(bytes, offset + 12)?);
+            self.field("bitmap_color_mode", color_mode);
+            self.field("band_lines", read_u16(bytes, offset + 17)?);
+            self.field("palette_size", palette_size);
+            self.field("palette", if palette_size > 0 { self.pointer(offset + 23) } else { String::from("NULL") });
+            self.field("bitmap_size", read_u32(bytes, offset + 23 + palette_size)?);
+            self.field("bitmap", self.pointer(offset + 28 + palette_size + bitmap_padding));
+            self.end();
+
+            pointers.push(format!("(tiled2saturn_bitmap_layer_t*)&{}_bitmap_layer_{}", self.name, index));
+            offset += read_u32(bytes, offset + 4)?;
+        }
+
+        self.pointer_array("tiled2saturn_bitmap_layer_t", "bitmap_layers", &pointers);
+        return Ok(());
+    }
+
+    fn object_layers(&mut self, count: u32) -> Result<(), String> {
+        let bytes = self.bytes;
+        let mut pointers = Vec::default();
+        let mut offset = read_u32(bytes, 32)?;
+
+        for index in 0..count {
+            let object_count = read_u16(bytes, offset + 8)?;
+            let cmdts = offset + 11 + read_u8(bytes, offset + 10)?;
+
+            self.begin(&format!("static const tiled2saturn_object_layer_t {}_object_layer_{}", self.name, index));
+            self.field("id", read_u32(bytes, offset)?);
+            self.field("layer_size", read_u32(bytes, offset + 4)?);
+            self.field("object_count", object_count);
+            self.field("cmdts", self.pointer(cmdts));
+            self.field("cmdts_size", object_count * CMDT_SIZE);
+            self.field("object_ids", self.pointer(cmdts + object_count * CMDT_SIZE));
+            self.end();
+
+            pointers.push(format!("(tiled2saturn_object_layer_t*)&{}_object_layer_{}", self.name, index));
+            offset += read_u32(bytes, offset + 4)?;
+        }
+
+        self.pointer_array("tiled2saturn_object_layer_t", "object_layers", &pointers);
+        return Ok(());
+    }
+
+    fn sprite_atlas(&mut self) -> Result<(), String> {
+        let bytes = self.bytes;
+        let offset = read_u32(bytes, 36)?;
+        let sheet_count = read_u16(bytes, offset + 4)?;
+        let frame_count = read_u16(bytes, offset + 6)?;
+        let frames = offset + 13 + sheet_count * 6;
+
+        self.begin(&format!("static const tiled2saturn_sprite_atlas_t {}_sprite_atlas", self.name));
+        self.field("atlas_size", read_u32(bytes, offset)?);
+        self.field("sheet_count", sheet_count);
+        self.field("frame_count", frame_count);
+        self.field("sheets", self.pointer(offset + 13));
+        self.field("frames", self.pointer(frames));
+        self.field("texture_size", read_u32(bytes, offset + 8)?);
+        self.field("texture", self.pointer(frames + frame_count * 8 + read_u8(bytes, offset + 12)?));
+        self.end();
+        return Ok(());
+    }
+
+    fn collision_rect_layers(&mut self, count: u32) -> Result<(), String> {
+        let bytes = self.bytes;
+        let mut pointers = Vec::default();
+        let mut offset = read_u32(bytes, 40)? + 1;
+
+        for index in 0..count {
+            let rect_count = read_u16(bytes, offset + 16)?;
+            let region_starts = offset + 22 + rect_count * 16;
+            let regions = read_u16(bytes, offset + 12)? * read_u16(bytes, offset + 14)?;
+
+            self.begin(&format!("static const tiled2saturn_collision_rect_layer_t {}_collision_rect_layer_{}", self.name, index));
+            self.field("id", read_u32(bytes, offset)?);
+            self.field("layer_size", read_u32(bytes, offset + 4)?);
+            self.field("region_width", read_u16(bytes, offset + 8)?);
+            self.field("region_height", read_u16(bytes, offset + 10)?);
+            self.field("region_columns", read_u16(bytes, offset + 12)?);
+            self.field("region_rows", read_u16(bytes, offset + 14)?);
+            self.field("rect_count", rect_count);
+            self.field("index_count", read_u32(bytes, offset + 18)?);
+            self.field("rects", self.pointer(offset + 22));
+            self.field("region_starts", self.pointer(region_starts));
+            self.field("region_rects", self.pointer(region_starts + (regions + 1) * 4));
+            self.end();
+
+            pointers.push(format!("(tiled2saturn_collision_rect_layer_t*)&{}_collision_rect_layer_{}", self.name, index));
+            offset += read_u32(bytes, offset + 4)?;
+        }
+
+        self.pointer_array("tiled2saturn_collision_rect_layer_t", "collision_rect_layers", &pointers);
+        return Ok(());
+    }
+
+    fn collision_masks(&mut self) -> Result<(), String> {
+        let bytes = self.bytes;
+        let offset = read_u32(bytes, 44)?;
+        let class_count = read_u8(bytes, offset + 4)?;
+        let mut masks = offset + 6;
+        for _ in 0..class_count {
+            masks += 1 + read_u8(bytes, masks)?;
+        }
+
+        self.begin(&format!("static const tiled2saturn_collision_masks_t {}_collision_masks", self.name));
+        self.field("masks_size", read_u32(bytes, offset)?);
+        self.field("width", read_u32(bytes, 8)?);
+        self.field("height", read_u32(bytes, 12)?);
+        self.field("class_count", class_count);
+        self.field("mask_size", read_u8(bytes, offset + 5)?);
+        self.field("class_names", self.pointer(offset + 6));
+        self.field("masks", self.pointer(masks));
+        self.end();
+        return Ok(());
+    }
+
+    /// Emits the collisions structure and the stored collisions, their points point into the payload.
+    fn collisions(&mut self) -> Result<(), String> {
+        let bytes = self.bytes;
+        let offset = read_u32(bytes, 48)?;
+        let tile_width = read_u8(bytes, offset + 5)?;
+        let tile_height = read_u8(bytes, offset + 6)?;
+        let chunk_count = read_u32(bytes, offset + 11)?;
+        let collision_count = read_u32(bytes, offset + 15)?;
+        let chunk_grid = offset + 19;
+        let chunks = chunk_grid + read_u16(bytes, offset + 7)? * read_u16(bytes, offset + 9)? * 2;
+
+        let mut collisions: Vec<String> = Vec::with_capacity(collision_count as usize);
+        for chunk in 0..chunk_count {
+            let mut position = offset + read_u32(bytes, chunks + chunk * 12 + 8)?;
+            for _ in 0..read_u32(bytes, chunks + chunk * 12 + 4)? {
+                let collision_type = match read_u8(bytes, position + 1)? {
+                    0 => String::from("EMPTY"),
+                    1 => String::from("RECT"),
+                    2 => String::from("POLY"),
+                    other => format!("(tiled2saturn_collision_type_t){}", other)
+                };
+                let point_count = read_u8(bytes, position + 2)?;
+                collisions.push(format!("{{ .collision_type = {}, .cell = {}, .point_count = {}, .points = (const tiled2saturn_point_t*)&{}_bytes[{}] }}",
+                                        collision_type, read_u8(bytes, position)?, point_count, self.name, position + 3));
+                position += 3 + point_count * 2;
+            }
+        }
+
+        if !collisions.is_empty() {
+            self.begin(&format!("static const tiled2saturn_collision_t {}_collision_records[{}]", self.name, collisions.len()));
+            for collision in collisions.iter() {
+                let _ = writeln!(self.out, "    {},", collision);
+            }
+            self.end();
+        }
+
+        self.begin(&format!("static const tiled2saturn_collisions_t {}_collisions", self.name));
+        self.field("collisions_size", read_u32(bytes, offset)?);
+        self.field("width", read_u32(bytes, 8)?);
+        self.field("height", read_u32(bytes, 12)?);
+        self.field("chunk_tiles", read_u8(bytes, offset + 4)?);
+        self.field("tile_width", tile_width);
+        self.field("tile_height", tile_height);
+        self.field("chunk_columns", read_u16(bytes, offset + 7)?);
+        self.field("chunk_rows", read_u16(bytes, offset + 9)?);
+        self.field("chunk_count", chunk_count);
+        self.field("collision_count", collision_count);
+        self.field("chunk_grid", self.pointer(chunk_grid));
+        self.field("chunks", self.pointer(chunks));
+        self.field("records", self.array(collision_count, "tiled2saturn_collision_t*", "collision_records"));
+        self.field("collision_masks", format!("(tiled2saturn_collision_masks_t*)&{}_collision_masks", self.name));
+        self.field("full_tile", format!("{{ .collision_type = RECT, .cell = 0, .point_count = 4, .points = {}_collisions.full_tile_points }}", self.name));
+        self.field("full_tile_points", format!("{{ {{ 0, 0 }}, {{ {0}, 0 }}, {{ {0}, {1} }}, {{ 0, {1} }} }}", tile_width, tile_height));
+        self.end();
+        return Ok(());
+    }
+
+    fn source(mut self, header_file: &str) -> Result<String, String> {
+        let bytes = self.bytes;
+        if read_u32(bytes, 0)? != MAP_MAGIC {
+            return Err(String::from("Not a tiled2saturn map"));
+        }
+        if read_u32(bytes, 4)? != MAP_VERSION {
+            return Err(format!("Unsupported map version {}", read_u32(bytes, 4)?));
+        }
+
+        let counts = [read_u8(bytes, 16)?, read_u8(bytes, 21)?, read_u8(bytes, 26)?, read_u8(bytes, 31)?, read_u8(bytes, read_u32(bytes, 40)?)?];
+        let _ = writeln!(self.out, "/* Generated by tiled2saturn, do not edit. */\n\n#include \"{}\"", header_file);
+
+        self.payload();
+        self.header(&counts)?;
+        let formats = self.tilesets(counts[0])?;
+        let (page_count, pages_vram_size) = self.layers(counts[1], &formats)?;
+        self.bitmap_layers(counts[2])?;
+        self.object_layers(counts[3])?;
+        self.sprite_atlas()?;
+        self.collision_rect_layers(counts[4])?;
+        self.collision_masks()?;
+        self.collisions()?;
+
+        self.begin(&format!("const tiled2saturn_t {}", self.name));
+        self.field("header", format!("(tiled2saturn_header_t*)&{}_header", self.name));
+        self.field("tilesets", self.array(counts[0], "tiled2saturn_tileset_t**", "tilesets"));
+        self.field("layers", self.array(counts[1], "tiled2saturn_layer_t**", "layers"));
+        self.field("bitmap_layers", self.array(counts[2], "tiled2saturn_bitmap_layer_t**", "bitmap_layers"));
+        self.field("object_layers", self.array(counts[3], "tiled2saturn_object_layer_t**", "object_layers"));
+        self.field("sprite_atlas", format!("(tiled2saturn_sprite_atlas_t*)&{}_sprite_atlas", self.name));
+        self.field("collision_rect_layers", self.array(counts[4], "tiled2saturn_collision_rect_layer_t**", "collision_rect_layers"));
+        self.field("collision_masks", format!("(tiled2saturn_collision_masks_t*)&{}_collision_masks", self.name));
+        self.field("collisions", format!("(tiled2saturn_collisions_t*)&{}_collisions", self.name));
+        self.field("page_count", page_count);
+        self.field("pages", self.array(page_count, "tiled2saturn_page_t*", "pages"));
+        self.field("pages_vram_size", pages_vram_size);
+        self.field("bytes", format!("(uint8_t*){}_bytes", self.name));
+        self.end();
+
+        return Ok(self.out);
+    }
+}
+
+fn c_header(name: &str) -> String {
+    let mut out = String::new();
+    let _ = writeln!(out, "/* Generated by tiled2saturn, do not edit. */\n");
+    let _ = writeln!(out, "#pragma once\n");
+    let _ = writeln!(out, "#if defined(__has_include)\n#  if __has_include(<tiled2saturn/tiled2saturn.h>)\n#    include <tiled2saturn/tiled2saturn.h>\n#  else\n#    include \"tiled2saturn.h\"\n#  endif\n#else\n#  include \"tiled2saturn.h\"\n#endif\n");
+    let _ = writeln!(out, "/* Already parsed, never pass to tiled2saturn_free or tiled2saturn_apply_patch. Copy a layer before editing it. */");
+    let _ = writeln!(out, "extern const tiled2saturn_t {};", name);
+    return out;
+}
+
+/// A C identifier from a file name, `level-1` becomes `level_1`.
+fn identifier(stem: &str) -> String {
+    let name: String = stem.chars().map(|c| if c.is_ascii_alphanumeric() { c } else { '_' }).collect();
+    return if name.starts_with(|c: char| c.is_ascii_digit()) || name.is_empty() { String::from("_") + &name } else { name };
+}
+
+/// Writes `bytes`, an exported map, as `<base>.c` and `<base>.h` declaring a `const tiled2saturn_t` named after the
+/// file, placed in the linker `section` when one is given.
+pub fn write_c(bytes: &[u8], base: &Path, section: Option<&str>) -> Result<String, String> {
+    let stem = match base.extension().and_then(|e| e.to_str()) {
+        Some("c") | Some("h") => base.file_stem(),
+        _ => base.file_name()
+    }.map(|f| f.to_string_lossy().into_owned()).ok_or(format!("Invalid C output {}", base.display()))?;
+    let name = identifier(&stem);
+    let source_file = base.with_file_name(format!("{}.c", stem));
+    let header_file = base.with_file_name(format!("{}.h", stem));
+
+    let source = CEmitter::new(bytes, &name, section).source(&format!("{}.h", stem))?;
+    fs::write(&header_file, c_header(&name)).map_err(|e| e.to_string() + " " + header_file.to_str().unwrap_or_default())?;
+    fs::write(&source_file, source).map_err(|e| e.to_string() + " " + source_file.to_str().unwrap_or_default())?;
+
+    return Ok(format!("Wrote {} and {}, declaring {}", source_file.display(), header_file.display(), name));
+}
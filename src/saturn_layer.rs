@@ -1,30 +1,341 @@
-use std::collections::BTreeMap;
+use std::collections::{BTreeMap, HashMap};
+use std::io::{self, Write};
+
+use tiled::{ChunkData, Layer, LayerTile, Map, TileLayer};
+
+use crate::saturn_character_allocation::{character_window, pattern_character};
+use crate::saturn_profile;
+use crate::saturn_scroll::SaturnScroll;
+use crate::saturn_tileset::SaturnTilesetInfo;
+use crate::saturn_writer::{SaturnWrite, write_bool, write_u16, write_u32};
+
+// id .. pattern_name_data_size, followed by the scroll tables, the page table and the pattern name data
+const LAYER_HEADER_SIZE: u32 = 42;
+
+// Infinite maps are cropped to a bounding box aligned to the largest page, 64x64 cells of 8x8 tiles
+const PAGE_ALIGNMENT: i32 = 64;
+
+// Set in a page table entry for a page without any tiles, the entry then points at the layer's blank page
+const EMPTY_PAGE_FLAG: u16 = 0x8000;
+
+/// The cells of the map that get exported, in tiles. Finite maps export everything, infinite maps export
+/// the page aligned bounding box of every chunk holding tiles.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct TileBounds {
+    pub origin_x: i32,
+    pub origin_y: i32,
+    pub width: u32,
+    pub height: u32
+}
+
+impl TileBounds {
+    /// The top left of the exported area in pixels.
+    pub fn pixel_origin(&self, map: &Map) -> (i32, i32) {
+        (self.origin_x * map.tile_width as i32, self.origin_y * map.tile_height as i32)
+    }
+
+    pub fn for_map(map: &Map) -> Self {
+        if !map.infinite() {
+            return TileBounds { origin_x: 0, origin_y: 0, width: map.width, height: map.height };
+        }
+
+        let chunks: Vec<(i32, i32)> = map.layers().filter_map(|layer| match layer.layer_type() {
+            tiled::LayerType::Tiles(TileLayer::Infinite(infinite)) => Some(infinite.chunks().map(|(position, _)| position).collect::<Vec<_>>()),
+            _ => None
+        }).flatten().collect();
+
+        let chunk_width = ChunkData::WIDTH as i32;
+        let chunk_height = ChunkData::HEIGHT as i32;
+
+        let min_x = chunks.iter().map(|(x, _)| x * chunk_width).min().unwrap_or(0).div_euclid(PAGE_ALIGNMENT) * PAGE_ALIGNMENT;
+        let min_y = chunks.iter().map(|(_, y)| y * chunk_height).min().unwrap_or(0).div_euclid(PAGE_ALIGNMENT) * PAGE_ALIGNMENT;
+        let max_x = chunks.iter().map(|(x, _)| (x + 1) * chunk_width).max().unwrap_or(0);
+        let max_y = chunks.iter().map(|(_, y)| (y + 1) * chunk_height).max().unwrap_or(0);
+
+        let width = ((max_x - min_x).max(0) + PAGE_ALIGNMENT - 1) / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+        let height = ((max_y - min_y).max(0) + PAGE_ALIGNMENT - 1) / PAGE_ALIGNMENT * PAGE_ALIGNMENT;
+
+        TileBounds { origin_x: min_x, origin_y: min_y, width: width as u32, height: height as u32 }
+    }
+}
+
+/// Calls `f` with the position relative to `bounds` of every cell of `tile_layer` holding a tile. Infinite
+/// layers are walked chunk by chunk, so the cost follows the stored chunks rather than the bounding box.
+fn for_each_tile<'a>(tile_layer: &TileLayer<'a>, bounds: &TileBounds, mut f: impl FnMut(u32, u32, LayerTile<'a>)) {
+    match tile_layer {
+        TileLayer::Finite(finite) => {
+            for y in 0..finite.height().min(bounds.height) {
+                for x in 0..finite.width().min(bounds.width) {
+                    if let Some(tile) = finite.get_tile(x as i32, y as i32) {
+                        f(x, y, tile);
+                    }
+                }
+            }
+        }
+        TileLayer::Infinite(infinite) => {
+            for ((chunk_x, chunk_y), chunk) in infinite.chunks() {
+                for local_y in 0..ChunkData::HEIGHT as i32 {
+                    for local_x in 0..ChunkData::WIDTH as i32 {
+                        if let Some(tile) = chunk.get_tile(local_x, local_y) {
+                            let x = chunk_x * ChunkData::WIDTH as i32 + local_x - bounds.origin_x;
+                            let y = chunk_y * ChunkData::HEIGHT as i32 + local_y - bounds.origin_y;
+                            f(x as u32, y as u32, tile);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// One bit per cell, set where a layer draws a tile.
+struct Occupancy {
+    width: u32,
+    height: u32,
+    words_per_row: usize,
+    bits: Vec<u64>
+}
+
+impl Occupancy {
+    fn new(width: u32, height: u32) -> Self {
+        let words_per_row = (width as usize + 63) / 64;
+        Occupancy { width, height, words_per_row, bits: vec![0; words_per_row * height as usize] }
+    }
+
+    fn set(&mut self, x: u32, y: u32) {
+        let word = y as usize * self.words_per_row + x as usize / 64;
+        self.bits[word] |= 1 << (x % 64);
+    }
+
+    /// Whether any cell inside the `width` x `height` area at `x`, `y` is set, checked a word at a time.
+    fn any(&self, x: u32, y: u32, width: u32, height: u32) -> bool {
+        let x_start = x as usize;
+        let x_end = (x + width).min(self.width) as usize;
+        let y_end = (y + height).min(self.height) as usize;
+
+        if x_start >= x_end {
+            return false;
+        }
+
+        let first_word = x_start / 64;
+        let last_word = (x_end - 1) / 64;
+
+        (y as usize..y_end).any(|row| {
+            let bits = &self.bits[row * self.words_per_row..(row + 1) * self.words_per_row];
+            (first_word..=last_word).any(|word| {
+                let low = if word == first_word { x_start % 64 } else { 0 };
+                let high = if word == last_word { (x_end - 1) % 64 + 1 } else { 64 };
+                let mask = (u64::MAX >> (64 - (high - low))) << low;
+                bits[word] & mask != 0
+            })
+        })
+    }
+
+    fn merge(&mut self, other: &Occupancy) {
+        let words = self.words_per_row.min(other.words_per_row);
+        for y in 0..self.height.min(other.height) as usize {
+            let row = &mut self.bits[y * self.words_per_row..y * self.words_per_row + words];
+            for (bits, other_bits) in row.iter_mut().zip(&other.bits[y * other.words_per_row..]) {
+                *bits |= other_bits;
+            }
+        }
+    }
+}
+
+/// Every distinct page of pattern name data in the map, numbered in the order layers first use them.
+/// Layers only store the pages they introduce, any page already seen is shared through the page table.
+struct PagePool {
+    pages: HashMap<Vec<u8>, u16>
+}
+
+impl PagePool {
+    fn new() -> Self {
+        PagePool { pages: HashMap::default() }
+    }
+
+    /// Returns the index of `page`, appending it to `stored` if no earlier page has the same contents.
+    fn intern(&mut self, page: &[u8], stored: &mut Vec<u8>) -> Result<u16, String> {
+        if let Some(index) = self.pages.get(page) {
+            return Ok(*index);
+        }
+
+        let index = u16::try_from(self.pages.len()).ok().filter(|i| *i < EMPTY_PAGE_FLAG).ok_or(format!("Too many distinct pages in map"))?;
+        self.pages.insert(page.to_vec(), index);
+        stored.extend_from_slice(page);
+
+        return Ok(index);
+    }
+}
+
+/// Everything the layer header needs, gathered in a single walk over the cells of a layer.
+struct LayerAnalysis {
+    /// Number of cells drawn from each tileset, by tileset index
+    tileset_usage: BTreeMap<usize, u32>,
+    tile_flip_enabled: bool,
+    occupancy: Occupancy
+}
+
+impl LayerAnalysis {
+    fn analyse(width: u32, height: u32, tile_layer: &TileLayer, bounds: &TileBounds) -> Self {
+        let mut analysis = LayerAnalysis {
+            tileset_usage: BTreeMap::default(),
+            tile_flip_enabled: false,
+            occupancy: Occupancy::new(width, height)
+        };
+
+        for_each_tile(tile_layer, bounds, |x, y, tile| {
+            *analysis.tileset_usage.entry(tile.tileset_index()).or_insert(0) += 1;
+            analysis.tile_flip_enabled |= tile.flip_d | tile.flip_h | tile.flip_v;
+            analysis.occupancy.set(x, y);
+        });
+
+        return analysis;
+    }
+}
+
+/// Final pattern name data words for every tile of every tileset in the map, so encoding a layer is one
+/// lookup per cell. Entries are indexed by the global tile index and the horizontal and vertical flip bits.
+struct PatternNameTable<'a> {
+    tilesets: &'a [SaturnTilesetInfo],
+    /// Global index of the first tile of each tileset
+    first_tile: Vec<usize>,
+    words: Vec<u32>
+}
+
+impl<'a> PatternNameTable<'a> {
+    /// Encodes against the `character_offset` of each tileset, placed by `SaturnCharacterAllocation`.
+    fn new(tilesets: &'a [SaturnTilesetInfo]) -> Self {
+        let mut first_tile: Vec<usize> = Vec::with_capacity(tilesets.len());
+        let mut words: Vec<u32> = Vec::default();
+
+        for tileset in tilesets {
+            first_tile.push(words.len() / 4);
+            words.reserve(tileset.tile_count as usize * 4);
+
+            for tile_id in 0..tileset.tile_count {
+                for flips in 0..4_u32 {
+                    words.push(PatternNameTable::encode(tileset, tile_id, flips & 1 != 0, flips & 2 != 0));
+                }
+            }
+        }
+
+        PatternNameTable { tilesets, first_tile, words }
+    }
+
+    fn encode(tileset: &SaturnTilesetInfo, in_val: u32, flip_horizontal: bool, flip_vertical: bool) -> u32 {
+        if tileset.words_per_palette == 1 {
+            // Cells without a tile point at the highest character number of the tileset's format
+            let mut out_val = if in_val == u32::MAX {
+                match tileset.bpp {
+                    11 => 0x3ff << 2,
+                    8 => 0x3ff << 1,
+                    _ => 0x3ff
+                }
+            } else {
+                pattern_character(tileset, in_val) as u16
+            };
+
+            // add the palette bank for this number of colors
+            out_val |= (tileset.palette_bank as u16) << 12;
+
+            // is tile horizontally flipped?
+            if flip_horizontal {
+                out_val |= 0x400;
+            }
+            // is tile vertically flipped?
+            if flip_vertical {
+                out_val |= 0x800;
+            }
+
+            return out_val as u32;
+        } else {
+            let mut out_val = if in_val == u32::MAX { 0x7fff << 1 } else { pattern_character(tileset, in_val) & 0x7fff };
 
-use deku::prelude::*;
-use tiled::{Layer, TileLayer};
+            // add the palette bank for this number of colors
+            out_val |= (tileset.palette_bank as u32) << 16;
 
-use crate::saturn_tileset::SaturnTileset;
+            // is tile horizontally flipped?
+            if flip_horizontal {
+                out_val |= 0x40000000;
+            }
+            // is tile vertically flipped?
+            if flip_vertical {
+                out_val |= 0x80000000;
+            }
+
+            return out_val;
+        }
+    }
+
+    /// Word written for `tile_id` of the tileset at `tileset_index`, failing for a tile the tileset doesn't have.
+    fn get(&self, tileset_index: usize, tile_id: u32, flip_horizontal: bool, flip_vertical: bool) -> Result<u32, String> {
+        let tileset = self.tilesets.get(tileset_index).ok_or(format!("Invalid tileset index {}", tileset_index))?;
+        if tile_id >= tileset.tile_count {
+            return Err(format!("Tile {} is past the {} tiles of tileset {}", tile_id, tileset.tile_count, tileset_index));
+        }
+
+        let tile = self.first_tile[tileset_index] + tile_id as usize;
+        return Ok(self.words[tile * 4 + flip_horizontal as usize + ((flip_vertical as usize) << 1)]);
+    }
+
+    /// Word written for cells without a tile in a layer using this tileset.
+    fn empty(&self, tileset_index: usize) -> u32 {
+        PatternNameTable::encode(&self.tilesets[tileset_index], u32::MAX, false, false)
+    }
+
+    /// Picks the tileset recorded for a layer, the lowest index it draws from. Every tileset a layer uses has
+    /// to share the character pattern and pattern name data format, and for 1 word pattern names the window,
+    /// so one VDP2 plane setup covers them all.
+    fn layer_tileset(&self, tileset_usage: &BTreeMap<usize, u32>) -> Result<u16, String> {
+        let mut used = tileset_usage.keys();
+        let index = *used.next().ok_or(format!("Layers must contain at least one tile"))?;
+        let tileset = self.tilesets.get(index).ok_or(format!("Invalid tileset index {} for layer", index))?;
+
+        if let Some(sprite_sheet) = tileset_usage.keys().find(|i| self.tilesets.get(**i).map_or(false, |t| t.sprite_sheet)) {
+            return Err(format!("Tile layers cannot draw from sprite sheet tileset {}", sprite_sheet));
+        }
+
+        for other_index in used {
+            let other = self.tilesets.get(*other_index).ok_or(format!("Invalid tileset index {} for layer", other_index))?;
+            if (other.tile_width, other.tile_height, other.bpp, other.words_per_palette) != (tileset.tile_width, tileset.tile_height, tileset.bpp, tileset.words_per_palette) {
+                return Err(format!("Layers can only mix tilesets with the same tile size, bpp and pnd_size, tilesets {} and {} differ", index, other_index));
+            }
+            if character_window(other) != character_window(tileset) {
+                return Err(format!("Layers can only mix 1 word tilesets in the same character window, tilesets {} and {} are at {:#07x} and {:#07x}",
+                                   index, other_index, character_window(tileset), character_window(other)));
+            }
+        }
+
+        return Ok(index as u16);
+    }
+}
 
 #[repr(C)]
-#[derive(Debug, PartialEq, DekuWrite)]
-#[deku(endian = "endian", ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+#[derive(Debug, PartialEq)]
 pub struct SaturnLayer{
     id: u32,
-    #[deku(update = "self.to_bytes().unwrap().len()")]
     pub layer_size: u32,
     width: u32,
     height: u32,
     tileset_index: u16,
     tile_flip_enabled: bool,
     tile_transparency_enabled: bool,
-    #[deku(update = "self.pattern_name_data.len()")]
+    origin_x: i32,
+    origin_y: i32,
+    page_columns: u16,
+    page_rows: u16,
+    blank_page: u16,
+    first_page: u16,
+    page_count: u16,
     pattern_name_data_size: u32,
-    #[deku(count = "character_pattern_size", endian = "big")]
+    scroll: SaturnScroll,
+    page_table: Vec<u16>,
     pattern_name_data:Vec<u8>
 }
 
 impl SaturnLayer {
-    fn new(id: u32, width: u32, height: u32, tileset_index:u16, tile_flip_enabled:bool, tile_transparency_enabled: bool) -> Result<Self, String> {
+    fn new(id: u32, bounds: &TileBounds, width: u32, height: u32, tileset_index:u16, tile_flip_enabled:bool, tile_transparency_enabled: bool,
+           scroll: SaturnScroll) -> Result<Self, String> {
         Ok(SaturnLayer {
             id,
             layer_size: Default::default(),
@@ -33,18 +344,39 @@ impl SaturnLayer {
             tileset_index,
             tile_flip_enabled,
             tile_transparency_enabled,
+            origin_x: bounds.origin_x,
+            origin_y: bounds.origin_y,
+            page_columns: Default::default(),
+            page_rows: Default::default(),
+            blank_page: Default::default(),
+            first_page: Default::default(),
+            page_count: Default::default(),
             pattern_name_data_size: Default::default(),
+            scroll,
+            page_table: Default::default(),
             pattern_name_data: Default::default(),
         })
     }
 
-    fn get_pattern_name_data<'a>(self:&SaturnLayer, tile_layer: &TileLayer<'a>, tilesets:&Vec<SaturnTileset>) -> Result<Vec<u8>, String> {
-        let mut results: Vec<u8> = Vec::default();
+    fn update_sizes(&mut self) {
+        self.pattern_name_data_size = self.pattern_name_data.len() as u32;
+        self.layer_size = self.encoded_size();
+    }
 
-        let tileset = tilesets.get(self.tileset_index as usize).expect(format!("Invalid tileset index {} for layer", self.tileset_index).as_str());
+    /// The number of pages this layer stores and the size of each one.
+    pub fn page_usage(&self) -> (u16, u32) {
+        if self.page_count == 0 {
+            return (0, 0);
+        }
+        (self.page_count, self.pattern_name_data_size / self.page_count as u32)
+    }
 
-        // We sequentially reference tile ids based on the previous tilesets that exist in the map, this assumes you load tilesets in the same order
-        let current_tile_index : u16 = (0..self.tileset_index as usize).flat_map(|num| tilesets.get(num).map(|t| (t.tile_count) as u16)).sum();
+    /// Encodes the pattern name data one page at a time, as the VDP2 expects it in VRAM. Pages are shared
+    /// through `pool`, so only pages no earlier layer or page has produced are stored. Pages without any tiles
+    /// are never encoded, they are flagged empty and point at the blank page.
+    fn set_pattern_name_data<'a>(&mut self, tile_layer: &TileLayer<'a>, pattern_names: &PatternNameTable, occupancy: &Occupancy, pool: &mut PagePool) -> Result<(), String> {
+        let tileset = &pattern_names.tilesets[self.tileset_index as usize];
+        let empty = pattern_names.empty(self.tileset_index as usize);
 
         let nunber_of_tiles_per_map = match (tileset.tile_height, tileset.tile_width) {
             (16, 16) => Ok(32),
@@ -52,157 +384,195 @@ impl SaturnLayer {
             e => Err(format!("Invalid tile size {:?} for saturn map", e))
         }?;
 
+        let word_size = tileset.words_per_palette as usize * 2;
+        let page_size = (nunber_of_tiles_per_map * nunber_of_tiles_per_map) as usize * word_size;
+
+        let push_word = |page: &mut Vec<u8>, out_val: u32| {
+            if word_size == 2 {
+                page.extend_from_slice(&(out_val as u16).to_be_bytes());
+            } else {
+                page.extend_from_slice(&out_val.to_be_bytes());
+            }
+        };
+
         let number_of_maps_y = self.height / nunber_of_tiles_per_map;
         let number_of_maps_x = self.width  / nunber_of_tiles_per_map;
 
+        let mut page_table: Vec<u16> = Vec::with_capacity((number_of_maps_x * number_of_maps_y) as usize);
+        let mut stored: Vec<u8> = Vec::default();
+        let first_page = pool.pages.len() as u16;
+
+        let mut blank: Vec<u8> = Vec::with_capacity(page_size);
+        for _ in 0..page_size / word_size {
+            push_word(&mut blank, empty);
+        }
+        let blank_page = pool.intern(&blank, &mut stored)?;
+
+        let mut page: Vec<u8> = Vec::with_capacity(page_size);
+
         for map_index_y in 0..number_of_maps_y {
             let start_y_offset = nunber_of_tiles_per_map * map_index_y;
             let end_y_offset   = (nunber_of_tiles_per_map * map_index_y) + nunber_of_tiles_per_map;
             for map_index_x in 0..number_of_maps_x {
                 let start_x_offset = nunber_of_tiles_per_map * map_index_x;
                 let end_x_offset   = (nunber_of_tiles_per_map * map_index_x) + nunber_of_tiles_per_map;
+
+                if !occupancy.any(start_x_offset, start_y_offset, nunber_of_tiles_per_map, nunber_of_tiles_per_map) {
+                    page_table.push(EMPTY_PAGE_FLAG | blank_page);
+                    continue;
+                }
+
+                page.clear();
                 for y in start_y_offset..end_y_offset{
                     for x in start_x_offset..end_x_offset{
-                        let (tile_id, flip_horizontal, flip_vertical) = tile_layer.get_tile(x as i32,y as i32).map(|f| (f.id(), f.flip_h, f.flip_v)).unwrap_or((u32::MAX, false, false));
-                        let in_val = tile_id;
-                        if tileset.words_per_palette == 1 {
-                            let mut out_val = if tileset.bpp == 11{
-                                    (in_val as u16 & 0x3ff) << 2
-                                } else if tileset.bpp == 8 {
-                                    (in_val as u16 & 0x3ff) << 1
-                                } else if tileset.bpp == 4 {
-                                    in_val as u16 & 0x3ff
-                                } else {0};
-                            
-                            //  current_tile_index - this is the tileset count we are currently at given all previous tilesets that exist - unless our tile is transparent, increment by index
-                            if tile_id != u32::MAX {
-                                out_val += current_tile_index; 
-                            }
-
-                            // add the palette bank for this number of colors
-                            out_val |= (tileset.palette_bank as u16) << 12;
-
-                            // is tile horizontally flipped?
-                            if flip_horizontal {
-                                out_val |= 0x400;
-                            }
-                            // is tile vertically flipped?
-                            if flip_vertical {
-                                out_val |= 0x800;
-                            }
-                            
-                            results.append(&mut out_val.to_be_bytes().to_vec());
-                        } else {
-                            let mut out_val = (in_val & 0x7fff) << 1;
-                            
-                            // add the palette bank for this number of colors
-                            out_val |= (tileset.palette_bank as u32) << 16;
-
-                            // is tile horizontally flipped?
-                            if flip_horizontal {
-                                out_val |= 0x40000000;
-                            }
-                            // is tile vertically flipped?
-                            if flip_vertical { 
-                                out_val |= 0x80000000;
-                            }
-
-                            results.append(&mut out_val.to_be_bytes().to_vec());
-                        }
+                        let out_val = match tile_layer.get_tile(self.origin_x + x as i32, self.origin_y + y as i32) {
+                            Some(f) => pattern_names.get(f.tileset_index(), f.id(), f.flip_h, f.flip_v)
+                                .map_err(|e| format!("{} in layer {} at cell {}, {}", e, self.id, x, y))?,
+                            None => empty
+                        };
+
+                        push_word(&mut page, out_val);
                     }
                 }
+
+                page_table.push(pool.intern(&page, &mut stored)?);
             }
         }
 
-       return Ok(results);
+        self.page_columns = u16::try_from(number_of_maps_x).map_err(|e| e.to_string())?;
+        self.page_rows = u16::try_from(number_of_maps_y).map_err(|e| e.to_string())?;
+        self.blank_page = blank_page;
+        self.first_page = first_page;
+        self.page_count = (stored.len() / page_size) as u16;
+        self.page_table = page_table;
+        self.pattern_name_data = stored;
+
+        return Ok(());
     }
 
-    pub fn build<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>, tilesets:&Vec<SaturnTileset>) -> Result<Vec<Self>, String> {
+    pub fn build<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>, tilesets:&[SaturnTilesetInfo], bounds: &TileBounds) -> Result<Vec<Self>, String> {
         let mut results: Vec<SaturnLayer> = Vec::default();
 
-        let tile_layers: Vec<(u32, TileLayer)> = layers.filter_map(|layer| match layer.layer_type() {
-            tiled::LayerType::Tiles(tile_layer) => Some((layer.id(), tile_layer)),
+        SaturnLayer::build_each(layers, tilesets, bounds, |saturn_layer| {
+            results.push(saturn_layer);
+            Ok(())
+        })?;
+
+        return Ok(results);
+    }
+
+    /// Builds the layers one at a time in id order, handing each to `f` as soon as it is encoded.
+    pub fn build_each<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>, tilesets:&[SaturnTilesetInfo], bounds: &TileBounds,
+                          mut f: impl FnMut(SaturnLayer) -> Result<(), String>) -> Result<(), String> {
+
+        let tile_layers: Vec<(u32, TileLayer, Layer)> = layers.filter_map(|layer| match layer.layer_type() {
+            tiled::LayerType::Tiles(tile_layer) => Some((layer.id(), tile_layer, layer)),
             _ => None,
         }).collect();
 
-        fn are_all_elements_equal<T: PartialEq>(elems: &[T]) -> Option<&T> {
-            match elems {
-                [head, tail @ ..] => tail.iter().all(|x| x == head).then(|| head),
-                [] => None,
-            }
-        }
+        // Cells drawn by any layer below the current one
+        let mut occupancy = Occupancy::new(bounds.width, bounds.height);
 
-        fn tileset_index_for_layer(height:u32, width:u32, tile_layer:&TileLayer) -> Result<u16, String> {
-            let mut res : Vec<Option<usize>> = Vec::default();
+        let pattern_names = PatternNameTable::new(tilesets);
+        let mut pool = PagePool::new();
 
-            for y in 0..height {
-                for x in 0..width {
-                    let t = tile_layer.get_tile(x as i32,y as i32);
-                    let o = t.map(|f| f.tileset_index());
-                    res.push(o);
-                }
-            }
+        let sorted: BTreeMap<&u32, (&TileLayer<'_>, &Layer<'_>)> = tile_layers.iter().map(|(id, tl, layer)| (id, (tl, layer))).collect();
+        
+        for (id, (tile_layer, layer)) in sorted {
+            let _stage = saturn_profile::stage_for("layer", || id.to_string());
+            let (width, height) = match tile_layer {
+                TileLayer::Finite(finite) => (finite.width(), finite.height()),
+                TileLayer::Infinite(_) => (bounds.width, bounds.height)
+            };
+            
+            let analysis_stage = saturn_profile::stage("analysis");
+            let analysis = LayerAnalysis::analyse(width, height, tile_layer, bounds);
+            drop(analysis_stage);
 
-            let filtered : Vec<&usize> = res.iter().flatten().collect();
-            let index = are_all_elements_equal(&filtered).map(|f| **f as u16).ok_or(format!("Layers can only contain tiles from a single tileset"));
+            let tileset_index = pattern_names.layer_tileset(&analysis.tileset_usage).map_err(|e| format!("{} in layer {}", e, id))?;
+            let tile_transparency_enabled = occupancy.any(0, 0, width, height);
+            occupancy.merge(&analysis.occupancy);
 
-            return index;
-        }
+            let scroll = SaturnScroll::from_layer(layer).map_err(|e| format!("{} in layer {}", e, id))?;
 
-        fn tile_flip_enabled(height:u32, width:u32, tile_layer:&TileLayer) -> bool {
-            for y in 0..height {
-                for x in 0..width {
-                    let t = tile_layer.get_tile(x as i32,y as i32);
-                    let o = t.map(|f| f.flip_d | f.flip_h | f.flip_v);
-                    if o.is_some() && o.unwrap() {
-                        return true
-                    }
-                }
-            }
-            return false;
-        }
+            let mut saturn_layer = SaturnLayer::new(*id, bounds, width, height, tileset_index, analysis.tile_flip_enabled, tile_transparency_enabled, scroll)?;
 
-        fn tile_transparency_enabled<'a>(height:u32, width:u32, previous_layers: impl Iterator<Item = &'a(u32,TileLayer<'a>)>) -> bool {
-            for layer in previous_layers {
-                for y in 0..height {
-                    for x in 0..width {
-                        let previous_tile = layer.1.get_tile(x as i32,y as i32);
-                        if previous_tile.is_some() {
-                            return true
-                        }
-                    }
-                }
-            }
+            let pnd_stage = saturn_profile::stage("pnd_encode");
+            saturn_layer.set_pattern_name_data(tile_layer, &pattern_names, &analysis.occupancy, &mut pool)?;
+            saturn_layer.update_sizes();
+            drop(pnd_stage);
 
-            return false;
+            f(saturn_layer)?;
         }
 
-        let mut index = 1_usize;
-
-        let sorted: BTreeMap<&u32, &TileLayer<'_>> = tile_layers.iter().map(|(id, tl)| (id,tl)).collect();
-        
-        for (id, tile_layer) in sorted {
-            let width = tile_layer.width().ok_or(format!("Unable to get width for layer {}", id))?;
-            let height = tile_layer.height().ok_or(format!("Unable to get height for layer {}", id))?;
-            
-            let tileset_index = tileset_index_for_layer(height, width, tile_layer)?;
-            let tile_flip_enabled = tile_flip_enabled(height, width, tile_layer);
-
-            let previous_layers = tile_layers.iter().take(index.saturating_sub(1));
+        return Ok(());
+    }
+}
 
-            let tile_transparency_enabled = tile_transparency_enabled(height, width, previous_layers);
+impl SaturnWrite for SaturnLayer {
+    fn encoded_size(&self) -> u32 {
+        LAYER_HEADER_SIZE + self.scroll.encoded_size() + self.page_table.len() as u32 * 2 + self.pattern_name_data.len() as u32
+    }
 
-            let mut saturn_layer = SaturnLayer::new(*id, width, height, tileset_index, tile_flip_enabled, tile_transparency_enabled)?;
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.id)?;
+        write_u32(out, self.layer_size)?;
+        write_u32(out, self.width)?;
+        write_u32(out, self.height)?;
+        write_u16(out, self.tileset_index)?;
+        write_bool(out, self.tile_flip_enabled)?;
+        write_bool(out, self.tile_transparency_enabled)?;
+        write_u32(out, self.origin_x as u32)?;
+        write_u32(out, self.origin_y as u32)?;
+        write_u16(out, self.page_columns)?;
+        write_u16(out, self.page_rows)?;
+        write_u16(out, self.blank_page)?;
+        write_u16(out, self.first_page)?;
+        write_u16(out, self.page_count)?;
+        write_u32(out, self.pattern_name_data_size)?;
+        self.scroll.write_to(out)?;
+        for page in self.page_table.iter() {
+            write_u16(out, *page)?;
+        }
+        out.write_all(&self.pattern_name_data)
+    }
+}
 
-            let pattern_data = &mut SaturnLayer::get_pattern_name_data(&saturn_layer, tile_layer, &tilesets)?;
-            saturn_layer.pattern_name_data.append(pattern_data);
-            saturn_layer.update().map_err(|op| op.to_string())?;
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// A 64x64 cell layer of 8x8 tiles with two line scroll bands, one page of 1 word pattern names.
+    pub(crate) fn sample_layer() -> SaturnLayer {
+        let bounds = TileBounds { origin_x: 0, origin_y: 0, width: 64, height: 64 };
+        let scroll = SaturnScroll::new(0.5, 1.0, 0.0, 8.0, Some("96:0.25,64:0.5")).unwrap();
+        let mut layer = SaturnLayer::new(1, &bounds, 64, 64, 0, false, false, scroll).unwrap();
+        layer.page_columns = 1;
+        layer.page_rows = 1;
+        layer.page_count = 1;
+        layer.page_table = vec![0];
+        layer.pattern_name_data = vec![0; 64 * 64 * 2];
+        layer.update_sizes();
+        return layer;
+    }
 
-            results.push(saturn_layer);
+    #[test]
+    fn pattern_name_of_a_missing_tile_is_an_error() {
+        let tilesets = [SaturnTilesetInfo { tile_width: 8, tile_height: 8, tile_count: 4, bpp: 4, words_per_palette: 1, palette_bank: 2,
+                                            character_offset: 0, sprite_sheet: false }];
+        let pattern_names = PatternNameTable::new(&tilesets);
 
-            index+=1;
-        }
+        assert_eq!(pattern_names.get(0, 3, true, false), Ok(0x2403));
+        assert!(pattern_names.get(0, 4, false, false).is_err());
+        assert!(pattern_names.get(1, 0, false, false).is_err());
+    }
 
-        return Ok(results);
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let layer = sample_layer();
+        let bytes = encode(&layer);
+        assert_eq!(read_u32(&bytes, 4), layer.layer_size);
+        assert_eq!(read_u32(&bytes, LAYER_HEADER_SIZE as usize - 4), 64 * 64 * 2);
     }
-}
\ No newline at end of file
+}
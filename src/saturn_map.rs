@@ -1,95 +1,403 @@
+use std::io::{self, Seek, SeekFrom, Write};
+
 use tiled::Map;
 use crate::saturn_bitmap_layer::SaturnBitmapLayer;
-use crate::saturn_tileset::SaturnTileset;
-use crate::saturn_layer::SaturnLayer;
-use crate::saturn_collisions::SaturnCollision;
+use crate::saturn_budget::{BudgetLimits, SaturnBudget};
+use crate::saturn_character_allocation::SaturnCharacterAllocation;
+use crate::saturn_tileset::{self, SaturnTileset, SaturnTilesetInfo};
+use crate::saturn_layer::{SaturnLayer, TileBounds};
+use crate::saturn_collision_masks::SaturnCollisionMasks;
+use crate::saturn_collision_rects::SaturnCollisionRects;
+use crate::saturn_collisions::SaturnCollisions;
+use crate::saturn_object_layer::SaturnObjectLayer;
+use crate::saturn_profile;
+use crate::saturn_sprite_atlas::SaturnSpriteAtlas;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u32};
 
-use deku::prelude::*;
+// magic .. collision_offset, sections follow straight after the header
+const HEADER_SIZE: u32 = 52;
 
 #[repr(C)]
-#[derive(Debug, PartialEq, DekuRead, DekuWrite)]
-#[deku(endian = "endian", ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+#[derive(Debug, PartialEq)]
 struct SaturnMapHeader {
     magic: u32, 
     version: u32,
     width: u32, // Width of the map, in tiles.
     height: u32,
     tileset_count: u8, 
-    #[deku(update = "self.to_bytes().unwrap().len()")]
     tileset_offset: u32,
     layer_count: u8,
-    #[deku(update = "(self.to_bytes().unwrap().len() as u32) + self.layer_offset")]
     layer_offset: u32,
     bitmap_layer_count: u8,
-    #[deku(update = "(self.to_bytes().unwrap().len() as u32) + self.bitmap_layer_offset")]
     bitmap_layer_offset: u32,
-    #[deku(update = "(self.to_bytes().unwrap().len() as u32) + self.collision_offset")]
+    object_layer_count: u8,
+    object_layer_offset: u32,
+    sprite_atlas_offset: u32,
+    collision_rects_offset: u32,
+    collision_masks_offset: u32,
     collision_offset: u32
 }
 
 impl SaturnMapHeader {
-    fn new(width: u32, height: u32, tileset_count:u8, tilesets_size: u32, layer_count: u8, layers_size: u32, bitmap_layer_count: u8, bitmap_layers_size: u32) -> Self {
+    fn new(width: u32, height: u32, tileset_count:u8, tilesets_size: u32, layer_count: u8, layers_size: u32, bitmap_layer_count: u8, bitmap_layers_size: u32,
+           object_layer_count: u8, object_layers_size: u32, sprite_atlas_size: u32, collision_rects_size: u32,
+           collision_masks_size: u32) -> Self {
         SaturnMapHeader {
             magic: 0x894D4150, 
-            version: 4, 
+            version: 17, 
             width, 
             height,
             tileset_count,
-            tileset_offset: Default::default(),
+            tileset_offset: HEADER_SIZE,
             layer_count,
-            layer_offset: tilesets_size,
+            layer_offset: HEADER_SIZE + tilesets_size,
             bitmap_layer_count,
-            bitmap_layer_offset: tilesets_size + layers_size,
-            collision_offset: tilesets_size + layers_size + bitmap_layers_size
+            bitmap_layer_offset: HEADER_SIZE + tilesets_size + layers_size,
+            object_layer_count,
+            object_layer_offset: HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size,
+            sprite_atlas_offset: HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size + object_layers_size,
+            collision_rects_offset: HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size + object_layers_size + sprite_atlas_size,
+            collision_masks_offset: HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size + object_layers_size + sprite_atlas_size + collision_rects_size,
+            collision_offset: HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size + object_layers_size + sprite_atlas_size + collision_rects_size +
+                              collision_masks_size
         }
     }
 }
 
-#[derive(Debug, PartialEq, DekuWrite)]
-#[deku(ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+impl SaturnWrite for SaturnMapHeader {
+    fn encoded_size(&self) -> u32 {
+        HEADER_SIZE
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.magic)?;
+        write_u32(out, self.version)?;
+        write_u32(out, self.width)?;
+        write_u32(out, self.height)?;
+        write_u8(out, self.tileset_count)?;
+        write_u32(out, self.tileset_offset)?;
+        write_u8(out, self.layer_count)?;
+        write_u32(out, self.layer_offset)?;
+        write_u8(out, self.bitmap_layer_count)?;
+        write_u32(out, self.bitmap_layer_offset)?;
+        write_u8(out, self.object_layer_count)?;
+        write_u32(out, self.object_layer_offset)?;
+        write_u32(out, self.sprite_atlas_offset)?;
+        write_u32(out, self.collision_rects_offset)?;
+        write_u32(out, self.collision_masks_offset)?;
+        write_u32(out, self.collision_offset)
+    }
+}
+
+#[derive(Debug, PartialEq)]
 pub struct SaturnMap {
     header: SaturnMapHeader,
-    #[deku(count = "header.tileset_count", endian = "big")]
-    tilesets: Vec<SaturnTileset>,
-    #[deku(count = "header.layer_count", endian = "big")]
-    layers: Vec<SaturnLayer>,
-    #[deku(count = "header.bitmap_layer_count", endian = "big")]
-    bitmap_layers: Vec<SaturnBitmapLayer>,
-    #[deku(count = "header.width * header.height", endian = "big")]
-    collisions: Vec<SaturnCollision>
+    pub(crate) tilesets: Vec<SaturnTileset>,
+    pub(crate) layers: Vec<SaturnLayer>,
+    pub(crate) bitmap_layers: Vec<SaturnBitmapLayer>,
+    pub(crate) object_layers: Vec<SaturnObjectLayer>,
+    pub(crate) sprite_atlas: SaturnSpriteAtlas,
+    pub(crate) collision_rects: SaturnCollisionRects,
+    pub(crate) collision_masks: SaturnCollisionMasks,
+    pub(crate) collisions: SaturnCollisions
 }
 
 impl SaturnMap {
-    pub fn build(map: Map) -> Result<SaturnMap, String> {
-        let width = map.width;
-        let height = map.height;
-
-        let tilesets = SaturnTileset::build(map.tilesets())?;
-        let tileset_count = u8::try_from(tilesets.len()).map_err(|e| e.to_string())?;
-        let tilesets_size: u32 = tilesets.iter().map(|f| f.tileset_size).sum();
-
-        let layers = SaturnLayer::build(map.layers(), &tilesets)?;
-        let layer_count = u8::try_from(layers.len()).map_err(|e| e.to_string())?;
-        let layers_size: u32 = layers.iter().map(|f| f.layer_size).sum();
-
-        let bitmap_layers = SaturnBitmapLayer::build(map.layers())?;
-        let bitmap_layer_count = u8::try_from(bitmap_layers.len()).map_err(|e| e.to_string())?;
-        let bitmap_layers_size = bitmap_layers.iter().map(|f| f.layer_size).sum();
-
-        let collisions = SaturnCollision::build(width, height, map.layers())?;
-        
-        let mut header = SaturnMapHeader::new(width, height, tileset_count, tilesets_size, 
-                                                               layer_count, layers_size, bitmap_layer_count, 
-                                                               bitmap_layers_size);
-                                                               
-        header.update().map_err(|e| e.to_string())?;
-
-        return Ok(SaturnMap {
+    /// Encodes the map one section at a time, writing each section out as soon as it is produced so only the
+    /// section being encoded is held in memory. The header is written last, back-patched over a placeholder
+    /// once every section size is known.
+    ///
+    /// The export fails, before the header is written, if it goes over the hardware budgets or the map's limit
+    /// properties, with `limits` overriding the map's. Every section has been streamed to `out` by then, so write
+    /// to a temporary file and only move it over the previous output once this succeeds.
+    ///
+    /// Returns the report lines of the sections that have one, ending with the budget table. A failed budget
+    /// check gives the table in the error instead.
+    pub fn export<W: Write + Seek>(map: &Map, out: &mut W, limits: &BudgetLimits) -> Result<Vec<String>, String> {
+        let bounds = TileBounds::for_map(map);
+        let limits = limits.or(&BudgetLimits::from_map(map)?);
+        let mut budget = SaturnBudget::default();
+        let mut reports: Vec<String> = Vec::default();
+
+        let start = out.stream_position().map_err(|e| e.to_string())?;
+        out.write_all(&[0; HEADER_SIZE as usize]).map_err(|e| e.to_string())?;
+
+        let tileset_count = u8::try_from(map.tilesets().len()).map_err(|e| e.to_string())?;
+        let mut tilesets: Vec<SaturnTilesetInfo> = Vec::default();
+        let mut tileset_positions: Vec<u64> = Vec::default();
+        let mut sprite_sheets = Vec::default();
+        let mut tilesets_size: u32 = 0;
+        for tileset in map.tilesets().iter() {
+            let _stage = saturn_profile::stage_for("tileset", || tileset.name.clone());
+            let mut saturn_tileset = SaturnTileset::build_one(tileset)?;
+            reports.extend(saturn_tileset.report(&tileset.name));
+            let write_stage = saturn_profile::stage("write");
+            tileset_positions.push(out.stream_position().map_err(|e| e.to_string())?);
+            saturn_tileset.write_to(out).map_err(|e| e.to_string())?;
+            drop(write_stage);
+            budget.add_tileset(&saturn_tileset);
+            tilesets_size += saturn_tileset.tileset_size;
+            tilesets.push(saturn_tileset.info());
+            sprite_sheets.push(saturn_tileset.sprite_sheet.take());
+        }
+
+        // Tilesets are placed in VRAM once all of them are known, their offsets are back-patched like the header
+        let allocation = SaturnCharacterAllocation::allocate(&mut tilesets)?;
+        let position = out.stream_position().map_err(|e| e.to_string())?;
+        for (tileset_position, tileset) in tileset_positions.iter().zip(tilesets.iter()) {
+            out.seek(SeekFrom::Start(tileset_position + saturn_tileset::CHARACTER_OFFSET_FIELD)).map_err(|e| e.to_string())?;
+            write_u32(out, tileset.character_offset).map_err(|e| e.to_string())?;
+        }
+        out.seek(SeekFrom::Start(position)).map_err(|e| e.to_string())?;
+        budget.set_character_patterns(allocation.size);
+        reports.extend(allocation.report());
+
+        let atlas_stage = saturn_profile::stage("sprite_atlas");
+        let mut sprite_atlas = SaturnSpriteAtlas::from_tilesets(sprite_sheets.iter().map(|s| s.as_ref()))?;
+        drop(sprite_sheets);
+        drop(atlas_stage);
+
+        let mut layer_count: usize = 0;
+        let mut layers_size: u32 = 0;
+        SaturnLayer::build_each(map.layers(), &tilesets, &bounds, |layer| {
+            let _stage = saturn_profile::stage("write");
+            layer.write_to(out).map_err(|e| e.to_string())?;
+            budget.add_layer(&layer);
+            layer_count += 1;
+            layers_size += layer.layer_size;
+            Ok(())
+        })?;
+
+        let mut bitmap_layer_count: usize = 0;
+        let mut bitmap_layers_size: u32 = 0;
+        SaturnBitmapLayer::build_each(map.layers(), |mut bitmap_layer| {
+            let position = out.stream_position().map_err(|e| e.to_string())? - start;
+            bitmap_layer.align_to(position as u32);
+            let _stage = saturn_profile::stage("write");
+            bitmap_layer.write_to(out).map_err(|e| e.to_string())?;
+            budget.add_bitmap_layer(&bitmap_layer);
+            bitmap_layer_count += 1;
+            bitmap_layers_size += bitmap_layer.layer_size;
+            Ok(())
+        })?;
+
+        let mut object_layer_count: usize = 0;
+        let mut object_layers_size: u32 = 0;
+        SaturnObjectLayer::build_each(map.layers(), bounds.pixel_origin(map), map.tilesets(), &sprite_atlas, |mut object_layer| {
+            let position = out.stream_position().map_err(|e| e.to_string())? - start;
+            object_layer.align_to(position as u32);
+            let _stage = saturn_profile::stage("write");
+            object_layer.write_to(out).map_err(|e| e.to_string())?;
+            budget.add_object_layer(&object_layer);
+            object_layer_count += 1;
+            object_layers_size += object_layer.layer_size;
+            Ok(())
+        })?;
+
+        let position = out.stream_position().map_err(|e| e.to_string())? - start;
+        sprite_atlas.align_to(position as u32);
+        let write_stage = saturn_profile::stage_for("write", || String::from("sprite_atlas"));
+        sprite_atlas.write_to(out).map_err(|e| e.to_string())?;
+        drop(write_stage);
+        budget.add_sprite_atlas(&sprite_atlas);
+        reports.extend(sprite_atlas.report());
+
+        let rects_stage = saturn_profile::stage("collision_rects");
+        let collision_rects = SaturnCollisionRects::build(map, &bounds)?;
+        collision_rects.write_to(out).map_err(|e| e.to_string())?;
+        budget.add_collision_rects(&collision_rects);
+        reports.extend(collision_rects.report());
+        drop(rects_stage);
+
+        let masks_stage = saturn_profile::stage("collision_masks");
+        let collision_masks = SaturnCollisionMasks::build(map, &bounds)?;
+        collision_masks.write_to(out).map_err(|e| e.to_string())?;
+        budget.add_collision_masks();
+        reports.extend(collision_masks.report());
+        drop(masks_stage);
+
+        let collisions_stage = saturn_profile::stage("collisions");
+        let collisions = SaturnCollisions::build(map, &bounds)?;
+        collisions.write_to(out).map_err(|e| e.to_string())?;
+        budget.add_collisions(&collisions);
+        reports.extend(collisions.report());
+        drop(collisions_stage);
+
+        let layer_count = u8::try_from(layer_count).map_err(|e| e.to_string())?;
+        let bitmap_layer_count = u8::try_from(bitmap_layer_count).map_err(|e| e.to_string())?;
+        let object_layer_count = u8::try_from(object_layer_count).map_err(|e| e.to_string())?;
+        let header = SaturnMapHeader::new(bounds.width, bounds.height, tileset_count, tilesets_size, 
+                                          layer_count, layers_size, bitmap_layer_count, 
+                                          bitmap_layers_size, object_layer_count, object_layers_size, sprite_atlas.atlas_size,
+                                          collision_rects.rects_size, collision_masks.masks_size);
+
+        let end = out.stream_position().map_err(|e| e.to_string())?;
+        budget.set_data_size((end - start) as u32);
+        let table = budget.table(&limits);
+        budget.check(&limits).map_err(|e| format!("{}{}", table, e))?;
+        reports.push(String::from(table.trim_end()));
+
+        out.seek(SeekFrom::Start(start)).map_err(|e| e.to_string())?;
+        header.write_to(out).map_err(|e| e.to_string())?;
+        out.seek(SeekFrom::Start(end)).map_err(|e| e.to_string())?;
+
+        return Ok(reports);
+    }
+
+    pub fn from_sections(width: u32, height: u32, tilesets: Vec<SaturnTileset>, layers: Vec<SaturnLayer>, 
+                         bitmap_layers: Vec<SaturnBitmapLayer>, object_layers: Vec<SaturnObjectLayer>, 
+                         sprite_atlas: SaturnSpriteAtlas, collision_rects: SaturnCollisionRects, 
+                         collision_masks: SaturnCollisionMasks, collisions: SaturnCollisions) -> Result<SaturnMap, String> {
+        let header = SaturnMapHeader::new(width, height, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+        let mut saturn_map = SaturnMap {
             header,
             tilesets,
             layers,
             bitmap_layers,
+            object_layers,
+            sprite_atlas,
+            collision_rects,
+            collision_masks,
             collisions
-        });
+        };
+
+        saturn_map.refresh_header()?;
+
+        return Ok(saturn_map);
+    }
+
+    /// The report lines of the sprite atlas and the collision rects, masks and shapes, for a map built in memory.
+    pub fn section_reports(&self) -> Vec<String> {
+        let mut reports: Vec<String> = Vec::default();
+        reports.extend(self.sprite_atlas.report());
+        reports.extend(self.collision_rects.report());
+        reports.extend(self.collision_masks.report());
+        reports.extend(self.collisions.report());
+        return reports;
+    }
+
+    /// Updates the exported map size, in tiles, for a map that has been resized.
+    pub fn set_size(&mut self, width: u32, height: u32) {
+        self.header.width = width;
+        self.header.height = height;
+    }
+
+    /// Recomputes section counts and offsets after any section has been replaced.
+    pub fn refresh_header(&mut self) -> Result<(), String> {
+        let tileset_count = u8::try_from(self.tilesets.len()).map_err(|e| e.to_string())?;
+        let tilesets_size: u32 = self.tilesets.iter().map(|f| f.tileset_size).sum();
+
+        let layer_count = u8::try_from(self.layers.len()).map_err(|e| e.to_string())?;
+        let layers_size: u32 = self.layers.iter().map(|f| f.layer_size).sum();
+
+        let bitmap_layer_count = u8::try_from(self.bitmap_layers.len()).map_err(|e| e.to_string())?;
+        let mut bitmap_layers_size: u32 = 0;
+        for bitmap_layer in self.bitmap_layers.iter_mut() {
+            bitmap_layer.align_to(HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size);
+            bitmap_layers_size += bitmap_layer.layer_size;
+        }
+
+        let object_layer_count = u8::try_from(self.object_layers.len()).map_err(|e| e.to_string())?;
+        let mut object_layers_size: u32 = 0;
+        for object_layer in self.object_layers.iter_mut() {
+            object_layer.align_to(HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size + object_layers_size);
+            object_layers_size += object_layer.layer_size;
+        }
+
+        self.sprite_atlas.align_to(HEADER_SIZE + tilesets_size + layers_size + bitmap_layers_size + object_layers_size);
+
+        self.header = SaturnMapHeader::new(self.header.width, self.header.height, tileset_count, tilesets_size, 
+                                                            layer_count, layers_size, bitmap_layer_count, 
+                                                            bitmap_layers_size, object_layer_count, object_layers_size,
+                                                            self.sprite_atlas.atlas_size, self.collision_rects.rects_size,
+                                                            self.collision_masks.masks_size);
+
+        return Ok(());
+    }
+}
+
+impl SaturnWrite for SaturnMap {
+    fn encoded_size(&self) -> u32 {
+        self.header.collision_offset + self.collisions.collisions_size
     }
-}
\ No newline at end of file
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        self.header.write_to(out)?;
+        for tileset in self.tilesets.iter() {
+            tileset.write_to(out)?;
+        }
+        for layer in self.layers.iter() {
+            layer.write_to(out)?;
+        }
+        for bitmap_layer in self.bitmap_layers.iter() {
+            bitmap_layer.write_to(out)?;
+        }
+        for object_layer in self.object_layers.iter() {
+            object_layer.write_to(out)?;
+        }
+        self.sprite_atlas.write_to(out)?;
+        self.collision_rects.write_to(out)?;
+        self.collision_masks.write_to(out)?;
+        self.collisions.write_to(out)?;
+        return Ok(());
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::saturn_bitmap_layer::tests::sample_bitmap_layer;
+    use crate::saturn_collision_masks::tests::sample_collision_masks;
+    use crate::saturn_collision_rects::tests::sample_collision_rects;
+    use crate::saturn_collisions::tests::sample_collisions;
+    use crate::saturn_layer::tests::sample_layer;
+    use crate::saturn_object_layer::tests::sample_object_layer;
+    use crate::saturn_sprite_atlas::tests::sample_sprite_atlas;
+    use crate::saturn_tileset::tests::sample_tileset;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    #[test]
+    fn header_encoded_size_matches_written_bytes() {
+        let header = SaturnMapHeader::new(64, 64, 1, 126, 1, 8290, 0, 0, 0, 0, 13, 1, 6);
+        assert_eq!(encode(&header).len() as u32, HEADER_SIZE);
+    }
+
+    #[test]
+    fn header_offsets_point_at_each_section() {
+        let saturn_map = SaturnMap::from_sections(64, 64, vec![sample_tileset()], vec![sample_layer()], vec![sample_bitmap_layer()],
+                                                  vec![sample_object_layer()], sample_sprite_atlas(), sample_collision_rects(),
+                                                  sample_collision_masks(), sample_collisions()).unwrap();
+        let bytes = encode(&saturn_map);
+
+        assert_eq!(read_u32(&bytes, 0), 0x894D4150);
+        assert_eq!(read_u32(&bytes, 4), 17);
+        assert_eq!((read_u32(&bytes, 8), read_u32(&bytes, 12)), (64, 64));
+        assert_eq!((bytes[16], bytes[21], bytes[26], bytes[31]), (1, 1, 1, 1));
+
+        let tileset_offset = read_u32(&bytes, 17);
+        let layer_offset = read_u32(&bytes, 22);
+        let bitmap_layer_offset = read_u32(&bytes, 27);
+        let object_layer_offset = read_u32(&bytes, 32);
+        let sprite_atlas_offset = read_u32(&bytes, 36);
+        let collision_rects_offset = read_u32(&bytes, 40);
+        let collision_masks_offset = read_u32(&bytes, 44);
+        let collision_offset = read_u32(&bytes, 48);
+
+        // Each section follows the previous one, starting with its size or with its id and size
+        assert_eq!(tileset_offset, HEADER_SIZE);
+        assert_eq!(layer_offset, tileset_offset + read_u32(&bytes, tileset_offset as usize));
+        assert_eq!(bitmap_layer_offset, layer_offset + read_u32(&bytes, layer_offset as usize + 4));
+        assert_eq!(object_layer_offset, bitmap_layer_offset + read_u32(&bytes, bitmap_layer_offset as usize + 4));
+        assert_eq!(sprite_atlas_offset, object_layer_offset + read_u32(&bytes, object_layer_offset as usize + 4));
+        assert_eq!(collision_rects_offset, sprite_atlas_offset + read_u32(&bytes, sprite_atlas_offset as usize));
+        assert_eq!(collision_masks_offset, collision_rects_offset + saturn_map.collision_rects.rects_size);
+        assert_eq!(collision_offset, collision_masks_offset + read_u32(&bytes, collision_masks_offset as usize));
+        assert_eq!(bytes.len() as u32, collision_offset + read_u32(&bytes, collision_offset as usize));
+
+        assert_eq!(bytes[collision_rects_offset as usize], 1);
+        assert_eq!(read_u32(&bytes, layer_offset as usize), 1);
+        assert_eq!(read_u32(&bytes, bitmap_layer_offset as usize), 2);
+        assert_eq!(read_u32(&bytes, object_layer_offset as usize), 3);
+    }
+}
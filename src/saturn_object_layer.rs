@@ -0,0 +1,287 @@
+use std::io::{self, Write};
+use std::sync::Arc;
+
+use tiled::{Layer, ObjectShape, Properties, PropertyValue, Tileset};
+
+use crate::saturn_profile;
+use crate::saturn_sprite_atlas::SaturnSpriteAtlas;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
+
+// id, layer_size, object_count and record_padding, followed by the padding, the records and the object ids
+const OBJECT_LAYER_HEADER_SIZE: u32 = 11;
+
+// SCU DMA moves longs, so the records start on a 4 byte boundary from the start of the output
+const RECORD_ALIGNMENT: u32 = 4;
+
+// Size of a vdp1_cmdt_t
+const RECORD_SIZE: u32 = 32;
+
+// CMDCTRL, jump mode skip for hidden objects and the character read direction
+const CTRL_JUMP_SKIP: u16 = 0x4000;
+const CTRL_FLIP_H: u16 = 0x0010;
+const CTRL_FLIP_V: u16 = 0x0020;
+
+// CMDPMOD draw mode bits
+const PMOD_PRE_CLIPPING_DISABLE: u16 = 0x0800;
+const PMOD_MESH_ENABLE: u16 = 0x0100;
+const PMOD_END_CODE_DISABLE: u16 = 0x0080;
+const PMOD_TRANS_PIXEL_DISABLE: u16 = 0x0040;
+
+// Size of VDP1 VRAM, character addresses are stored in units of 8 bytes
+const VDP1_VRAM_SIZE: u32 = 0x80000;
+
+/// Looks a property up on the object first, then on the tile it shows.
+fn object_property<'p>(properties: &'p Properties, tile_properties: Option<&'p Properties>, name: &str) -> Option<&'p PropertyValue> {
+    properties.get(name).or_else(|| tile_properties.and_then(|p| p.get(name)))
+}
+
+fn int_property(value: Option<&PropertyValue>, name: &str, default: u32) -> Result<u32, String> {
+    let result: u32 = match value {
+        None => default,
+        Some(PropertyValue::IntValue(s)) => u32::try_from(*s).map_err(|e| format!("Invalid {} {:?}", name, e))?,
+        Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid {} {:?}", name, e))?,
+        _ => Err(format!("Invalid {}", name))?
+    };
+    return Ok(result);
+}
+
+fn bool_property(value: Option<&PropertyValue>, name: &str) -> Result<bool, String> {
+    let result: bool = match value {
+        None => false,
+        Some(PropertyValue::BoolValue(b)) => *b,
+        Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid {} {:?}", name, e))?,
+        _ => Err(format!("Invalid {}", name))?
+    };
+    return Ok(result);
+}
+
+/// One normal sprite command in the VDP1 command table layout, every field a big endian word.
+#[derive(Debug, PartialEq, Default, Clone, Copy)]
+struct SpriteRecord {
+    ctrl: u16,
+    pmod: u16,
+    colr: u16,
+    srca: u16,
+    size: u16,
+    xa: i16,
+    ya: i16
+}
+
+impl SpriteRecord {
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u16(out, self.ctrl)?;
+        write_u16(out, 0)?; // link
+        write_u16(out, self.pmod)?;
+        write_u16(out, self.colr)?;
+        write_u16(out, self.srca)?;
+        write_u16(out, self.size)?;
+        write_u16(out, self.xa as u16)?;
+        write_u16(out, self.ya as u16)?;
+        for _ in 0..6 {
+            write_u16(out, 0)?; // xb .. yd
+        }
+        write_u16(out, 0)?; // grda
+        write_u16(out, 0) // reserved
+    }
+}
+
+/// Tile and rectangle objects of an object layer, exported as ready to copy VDP1 normal sprite commands.
+///
+/// Positions are in pixels from the top left of the exported map. Character data is placed with the layer's
+/// `texture_base` property plus the `char_address` of the object or its tile, both VDP1 VRAM byte offsets,
+/// and `color_mode`, `color_bank`, `trans_pixel_disable`, `end_code_disable`, `pre_clipping_disable` and
+/// `mesh_enable` fill in the draw mode. Tile objects showing a sprite sheet frame default to the frame's place
+/// in the sprite atlas, its size and its colors. Hidden objects are exported with their command skipped.
+#[repr(C)]
+#[derive(Debug, PartialEq)]
+pub struct SaturnObjectLayer {
+    id: u32,
+    pub layer_size: u32,
+    object_count: u16,
+    record_padding: u8,
+    records: Vec<SpriteRecord>,
+    object_ids: Vec<u32>
+}
+
+impl SaturnObjectLayer {
+    fn new(id: u32, records: Vec<SpriteRecord>, object_ids: Vec<u32>) -> Result<Self, String> {
+        let object_count = u16::try_from(records.len()).map_err(|e| e.to_string())?;
+        let mut object_layer = SaturnObjectLayer {
+            id,
+            layer_size: Default::default(),
+            object_count,
+            record_padding: Default::default(),
+            records,
+            object_ids
+        };
+        object_layer.layer_size = object_layer.encoded_size();
+        Ok(object_layer)
+    }
+
+    /// Bytes of VDP1 VRAM the layer's sprite commands take once copied to the command table.
+    pub fn command_table_size(&self) -> u32 {
+        self.records.len() as u32 * RECORD_SIZE
+    }
+
+    /// Pads the records so they start on an aligned address once this section is written at `section_offset`
+    /// from the start of the output.
+    pub fn align_to(&mut self, section_offset: u32) {
+        let records_offset = section_offset + OBJECT_LAYER_HEADER_SIZE;
+        self.record_padding = ((RECORD_ALIGNMENT - records_offset % RECORD_ALIGNMENT) % RECORD_ALIGNMENT) as u8;
+        self.layer_size = self.encoded_size();
+    }
+
+    fn build_record<'a>(layer: &Layer<'a>, object: &tiled::Object<'a>, origin: (i32, i32), tilesets: &[Arc<Tileset>],
+                        atlas: &SaturnSpriteAtlas) -> Result<Option<SpriteRecord>, String> {
+        let (width, height) = match object.shape {
+            ObjectShape::Rect { width, height } => (width.round() as u32, height.round() as u32),
+            _ => return Ok(None)
+        };
+
+        let object_tile = object.get_tile();
+        let tile = object_tile.as_ref().and_then(|t| t.get_tile());
+        let tile_properties = tile.as_ref().map(|t| &t.properties);
+        let frame = object_tile.as_ref().and_then(|t| atlas.frame(tilesets, t.get_tileset(), t.id()));
+
+        // Sprites are drawn at the size of their frame, scaling a tile object does not change it
+        let (width, height) = frame.map_or((width, height), |f| ((f.size >> 8) as u32 * 8, (f.size & 0xFF) as u32));
+
+        if width % 8 != 0 || width == 0 || width > 504 || height == 0 || height > 255 {
+            return Err(format!("Object {} is {}x{}, sprites must be 8 to 504 pixels wide in steps of 8 and 1 to 255 high", object.id(), width, height));
+        }
+
+        let texture_base = int_property(layer.properties.get("texture_base"), "texture_base", 0)?;
+        let frame_address = frame.map_or(0, |f| f.char_address as u32 * 8);
+        let char_address = texture_base + int_property(object_property(&object.properties, tile_properties, "char_address"), "char_address", frame_address)?;
+        if char_address % 8 != 0 || char_address >= VDP1_VRAM_SIZE {
+            return Err(format!("Object {} char_address 0x{:X} must be 8 byte aligned inside VDP1 VRAM", object.id(), char_address));
+        }
+
+        let color_mode = int_property(object_property(&object.properties, tile_properties, "color_mode"), "color_mode", frame.map_or(0, |f| f.color_mode as u32))?;
+        if color_mode > 5 {
+            return Err(format!("Object {} color_mode {} must be 0 to 5", object.id(), color_mode));
+        }
+        let color_bank = int_property(object_property(&object.properties, tile_properties, "color_bank"), "color_bank", frame.map_or(0, |f| f.color_bank as u32))?;
+        let color_bank = u16::try_from(color_bank).map_err(|e| format!("Invalid color_bank {:?}", e))?;
+
+        let mut pmod = (color_mode as u16) << 3;
+        let flags = [("pre_clipping_disable", PMOD_PRE_CLIPPING_DISABLE), ("mesh_enable", PMOD_MESH_ENABLE),
+                     ("end_code_disable", PMOD_END_CODE_DISABLE), ("trans_pixel_disable", PMOD_TRANS_PIXEL_DISABLE)];
+        for (name, bit) in flags {
+            if bool_property(object_property(&object.properties, tile_properties, name), name)? {
+                pmod |= bit;
+            }
+        }
+
+        let mut ctrl: u16 = 0;
+        if !object.visible {
+            ctrl |= CTRL_JUMP_SKIP;
+        }
+
+        // Tile objects are anchored at their bottom left corner
+        let mut y = object.y.round() as i32;
+        if let Some(object_tile) = object_tile.as_ref() {
+            y -= height as i32;
+            if object_tile.flip_h {
+                ctrl |= CTRL_FLIP_H;
+            }
+            if object_tile.flip_v {
+                ctrl |= CTRL_FLIP_V;
+            }
+        }
+
+        let xa = i16::try_from(object.x.round() as i32 - origin.0).map_err(|e| format!("Object {} x {:?}", object.id(), e))?;
+        let ya = i16::try_from(y - origin.1).map_err(|e| format!("Object {} y {:?}", object.id(), e))?;
+
+        Ok(Some(SpriteRecord {
+            ctrl,
+            pmod,
+            colr: color_bank,
+            srca: (char_address >> 3) as u16,
+            size: (((width / 8) << 8) | height) as u16,
+            xa,
+            ya
+        }))
+    }
+
+    pub fn build<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>, origin: (i32, i32), tilesets: &[Arc<Tileset>],
+                     atlas: &SaturnSpriteAtlas) -> Result<Vec<Self>, String> {
+        let mut results: Vec<SaturnObjectLayer> = Vec::default();
+
+        SaturnObjectLayer::build_each(layers, origin, tilesets, atlas, |object_layer| {
+            results.push(object_layer);
+            Ok(())
+        })?;
+
+        return Ok(results);
+    }
+
+    /// Builds the object layers one at a time in map order, `origin` is the top left of the exported map in pixels.
+    pub fn build_each<'a>(layers: impl ExactSizeIterator<Item = Layer<'a>>, origin: (i32, i32), tilesets: &[Arc<Tileset>],
+                          atlas: &SaturnSpriteAtlas, mut f: impl FnMut(SaturnObjectLayer) -> Result<(), String>) -> Result<(), String> {
+        for layer in layers {
+            let object_layer = match layer.layer_type() {
+                tiled::LayerType::Objects(object_layer) => object_layer,
+                _ => continue
+            };
+
+            let _stage = saturn_profile::stage_for("object_layer", || layer.id().to_string());
+            let mut records: Vec<SpriteRecord> = Vec::default();
+            let mut object_ids: Vec<u32> = Vec::default();
+
+            for object in object_layer.objects() {
+                if let Some(record) = SaturnObjectLayer::build_record(&layer, &object, origin, tilesets, atlas).map_err(|e| format!("{} in layer {}", e, layer.id()))? {
+                    records.push(record);
+                    object_ids.push(object.id());
+                }
+            }
+
+            f(SaturnObjectLayer::new(layer.id(), records, object_ids)?)?;
+        }
+
+        return Ok(());
+    }
+}
+
+impl SaturnWrite for SaturnObjectLayer {
+    fn encoded_size(&self) -> u32 {
+        OBJECT_LAYER_HEADER_SIZE + self.record_padding as u32 + self.records.len() as u32 * RECORD_SIZE + self.object_ids.len() as u32 * 4
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.id)?;
+        write_u32(out, self.layer_size)?;
+        write_u16(out, self.object_count)?;
+        write_u8(out, self.record_padding)?;
+        out.write_all(&vec![0; self.record_padding as usize])?;
+        for record in self.records.iter() {
+            record.write_to(out)?;
+        }
+        for object_id in self.object_ids.iter() {
+            write_u32(out, *object_id)?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// Two sprites with their object ids.
+    pub(crate) fn sample_object_layer() -> SaturnObjectLayer {
+        SaturnObjectLayer::new(3, vec![SpriteRecord::default(); 2], vec![7, 8]).unwrap()
+    }
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let mut layer = sample_object_layer();
+        for section_offset in 52..56 {
+            layer.align_to(section_offset);
+            let bytes = encode(&layer);
+            assert_eq!(read_u32(&bytes, 4), layer.layer_size);
+            assert_eq!((section_offset + OBJECT_LAYER_HEADER_SIZE + layer.record_padding as u32) % RECORD_ALIGNMENT, 0);
+        }
+    }
+}
@@ -0,0 +1,409 @@
+use std::fs;
+use std::io::{self, Write};
+use std::ops::Range;
+use std::path::Path;
+
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u32};
+
+const PATCH_MAGIC: u32 = 0x89504154;
+const PATCH_VERSION: u32 = 1;
+
+// magic .. operation_count
+const PATCH_HEADER_SIZE: u32 = 24;
+// section kind, section index, offset and size, before the bytes themselves
+const OPERATION_HEADER_SIZE: u32 = 10;
+
+// Ranges are widened to long boundaries from the start of their region, VRAM and CRAM take 16 and 32 bit writes
+const RANGE_ALIGNMENT: u32 = 4;
+
+const MAP_HEADER_SIZE: usize = 52;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum SectionKind {
+    Tileset = 0,
+    Layer = 1,
+    BitmapLayer = 2,
+    ObjectLayer = 3,
+    SpriteAtlas = 4,
+    Collisions = 5,
+    CollisionRects = 6,
+    CollisionMasks = 7
+}
+
+impl SectionKind {
+    fn name(&self) -> &'static str {
+        match self {
+            SectionKind::Tileset => "Tileset",
+            SectionKind::Layer => "Layer",
+            SectionKind::BitmapLayer => "Bitmap layer",
+            SectionKind::ObjectLayer => "Object layer",
+            SectionKind::SpriteAtlas => "Sprite atlas",
+            SectionKind::Collisions => "Collisions",
+            SectionKind::CollisionRects => "Collision rects",
+            SectionKind::CollisionMasks => "Collision masks"
+        }
+    }
+}
+
+/// A part of a section. Data uploaded to VRAM or CRAM, and the collisions, are patched by changed byte ranges,
+/// anything else is replaced whole when any of it changes.
+#[derive(Debug, PartialEq)]
+struct Region {
+    range: Range<u32>,
+    ranged: bool
+}
+
+#[derive(Debug)]
+struct Section {
+    kind: SectionKind,
+    index: u8,
+    regions: Vec<Region>
+}
+
+pub(crate) fn read_u8(bytes: &[u8], position: u32) -> Result<u32, String> {
+    return bytes.get(position as usize).map(|b| *b as u32).ok_or(format!("Truncated map at {}", position));
+}
+
+pub(crate) fn read_u16(bytes: &[u8], position: u32) -> Result<u32, String> {
+    return Ok(read_u8(bytes, position)? << 8 | read_u8(bytes, position + 1)?);
+}
+
+pub(crate) fn read_u32(bytes: &[u8], position: u32) -> Result<u32, String> {
+    return Ok(read_u16(bytes, position)? << 16 | read_u16(bytes, position + 2)?);
+}
+
+fn whole(range: Range<u32>) -> Region {
+    Region { range, ranged: false }
+}
+
+fn ranged(range: Range<u32>) -> Region {
+    Region { range, ranged: true }
+}
+
+/// Splits an exported map into its sections, following the offsets and sizes libtiled2saturn parses.
+fn sections(bytes: &[u8]) -> Result<Vec<Section>, String> {
+    if read_u32(bytes, 0)? != 0x894D4150 {
+        return Err(String::from("Not a tiled2saturn map"));
+    }
+
+    let mut sections = Vec::default();
+
+    let mut offset = read_u32(bytes, 17)?;
+    for index in 0..read_u8(bytes, 16)? as u8 {
+        let size = read_u32(bytes, offset)?;
+        let palette_size = read_u32(bytes, offset + 26)?;
+        let palette_end = offset + 30 + palette_size;
+        sections.push(Section { kind: SectionKind::Tileset, index, regions: vec![
+            whole(offset..offset + 30), ranged(offset + 30..palette_end),
+            whole(palette_end..palette_end + 4), ranged(palette_end + 4..offset + size)
+        ]});
+        offset += size;
+    }
+
+    let mut offset = read_u32(bytes, 22)?;
+    for index in 0..read_u8(bytes, 21)? as u8 {
+        let size = read_u32(bytes, offset + 4)?;
+        let page_table_size = read_u16(bytes, offset + 28)? * read_u16(bytes, offset + 30)? * 2;
+        let pattern_name_data = offset + 60 + read_u16(bytes, offset + 58)? * 8 + page_table_size;
+        sections.push(Section { kind: SectionKind::Layer, index, regions: vec![
+            whole(offset..pattern_name_data), ranged(pattern_name_data..offset + size)
+        ]});
+        offset += size;
+    }
+
+    let mut offset = read_u32(bytes, 27)?;
+    for index in 0..read_u8(bytes, 26)? as u8 {
+        let size = read_u32(bytes, offset + 4)?;
+        let palette_end = offset + 23 + read_u32(bytes, offset + 19)?;
+        let bitmap = palette_end + 5 + read_u8(bytes, palette_end + 4)?;
+        sections.push(Section { kind: SectionKind::BitmapLayer, index, regions: vec![
+            whole(offset..offset + 23), ranged(offset + 23..palette_end), whole(palette_end..bitmap), ranged(bitmap..offset + size)
+        ]});
+        offset += size;
+    }
+
+    let mut offset = read_u32(bytes, 32)?;
+    for index in 0..read_u8(bytes, 31)? as u8 {
+        let size = read_u32(bytes, offset + 4)?;
+        sections.push(Section { kind: SectionKind::ObjectLayer, index, regions: vec![whole(offset..offset + size)] });
+        offset += size;
+    }
+
+    let offset = read_u32(bytes, 36)?;
+    let size = read_u32(bytes, offset)?;
+    let texture = offset + 13 + read_u16(bytes, offset + 4)? * 6 + read_u16(bytes, offset + 6)? * 8 + read_u8(bytes, offset + 12)?;
+    sections.push(Section { kind: SectionKind::SpriteAtlas, index: 0, regions: vec![
+        whole(offset..texture), ranged(texture..offset + size)
+    ]});
+
+    let mut offset = read_u32(bytes, 40)? + 1;
+    for index in 0..read_u8(bytes, offset - 1)? as u8 {
+        let size = read_u32(bytes, offset + 4)?;
+        sections.push(Section { kind: SectionKind::CollisionRects, index, regions: vec![whole(offset..offset + size)] });
+        offset += size;
+    }
+
+    let offset = read_u32(bytes, 44)?;
+    let mut masks = offset + 6;
+    for _ in 0..read_u8(bytes, offset + 4)? {
+        masks += 1 + read_u8(bytes, masks)?;
+    }
+    sections.push(Section { kind: SectionKind::CollisionMasks, index: 0, regions: vec![
+        whole(offset..masks), ranged(masks..offset + read_u32(bytes, offset)?)
+    ]});
+
+    let offset = read_u32(bytes, 48)?;
+    let records = offset + 19 + read_u16(bytes, offset + 7)? * read_u16(bytes, offset + 9)? * 2 + read_u32(bytes, offset + 11)? * 12;
+    sections.push(Section { kind: SectionKind::Collisions, index: 0, regions: vec![
+        whole(offset..records), ranged(records..offset + read_u32(bytes, offset)?)
+    ]});
+
+    for section in sections.iter() {
+        if section.regions.iter().any(|r| r.range.start > r.range.end || r.range.end as usize > bytes.len()) {
+            return Err(format!("{} {} runs past the end of the map", section.kind.name(), section.index));
+        }
+    }
+
+    return Ok(sections);
+}
+
+/// Changed byte ranges of a region, widened to long boundaries. Ranges closer than an operation header are
+/// merged, sending the unchanged bytes between them is cheaper than starting another operation.
+fn changed_ranges(old: &[u8], new: &[u8], region: &Range<u32>) -> Vec<Range<u32>> {
+    let mut ranges: Vec<Range<u32>> = Vec::default();
+    let mut position = region.start;
+
+    while position < region.end {
+        if old[position as usize] == new[position as usize] {
+            position += 1;
+            continue;
+        }
+
+        let start = region.start + (position - region.start) / RANGE_ALIGNMENT * RANGE_ALIGNMENT;
+        while position < region.end && old[position as usize] != new[position as usize] {
+            position += 1;
+        }
+        let end = (region.start + (position - region.start).div_ceil(RANGE_ALIGNMENT) * RANGE_ALIGNMENT).min(region.end);
+
+        match ranges.last_mut() {
+            Some(last) if start <= last.end + OPERATION_HEADER_SIZE => last.end = end,
+            _ => ranges.push(start..end)
+        }
+        position = end;
+    }
+
+    return ranges;
+}
+
+/// The checksum patches carry of the map they apply to and of the map they produce.
+pub fn adler32(bytes: &[u8]) -> u32 {
+    let mut a: u32 = 1;
+    let mut b: u32 = 0;
+    // The most bytes that can be summed before b could overflow
+    for chunk in bytes.chunks(5552) {
+        for byte in chunk {
+            a += *byte as u32;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+#[derive(Debug, PartialEq)]
+struct PatchOperation {
+    kind: SectionKind,
+    index: u8,
+    offset: u32,
+    data: Vec<u8>
+}
+
+/// The changes between two exports of a map with the same layout, which `tiled2saturn_apply_patch` writes over the
+/// older data.bin in memory.
+#[derive(Debug, PartialEq)]
+pub struct SaturnPatch {
+    data_size: u32,
+    base_checksum: u32,
+    target_checksum: u32,
+    operations: Vec<PatchOperation>
+}
+
+impl SaturnPatch {
+    /// Finds the sections that changed from `old` to `new`. Patches are applied in place, so this fails if the
+    /// map was resized or any section changed size, the whole of `new` has to be transferred instead.
+    pub fn diff(old: &[u8], new: &[u8]) -> Result<Self, String> {
+        let old_sections = sections(old)?;
+        let new_sections = sections(new)?;
+
+        if old.len() != new.len() || old[..MAP_HEADER_SIZE] != new[..MAP_HEADER_SIZE] || old_sections.len() != new_sections.len() {
+            return Err(String::from("Map layout changed, transfer the whole map"));
+        }
+
+        let mut operations = Vec::default();
+        for (old_section, new_section) in old_sections.iter().zip(new_sections.iter()) {
+            if old_section.regions != new_section.regions {
+                return Err(format!("{} {} changed size, transfer the whole map", new_section.kind.name(), new_section.index));
+            }
+
+            for region in new_section.regions.iter() {
+                let range = region.range.start as usize..region.range.end as usize;
+                if old[range.clone()] == new[range.clone()] {
+                    continue;
+                }
+
+                let ranges = if region.ranged { changed_ranges(old, new, &region.range) } else { vec![region.range.clone()] };
+                for range in ranges {
+                    operations.push(PatchOperation {
+                        kind: new_section.kind,
+                        index: new_section.index,
+                        offset: range.start,
+                        data: new[range.start as usize..range.end as usize].to_vec()
+                    });
+                }
+            }
+        }
+
+        return Ok(SaturnPatch {
+            data_size: new.len() as u32,
+            base_checksum: adler32(old),
+            target_checksum: adler32(new),
+            operations
+        });
+    }
+
+    pub fn report(&self) -> String {
+        let changed: usize = self.operations.iter().map(|o| o.data.len()).sum();
+        format!("Patch: {} bytes in {} changed ranges, {} bytes to transfer instead of {}",
+                changed, self.operations.len(), self.encoded_size(), self.data_size)
+    }
+}
+
+impl SaturnWrite for SaturnPatch {
+    fn encoded_size(&self) -> u32 {
+        PATCH_HEADER_SIZE + self.operations.iter().map(|o| OPERATION_HEADER_SIZE + o.data.len() as u32).sum::<u32>()
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, PATCH_MAGIC)?;
+        write_u32(out, PATCH_VERSION)?;
+        write_u32(out, self.data_size)?;
+        write_u32(out, self.base_checksum)?;
+        write_u32(out, self.target_checksum)?;
+        write_u32(out, self.operations.len() as u32)?;
+        for operation in self.operations.iter() {
+            write_u8(out, operation.kind as u8)?;
+            write_u8(out, operation.index)?;
+            write_u32(out, operation.offset)?;
+            write_u32(out, operation.data.len() as u32)?;
+            out.write_all(&operation.data)?;
+        }
+        return Ok(());
+    }
+}
+
+/// Writes the patch from `previous`, the output before this export, to the output now on disk. Any earlier patch
+/// is removed first, so a patch that no longer applies is never left behind when there is nothing to patch from
+/// or the layout changed.
+pub fn write_patch(previous: Option<&[u8]>, output: &Path, patch_file: &Path) -> Result<String, String> {
+    let _ = fs::remove_file(patch_file);
+    let previous = previous.ok_or(format!("No previous {} to patch, transfer the whole map", output.display()))?;
+    let current = fs::read(output).map_err(|e| e.to_string() + " " + output.to_str().unwrap_or_default())?;
+
+    let patch = SaturnPatch::diff(previous, &current)?;
+    let mut bytes = Vec::with_capacity(patch.encoded_size() as usize);
+    patch.write_to(&mut bytes).map_err(|e| e.to_string())?;
+    fs::write(patch_file, bytes).map_err(|e| e.to_string() + " " + patch_file.to_str().unwrap_or_default())?;
+
+    return Ok(patch.report());
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::saturn_map::SaturnMap;
+    use crate::saturn_bitmap_layer::tests::sample_bitmap_layer;
+    use crate::saturn_collision_masks::tests::sample_collision_masks;
+    use crate::saturn_collision_rects::tests::sample_collision_rects;
+    use crate::saturn_collisions::tests::sample_collisions;
+    use crate::saturn_layer::tests::sample_layer;
+    use crate::saturn_object_layer::tests::sample_object_layer;
+    use crate::saturn_sprite_atlas::tests::sample_sprite_atlas;
+    use crate::saturn_tileset::tests::sample_tileset;
+    use crate::saturn_writer::tests::encode;
+
+    fn changed(old: &[u8], positions: &[usize]) -> Vec<u8> {
+        let mut new = old.to_vec();
+        for position in positions {
+            new[*position] ^= 0xff;
+        }
+        return new;
+    }
+
+    #[test]
+    fn adler32_matches_known_vectors() {
+        assert_eq!(adler32(b""), 1);
+        assert_eq!(adler32(b"Wikipedia"), 0x11E60398);
+
+        // Longer than the 5552 bytes summed between reductions
+        let bytes = vec![0xff; 20000];
+        let (a, b) = bytes.iter().fold((1u32, 0u32), |(a, b), byte| ((a + *byte as u32) % 65521, (b + (a + *byte as u32) % 65521) % 65521));
+        assert_eq!(adler32(&bytes), b << 16 | a);
+    }
+
+    #[test]
+    fn changed_ranges_are_widened_to_long_boundaries() {
+        let old = vec![0; 64];
+        assert_eq!(changed_ranges(&old, &changed(&old, &[5]), &(0..64)), vec![4..8]);
+        assert_eq!(changed_ranges(&old, &changed(&old, &[4, 5, 6, 7, 8]), &(0..64)), vec![4..12]);
+        // From the start of the region, not of the map
+        assert_eq!(changed_ranges(&old, &changed(&old, &[4]), &(3..64)), vec![3..7]);
+    }
+
+    #[test]
+    fn changed_ranges_stop_at_the_end_of_the_region() {
+        let old = vec![0; 64];
+        assert_eq!(changed_ranges(&old, &changed(&old, &[29]), &(0..30)), vec![28..30]);
+        assert_eq!(changed_ranges(&old, &changed(&old, &[29, 30]), &(0..30)), vec![28..30]);
+    }
+
+    #[test]
+    fn changed_ranges_closer_than_an_operation_header_are_merged() {
+        let old = vec![0; 64];
+        // 12 starts 4 bytes after the end of 4..8, cheaper to send than a second operation
+        assert_eq!(changed_ranges(&old, &changed(&old, &[5, 12]), &(0..64)), vec![4..16]);
+        assert_eq!(changed_ranges(&old, &changed(&old, &[5, 18]), &(0..64)), vec![4..20]);
+        assert_eq!(changed_ranges(&old, &changed(&old, &[5, 22]), &(0..64)), vec![4..8, 20..24]);
+        assert_eq!(changed_ranges(&old, &changed(&old, &[5, 12, 40]), &(0..64)), vec![4..16, 40..44]);
+    }
+
+    fn sample_map() -> Vec<u8> {
+        let saturn_map = SaturnMap::from_sections(64, 64, vec![sample_tileset()], vec![sample_layer()], vec![sample_bitmap_layer()],
+                                                  vec![sample_object_layer()], sample_sprite_atlas(), sample_collision_rects(),
+                                                  sample_collision_masks(), sample_collisions()).unwrap();
+        return encode(&saturn_map);
+    }
+
+    #[test]
+    fn diff_patches_changed_character_bytes_only() {
+        let old = sample_map();
+        let tileset_offset = read_u32(&old, 17).unwrap() as usize;
+        // The last byte of the tileset's character pattern
+        let position = tileset_offset + read_u32(&old, tileset_offset as u32).unwrap() as usize - 1;
+        let new = changed(&old, &[position]);
+
+        let patch = SaturnPatch::diff(&old, &new).unwrap();
+        assert_eq!(patch.operations, vec![PatchOperation { kind: SectionKind::Tileset, index: 0, offset: position as u32 - 3,
+                                                           data: new[position - 3..=position].to_vec() }]);
+        assert_eq!((patch.base_checksum, patch.target_checksum), (adler32(&old), adler32(&new)));
+        assert_eq!(encode(&patch).len(), PATCH_HEADER_SIZE as usize + OPERATION_HEADER_SIZE as usize + 4);
+        assert!(SaturnPatch::diff(&old, &old).unwrap().operations.is_empty());
+    }
+
+    #[test]
+    fn diff_fails_when_the_layout_changed() {
+        let old = sample_map();
+        assert!(SaturnPatch::diff(&old, &changed(&old, &[8])).is_err());
+        assert!(SaturnPatch::diff(&old, &old[..old.len() - 1]).is_err());
+    }
+}
@@ -0,0 +1,272 @@
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::RefCell;
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Instant;
+
+/// The system allocator, counting every byte handed out so stages can report how much they allocated. The binary
+/// only installs it when built with the `profile` feature, stages report no allocations otherwise.
+pub struct CountingAllocator;
+
+static ALLOCATED: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATED.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        ALLOCATED.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        // Growing counts the extra bytes, shrinking allocates nothing
+        ALLOCATED.fetch_add(new_size.saturating_sub(layout.size()) as u64, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+#[cfg(target_os = "linux")]
+mod thread_clock {
+    use std::os::raw::{c_int, c_long};
+
+    #[repr(C)]
+    pub struct Timespec {
+        pub tv_sec: c_long,
+        pub tv_nsec: c_long
+    }
+
+    pub const CLOCK_THREAD_CPUTIME_ID: c_int = 3;
+
+    extern "C" {
+        pub fn clock_gettime(clock_id: c_int, tp: *mut Timespec) -> c_int;
+    }
+}
+
+/// CPU time of the calling thread in microseconds, where the platform reports it.
+#[cfg(target_os = "linux")]
+fn thread_cpu_time() -> Option<u64> {
+    let mut time = thread_clock::Timespec { tv_sec: 0, tv_nsec: 0 };
+    if unsafe { thread_clock::clock_gettime(thread_clock::CLOCK_THREAD_CPUTIME_ID, &mut time) } != 0 {
+        return None;
+    }
+    return Some(time.tv_sec as u64 * 1_000_000 + time.tv_nsec as u64 / 1000);
+}
+
+#[cfg(not(target_os = "linux"))]
+fn thread_cpu_time() -> Option<u64> {
+    None
+}
+
+#[derive(Debug)]
+struct StageRecord {
+    name: &'static str,
+    detail: Option<String>,
+    depth: usize,
+    start_us: u64,
+    wall_us: u64,
+    cpu_us: Option<u64>,
+    allocated_bytes: Option<u64>
+}
+
+struct Profiler {
+    epoch: Instant,
+    depth: usize,
+    /// Whether `CountingAllocator` is installed, it has counted the allocations made before profiling starts
+    counting: bool,
+    records: Vec<StageRecord>
+}
+
+thread_local! {
+    static PROFILER: RefCell<Option<Profiler>> = RefCell::new(None);
+}
+
+/// Starts recording stages on this thread, until `finish` is called.
+pub fn enable() {
+    let counting = ALLOCATED.load(Ordering::Relaxed) > 0;
+    PROFILER.with(|p| *p.borrow_mut() = Some(Profiler { epoch: Instant::now(), depth: 0, counting, records: Vec::default() }));
+}
+
+/// Stops recording and returns every stage recorded since `enable`, or nothing if profiling was never enabled.
+pub fn finish() -> Option<Profile> {
+    PROFILER.with(|p| p.borrow_mut().take()).map(|profiler| Profile { records: profiler.records })
+}
+
+/// Times a stage until the returned guard is dropped. Stages started while another is running are nested
+/// inside it, and their time and allocations are included in it.
+pub fn stage(name: &'static str) -> Stage {
+    stage_for(name, || String::default())
+}
+
+/// Like `stage`, with a detail naming what the stage works on, such as a tileset or a layer. The detail is
+/// only formatted when profiling is enabled.
+pub fn stage_for(name: &'static str, detail: impl FnOnce() -> String) -> Stage {
+    let index = PROFILER.with(|p| {
+        let mut profiler = p.borrow_mut();
+        let profiler = profiler.as_mut()?;
+        let detail = detail();
+        profiler.records.push(StageRecord {
+            name,
+            detail: if detail.is_empty() { None } else { Some(detail) },
+            depth: profiler.depth,
+            start_us: profiler.epoch.elapsed().as_micros() as u64,
+            wall_us: 0,
+            cpu_us: thread_cpu_time(),
+            allocated_bytes: None
+        });
+        profiler.depth += 1;
+        Some(profiler.records.len() - 1)
+    });
+
+    Stage { index, allocated: ALLOCATED.load(Ordering::Relaxed) }
+}
+
+/// A running stage, recorded when dropped.
+pub struct Stage {
+    index: Option<usize>,
+    allocated: u64
+}
+
+impl Drop for Stage {
+    fn drop(&mut self) {
+        let index = match self.index {
+            Some(index) => index,
+            None => return
+        };
+        let allocated_bytes = ALLOCATED.load(Ordering::Relaxed) - self.allocated;
+        let cpu_us = thread_cpu_time();
+
+        PROFILER.with(|p| {
+            if let Some(profiler) = p.borrow_mut().as_mut() {
+                let elapsed = profiler.epoch.elapsed().as_micros() as u64;
+                profiler.depth -= 1;
+                let record = &mut profiler.records[index];
+                record.wall_us = elapsed - record.start_us;
+                record.cpu_us = record.cpu_us.zip(cpu_us).map(|(start, end)| end.saturating_sub(start));
+                record.allocated_bytes = if profiler.counting { Some(allocated_bytes) } else { None };
+            }
+        });
+    }
+}
+
+fn write_json_string(out: &mut String, value: &str) {
+    out.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if (c as u32) < 0x20 => { let _ = write!(out, "\\u{:04x}", c as u32); }
+            c => out.push(c)
+        }
+    }
+    out.push('"');
+}
+
+fn write_json_optional(out: &mut String, value: Option<u64>) {
+    match value {
+        Some(value) => { let _ = write!(out, "{}", value); }
+        None => out.push_str("null")
+    }
+}
+
+/// The stages recorded for one export, in the order they started.
+#[derive(Debug)]
+pub struct Profile {
+    records: Vec<StageRecord>
+}
+
+impl Profile {
+    fn write_stages(&self, out: &mut String, first: usize, depth: usize, indent: usize) -> usize {
+        let mut index = first;
+        let mut written = 0;
+        out.push('[');
+        while index < self.records.len() && self.records[index].depth == depth {
+            let record = &self.records[index];
+            out.push_str(if written == 0 { "\n" } else { ",\n" });
+            out.push_str(&" ".repeat(indent + 2));
+            out.push_str("{\"name\": ");
+            write_json_string(out, record.name);
+            if let Some(detail) = record.detail.as_ref() {
+                out.push_str(", \"detail\": ");
+                write_json_string(out, detail);
+            }
+            let _ = write!(out, ", \"wall_us\": {}, \"cpu_us\": ", record.wall_us);
+            write_json_optional(out, record.cpu_us);
+            out.push_str(", \"allocated_bytes\": ");
+            write_json_optional(out, record.allocated_bytes);
+            out.push_str(", \"stages\": ");
+            index = if self.records.get(index + 1).map_or(false, |r| r.depth > depth) {
+                self.write_stages(out, index + 1, depth + 1, indent + 2)
+            } else {
+                out.push_str("[]");
+                index + 1
+            };
+            out.push('}');
+            written += 1;
+        }
+        if written > 0 {
+            out.push('\n');
+            out.push_str(&" ".repeat(indent));
+        }
+        out.push(']');
+        return index;
+    }
+
+    /// The stages as a tree of JSON objects, each with its wall time, CPU time and allocated bytes. CPU time is
+    /// null where the platform does not report per thread CPU time, allocated bytes without the `profile` feature.
+    pub fn report_json(&self) -> String {
+        let mut out = String::from("{\"stages\": ");
+        self.write_stages(&mut out, 0, 0, 0);
+        out.push_str("}\n");
+        return out;
+    }
+
+    /// The stages as complete events in the Chrome trace event format, which chrome://tracing, Perfetto and
+    /// speedscope load as a flame graph.
+    pub fn trace_json(&self) -> String {
+        let mut out = String::from("{\"traceEvents\": [");
+        for (index, record) in self.records.iter().enumerate() {
+            out.push_str(if index == 0 { "\n  " } else { ",\n  " });
+            out.push_str("{\"name\": ");
+            match record.detail.as_ref() {
+                Some(detail) => write_json_string(&mut out, &format!("{} {}", record.name, detail)),
+                None => write_json_string(&mut out, record.name)
+            }
+            let _ = write!(out, ", \"cat\": \"tiled2saturn\", \"ph\": \"X\", \"ts\": {}, \"dur\": {}, \"pid\": 1, \"tid\": 1, \"args\": {{\"cpu_us\": ",
+                           record.start_us, record.wall_us);
+            write_json_optional(&mut out, record.cpu_us);
+            out.push_str(", \"allocated_bytes\": ");
+            write_json_optional(&mut out, record.allocated_bytes);
+            out.push_str("}}");
+        }
+        out.push_str("\n]}\n");
+        return out;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn allocations_are_null_without_the_counting_allocator() {
+        enable();
+        {
+            let _outer = stage("outer");
+            let _inner = stage_for("inner", || String::from("detail"));
+        }
+        let profile = finish().unwrap();
+
+        let report = profile.report_json();
+        assert!(report.contains("{\"name\": \"inner\", \"detail\": \"detail\""));
+        assert_eq!(report.matches("\"allocated_bytes\": null").count(), 2);
+        assert!(profile.trace_json().contains("\"allocated_bytes\": null}}"));
+        assert!(finish().is_none());
+    }
+}
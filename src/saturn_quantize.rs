@@ -0,0 +1,255 @@
+use std::collections::HashMap;
+use std::thread;
+
+/// A set of distinct colors, with how many pixels use each one, that median cut splits in two.
+struct ColorBox {
+    colors: Vec<([u8; 3], u32)>,
+}
+
+impl ColorBox {
+    fn channel_range(&self, channel: usize) -> u8 {
+        let min = self.colors.iter().map(|(c, _)| c[channel]).min().unwrap_or(0);
+        let max = self.colors.iter().map(|(c, _)| c[channel]).max().unwrap_or(0);
+        max - min
+    }
+
+    fn widest_channel(&self) -> (usize, u8) {
+        (0..3).map(|channel| (channel, self.channel_range(channel))).max_by_key(|(_, range)| *range).unwrap_or((0, 0))
+    }
+
+    fn split(mut self) -> (ColorBox, ColorBox) {
+        let (channel, _) = self.widest_channel();
+        self.colors.sort_by_key(|(c, _)| c[channel]);
+
+        // Split at the pixel weighted median so busy colors get more of the palette
+        let total: u64 = self.colors.iter().map(|(_, n)| *n as u64).sum();
+        let mut running: u64 = 0;
+        let mut at = 1;
+        for (index, (_, count)) in self.colors.iter().enumerate() {
+            running += *count as u64;
+            if running * 2 >= total {
+                at = (index + 1).clamp(1, self.colors.len() - 1);
+                break;
+            }
+        }
+
+        let upper = self.colors.split_off(at);
+        (ColorBox { colors: self.colors }, ColorBox { colors: upper })
+    }
+
+    fn average(&self) -> [u8; 3] {
+        let total: u64 = self.colors.iter().map(|(_, n)| *n as u64).sum::<u64>().max(1);
+        let mut sum = [0u64; 3];
+        for (color, count) in self.colors.iter() {
+            for channel in 0..3 {
+                sum[channel] += color[channel] as u64 * *count as u64;
+            }
+        }
+        [(sum[0] / total) as u8, (sum[1] / total) as u8, (sum[2] / total) as u8]
+    }
+}
+
+/// Counts the distinct b, g, r triplets in `pixels`.
+pub fn histogram(pixels: &[u8]) -> HashMap<[u8; 3], u32> {
+    let mut histogram: HashMap<[u8; 3], u32> = HashMap::default();
+    for pixel in pixels.chunks_exact(3) {
+        *histogram.entry([pixel[0], pixel[1], pixel[2]]).or_insert(0) += 1;
+    }
+    return histogram;
+}
+
+/// Reduces the colors of `histogram` to at most `max_colors` with median cut. Returns the palette and the palette
+/// index of every color in the histogram.
+fn median_cut(histogram: HashMap<[u8; 3], u32>, max_colors: usize) -> (Vec<[u8; 3]>, HashMap<[u8; 3], u16>) {
+    let mut colors: Vec<([u8; 3], u32)> = histogram.into_iter().collect();
+    colors.sort();
+
+    let mut boxes: Vec<ColorBox> = vec![ColorBox { colors }];
+
+    while boxes.len() < max_colors {
+        let candidate = boxes.iter().enumerate()
+            .filter(|(_, b)| b.colors.len() > 1)
+            .max_by_key(|(_, b)| b.widest_channel().1)
+            .map(|(index, _)| index);
+
+        match candidate {
+            Some(index) => {
+                let (lower, upper) = boxes.swap_remove(index).split();
+                boxes.push(lower);
+                boxes.push(upper);
+            }
+            None => break
+        }
+    }
+
+    let mut palette: Vec<[u8; 3]> = Vec::with_capacity(boxes.len());
+    let mut lookup: HashMap<[u8; 3], u16> = HashMap::default();
+
+    for (index, color_box) in boxes.iter().filter(|b| !b.colors.is_empty()).enumerate() {
+        // A box holding a single color keeps it exactly, so images that fit are lossless
+        palette.push(if color_box.colors.len() == 1 { color_box.colors[0].0 } else { color_box.average() });
+        for (color, _) in color_box.colors.iter() {
+            lookup.insert(*color, index as u16);
+        }
+    }
+
+    return (palette, lookup);
+}
+
+/// Builds a palette of at most `max_colors` b, g, r entries for `pixels` and indexes every pixel into it.
+/// Images that already fit are indexed exactly, anything else is reduced with median cut.
+pub fn quantize(pixels: &[u8], max_colors: usize) -> (Vec<[u8; 3]>, Vec<u16>) {
+    let (palette, lookup) = median_cut(histogram(pixels), max_colors);
+    let indices: Vec<u16> = pixels.chunks_exact(3).map(|p| lookup[&[p[0], p[1], p[2]]]).collect();
+
+    return (palette, indices);
+}
+
+/// How closely a quantized image matches the image it was quantized from.
+#[derive(Debug, Clone, PartialEq)]
+pub struct QuantizeStats {
+    pub source_colors: usize,
+    pub colors: usize,
+    pub dithered: bool,
+    /// Mean of the squared difference of every channel of every pixel.
+    pub mean_squared_error: f64,
+    /// Largest difference of any channel of any pixel.
+    pub max_error: u8
+}
+
+impl QuantizeStats {
+    /// Peak signal to noise ratio in decibels, infinite when nothing was lost.
+    pub fn psnr(&self) -> f64 {
+        if self.mean_squared_error == 0.0 {
+            return f64::INFINITY;
+        }
+        return 10.0 * (255.0 * 255.0 / self.mean_squared_error).log10();
+    }
+
+    fn measure(pixels: &[u8], palette: &[[u8; 3]], indices: &[u16], source_colors: usize, dithered: bool) -> Self {
+        let mut squared_error: u64 = 0;
+        let mut max_error: u8 = 0;
+        for (pixel, index) in pixels.chunks_exact(3).zip(indices.iter()) {
+            let color = palette[*index as usize];
+            for channel in 0..3 {
+                let error = pixel[channel].abs_diff(color[channel]);
+                squared_error += error as u64 * error as u64;
+                max_error = max_error.max(error);
+            }
+        }
+
+        QuantizeStats {
+            source_colors,
+            colors: palette.len(),
+            dithered,
+            mean_squared_error: squared_error as f64 / pixels.len().max(1) as f64,
+            max_error
+        }
+    }
+}
+
+/// Index of the palette entry closest to `color`, searching from `first`.
+fn nearest(palette: &[[u8; 3]], first: usize, color: [i32; 3]) -> u16 {
+    let mut best = first;
+    let mut best_distance = i32::MAX;
+    for (index, entry) in palette.iter().enumerate().skip(first) {
+        let distance: i32 = (0..3).map(|c| (color[c] - entry[c] as i32).pow(2)).sum();
+        if distance < best_distance {
+            best = index;
+            best_distance = distance;
+            if distance == 0 {
+                break;
+            }
+        }
+    }
+    return best as u16;
+}
+
+/// Indexes a band of whole tile rows into `palette`, one tile at a time. Dithering diffuses the error of each
+/// pixel to its neighbours with Floyd-Steinberg, within the tile only, as tiles are placed independently on the map.
+fn remap_band(pixels: &[u8], indices: &mut [u16], image_width: usize, tile_size: (usize, usize), palette: &[[u8; 3]],
+              transparent: Option<[u8; 3]>, dither: bool) {
+    let (tile_width, tile_height) = tile_size;
+    let rows = indices.len() / image_width.max(1);
+    let first = if transparent.is_some() { 1 } else { 0 };
+    let mut cache: HashMap<[u8; 3], u16> = HashMap::default();
+    let mut errors: Vec<[i32; 3]> = vec![[0; 3]; (tile_width + 2) * 2];
+
+    for tile_y in (0..rows).step_by(tile_height) {
+        for tile_x in (0..image_width).step_by(tile_width) {
+            errors.iter_mut().for_each(|e| *e = [0; 3]);
+
+            for y in tile_y..(tile_y + tile_height).min(rows) {
+                // Errors for this row and the next, offset by one so the left neighbour of the first column exists
+                let (current, next) = errors.split_at_mut(tile_width + 2);
+                for x in tile_x..(tile_x + tile_width).min(image_width) {
+                    let position = y * image_width + x;
+                    let pixel = [pixels[position * 3], pixels[position * 3 + 1], pixels[position * 3 + 2]];
+
+                    if Some(pixel) == transparent {
+                        indices[position] = 0;
+                        continue;
+                    }
+
+                    if !dither {
+                        indices[position] = *cache.entry(pixel).or_insert_with(|| nearest(palette, first, pixel.map(|c| c as i32)));
+                        continue;
+                    }
+
+                    let column = x - tile_x + 1;
+                    let color: [i32; 3] = [0, 1, 2].map(|c| (pixel[c] as i32 + current[column][c] / 16).clamp(0, 255));
+                    let index = nearest(palette, first, color);
+                    indices[position] = index;
+
+                    for c in 0..3 {
+                        let error = color[c] - palette[index as usize][c] as i32;
+                        current[column + 1][c] += error * 7;
+                        next[column - 1][c] += error * 3;
+                        next[column][c] += error * 5;
+                        next[column + 1][c] += error;
+                    }
+                }
+
+                let (current, next) = errors.split_at_mut(tile_width + 2);
+                current.copy_from_slice(next);
+                next.iter_mut().for_each(|e| *e = [0; 3]);
+            }
+        }
+    }
+}
+
+/// Quantizes a tileset image to at most `max_colors` colors. `pixels` are b, g, r triplets, `image_width` pixels
+/// per row, and every pixel is indexed to its nearest palette entry, optionally dithered within each tile of
+/// `tile_size`. The `transparent` color, when given, keeps palette index 0 and only its own pixels use it.
+///
+/// Tile rows are indexed in parallel, one band of rows per available core.
+pub fn quantize_tiles(pixels: &[u8], image_width: usize, tile_size: (usize, usize), max_colors: usize,
+                      transparent: Option<[u8; 3]>, dither: bool) -> (Vec<[u8; 3]>, Vec<u16>, QuantizeStats) {
+    let mut histogram = histogram(pixels);
+    let source_colors = histogram.len();
+
+    let mut palette: Vec<[u8; 3]> = Vec::with_capacity(max_colors);
+    if let Some(color) = transparent {
+        histogram.remove(&color);
+        palette.push(color);
+    }
+    palette.extend(median_cut(histogram, max_colors - palette.len()).0);
+
+    let mut indices: Vec<u16> = vec![0; pixels.len() / 3];
+    let band = image_width * tile_size.1;
+    let threads = thread::available_parallelism().map_or(1, |n| n.get());
+    let bands_per_thread = (indices.len() / band.max(1)).div_ceil(threads).max(1);
+
+    thread::scope(|scope| {
+        for (chunk, chunk_indices) in indices.chunks_mut(band.max(1) * bands_per_thread).enumerate() {
+            let start = chunk * band * bands_per_thread;
+            let chunk_pixels = &pixels[start * 3..(start + chunk_indices.len()) * 3];
+            let palette = &palette;
+            scope.spawn(move || remap_band(chunk_pixels, chunk_indices, image_width, tile_size, palette, transparent, dither));
+        }
+    });
+
+    let stats = QuantizeStats::measure(pixels, &palette, &indices, source_colors, dither);
+
+    return (palette, indices, stats);
+}
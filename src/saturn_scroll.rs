@@ -0,0 +1,122 @@
+use std::io::{self, Write};
+
+use tiled::{Layer, PropertyValue};
+
+use crate::saturn_writer::{SaturnWrite, write_u16, write_u32};
+
+// ratio_x, ratio_y, offset_x, offset_y and band_count, followed by the line scroll bands
+pub const SCROLL_HEADER_SIZE: u32 = 18;
+
+const LINE_SCROLL_BAND_SIZE: u32 = 8;
+
+// Tallest scroll screen the VDP2 can display, in scanlines
+const MAX_LINE_SCROLL_LINES: u32 = 512;
+
+/// Converts to the 16.16 fixed point format Yaul's fix16_t uses.
+fn to_fix16(value: f32) -> Result<i32, String> {
+    let fixed = (value as f64 * 65536.0).round();
+    if fixed < i32::MIN as f64 || fixed > i32::MAX as f64 {
+        return Err(format!("{} does not fit in 16.16 fixed point", value));
+    }
+    return Ok(fixed as i32);
+}
+
+/// A run of scanlines scrolling horizontally at its own speed. `ratio` is relative to the layer's own
+/// scroll ratio, as the VDP2 adds line scroll values on top of the screen's scroll.
+#[derive(Debug, PartialEq)]
+pub struct LineScrollBand {
+    start_line: u16,
+    line_count: u16,
+    ratio: i32
+}
+
+/// How a layer scrolls against the camera: Tiled's parallax factors and offsets as 16.16 fixed point, and
+/// the optional `line_scroll` property, a comma separated list of `lines:speed` bands from the top of the
+/// screen, e.g. `96:0.25,64:0.5,64:1`.
+#[derive(Debug, PartialEq)]
+pub struct SaturnScroll {
+    ratio_x: i32,
+    ratio_y: i32,
+    offset_x: i32,
+    offset_y: i32,
+    bands: Vec<LineScrollBand>
+}
+
+impl SaturnScroll {
+    pub fn from_layer<'a>(layer: &Layer<'a>) -> Result<Self, String> {
+        let line_scroll = match layer.properties.get("line_scroll") {
+            None => None,
+            Some(PropertyValue::StringValue(c)) => Some(c.as_str()),
+            _ => Err("Invalid line_scroll, expected a string of lines:speed bands")?
+        };
+
+        return SaturnScroll::new(layer.parallax_x, layer.parallax_y, layer.offset_x, layer.offset_y, line_scroll);
+    }
+
+    /// The scroll of a layer with Tiled's parallax factors and offsets, and the `line_scroll` bands if it has any.
+    pub fn new(parallax_x: f32, parallax_y: f32, offset_x: f32, offset_y: f32, line_scroll: Option<&str>) -> Result<Self, String> {
+        let ratio_x = to_fix16(parallax_x)?;
+
+        let bands = match line_scroll {
+            None => Vec::default(),
+            Some(c) => SaturnScroll::parse_bands(c, ratio_x)?
+        };
+
+        Ok(SaturnScroll {
+            ratio_x,
+            ratio_y: to_fix16(parallax_y)?,
+            offset_x: to_fix16(offset_x)?,
+            offset_y: to_fix16(offset_y)?,
+            bands
+        })
+    }
+
+    fn parse_bands(value: &str, ratio_x: i32) -> Result<Vec<LineScrollBand>, String> {
+        let mut bands: Vec<LineScrollBand> = Vec::default();
+        let mut start_line: u32 = 0;
+
+        for band in value.split(',').map(|b| b.trim()).filter(|b| !b.is_empty()) {
+            let (lines, speed) = band.split_once(':').ok_or(format!("Invalid line_scroll band {:?}, expected lines:speed", band))?;
+            let line_count: u32 = lines.trim().parse().map_err(|e| format!("Invalid line_scroll lines {:?}", e))?;
+            let speed: f32 = speed.trim().parse().map_err(|e| format!("Invalid line_scroll speed {:?}", e))?;
+
+            if line_count == 0 {
+                return Err(format!("Empty line_scroll band {:?}", band));
+            }
+
+            if start_line + line_count > MAX_LINE_SCROLL_LINES {
+                return Err(format!("line_scroll covers more than {} lines", MAX_LINE_SCROLL_LINES));
+            }
+
+            bands.push(LineScrollBand {
+                start_line: start_line as u16,
+                line_count: line_count as u16,
+                ratio: to_fix16(speed)?.wrapping_sub(ratio_x)
+            });
+
+            start_line += line_count;
+        }
+
+        return Ok(bands);
+    }
+}
+
+impl SaturnWrite for SaturnScroll {
+    fn encoded_size(&self) -> u32 {
+        SCROLL_HEADER_SIZE + self.bands.len() as u32 * LINE_SCROLL_BAND_SIZE
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.ratio_x as u32)?;
+        write_u32(out, self.ratio_y as u32)?;
+        write_u32(out, self.offset_x as u32)?;
+        write_u32(out, self.offset_y as u32)?;
+        write_u16(out, self.bands.len() as u16)?;
+        for band in self.bands.iter() {
+            write_u16(out, band.start_line)?;
+            write_u16(out, band.line_count)?;
+            write_u32(out, band.ratio as u32)?;
+        }
+        Ok(())
+    }
+}
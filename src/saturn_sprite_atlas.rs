@@ -0,0 +1,278 @@
+use std::collections::HashMap;
+use std::io::{self, Write};
+use std::sync::Arc;
+
+use tiled::{PropertyValue, Tileset};
+
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
+
+// atlas_size, sheet_count, frame_count, texture_size and texture_padding, followed by the sheets, the frames,
+// the padding and the texture
+const SPRITE_ATLAS_HEADER_SIZE: u32 = 13;
+
+const SHEET_SIZE: u32 = 6;
+
+const FRAME_SIZE: u32 = 8;
+
+// Character addresses are stored in units of 8 bytes
+const FRAME_ALIGNMENT: usize = 8;
+
+// SCU DMA moves longs, so the texture starts on a 4 byte boundary from the start of the output
+const TEXTURE_ALIGNMENT: u32 = 4;
+
+const VDP1_VRAM_SIZE: usize = 0x80000;
+
+/// The frames of a tileset marked with the `sprite_sheet` property, one per tile, packed for VDP1. Frames are
+/// padded with transparent pixels to a multiple of 8 pixels wide, the width VDP1 sprites are drawn in.
+#[derive(Debug, PartialEq, Clone)]
+pub struct SpriteSheet {
+    frame_width: u32,
+    frame_height: u32,
+    color_mode: u8,
+    color_bank: u16,
+    frames: Vec<Vec<u8>>
+}
+
+impl SpriteSheet {
+    pub fn is_sprite_sheet(tileset: &Tileset) -> Result<bool, String> {
+        let sprite_sheet: bool = match tileset.properties.get("sprite_sheet") {
+            None => false,
+            Some(PropertyValue::BoolValue(b)) => *b,
+            Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid sprite_sheet {:?}", e))?,
+            _ => Err("Invalid sprite_sheet")?
+        };
+        Ok(sprite_sheet)
+    }
+
+    fn get_color_bank(tileset: &Tileset, bpp: u16) -> Result<u16, String> {
+        let color_bank: u16 = match tileset.properties.get("color_bank") {
+            None => 0,
+            Some(PropertyValue::IntValue(s)) => u16::try_from(*s).map_err(|e| format!("Invalid color_bank {:?}", e))?,
+            Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid color_bank {:?}", e))?,
+            _ => Err("Invalid color_bank")?
+        };
+
+        // The low bits of the color bank are replaced by the dot's color index
+        let index_mask: u16 = if bpp == 4 { 0xF } else { 0xFF };
+        if color_bank & index_mask != 0 {
+            return Err(format!("color_bank 0x{:X} of sprite sheet {} must leave the low {} bits clear", color_bank, tileset.name, bpp));
+        }
+
+        Ok(color_bank)
+    }
+
+    /// Cuts `indexed_image`, one palette index per pixel, into frames of the tileset's tile size.
+    pub fn build(tileset: &Tileset, indexed_image: &[u32], image_width: usize, image_height: usize, bpp: u16) -> Result<Self, String> {
+        let color_mode = match bpp {
+            4 => 0,
+            8 => 4,
+            _ => return Err(format!("Sprite sheet {} has more than 256 colors, VDP1 sprites are packed at 4 or 8 bpp", tileset.name))
+        };
+
+        let tile_width = tileset.tile_width as usize;
+        let tile_height = tileset.tile_height as usize;
+        if tile_width == 0 || tile_height == 0 || tile_width > 504 || tile_height > 255 {
+            return Err(format!("Sprite sheet {} frames are {}x{}, sprites can be at most 504x255", tileset.name, tile_width, tile_height));
+        }
+
+        let columns = image_width / tile_width;
+        let frame_width = (tile_width + 7) & !7;
+        let row_bytes = frame_width * bpp as usize / 8;
+
+        let mut frames: Vec<Vec<u8>> = Vec::with_capacity(tileset.tilecount as usize);
+        for tile_id in 0..tileset.tilecount as usize {
+            let (x, y) = ((tile_id % columns.max(1)) * tile_width, (tile_id / columns.max(1)) * tile_height);
+            if x + tile_width > image_width || y + tile_height > image_height {
+                return Err(format!("Sprite sheet {} frame {} lies outside the image", tileset.name, tile_id));
+            }
+
+            let mut frame: Vec<u8> = vec![0; row_bytes * tile_height];
+            for (row, out) in frame.chunks_exact_mut(row_bytes).enumerate() {
+                let start = (y + row) * image_width + x;
+                let pixels = indexed_image.get(start..start + tile_width).ok_or(format!("No pixel value found at {} {}", x, y + row))?;
+                for (column, pixel) in pixels.iter().enumerate() {
+                    if bpp == 4 {
+                        out[column / 2] |= ((pixel & 0xF) as u8) << if column % 2 == 0 { 4 } else { 0 };
+                    } else {
+                        out[column] = *pixel as u8;
+                    }
+                }
+            }
+            frames.push(frame);
+        }
+
+        Ok(SpriteSheet {
+            frame_width: frame_width as u32,
+            frame_height: tile_height as u32,
+            color_mode,
+            color_bank: SpriteSheet::get_color_bank(tileset, bpp)?,
+            frames
+        })
+    }
+}
+
+/// Where a frame lives in the texture and how VDP1 draws it, as the CMDSRCA, CMDSIZE, CMDCOLR and CMDPMOD
+/// words of a sprite command. `char_address` is relative to the start of the texture.
+#[derive(Debug, PartialEq, Clone, Copy)]
+pub struct SpriteFrame {
+    pub char_address: u16,
+    pub size: u16,
+    pub color_bank: u16,
+    pub color_mode: u8
+}
+
+/// Every sprite sheet of the map packed into one VDP1 texture. Identical frames, within a sheet or across
+/// sheets, are stored once, and each frame starts on the 8 byte boundary VDP1 character addresses need.
+#[derive(Debug, PartialEq)]
+pub struct SaturnSpriteAtlas {
+    pub atlas_size: u32,
+    sheets: Vec<(u16, u16, u16)>,
+    frames: Vec<SpriteFrame>,
+    texture_padding: u8,
+    texture: Vec<u8>,
+    unique_frames: usize
+}
+
+impl SaturnSpriteAtlas {
+    pub fn build(sheets: &[(usize, &SpriteSheet)]) -> Result<Self, String> {
+        let mut texture: Vec<u8> = Vec::default();
+        let mut stored: HashMap<&[u8], u16> = HashMap::default();
+        let mut sheet_table: Vec<(u16, u16, u16)> = Vec::with_capacity(sheets.len());
+        let mut frames: Vec<SpriteFrame> = Vec::default();
+
+        for (tileset_index, sheet) in sheets {
+            let first_frame = u16::try_from(frames.len()).map_err(|e| e.to_string())?;
+            let size = (((sheet.frame_width / 8) << 8) | sheet.frame_height) as u16;
+
+            for frame in sheet.frames.iter() {
+                let char_address = match stored.get(frame.as_slice()) {
+                    Some(char_address) => *char_address,
+                    None => {
+                        let char_address = u16::try_from(texture.len() / FRAME_ALIGNMENT).map_err(|_| format!("Sprite frames do not fit in VDP1 VRAM"))?;
+                        texture.extend_from_slice(frame);
+                        texture.resize((texture.len() + FRAME_ALIGNMENT - 1) & !(FRAME_ALIGNMENT - 1), 0);
+                        stored.insert(frame, char_address);
+                        char_address
+                    }
+                };
+
+                frames.push(SpriteFrame { char_address, size, color_bank: sheet.color_bank, color_mode: sheet.color_mode });
+            }
+
+            sheet_table.push((u16::try_from(*tileset_index).map_err(|e| e.to_string())?, first_frame, sheet.frames.len() as u16));
+        }
+
+        if frames.len() > u16::MAX as usize {
+            return Err(format!("Sprite atlas has {} frames, at most {} are supported", frames.len(), u16::MAX));
+        }
+
+        if texture.len() > VDP1_VRAM_SIZE {
+            return Err(format!("Sprite frames need {} bytes, more than the {} bytes of VDP1 VRAM", texture.len(), VDP1_VRAM_SIZE));
+        }
+
+        let mut atlas = SaturnSpriteAtlas {
+            atlas_size: Default::default(),
+            sheets: sheet_table,
+            frames,
+            texture_padding: Default::default(),
+            texture,
+            unique_frames: stored.len()
+        };
+        atlas.atlas_size = atlas.encoded_size();
+
+        return Ok(atlas);
+    }
+
+    /// Builds the atlas from every tileset of `tilesets` that has sprite sheet frames.
+    pub fn from_tilesets<'a>(tilesets: impl Iterator<Item = Option<&'a SpriteSheet>>) -> Result<Self, String> {
+        let sheets: Vec<(usize, &SpriteSheet)> = tilesets.enumerate().filter_map(|(index, sheet)| sheet.map(|s| (index, s))).collect();
+        SaturnSpriteAtlas::build(&sheets)
+    }
+
+    /// The frame showing `tile_id` of the map tileset `tileset`, if that tileset is a sprite sheet.
+    pub fn frame(&self, tilesets: &[Arc<Tileset>], tileset: &Tileset, tile_id: u32) -> Option<SpriteFrame> {
+        let tileset_index = tilesets.iter().position(|t| std::ptr::eq(t.as_ref(), tileset))? as u16;
+        let (_, first_frame, frame_count) = self.sheets.iter().find(|(index, _, _)| *index == tileset_index)?;
+        if tile_id >= *frame_count as u32 {
+            return None;
+        }
+        self.frames.get(*first_frame as usize + tile_id as usize).copied()
+    }
+
+    /// Bytes of VDP1 VRAM the texture takes.
+    pub fn texture_size(&self) -> u32 {
+        self.texture.len() as u32
+    }
+
+    /// Pads the texture so it starts on an aligned address once this section is written at `section_offset`
+    /// from the start of the output.
+    pub fn align_to(&mut self, section_offset: u32) {
+        let texture_offset = section_offset + SPRITE_ATLAS_HEADER_SIZE + self.sheets.len() as u32 * SHEET_SIZE + self.frames.len() as u32 * FRAME_SIZE;
+        self.texture_padding = ((TEXTURE_ALIGNMENT - texture_offset % TEXTURE_ALIGNMENT) % TEXTURE_ALIGNMENT) as u8;
+        self.atlas_size = self.encoded_size();
+    }
+
+    /// One line summary of how much VDP1 VRAM the texture takes, empty when the map has no sprite sheets.
+    pub fn report(&self) -> Option<String> {
+        if self.sheets.is_empty() {
+            return None;
+        }
+
+        Some(format!("Sprite atlas: {} frames, {} unique, {} of {} bytes VDP1 VRAM ({:.1}%)",
+                     self.frames.len(), self.unique_frames, self.texture.len(), VDP1_VRAM_SIZE,
+                     self.texture.len() as f64 * 100.0 / VDP1_VRAM_SIZE as f64))
+    }
+}
+
+impl SaturnWrite for SaturnSpriteAtlas {
+    fn encoded_size(&self) -> u32 {
+        SPRITE_ATLAS_HEADER_SIZE + self.sheets.len() as u32 * SHEET_SIZE + self.frames.len() as u32 * FRAME_SIZE
+            + self.texture_padding as u32 + self.texture.len() as u32
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.atlas_size)?;
+        write_u16(out, self.sheets.len() as u16)?;
+        write_u16(out, self.frames.len() as u16)?;
+        write_u32(out, self.texture.len() as u32)?;
+        write_u8(out, self.texture_padding)?;
+        for (tileset_index, first_frame, frame_count) in self.sheets.iter() {
+            write_u16(out, *tileset_index)?;
+            write_u16(out, *first_frame)?;
+            write_u16(out, *frame_count)?;
+        }
+        for frame in self.frames.iter() {
+            write_u16(out, frame.char_address)?;
+            write_u16(out, frame.size)?;
+            write_u16(out, frame.color_bank)?;
+            write_u16(out, (frame.color_mode as u16) << 3)?;
+        }
+        out.write_all(&vec![0; self.texture_padding as usize])?;
+        out.write_all(&self.texture)
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// One sheet of three 8x8 4 bpp frames, two of them the same.
+    pub(crate) fn sample_sprite_atlas() -> SaturnSpriteAtlas {
+        let sheet = SpriteSheet { frame_width: 8, frame_height: 8, color_mode: 0, color_bank: 0, frames: vec![vec![1; 32], vec![1; 32], vec![2; 32]] };
+        return SaturnSpriteAtlas::build(&[(0, &sheet)]).unwrap();
+    }
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let mut atlas = sample_sprite_atlas();
+        assert_eq!(atlas.unique_frames, 2);
+        for section_offset in 52..56 {
+            atlas.align_to(section_offset);
+            let bytes = encode(&atlas);
+            assert_eq!(read_u32(&bytes, 0), atlas.atlas_size);
+            assert_eq!(read_u32(&bytes, 8), 64);
+            assert_eq!((section_offset + bytes.len() as u32 - 64) % TEXTURE_ALIGNMENT, 0);
+        }
+    }
+}
@@ -1,32 +1,54 @@
-use std::{collections::{BTreeMap, HashMap, HashSet}, fmt::Debug, fs::{self}, sync::Arc};
+use std::{collections::{BTreeMap, HashMap, HashSet}, fmt::Debug, fs::{self}, io::{self, Write}, sync::Arc};
 
 use tiled::{PropertyValue, Tileset};
-use embedded_graphics::pixelcolor::{RgbColor, IntoStorage};
-use deku::prelude::*;
+use embedded_graphics::pixelcolor::IntoStorage;
 use tinybmp::RawBmp;
 
+use crate::saturn_color_convert;
 use crate::saturn_color_table::SaturnColorTable;
+use crate::saturn_profile;
+use crate::saturn_quantize::{self, QuantizeStats};
+use crate::saturn_sprite_atlas::SpriteSheet;
+use crate::saturn_writer::{SaturnWrite, write_u8, write_u16, write_u32};
 
-#[derive(Debug, PartialEq, DekuRead, DekuWrite)]
-#[deku(endian = "endian", ctx = "endian: deku::ctx::Endian", ctx_default = "deku::ctx::Endian::Big")]
+// tileset_size .. palette_size, followed by the palette, character_pattern_size and the character pattern
+const TILESET_HEADER_SIZE: u32 = 30;
+// Position of character_offset in the tileset, the export fills it in once every tileset of the map is placed
+pub(crate) const CHARACTER_OFFSET_FIELD: u64 = 22;
+
+#[derive(Debug, PartialEq)]
 pub struct SaturnTileset {
-    #[deku(update = "self.to_bytes().unwrap().len()")]
     pub tileset_size: u32,
     pub tile_width: u32,
     pub tile_height: u32,
     pub tile_count: u32,
     pub bpp: u16,
     pub words_per_palette: u8,
-    number_of_colors: u16,
+    pub number_of_colors: u16,
     pub palette_bank: u8,
-    #[deku(update = "self.palette.len()")]
+    /// Where the character pattern goes in VRAM, in bytes from the character pattern base
+    pub character_offset: u32,
     pub palette_size: u32,
-    #[deku(count = "palette_size", endian = "big")]
     palette: Vec<u8>,
-    #[deku(update = "self.character_pattern.len()")]
     pub character_pattern_size: u32,
-    #[deku(count = "character_pattern_size", endian = "big")]
-    character_pattern: Vec<u8>
+    character_pattern: Vec<u8>,
+    /// VDP1 frames of a `sprite_sheet` tileset, packed into the sprite atlas instead of the character pattern
+    pub sprite_sheet: Option<SpriteSheet>,
+    /// How far the tileset moved from its image when `palette_colors` reduced it
+    pub quantization: Option<QuantizeStats>
+}
+
+/// The parts of a tileset that other sections are encoded against, kept once the tileset itself has been written out.
+#[derive(Debug, Clone, PartialEq)]
+pub struct SaturnTilesetInfo {
+    pub tile_width: u32,
+    pub tile_height: u32,
+    pub tile_count: u32,
+    pub bpp: u16,
+    pub words_per_palette: u8,
+    pub palette_bank: u8,
+    pub character_offset: u32,
+    pub sprite_sheet: bool
 }
 
 impl SaturnTileset {
@@ -42,130 +64,133 @@ impl SaturnTileset {
             palette_size: Default::default(),
             palette: Default::default(),
             palette_bank,
+            character_offset: Default::default(),
             character_pattern_size: Default::default(),
-            character_pattern: Default::default()
+            character_pattern: Default::default(),
+            sprite_sheet: Default::default(),
+            quantization: Default::default()
         })
     }
 
-    fn read_8x8_tile(raw_image: &Vec<u32>, image_width: i32, image_height: i32, tile_x: i32, tile_y: i32) -> Result<Vec<u16>, String> {
-        let mut result: Vec<u16> = Vec::new();
-        let rows = raw_image.len() as i32 / image_height;
-        for y in 0..8 {
-            for x in 0..8 {
-                if ((x + tile_x) > image_width) || ((y + tile_y) > image_height) {
-                    return Err(format!("Error: Image width {} or height {} not a multiple of 8/16.", image_width, image_height));
-                }
-                let index = ((rows * (y + tile_y)) + (x + tile_x)) as usize;
-                let value = raw_image.get(index).map(|p| *p);
-                result.insert((y * 8 + x) as usize, value.ok_or(format!("No pixel value found at {} {}", (x + tile_x), (y + tile_y)))? as u16);
-            }
+    pub fn info(&self) -> SaturnTilesetInfo {
+        SaturnTilesetInfo {
+            tile_width: self.tile_width,
+            tile_height: self.tile_height,
+            tile_count: self.tile_count,
+            bpp: self.bpp,
+            words_per_palette: self.words_per_palette,
+            palette_bank: self.palette_bank,
+            character_offset: self.character_offset,
+            sprite_sheet: self.sprite_sheet.is_some()
         }
-        return Ok(result);
     }
 
-    fn get_pallette_data_32(color_table: &SaturnColorTable) -> Result<Vec<u32>, String> {
-        let mut results: Vec<u32> = Vec::default();
+    fn update_sizes(&mut self) {
+        self.palette_size = self.palette.len() as u32;
+        self.character_pattern_size = self.character_pattern.len() as u32;
+        self.tileset_size = self.encoded_size();
+    }
+
+    fn get_palette_data(color_table: &SaturnColorTable, words_per_palette: u8) -> Result<Vec<u8>, String> {
+        let bgr = color_table.to_bgr888();
+        let bytes_per_color = if words_per_palette == 1 { 2 } else { 4 };
+        let mut results: Vec<u8> = vec![0; color_table.len() * bytes_per_color];
 
-        for i in 0..color_table.len(){
-            let color = color_table.get(i.try_into().unwrap()).unwrap();
-            results.push(u32::from(color.r()) | (u32::from(color.g()) << 8) | (u32::from(color.b()) << 16));
+        if words_per_palette == 1 {
+            saturn_color_convert::bgr888_to_rgb555_be(&bgr, &mut results);
+        } else {
+            saturn_color_convert::bgr888_to_rgb888_be(&bgr, &mut results);
         }
 
         return Ok(results);
     }
 
-    fn get_pallette_data_16(color_table: &SaturnColorTable) -> Result<Vec<u16>, String> {
-        let mut results: Vec<u16> = Vec::default();
-
-        for i in 0..color_table.len() as u32{
-            let color = color_table.get(i).ok_or(format!("Unable to get color from color table for index {}", i))?;
+    fn pack_row_4bpp(row: &[u32; 8], out: &mut [u8]) {
+        for (byte, pair) in out.iter_mut().zip(row.chunks_exact(2)) {
+            *byte = (((pair[0] & 0xF) << 4) | (pair[1] & 0xF)) as u8;
+        }
+    }
 
-            let r = (color.r() & 0xff).overflowing_shr(3);
-            let g = ((color.g().overflowing_shr(8).0) & 0xff).overflowing_shr(3);
-            let b = ((color.b().overflowing_shr(16).0) & 0xff).overflowing_shr(3);
-            results.push(u16::from(r.0) | (u16::from(g.0) << 5) | (u16::from(b.0) << 10) | 0x8000);
+    fn pack_row_8bpp(row: &[u32; 8], out: &mut [u8]) {
+        for (byte, pixel) in out.iter_mut().zip(row.iter()) {
+            *byte = *pixel as u8;
         }
+    }
 
-        return Ok(results);
+    fn pack_row_11bpp(row: &[u32; 8], out: &mut [u8]) {
+        for (word, pixel) in out.chunks_exact_mut(2).zip(row.iter()) {
+            word[0] = ((pixel >> 8) & 0x7) as u8;
+            word[1] = *pixel as u8;
+        }
     }
 
-    fn get_character_pattern_data(self:&SaturnTileset, raw_image: Vec<u32>, image_width: i32, image_height: i32) -> Result<Vec<u8>, String> {
-        let mut results: Vec<u8> = Vec::default();
-
-        match (self.tile_width, self.tile_height) {
-            //process for 8x8 tiles
-            (8, 8) => {
-                for y in (0..image_height).step_by(8) {
-                    for x in (0..image_width).step_by(8) {
-                        let pixel_data = SaturnTileset::read_8x8_tile(&raw_image, image_width, image_height, x, y)?;
-
-                        match self.bpp {
-                            4 => {
-                                for i in (0..64).step_by(2) {
-                                    results.push((((pixel_data[i] as u8) & 0xF) << 4) | ((pixel_data[i + 1] as u8) & 0xF));
-                                }
-                            }
-                            8 => {
-                                for i in 0..64 {
-                                    results.push(pixel_data[i] as u8);
-                                }
-                            }
-                            11 => {
-                                for i in 0..64 {
-                                    results.push(((pixel_data[i] >> 8) & 0x7) as u8);
-                                    results.push(pixel_data[i] as u8)
-                                }
-                            }
-                            _ => 
-                                return Err::<Vec<u8>, String>(format!("Unsupported bpp for image/color table"))
-                        }
+    /// Origins of every 8x8 cell in character pattern order. 16x16 characters are stored as four consecutive
+    /// cells: top left, top right, bottom left, bottom right.
+    fn cell_origins(tile_width: usize, tile_height: usize, image_width: usize, image_height: usize) -> Vec<(usize, usize)> {
+        let mut cells = Vec::with_capacity((image_width / 8) * (image_height / 8));
 
+        for y in (0..image_height).step_by(tile_height) {
+            for x in (0..image_width).step_by(tile_width) {
+                for cell_y in (0..tile_height).step_by(8) {
+                    for cell_x in (0..tile_width).step_by(8) {
+                        cells.push((x + cell_x, y + cell_y));
                     }
                 }
-
-                return Ok(results); 
             }
-            (16, 16) => {
-                for y in (0..image_height).step_by(16) {
-                    for x in (0..image_width).step_by(16) {
-                        let mut  res = Vec::<u16>::default();
-                        // top left
-                        res.append(SaturnTileset::read_8x8_tile(&raw_image, image_width, image_height, x, y)?.as_mut());
-                        // top right
-                        res.append(SaturnTileset::read_8x8_tile(&raw_image, image_width, image_height, x + 8, y)?.as_mut());
-                        // bottom left
-                        res.append(SaturnTileset::read_8x8_tile(&raw_image, image_width, image_height, x, y + 8)?.as_mut());
-                        // bottom right
-                        res.append(SaturnTileset::read_8x8_tile(&raw_image, image_width, image_height, x + 8, y + 8)?.as_mut());
-                        
-
-                        match self.bpp {
-                            4 => {
-                                for i in (0..256).step_by(2) {
-                                    results.push((((res[i] as u8) & 0xF) << 4) | ((res[i + 1] as u8) & 0xF));
-                                }
-                            }
-                            8 => {
-                                for i in 0..256 {
-                                    results.push(res[i] as u8);
-                                }
-                            }
-                            11 => {
-                                for i in 0..256 {
-                                    results.push(((res[i] >> 8) & 0x7) as u8);
-                                    results.push(res[i] as u8);
-                                }
-                            }
-                            _ => 
-                                return Err::<Vec<u8>, String>(format!("Unsupported bpp for image/color table"))
-                        }
-                    }
-                }
+        }
+
+        return cells;
+    }
 
-                return Ok(results);
+    /// Copies each 8 pixel cell row into a stack array and packs it straight into its place in `out`,
+    /// so the whole pass is one bounds check per row and no per tile allocation.
+    fn gather_cells(raw_image: &[u32], image_width: usize, cells: &[(usize, usize)], out: &mut [u8], pack: impl Fn(&[u32; 8], &mut [u8])) -> Result<(), String> {
+        let row_bytes = out.len() / (cells.len() * 8).max(1);
+
+        for (cell, (x, y)) in out.chunks_exact_mut(row_bytes * 8).zip(cells.iter()) {
+            for (row_index, row_out) in cell.chunks_exact_mut(row_bytes).enumerate() {
+                let start = (y + row_index) * image_width + x;
+                let row: &[u32; 8] = raw_image.get(start..start + 8).and_then(|r| r.try_into().ok())
+                    .ok_or(format!("No pixel value found at {} {}", x, y + row_index))?;
+                pack(row, row_out);
             }
-            _ => return Err(format!("Unsupported tile size {} {}", self.tile_width, self.tile_height))
         }
+
+        return Ok(());
+    }
+
+    fn get_character_pattern_data(self:&SaturnTileset, raw_image: &[u32], image_width: i32, image_height: i32) -> Result<Vec<u8>, String> {
+        let tile_width = self.tile_width as usize;
+        let tile_height = self.tile_height as usize;
+        let image_width = image_width as usize;
+        let image_height = image_height as usize;
+
+        if !matches!((self.tile_width, self.tile_height), (8, 8) | (16, 16)) {
+            return Err(format!("Unsupported tile size {} {}", self.tile_width, self.tile_height));
+        }
+
+        if image_width % tile_width != 0 || image_height % tile_height != 0 || raw_image.len() < image_width * image_height {
+            return Err(format!("Error: Image width {} or height {} not a multiple of 8/16.", image_width, image_height));
+        }
+
+        let cells = SaturnTileset::cell_origins(tile_width, tile_height, image_width, image_height);
+
+        let row_bytes = match self.bpp {
+            4 => 4,
+            8 => 8,
+            11 => 16,
+            _ => return Err::<Vec<u8>, String>(format!("Unsupported bpp for image/color table"))
+        };
+
+        let mut results: Vec<u8> = vec![0; cells.len() * 8 * row_bytes];
+
+        match self.bpp {
+            4 => SaturnTileset::gather_cells(raw_image, image_width, &cells, &mut results, SaturnTileset::pack_row_4bpp)?,
+            8 => SaturnTileset::gather_cells(raw_image, image_width, &cells, &mut results, SaturnTileset::pack_row_8bpp)?,
+            _ => SaturnTileset::gather_cells(raw_image, image_width, &cells, &mut results, SaturnTileset::pack_row_11bpp)?
+        }
+
+        return Ok(results);
     }
 
     fn get_indexed_image<'a>(indexed_palette: &HashMap<u32, u32>, data: &RawBmp) -> Vec<u32> {
@@ -190,16 +215,73 @@ impl SaturnTileset {
         return SaturnColorTable::new(sorted.clone().into_values().collect()); 
     }
 
-    fn get_number_of_colors(indexed_palette: &HashMap<u32, u32>) -> Result<u16, String> {
-        return match indexed_palette.len() {
+    fn get_number_of_colors(colors: usize) -> Result<u16, String> {
+        return match colors {
             1..=16      => Ok(16),
             17..=256    => Ok(256),
             257..=1024  => Ok(1024),
             1025..=2048 => Ok(2048),
-            _ => Err(format!("Unsupported color table length {}", indexed_palette.len()))
+            _ => Err(format!("Unsupported color table length {}", colors))
+        }
+    }
+
+    fn get_palette_colors(tileset:&Arc<Tileset>) -> Result<Option<usize>, String> {
+        let palette_colors: Option<usize> = match tileset.properties.get("palette_colors") {
+            None => None,
+            Some(PropertyValue::IntValue(s)) => Some(*s as usize),
+            Some(PropertyValue::StringValue(c)) => Some(c.parse().map_err(|e| format!("Invalid palette_colors {:?}", e))?),
+            _ => Err("Invalid palette_colors")?
+        };
+
+        match palette_colors {
+            Some(2..=2048) | None => Ok(palette_colors),
+            Some(colors) => Err(format!("Unsupported palette_colors {}, expected 2 to 2048", colors))
         }
     }
 
+    fn is_dithered(tileset:&Arc<Tileset>) -> Result<bool, String> {
+        let dither: bool = match tileset.properties.get("dither") {
+            None => false,
+            Some(PropertyValue::BoolValue(b)) => *b,
+            Some(PropertyValue::StringValue(c)) => c.parse().map_err(|e| format!("Invalid dither {:?}", e))?,
+            _ => Err("Invalid dither")?
+        };
+
+        Ok(dither)
+    }
+
+    /// Reduces the tileset image to `palette_colors` colors. Palette index 0 stays the color the image marks as
+    /// transparent, the first color table entry of a paletted BMP or the tileset's transparent color otherwise.
+    fn quantize(tileset:&Arc<Tileset>, data: &RawBmp, palette_colors: usize) -> Result<(SaturnColorTable, Vec<u32>, QuantizeStats), String> {
+        let image = tileset.image.as_ref().ok_or("No Image for tileset found")?;
+        let pixels: Vec<u8> = data.color_table().map_or_else(
+            || data.pixels().flat_map(|f| { let [b, g, r, _] = f.color.to_le_bytes(); [b, g, r] }).collect(),
+            |ct| data.pixels().flat_map(|f| { let [b, g, r, _] = ct.get(f.color).unwrap().into_storage().to_le_bytes(); [b, g, r] }).collect()
+        );
+
+        let transparent: Option<[u8; 3]> = match (data.color_table(), &image.transparent_colour) {
+            (Some(ct), _) => ct.get(0).map(|c| { let [b, g, r, _] = c.into_storage().to_le_bytes(); [b, g, r] }),
+            (None, Some(c)) => Some([c.blue, c.green, c.red]),
+            (None, None) => None
+        };
+
+        let (palette, indices, stats) = saturn_quantize::quantize_tiles(&pixels, image.width as usize,
+            (tileset.tile_width as usize, tileset.tile_height as usize), palette_colors, transparent, SaturnTileset::is_dithered(tileset)?);
+
+        let color_table = SaturnColorTable::new(palette.iter().map(|[b, g, r]| *b as u32 | (*g as u32) << 8 | (*r as u32) << 16).collect());
+        return Ok((color_table, indices.into_iter().map(|i| i as u32).collect(), stats));
+    }
+
+    /// The quantization line of the export report, for tilesets with `palette_colors` set.
+    pub fn report(&self, name: &str) -> Option<String> {
+        let stats = self.quantization.as_ref()?;
+        let error = if stats.max_error == 0 { String::from("lossless") } else {
+            format!("PSNR {:.1} dB, max channel error {}", stats.psnr(), stats.max_error)
+        };
+        Some(format!("Tileset {}: {} colors quantized to {} ({} bpp), {}{}", name, stats.source_colors, stats.colors,
+                     self.bpp, error, if stats.dithered { ", dithered" } else { "" }))
+    }
+
     fn get_bpp(number_of_colors:u16) -> Result<u16, String> {
         return match number_of_colors {
             16   => Ok(4),
@@ -232,41 +314,95 @@ impl SaturnTileset {
         Ok(words_per_palette)
     }
 
-    pub fn build(tilesets: &[Arc<Tileset>]) -> Result<Vec<Self>, String> {
-        let mut results: Vec<SaturnTileset> = Vec::default();
-
-        for tileset in tilesets.iter() {
-            let image = tileset.as_ref().clone().image.ok_or("No Image for tileset found")?;
-            let image_file = fs::read(image.source.as_path()).map_err(|op| op.to_string() + " " + image.source.as_path().to_str().unwrap())?;
-            let raw_bmp = RawBmp::from_slice(&image_file).map_err(|op| format!("{:?}", op))?;
-            let indexed_palette = &SaturnTileset::get_indexed_palette(&raw_bmp);
-            let indexed_image = SaturnTileset::get_indexed_image(indexed_palette, &raw_bmp);
-            let number_of_colors = SaturnTileset::get_number_of_colors(indexed_palette)?;
-            let bpp = SaturnTileset::get_bpp(number_of_colors)?;
-            let color_table = &SaturnTileset::get_color_table(indexed_palette);
-            let palette_bank = SaturnTileset::get_palette_bank(tileset)?;
-            let words_per_palette = SaturnTileset::get_words_per_palette(tileset)?;
-
-            let mut saturn_tileset = SaturnTileset::new(tileset.tile_width, tileset.tile_height, tileset.tilecount, bpp, words_per_palette, number_of_colors, palette_bank)?;                                                              
- 
-            let mut pallete_data_bytes : Vec<u8> = if words_per_palette == 1 {
-                let pallete_data = &mut SaturnTileset::get_pallette_data_16(color_table)?;
-                pallete_data.iter().flat_map(|val| val.to_be_bytes()).collect()
-            } else {
-                let pallete_data = &mut SaturnTileset::get_pallette_data_32(color_table)?;
-                pallete_data.iter().flat_map(|val| val.to_be_bytes()).collect()
-            };
-
-            saturn_tileset.palette.append(&mut pallete_data_bytes);
-
-            let character_pattern_data = &mut SaturnTileset::get_character_pattern_data(&saturn_tileset, indexed_image, image.width, image.height)?;
-            saturn_tileset.character_pattern.append(character_pattern_data);
-
-            saturn_tileset.update().map_err(|op| op.to_string())?;
-
-            results.push(saturn_tileset);
+    pub fn build_one(tileset: &Arc<Tileset>) -> Result<Self, String> {
+        let decode_stage = saturn_profile::stage("bmp_decode");
+        let image = tileset.as_ref().clone().image.ok_or("No Image for tileset found")?;
+        let image_file = fs::read(image.source.as_path()).map_err(|op| op.to_string() + " " + image.source.as_path().to_str().unwrap())?;
+        let raw_bmp = RawBmp::from_slice(&image_file).map_err(|op| format!("{:?}", op))?;
+        drop(decode_stage);
+
+        let index_stage = saturn_profile::stage("palette_index");
+        let (color_table, indexed_image, quantization) = match SaturnTileset::get_palette_colors(tileset)? {
+            Some(palette_colors) => {
+                let (color_table, indexed_image, stats) = SaturnTileset::quantize(tileset, &raw_bmp, palette_colors)?;
+                (color_table, indexed_image, Some(stats))
+            }
+            None => {
+                let indexed_palette = &SaturnTileset::get_indexed_palette(&raw_bmp);
+                (SaturnTileset::get_color_table(indexed_palette), SaturnTileset::get_indexed_image(indexed_palette, &raw_bmp), None)
+            }
+        };
+        let color_table = &color_table;
+        let number_of_colors = SaturnTileset::get_number_of_colors(color_table.len())?;
+        let bpp = SaturnTileset::get_bpp(number_of_colors)?;
+        let sprite_sheet = SpriteSheet::is_sprite_sheet(tileset)?;
+
+        // Sprite sheets never reach VDP2, the bank and pattern name format only default their palette format
+        let palette_bank = if sprite_sheet && tileset.properties.get("palette_bank").is_none() { 0 } else { SaturnTileset::get_palette_bank(tileset)? };
+        let words_per_palette = if sprite_sheet && tileset.properties.get("pnd_size").is_none() { 1 } else { SaturnTileset::get_words_per_palette(tileset)? };
+
+        let mut saturn_tileset = SaturnTileset::new(tileset.tile_width, tileset.tile_height, tileset.tilecount, bpp, words_per_palette, number_of_colors, palette_bank)?;                                                              
+
+        saturn_tileset.palette = SaturnTileset::get_palette_data(color_table, words_per_palette)?;
+        saturn_tileset.quantization = quantization;
+        drop(index_stage);
+
+        let packing_stage = saturn_profile::stage("tile_packing");
+        if sprite_sheet {
+            saturn_tileset.sprite_sheet = Some(SpriteSheet::build(tileset, &indexed_image, image.width as usize, image.height as usize, bpp)?);
+        } else {
+            saturn_tileset.character_pattern = SaturnTileset::get_character_pattern_data(&saturn_tileset, &indexed_image, image.width, image.height)?;
         }
-        
-        return Ok(results);
+        drop(packing_stage);
+
+        saturn_tileset.update_sizes();
+
+        return Ok(saturn_tileset);
     }
-}
\ No newline at end of file
+}
+
+impl SaturnWrite for SaturnTileset {
+    fn encoded_size(&self) -> u32 {
+        TILESET_HEADER_SIZE + self.palette.len() as u32 + 4 + self.character_pattern.len() as u32
+    }
+
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()> {
+        write_u32(out, self.tileset_size)?;
+        write_u32(out, self.tile_width)?;
+        write_u32(out, self.tile_height)?;
+        write_u32(out, self.tile_count)?;
+        write_u16(out, self.bpp)?;
+        write_u8(out, self.words_per_palette)?;
+        write_u16(out, self.number_of_colors)?;
+        write_u8(out, self.palette_bank)?;
+        write_u32(out, self.character_offset)?;
+        write_u32(out, self.palette_size)?;
+        out.write_all(&self.palette)?;
+        write_u32(out, self.character_pattern_size)?;
+        out.write_all(&self.character_pattern)
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::saturn_writer::tests::{encode, read_u32};
+
+    /// Two 8x8 tiles at 4 bpp with a 16 color palette.
+    pub(crate) fn sample_tileset() -> SaturnTileset {
+        let mut tileset = SaturnTileset::new(8, 8, 2, 4, 1, 16, 0).unwrap();
+        tileset.palette = vec![0x80; 32];
+        tileset.character_pattern = vec![0x12; 64];
+        tileset.update_sizes();
+        return tileset;
+    }
+
+    #[test]
+    fn encoded_size_matches_written_bytes() {
+        let tileset = sample_tileset();
+        let bytes = encode(&tileset);
+        assert_eq!(read_u32(&bytes, 0), tileset.tileset_size);
+        assert_eq!(read_u32(&bytes, TILESET_HEADER_SIZE as usize - 4), 32);
+        assert_eq!(read_u32(&bytes, TILESET_HEADER_SIZE as usize + 32), 64);
+    }
+}
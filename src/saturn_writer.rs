@@ -0,0 +1,56 @@
+use std::io::{self, Write};
+
+/// A section of the tiled2saturn binary format.
+///
+/// Every section knows its encoded size arithmetically, so offsets and size fields can be filled in
+/// without serializing anything, and `write_to` streams the big endian bytes exactly once.
+pub trait SaturnWrite {
+    /// Number of bytes `write_to` will produce.
+    fn encoded_size(&self) -> u32;
+
+    /// Writes the section to `out` in big endian order.
+    fn write_to<W: Write>(&self, out: &mut W) -> io::Result<()>;
+}
+
+pub fn write_u8<W: Write>(out: &mut W, value: u8) -> io::Result<()> {
+    out.write_all(&[value])
+}
+
+pub fn write_u16<W: Write>(out: &mut W, value: u16) -> io::Result<()> {
+    out.write_all(&value.to_be_bytes())
+}
+
+pub fn write_u32<W: Write>(out: &mut W, value: u32) -> io::Result<()> {
+    out.write_all(&value.to_be_bytes())
+}
+
+pub fn write_bool<W: Write>(out: &mut W, value: bool) -> io::Result<()> {
+    out.write_all(&[value as u8])
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+
+    /// Writes `section`, checking it is exactly the `encoded_size` the header offsets are computed from.
+    pub(crate) fn encode<S: SaturnWrite>(section: &S) -> Vec<u8> {
+        let mut bytes: Vec<u8> = Vec::default();
+        section.write_to(&mut bytes).unwrap();
+        assert_eq!(bytes.len() as u32, section.encoded_size());
+        return bytes;
+    }
+
+    pub(crate) fn read_u32(bytes: &[u8], offset: usize) -> u32 {
+        u32::from_be_bytes(bytes[offset..offset + 4].try_into().unwrap())
+    }
+
+    #[test]
+    fn writes_big_endian() {
+        let mut bytes: Vec<u8> = Vec::default();
+        write_u8(&mut bytes, 0x12).unwrap();
+        write_u16(&mut bytes, 0x3456).unwrap();
+        write_u32(&mut bytes, 0x789abcde).unwrap();
+        write_bool(&mut bytes, true).unwrap();
+        assert_eq!(bytes, [0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0x01]);
+    }
+}
@@ -0,0 +1,360 @@
+use std::{collections::HashSet, fs, io::{BufWriter, Write}, path::{Path, PathBuf}, sync::{Arc, mpsc}, time::{Duration, Instant}};
+
+use notify::{EventKind, RecursiveMode, Watcher};
+use tiled::{Loader, Map, PropertyValue, Tileset};
+
+use crate::saturn_bitmap_layer::SaturnBitmapLayer;
+use crate::saturn_budget::{BudgetLimits, SaturnBudget};
+use crate::saturn_character_allocation::SaturnCharacterAllocation;
+use crate::saturn_collision_masks::SaturnCollisionMasks;
+use crate::saturn_collision_rects::SaturnCollisionRects;
+use crate::saturn_collisions::SaturnCollisions;
+use crate::saturn_layer::{SaturnLayer, TileBounds};
+use crate::saturn_object_layer::SaturnObjectLayer;
+use crate::saturn_patch;
+use crate::saturn_sprite_atlas::SaturnSpriteAtlas;
+use crate::saturn_map::SaturnMap;
+use crate::saturn_tileset::SaturnTileset;
+use crate::saturn_writer::SaturnWrite;
+
+// Editors tend to save in several writes (and Tiled saves the tsx and tmx separately), so wait for the
+// burst of events to settle before rebuilding.
+const DEBOUNCE: Duration = Duration::from_millis(50);
+
+/// Everything the previous export was built from, kept in memory so a change only re-encodes the
+/// sections that depend on it.
+struct WarmMap {
+    map: Map,
+    saturn_map: SaturnMap,
+    tileset_keys: Vec<String>,
+    bitmap_layer_keys: Vec<String>,
+}
+
+struct Timings {
+    sections: Vec<(String, Duration)>,
+}
+
+impl Timings {
+    fn new() -> Self {
+        Timings { sections: Vec::default() }
+    }
+
+    fn time<T>(&mut self, name: String, f: impl FnOnce() -> Result<T, String>) -> Result<T, String> {
+        let start = Instant::now();
+        let result = f()?;
+        self.sections.push((name, start.elapsed()));
+        return Ok(result);
+    }
+
+    fn print(&self, total: Duration) {
+        for (name, elapsed) in self.sections.iter() {
+            println!("  {:<32} {:>8.2}ms", name, elapsed.as_secs_f64() * 1000.0);
+        }
+        println!("  {:<32} {:>8.2}ms", "total", total.as_secs_f64() * 1000.0);
+    }
+}
+
+fn load_tmx(filename: &Path) -> Result<Map, String> {
+    // A fresh loader each time, the default loader caches tsx files and would never see them change
+    let mut loader = Loader::new();
+    return loader.load_tmx_map(filename).map_err(|e| e.to_string());
+}
+
+fn canonical(path: &Path) -> PathBuf {
+    fs::canonicalize(path).unwrap_or(path.to_path_buf())
+}
+
+fn property_key(value: Option<&PropertyValue>) -> String {
+    format!("{:?}", value)
+}
+
+fn tileset_key(tileset: &Arc<Tileset>) -> String {
+    format!("{}|{}x{}|{}|{:?}|{}|{}", tileset.name, tileset.tile_width, tileset.tile_height, tileset.tilecount,
+            tileset.image.as_ref().map(|i| canonical(&i.source)),
+            property_key(tileset.properties.get("palette_bank")), property_key(tileset.properties.get("pnd_size")) +
+            &property_key(tileset.properties.get("sprite_sheet")) + &property_key(tileset.properties.get("color_bank")) +
+            &property_key(tileset.properties.get("palette_colors")) + &property_key(tileset.properties.get("dither")))
+}
+
+fn image_layers(map: &Map) -> Vec<(u32, Option<PathBuf>, String)> {
+    map.layers().filter_map(|layer| match layer.layer_type() {
+        tiled::LayerType::Image(image_layer) => {
+            let source = image_layer.image.as_ref().map(|i| canonical(&i.source));
+            let key = format!("{}|{:?}|{}|{}", layer.id(), source, property_key(layer.properties.get("pnd_size")),
+                              property_key(layer.properties.get("palette_colors")) + &property_key(layer.properties.get("band_lines")));
+            Some((layer.id(), source, key))
+        },
+        _ => None,
+    }).collect()
+}
+
+fn build_bitmap_layer(map: &Map, id: u32) -> Result<SaturnBitmapLayer, String> {
+    for layer in map.layers() {
+        if layer.id() != id {
+            continue;
+        }
+        if let tiled::LayerType::Image(image_layer) = layer.layer_type() {
+            return SaturnBitmapLayer::build_one(&layer, &image_layer);
+        }
+    }
+    return Err(format!("Unable to find image layer {}", id));
+}
+
+fn write_atomically(output: &Path, saturn_map: &SaturnMap) -> Result<(), String> {
+    let mut temporary = output.as_os_str().to_owned();
+    temporary.push(".tmp");
+    let temporary = PathBuf::from(temporary);
+
+    let file = fs::File::create(&temporary).map_err(|e| e.to_string() + " " + temporary.to_str().unwrap_or_default())?;
+    let mut writer = BufWriter::new(file);
+    saturn_map.write_to(&mut writer).and_then(|_| writer.flush()).map_err(|e| e.to_string() + " " + temporary.to_str().unwrap_or_default())?;
+    drop(writer);
+    fs::rename(&temporary, output).map_err(|e| e.to_string() + " " + output.to_str().unwrap_or_default())?;
+
+    return Ok(());
+}
+
+/// Refreshes the header and writes the map out, unless it goes over budget, leaving the previous output in place.
+/// With a patch file, the changes from the previous output are written to it as well. Returns the budget table and
+/// the patch report.
+fn write_map(saturn_map: &mut SaturnMap, map: &Map, output: &Path, limits: &BudgetLimits, patch_file: Option<&Path>, timings: &mut Timings) -> Result<Vec<String>, String> {
+    saturn_map.refresh_header()?;
+    let limits = limits.or(&BudgetLimits::from_map(map)?);
+    let budget = SaturnBudget::for_map(saturn_map);
+    let table = budget.table(&limits);
+    budget.check(&limits).map_err(|e| format!("{}{}", table, e))?;
+    let mut reports: Vec<String> = vec![String::from(table.trim_end())];
+
+    let previous = patch_file.and_then(|_| fs::read(output).ok());
+    timings.time(String::from("write"), || write_atomically(output, saturn_map))?;
+
+    // A patch that cannot be made is not an error, the new output is already written and can be transferred whole
+    if let Some(patch_file) = patch_file {
+        let report = timings.time(String::from("patch"), || Ok(saturn_patch::write_patch(previous.as_deref(), output, patch_file).unwrap_or_else(|err| err)))?;
+        reports.push(report);
+    }
+
+    return Ok(reports);
+}
+
+impl WarmMap {
+    /// Builds every section and writes the map, returning it with its report lines.
+    fn build(tmx_file: &Path, output: &Path, limits: &BudgetLimits, patch_file: Option<&Path>, timings: &mut Timings) -> Result<(Self, Vec<String>), String> {
+        let map = timings.time(String::from("load tmx"), || load_tmx(tmx_file))?;
+        let tileset_keys: Vec<String> = map.tilesets().iter().map(tileset_key).collect();
+        let bitmap_layer_keys: Vec<String> = image_layers(&map).into_iter().map(|(_, _, key)| key).collect();
+
+        let mut reports: Vec<String> = Vec::default();
+        let mut tilesets = Vec::default();
+        for tileset in map.tilesets().iter() {
+            let saturn_tileset = timings.time(format!("tileset {}", tileset.name), || SaturnTileset::build_one(tileset))?;
+            reports.extend(saturn_tileset.report(&tileset.name));
+            tilesets.push(saturn_tileset);
+        }
+
+        let bounds = TileBounds::for_map(&map);
+        let (allocation, infos) = SaturnCharacterAllocation::place(&mut tilesets)?;
+        reports.extend(allocation.report());
+        let layers = timings.time(String::from("layers"), || SaturnLayer::build(map.layers(), &infos, &bounds))?;
+
+        let mut bitmap_layers = Vec::default();
+        for (id, _, _) in image_layers(&map) {
+            bitmap_layers.push(timings.time(format!("bitmap layer {}", id), || build_bitmap_layer(&map, id))?);
+        }
+
+        let sprite_atlas = timings.time(String::from("sprite atlas"), || SaturnSpriteAtlas::from_tilesets(tilesets.iter().map(|t| t.sprite_sheet.as_ref())))?;
+        let object_layers = timings.time(String::from("object layers"), || SaturnObjectLayer::build(map.layers(), bounds.pixel_origin(&map), map.tilesets(), &sprite_atlas))?;
+
+        let collision_rects = timings.time(String::from("collision rects"), || SaturnCollisionRects::build(&map, &bounds))?;
+        let collision_masks = timings.time(String::from("collision masks"), || SaturnCollisionMasks::build(&map, &bounds))?;
+        let collisions = timings.time(String::from("collisions"), || SaturnCollisions::build(&map, &bounds))?;
+
+        let mut saturn_map = SaturnMap::from_sections(bounds.width, bounds.height, tilesets, layers, bitmap_layers, object_layers, sprite_atlas,
+                                                      collision_rects, collision_masks, collisions)?;
+        reports.extend(saturn_map.section_reports());
+        reports.extend(write_map(&mut saturn_map, &map, output, limits, patch_file, timings)?);
+
+        return Ok((WarmMap { map, saturn_map, tileset_keys, bitmap_layer_keys }, reports));
+    }
+
+    /// Directories holding the map and every tsx and image it references, watching directories rather than files
+    /// survives editors that save by writing a new file and renaming it over the old one.
+    fn watched_directories(&self, tmx_file: &Path) -> HashSet<PathBuf> {
+        let mut paths: Vec<PathBuf> = vec![canonical(tmx_file)];
+        // External tilesets live in their own tsx, embedded ones give the tmx as their source
+        paths.extend(self.map.tilesets().iter().map(|t| canonical(&t.source)));
+        paths.extend(self.map.tilesets().iter().filter_map(|t| t.image.as_ref().map(|i| canonical(&i.source))));
+        paths.extend(image_layers(&self.map).into_iter().filter_map(|(_, source, _)| source));
+
+        paths.iter().filter_map(|p| p.parent().map(|d| d.to_path_buf())).collect()
+    }
+
+    /// Re-encodes the sections `changed` affects and writes the map, returning the report lines of the rebuilt
+    /// tilesets and every section.
+    fn rebuild(&mut self, tmx_file: &Path, output: &Path, changed: &HashSet<PathBuf>, limits: &BudgetLimits, patch_file: Option<&Path>,
+               timings: &mut Timings) -> Result<Vec<String>, String> {
+        let map_changed = changed.iter().any(|p| matches!(p.extension().and_then(|e| e.to_str()).map(|e| e.to_ascii_lowercase()).as_deref(),
+                                                          Some("tmx") | Some("tsx")));
+
+        if map_changed {
+            self.map = timings.time(String::from("load tmx"), || load_tmx(tmx_file))?;
+        }
+
+        let map = &self.map;
+        let bounds = TileBounds::for_map(map);
+        let image_changed = |source: Option<PathBuf>| source.map_or(false, |s| changed.contains(&s));
+
+        // Tilesets only need to be re-encoded when their image or their definition has changed
+        let tileset_keys: Vec<String> = map.tilesets().iter().map(tileset_key).collect();
+        let mut tileset_metadata_changed = tileset_keys.len() != self.tileset_keys.len();
+        let mut tilesets_rebuilt = tileset_metadata_changed;
+        let mut reports: Vec<String> = Vec::default();
+        let mut tilesets: Vec<SaturnTileset> = Vec::default();
+        let previous_offsets: Vec<u32> = self.saturn_map.tilesets.iter().map(|t| t.character_offset).collect();
+        let mut previous: Vec<Option<SaturnTileset>> = std::mem::take(&mut self.saturn_map.tilesets).into_iter().map(Some).collect();
+
+        for (index, tileset) in map.tilesets().iter().enumerate() {
+            let source = tileset.image.as_ref().map(|i| canonical(&i.source));
+            let reusable = self.tileset_keys.get(index) == Some(&tileset_keys[index]) && !image_changed(source);
+
+            match previous.get_mut(index).and_then(|t| t.take()) {
+                Some(saturn_tileset) if reusable => tilesets.push(saturn_tileset),
+                old => {
+                    let saturn_tileset = timings.time(format!("tileset {}", tileset.name), || SaturnTileset::build_one(tileset))?;
+                    reports.extend(saturn_tileset.report(&tileset.name));
+                    tileset_metadata_changed |= old.map_or(true, |o| o.bpp != saturn_tileset.bpp || o.tile_count != saturn_tileset.tile_count ||
+                                                                      o.palette_bank != saturn_tileset.palette_bank ||
+                                                                      o.words_per_palette != saturn_tileset.words_per_palette ||
+                                                                      o.sprite_sheet.is_some() != saturn_tileset.sprite_sheet.is_some());
+                    tilesets_rebuilt = true;
+                    tilesets.push(saturn_tileset);
+                }
+            }
+        }
+
+        // A tileset changing size can move the others in VRAM, their pattern names follow
+        let (allocation, infos) = SaturnCharacterAllocation::place(&mut tilesets)?;
+        tileset_metadata_changed |= tilesets.iter().zip(previous_offsets.iter()).any(|(t, o)| t.character_offset != *o);
+        if tilesets_rebuilt {
+            reports.extend(allocation.report());
+        }
+
+        self.saturn_map.tilesets = tilesets;
+        self.tileset_keys = tileset_keys;
+
+        // Pattern name data references tile numbers, bpp and palette banks, so layers follow any tileset layout change
+        if map_changed || tileset_metadata_changed {
+            self.saturn_map.layers = timings.time(String::from("layers"), || SaturnLayer::build(map.layers(), &infos, &bounds))?;
+        }
+
+        let bitmap_layer_keys: Vec<String> = image_layers(map).into_iter().map(|(_, _, key)| key).collect();
+        let mut bitmap_layers: Vec<SaturnBitmapLayer> = Vec::default();
+        let mut previous: Vec<Option<SaturnBitmapLayer>> = std::mem::take(&mut self.saturn_map.bitmap_layers).into_iter().map(Some).collect();
+
+        for (index, (id, source, key)) in image_layers(map).into_iter().enumerate() {
+            let reusable = self.bitmap_layer_keys.get(index) == Some(&key) && !image_changed(source);
+
+            match previous.get_mut(index).and_then(|l| l.take()) {
+                Some(bitmap_layer) if reusable => bitmap_layers.push(bitmap_layer),
+                _ => bitmap_layers.push(timings.time(format!("bitmap layer {}", id), || build_bitmap_layer(map, id))?)
+            }
+        }
+
+        self.saturn_map.bitmap_layers = bitmap_layers;
+        self.bitmap_layer_keys = bitmap_layer_keys;
+
+        // Sprite frames come from the tilesets and objects can show them, so both follow any tileset rebuild
+        if map_changed || tilesets_rebuilt {
+            let tilesets = &self.saturn_map.tilesets;
+            self.saturn_map.sprite_atlas = timings.time(String::from("sprite atlas"), || SaturnSpriteAtlas::from_tilesets(tilesets.iter().map(|t| t.sprite_sheet.as_ref())))?;
+            let sprite_atlas = &self.saturn_map.sprite_atlas;
+            self.saturn_map.object_layers = timings.time(String::from("object layers"), || SaturnObjectLayer::build(map.layers(), bounds.pixel_origin(map), map.tilesets(), sprite_atlas))?;
+        }
+
+        // Collision shapes live in the tmx/tsx, images never affect them
+        if map_changed {
+            self.saturn_map.collision_rects = timings.time(String::from("collision rects"), || SaturnCollisionRects::build(map, &bounds))?;
+            self.saturn_map.collision_masks = timings.time(String::from("collision masks"), || SaturnCollisionMasks::build(map, &bounds))?;
+            self.saturn_map.collisions = timings.time(String::from("collisions"), || SaturnCollisions::build(map, &bounds))?;
+            self.saturn_map.set_size(bounds.width, bounds.height);
+        }
+
+        reports.extend(self.saturn_map.section_reports());
+        reports.extend(write_map(&mut self.saturn_map, &self.map, output, limits, patch_file, timings)?);
+        return Ok(reports);
+    }
+}
+
+fn is_source_file(path: &Path) -> bool {
+    matches!(path.extension().and_then(|e| e.to_str()).map(|e| e.to_ascii_lowercase()).as_deref(), Some("tmx") | Some("tsx") | Some("bmp"))
+}
+
+/// Exports the map, then keeps the decoded map and encoded sections in memory and re-exports whenever the
+/// tmx, a tsx or a referenced bmp changes on disk. Only sections depending on the changed files are re-encoded,
+/// and the output is replaced atomically so a build picking it up never sees a partial file. With a patch file,
+/// every export also writes the changes from the output it replaced.
+pub fn watch(tmx_file: &Path, output: &Path, limits: &BudgetLimits, patch_file: Option<&Path>) -> Result<(), String> {
+    let start = Instant::now();
+    let mut timings = Timings::new();
+    let (mut warm, reports) = WarmMap::build(tmx_file, output, limits, patch_file, &mut timings)?;
+    for report in reports {
+        println!("{}", report);
+    }
+    println!("Exported {}", output.display());
+    timings.print(start.elapsed());
+
+    let (sender, receiver) = mpsc::channel::<notify::Result<notify::Event>>();
+    let mut watcher = notify::recommended_watcher(sender).map_err(|e| e.to_string())?;
+    let mut watched: HashSet<PathBuf> = HashSet::default();
+
+    loop {
+        let directories = warm.watched_directories(tmx_file);
+        for directory in directories.difference(&watched).cloned().collect::<Vec<PathBuf>>() {
+            watcher.watch(&directory, RecursiveMode::NonRecursive).map_err(|e| e.to_string())?;
+            watched.insert(directory);
+        }
+
+        println!("Watching for changes...");
+
+        let mut changed: HashSet<PathBuf> = HashSet::default();
+        let mut deadline: Option<Instant> = None;
+
+        loop {
+            let event = match deadline {
+                Some(d) => match receiver.recv_timeout(d.saturating_duration_since(Instant::now())) {
+                    Ok(event) => event,
+                    Err(mpsc::RecvTimeoutError::Timeout) => break,
+                    Err(mpsc::RecvTimeoutError::Disconnected) => return Err(String::from("File watcher stopped")),
+                },
+                None => receiver.recv().map_err(|e| e.to_string())?
+            };
+
+            let event = event.map_err(|e| e.to_string())?;
+            if !matches!(event.kind, EventKind::Create(_) | EventKind::Modify(_)) {
+                continue;
+            }
+
+            for path in event.paths.iter().filter(|p| is_source_file(p)) {
+                changed.insert(canonical(path));
+                deadline.get_or_insert(Instant::now() + DEBOUNCE);
+            }
+        }
+
+        let names: Vec<String> = changed.iter().filter_map(|p| p.file_name().map(|f| f.to_string_lossy().into_owned())).collect();
+        println!("Changed: {}", names.join(", "));
+
+        let start = Instant::now();
+        let mut timings = Timings::new();
+        match warm.rebuild(tmx_file, output, &changed, limits, patch_file, &mut timings) {
+            Ok(reports) => {
+                for report in reports {
+                    println!("{}", report);
+                }
+                println!("Exported {}", output.display());
+                timings.print(start.elapsed());
+            },
+            // Keep watching, the next save will most likely fix whatever is broken
+            Err(err) => println!("{}", err)
+        }
+    }
+}